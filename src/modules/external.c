@@ -36,6 +36,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <signal.h>
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -70,6 +71,8 @@ typedef enum {
 
 struct check_info {
   int64_t check_no;
+  int helper;
+  uint16_t flags;
   uint16_t argcnt;
   uint16_t *arglens;
   char **args;
@@ -102,11 +105,12 @@ typedef struct external_closure {
 
  *     int64(check_no)
  *     uint16(argcnt) [argcnt > 0]
+ *     uint16(flags) [EXTERNAL_FLAG_*]
  *     uint16(arglen) x argcnt  (arglen includes \0)
  *     string of sum(arglen)
  *     uint16(envcnt)
  *     uint16(envlen) x envcnt  (envlen includes \0)
- *     string of sum(envlen) -> execve .end
+ *     string of sum(envlen) -> execve (or persistent plugin) .end
  *
  *   ext 2 noit:
  *     int64(check_no)
@@ -347,7 +351,8 @@ static void check_info_clean(struct check_info *ci) {
 }
 static int external_handler(eventer_t e, int mask,
                             void *closure, struct timeval *now) {
-  noit_module_t *self = (noit_module_t *)closure;
+  external_helper_t *helper = (external_helper_t *)closure;
+  noit_module_t *self = (noit_module_t *)helper->self;
   external_data_t *data;
 
   data = noit_module_get_userdata(self);
@@ -358,7 +363,7 @@ static int external_handler(eventer_t e, int mask,
     void *vci;
     int ret;
 
-    if(!data->cr) {
+    if(!helper->cr) {
       struct external_response r;
       external_header h;
 
@@ -402,66 +407,66 @@ static int external_handler(eventer_t e, int mask,
       r.stdout_truncated = h.stdout_truncated;
       r.stderr_truncated = h.stderr_truncated;
       r.stdoutlen = h.stdoutlen;
-      data->cr = calloc(1, sizeof(*data->cr));
-      memcpy(data->cr, &r, sizeof(r));
-      data->cr->stdoutbuff = calloc(1, data->cr->stdoutlen);
+      helper->cr = calloc(1, sizeof(*helper->cr));
+      memcpy(helper->cr, &r, sizeof(r));
+      helper->cr->stdoutbuff = calloc(1, helper->cr->stdoutlen);
     }
 
-    while(data->cr->stdoutlen_sofar < data->cr->stdoutlen) {
+    while(helper->cr->stdoutlen_sofar < helper->cr->stdoutlen) {
       while((inlen =
                read(eventer_get_fd(e),
-                    data->cr->stdoutbuff + data->cr->stdoutlen_sofar,
-                    data->cr->stdoutlen - data->cr->stdoutlen_sofar)) == -1 &&
+                    helper->cr->stdoutbuff + helper->cr->stdoutlen_sofar,
+                    helper->cr->stdoutlen - helper->cr->stdoutlen_sofar)) == -1 &&
              errno == EINTR);
       if(inlen == -1 && errno == EAGAIN)
         return EVENTER_READ | EVENTER_EXCEPTION;
       if(inlen == 0) goto widowed;
-      if((data->cr->stdoutlen_sofar + inlen) < data->cr->stdoutlen_sofar)
+      if((helper->cr->stdoutlen_sofar + inlen) < helper->cr->stdoutlen_sofar)
         goto widowed; /* overflow */
-      data->cr->stdoutlen_sofar += inlen;
+      helper->cr->stdoutlen_sofar += inlen;
     }
-    mtevAssert(data->cr->stdoutbuff[data->cr->stdoutlen-1] == '\0');
-    if(!data->cr->stderrbuff) {
-      while((inlen = read(eventer_get_fd(e), &data->cr->stderrlen,
-                          sizeof(data->cr->stderrlen))) == -1 &&
+    mtevAssert(helper->cr->stdoutbuff[helper->cr->stdoutlen-1] == '\0');
+    if(!helper->cr->stderrbuff) {
+      while((inlen = read(eventer_get_fd(e), &helper->cr->stderrlen,
+                          sizeof(helper->cr->stderrlen))) == -1 &&
             errno == EINTR);
       if(inlen == -1 && errno == EAGAIN)
         return EVENTER_READ | EVENTER_EXCEPTION;
       if(inlen == 0) goto widowed;
-      mtevAssert(inlen == sizeof(data->cr->stderrlen));
+      mtevAssert(inlen == sizeof(helper->cr->stderrlen));
       /* We know that the strderrlen we read is taintet, but it comes
        * from our parent process and is well controlled, so we can
        * forgive that transgression.
        */
       /* coverity[tainted_data] */
-      data->cr->stderrbuff = malloc(data->cr->stderrlen);
+      helper->cr->stderrbuff = malloc(helper->cr->stderrlen);
     }
-    while(data->cr->stderrlen_sofar < (int)data->cr->stderrlen) {
-      int stderrlen = (int)data->cr->stderrlen;
-      if((stderrlen - data->cr->stderrlen_sofar) < 0 ||
-         (size_t)(stderrlen - data->cr->stderrlen_sofar) > data->cr->stderrlen)
+    while(helper->cr->stderrlen_sofar < (int)helper->cr->stderrlen) {
+      int stderrlen = (int)helper->cr->stderrlen;
+      if((stderrlen - helper->cr->stderrlen_sofar) < 0 ||
+         (size_t)(stderrlen - helper->cr->stderrlen_sofar) > helper->cr->stderrlen)
         goto widowed; /* overflow */
       while((inlen =
                read(eventer_get_fd(e),
-                    data->cr->stderrbuff + data->cr->stderrlen_sofar,
-                    stderrlen - data->cr->stderrlen_sofar)) == -1 &&
+                    helper->cr->stderrbuff + helper->cr->stderrlen_sofar,
+                    stderrlen - helper->cr->stderrlen_sofar)) == -1 &&
              errno == EINTR);
       if(inlen == -1 && errno == EAGAIN)
         return EVENTER_READ | EVENTER_EXCEPTION;
       if(inlen == 0) goto widowed;
-      if(((int)data->cr->stdoutlen_sofar + inlen) < data->cr->stdoutlen_sofar)
+      if(((int)helper->cr->stdoutlen_sofar + inlen) < helper->cr->stdoutlen_sofar)
         goto widowed; /* overflow */
-      data->cr->stderrlen_sofar += inlen;
+      helper->cr->stderrlen_sofar += inlen;
     }
-    mtevAssert(data->cr && data->cr->stdoutbuff && data->cr->stderrbuff);
-    mtevAssert(data->cr->stderrbuff[data->cr->stderrlen-1] == '\0');
+    mtevAssert(helper->cr && helper->cr->stdoutbuff && helper->cr->stderrbuff);
+    mtevAssert(helper->cr->stderrbuff[helper->cr->stderrlen-1] == '\0');
 
     mtev_gettimeofday(now, NULL); /* set it, as we care about accuracy */
 
     /* Lookup data in check_no hash */
     if(mtev_hash_retrieve(&data->external_checks,
-                          (const char *)&data->cr->check_no,
-                          sizeof(data->cr->check_no),
+                          (const char *)&helper->cr->check_no,
+                          sizeof(helper->cr->check_no),
                           &vci) == 0)
       vci = NULL;
     ci = (struct check_info *)vci;
@@ -469,16 +474,16 @@ static int external_handler(eventer_t e, int mask,
     /* We've seen it, it ain't coming again...
      * remove it, we'll free it ourselves */
     mtev_hash_delete(&data->external_checks,
-                     (const char *)&data->cr->check_no,
-                     sizeof(data->cr->check_no), NULL, NULL);
+                     (const char *)&helper->cr->check_no,
+                     sizeof(helper->cr->check_no), NULL, NULL);
 
     /* If there is no timeout_event, the check must have completed.
      * We have nothing to do. */
     if(!ci || !ci->timeout_event) {
-      free(data->cr->stdoutbuff);
-      free(data->cr->stderrbuff);
-      free(data->cr);
-      data->cr = NULL;
+      free(helper->cr->stdoutbuff);
+      free(helper->cr->stderrbuff);
+      free(helper->cr);
+      helper->cr = NULL;
       if (ci && ci->check) {
         noit_check_end(ci->check);
       }
@@ -488,13 +493,13 @@ static int external_handler(eventer_t e, int mask,
     free(eventer_get_closure(ci->timeout_event));
     eventer_free(ci->timeout_event);
     ci->timeout_event = NULL;
-    ci->exit_code = data->cr->exit_code;
-    ci->output = data->cr->stdoutbuff;
-    ci->error = data->cr->stderrbuff;
-    ci->stdout_truncated = data->cr->stdout_truncated;
-    ci->stderr_truncated = data->cr->stderr_truncated;
-    free(data->cr);
-    data->cr = NULL;
+    ci->exit_code = helper->cr->exit_code;
+    ci->output = helper->cr->stdoutbuff;
+    ci->error = helper->cr->stderrbuff;
+    ci->stdout_truncated = helper->cr->stdout_truncated;
+    ci->stderr_truncated = helper->cr->stderr_truncated;
+    free(helper->cr);
+    helper->cr = NULL;
     check = ci->check;
     if (!ci->errortype) {
       external_log_results(self, check);
@@ -507,21 +512,33 @@ static int external_handler(eventer_t e, int mask,
   exit(1);
 }
 
+/* Stops the first n helpers external_init started (parent side). */
+static void external_helpers_stop(external_data_t *data, int n) {
+  int i;
+  for(i=0; i<n; i++) {
+    external_helper_t *helper = &data->helpers[i];
+    close(helper->pipe_n2e[1]);
+    close(helper->pipe_e2n[0]);
+    kill(helper->child, SIGKILL);
+    while(waitpid(helper->child, NULL, 0) == -1 && errno == EINTR);
+  }
+}
+
 static int external_init(noit_module_t *self) {
   external_data_t *data;
+  mtev_boolean fresh = mtev_false;
+  int i;
   const char* path = NULL, *nagios_regex = NULL, *max_out_len = NULL;
 
   data = noit_module_get_userdata(self);
   if(!data) {
     data = calloc(1, sizeof(*data));
     mtev_hash_init(&data->external_checks);
+    fresh = mtev_true;
   }
   data->nlerr = mtev_log_stream_find("error/external");
   data->nldeb = mtev_log_stream_find("debug/external");
 
-  data->jobq = eventer_jobq_create("external");
-  eventer_jobq_set_concurrency(data->jobq, 1);
-
   if (data->options) {
     (void)mtev_hash_retr_str(data->options, "path", strlen("path"), &path);
     if (path) {
@@ -560,56 +577,109 @@ static int external_init(noit_module_t *self) {
     data->max_out_len = 256 * 1024; // default to 256K if they don't specify above
   }
 
-  if(socketpair(AF_UNIX, SOCK_STREAM, 0, data->pipe_n2e) != 0 ||
-     socketpair(AF_UNIX, SOCK_STREAM, 0, data->pipe_e2n) != 0) {
-    mtevL(noit_error, "external: pipe() failed: %s\n", strerror(errno));
-    free(data->jobq);
-    free(data);
-    return -1;
+  data->nhelpers = 1;
+  data->use_posix_spawn = mtev_false;
+  if (data->options) {
+    const char *helpers = NULL, *exec_mode = NULL;
+    (void)mtev_hash_retr_str(data->options, "helpers", strlen("helpers"), &helpers);
+    if (helpers) {
+      data->nhelpers = atoi(helpers);
+      if (data->nhelpers < 1) data->nhelpers = 1;
+      if (data->nhelpers > EXTERNAL_MAX_HELPERS) data->nhelpers = EXTERNAL_MAX_HELPERS;
+    }
+    (void)mtev_hash_retr_str(data->options, "exec_mode", strlen("exec_mode"), &exec_mode);
+    if (exec_mode && !strcmp(exec_mode, "spawn")) {
+      data->use_posix_spawn = mtev_true;
+    }
   }
+  data->helpers = calloc(data->nhelpers, sizeof(*data->helpers));
 
-  data->child = fork();
-  if(data->child == -1) {
-    /* No child, bail. */
-    mtevL(noit_error, "external: fork() failed: %s\n", strerror(errno));
-    free(data->jobq);
-    free(data);
-    return -1;
-  }
-
-  /* parent must close the read side of n2e and the write side of e2n */
-  /* The child must do the opposite */
-  close(data->pipe_n2e[(data->child == 0) ? 1 : 0]);
-  close(data->pipe_e2n[(data->child == 0) ? 0 : 1]);
-
-  /* Now the parent must set its bits non-blocking, the child need not */
-  if(data->child != 0) {
-    /* in the parent */
-    if(eventer_set_fd_nonblocking(data->pipe_e2n[0]) == -1) {
-      close(data->pipe_n2e[1]);
-      close(data->pipe_e2n[0]);
-      mtevL(noit_error,
-            "external: could not set pipe non-blocking: %s\n",
-            strerror(errno));
-      free(data);
-      return -1;
+  for(i=0; i<data->nhelpers; i++) {
+    external_helper_t *helper = &data->helpers[i];
+    helper->data = data;
+    helper->self = self;
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, helper->pipe_n2e) != 0) {
+      mtevL(noit_error, "external: pipe() failed: %s\n", strerror(errno));
+      goto bail;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, helper->pipe_e2n) != 0) {
+      mtevL(noit_error, "external: pipe() failed: %s\n", strerror(errno));
+      close(helper->pipe_n2e[0]);
+      close(helper->pipe_n2e[1]);
+      goto bail;
+    }
+
+    helper->child = fork();
+    if(helper->child == -1) {
+      /* No child, bail. */
+      mtevL(noit_error, "external: fork() failed: %s\n", strerror(errno));
+      close(helper->pipe_n2e[0]);
+      close(helper->pipe_n2e[1]);
+      close(helper->pipe_e2n[0]);
+      close(helper->pipe_e2n[1]);
+      goto bail;
+    }
+
+    /* parent must close the read side of n2e and the write side of e2n */
+    /* The child must do the opposite */
+    close(helper->pipe_n2e[(helper->child == 0) ? 1 : 0]);
+    close(helper->pipe_e2n[(helper->child == 0) ? 0 : 1]);
+
+    /* Now the parent must set its bits non-blocking, the child need not */
+    if(helper->child != 0) {
+      /* in the parent */
+      if(eventer_set_fd_nonblocking(helper->pipe_e2n[0]) == -1) {
+        mtevL(noit_error,
+              "external: could not set pipe non-blocking: %s\n",
+              strerror(errno));
+        i++; /* this helper is running, stop it with the others */
+        goto bail;
+      }
+    }
+    else {
+      const char *user = NULL, *group = NULL;
+      int j;
+      /* earlier helpers must see EOF when noitd goes away, not hang on us */
+      for(j=0; j<i; j++) {
+        close(data->helpers[j].pipe_n2e[1]);
+        close(data->helpers[j].pipe_e2n[0]);
+      }
+      if(data->options) {
+        (void)mtev_hash_retr_str(data->options, "user", strlen("user"), &user);
+        (void)mtev_hash_retr_str(data->options, "group", strlen("group"), &group);
+      }
+      mtev_security_usergroup(user, group, mtev_false);
+      exit(external_child(data, helper));
     }
+  }
+
+  /* Only listen once every helper is up, so a failure has nothing to undo. */
+  for(i=0; i<data->nhelpers; i++) {
+    external_helper_t *helper = &data->helpers[i];
     eventer_t newe;
-    newe = eventer_alloc_fd(external_handler, self, data->pipe_e2n[0],
+    newe = eventer_alloc_fd(external_handler, helper, helper->pipe_e2n[0],
                             EVENTER_READ | EVENTER_EXCEPTION);
     eventer_add(newe);
   }
-  else {
-    const char *user = NULL, *group = NULL;
-    if(data->options) {
-      (void)mtev_hash_retr_str(data->options, "user", strlen("user"), &user);
-      (void)mtev_hash_retr_str(data->options, "group", strlen("group"), &group);
-    }
-    mtev_security_usergroup(user, group, mtev_false);
-    exit(external_child(data));
-  }
+  data->jobq = eventer_jobq_create("external");
+  eventer_jobq_set_concurrency(data->jobq, 1);
   noit_module_set_userdata(self, data);
   return 0;
+
+ bail:
+  external_helpers_stop(data, i);
+  free(data->helpers);
+  data->helpers = NULL;
+  data->nhelpers = 0;
+  free(data->path);
+  data->path = NULL;
+  free(data->nagios_regex);
+  data->nagios_regex = NULL;
+  if(fresh) {
+    mtev_hash_destroy(&data->external_checks, NULL, NULL);
+    free(data);
+  }
+  return -1;
 }
 
 static void external_cleanup(noit_module_t *self, noit_check_t *check) {
@@ -677,9 +747,10 @@ static int external_enqueue(eventer_t e, int mask, void *closure,
     return 0;
   }
   data = noit_module_get_userdata(ecl->self);
-  fd = data->pipe_n2e[1];
+  fd = data->helpers[ci->helper].pipe_n2e[1];
   assert_write(fd, &ci->check_no, sizeof(ci->check_no));
   assert_write(fd, &ci->argcnt, sizeof(ci->argcnt));
+  assert_write(fd, &ci->flags, sizeof(ci->flags));
   assert_write(fd, ci->arglens, sizeof(*ci->arglens)*ci->argcnt);
   for(i=0; i<ci->argcnt; i++)
     assert_write(fd, ci->args[i], ci->arglens[i]);
@@ -690,6 +761,12 @@ static int external_enqueue(eventer_t e, int mask, void *closure,
   ci->written = 1;
   return 0;
 }
+static int external_helper_for(external_data_t *data, noit_check_t *check) {
+  uint32_t h = 0;
+  int i;
+  for(i=0; i<sizeof(uuid_t); i++) h = h * 31 + check->checkid[i];
+  return h % data->nhelpers;
+}
 static int external_invoke(noit_module_t *self, noit_check_t *check,
                            noit_check_t *cause) {
   struct timeval now, when, p_int;
@@ -730,6 +807,10 @@ static int external_invoke(noit_module_t *self, noit_check_t *check,
   /* Setup all our check bits */
   ci->check_no = ck_pr_faa_64(&data->check_no_seq, 1) + 1;
   ci->check = check;
+  ci->helper = external_helper_for(data, check);
+  if(mtev_hash_retr_str(check->config, "persistent", strlen("persistent"),
+                        &value) && !strcmp(value, "true"))
+    ci->flags |= EXTERNAL_FLAG_PERSISTENT;
 
   /* Pull the command value */
   if(mtev_hash_retr_str(check->config, "command", strlen("command"),
@@ -39,6 +39,7 @@
 #include <sys/mman.h>
 #include <poll.h>
 #include <errno.h>
+#include <spawn.h>
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
 #endif
@@ -49,12 +50,15 @@
 #include "external_proc.h"
 
 static void finish_procs();
+static mtev_boolean plugin_reaped(pid_t pid);
 static mtev_log_stream_t nlerr = NULL;
 static mtev_log_stream_t nldeb = NULL;
+static mtev_boolean use_posix_spawn = mtev_false;
 int in_fd, out_fd;
 
 struct proc_state {
   int64_t check_no;
+  uint16_t flags;
   int cancelled;
   pid_t pid;
   int32_t status;
@@ -122,6 +126,7 @@ static void process_siglist() {
     pid = waitpid(0, &status, WNOHANG);
     if(pid <= 0) break;
     ps = mtev_skiplist_find_compare(active_procs, &pid, &iter, __proc_state_pid);
+    if(!ps && plugin_reaped(pid)) continue;
     mtevL((ps?nldeb:nlerr), "reaped pid %d (check: %lld) -> %x\n",
           pid, (long long int)(ps?ps->check_no:-1), status);
     if(ps) {
@@ -251,6 +256,35 @@ static int write_out_backing_fd(int ofd, int bfd, uint32_t max_out_len) {
   return -1;
 }
 
+static void write_out_buffer(int ofd, const char *buf, uint32_t len) {
+  uint32_t outlen = len + 1;
+  assert_write(ofd, &outlen, sizeof(outlen));
+  assert_write(ofd, buf, len);
+  assert_write(ofd, "", 1);
+}
+
+/* A result that did not come from a process with backing files. */
+static void write_result(int64_t check_no, int32_t status,
+                         const char *out, uint32_t outlen,
+                         const char *err, uint32_t errlen,
+                         uint32_t max_out_len) {
+  int16_t stdout_trunc = 0, stderr_trunc = 0;
+  if(outlen > max_out_len - 1) {
+    outlen = max_out_len - 1;
+    stdout_trunc = 1;
+  }
+  if(errlen > max_out_len - 1) {
+    errlen = max_out_len - 1;
+    stderr_trunc = 1;
+  }
+  assert_write(out_fd, &check_no, sizeof(check_no));
+  assert_write(out_fd, &status, sizeof(status));
+  assert_write(out_fd, &stdout_trunc, sizeof(stdout_trunc));
+  assert_write(out_fd, &stderr_trunc, sizeof(stderr_trunc));
+  write_out_buffer(out_fd, out, outlen);
+  write_out_buffer(out_fd, err, errlen);
+}
+
 static void finish_procs() {
   struct proc_state *ps;
   process_siglist();
@@ -276,53 +310,360 @@ static void finish_procs() {
   }
 }
 
-int external_proc_spawn(struct proc_state *ps) {
-  int i, stdin_fd;
-  char stdoutfile[PATH_MAX];
-  char stderrfile[PATH_MAX];
+static int set_cloexec(int fd) {
+  int flags = fcntl(fd, F_GETFD);
+  if(flags == -1) return -1;
+  return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
 
-  mtevL(nldeb, "About to spawn: (%s)\n", ps->path);
-  strlcpy(stdoutfile, "/tmp/noitext.XXXXXX", PATH_MAX);
-  ps->stdout_fd = mkstemp(stdoutfile);
-  if(ps->stdout_fd < 0) goto prefork_fail;
-  unlink(stdoutfile);
-  strlcpy(stderrfile, "/tmp/noitext.XXXXXX", PATH_MAX);
-  ps->stderr_fd = mkstemp(stderrfile);
-  if(ps->stderr_fd < 0) goto prefork_fail;
-  unlink(stderrfile);
-  ps->pid = fork();
-  if(ps->pid == -1) goto prefork_fail;
+static int make_pipe(int fds[2]) {
+  if(pipe(fds) != 0) return -1;
+  set_cloexec(fds[0]);
+  set_cloexec(fds[1]);
+  return 0;
+}
 
-  /* Here.. fork has succeeded */
-  if(ps->pid) {
-    mtev_skiplist_insert(active_procs, ps);
-    return 0;
+/* An anonymous file to capture output; memfd where we have it. */
+static int backing_fd() {
+  char tmpfile[PATH_MAX];
+  int fd;
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+  fd = memfd_create("noitext", MFD_CLOEXEC);
+  if(fd >= 0 || errno != ENOSYS) return fd;
+#endif
+  strlcpy(tmpfile, "/tmp/noitext.XXXXXX", PATH_MAX);
+  fd = mkstemp(tmpfile);
+  if(fd < 0) return -1;
+  unlink(tmpfile);
+  set_cloexec(fd);
+  return fd;
+}
+
+/* Starts path with stdin/stdout/stderr on the given fds.  in_fd < 0 is
+ * /dev/null, err_fd < 0 leaves our stderr in place.  Returns the pid or -1.
+ */
+static pid_t external_exec(const char *path, char **argv, char **envp,
+                           int stdin_fd, int stdout_fd, int stderr_fd) {
+  pid_t pid;
+  int i;
+
+  if(use_posix_spawn) {
+    posix_spawn_file_actions_t fa;
+    int rv;
+    posix_spawn_file_actions_init(&fa);
+    if(stdin_fd >= 0) posix_spawn_file_actions_adddup2(&fa, stdin_fd, 0);
+    else posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, stdout_fd, 1);
+    if(stderr_fd >= 0) posix_spawn_file_actions_adddup2(&fa, stderr_fd, 2);
+    /* everything else we hold is close-on-exec */
+    rv = posix_spawn(&pid, path, &fa, NULL, argv, envp);
+    posix_spawn_file_actions_destroy(&fa);
+    if(rv != 0) {
+      mtevL(nldeb, "posix_spawn(%s): %s\n", path, strerror(rv));
+      return -1;
+    }
+    return pid;
   }
+
+  pid = fork();
+  if(pid != 0) return pid;
   /* Run the process */
-  stdin_fd = open("/dev/null", O_RDONLY);
-  if(stdin_fd < 0) close(0);
-  else dup2(stdin_fd, 0);
-  dup2(ps->stdout_fd, 1);
-  dup2(ps->stderr_fd, 2);
+  if(stdin_fd >= 0) dup2(stdin_fd, 0);
+  else {
+    stdin_fd = open("/dev/null", O_RDONLY);
+    if(stdin_fd < 0) close(0);
+    else dup2(stdin_fd, 0);
+  }
+  dup2(stdout_fd, 1);
+  if(stderr_fd >= 0) dup2(stderr_fd, 2);
   /* Shut off everything but std{in,out,err} */
   for(i=3;i<256;i++) close(i);
-  execve(ps->path, ps->argv, ps->envp);
+  execve(path, argv, envp);
   exit(-1);
+}
+
+int external_proc_spawn(struct proc_state *ps) {
+  mtevL(nldeb, "About to spawn: (%s)\n", ps->path);
+  ps->stdout_fd = backing_fd();
+  if(ps->stdout_fd < 0) goto prefork_fail;
+  ps->stderr_fd = backing_fd();
+  if(ps->stderr_fd < 0) goto prefork_fail;
+  ps->pid = external_exec(ps->path, ps->argv, ps->envp,
+                          -1, ps->stdout_fd, ps->stderr_fd);
+  if(ps->pid == -1) goto prefork_fail;
+
+  mtev_skiplist_insert(active_procs, ps);
+  return 0;
  prefork_fail:
   ps->status = -1;
   mtev_skiplist_insert(done_procs, ps);
   return -1;
 }
 
+/* Persistent plugins are started once per command and fed checks over
+ * stdin, several may be outstanding at once.
+ *
+ *   helper to plugin:
+ *     "<check_no> <nargs> <nenv>\n"
+ *     then for each argument (after argv[0]) and environment entry:
+ *     "<len>\n" followed by len bytes and "\n"
+ *
+ *   plugin to helper (in any order):
+ *     "<check_no> <exit code> <len>\n" followed by len bytes of output
+ *
+ * If a plugin exits, breaks protocol or lets more than PLUGIN_MAX_BACKLOG
+ * bytes of requests back up unread, its outstanding checks fail and the
+ * next check to use it starts it anew.
+ */
+#define PLUGIN_MAX_HEADER 256
+#define PLUGIN_MAX_RESPONSE (16 * 1024 * 1024)
+#define PLUGIN_MAX_BACKLOG (16 * 1024 * 1024)
+
+struct persistent_plugin {
+  char *path;
+  pid_t pid;
+  int to_fd;
+  int from_fd;
+  short revents_to;
+  short revents_from;
+  uint32_t max_out_len;
+  char *wbuf;
+  size_t wlen, woff, wsize;
+  char *rbuf;
+  size_t rlen, rsize;
+  int64_t *pending;
+  int npending, pending_size;
+  struct persistent_plugin *next;
+};
+static struct persistent_plugin *plugins = NULL;
+
+static void plugin_fail(struct persistent_plugin *p, const char *reason) {
+  struct persistent_plugin **pp;
+  int i;
+  mtevL(nlerr, "external: persistent plugin %s (pid %d): %s\n",
+        p->path, p->pid, reason);
+  if(p->pid > 0) {
+    kill(p->pid, SIGKILL);
+    while(waitpid(p->pid, NULL, 0) == -1 && errno == EINTR);
+  }
+  for(pp = &plugins; *pp; pp = &(*pp)->next) {
+    if(*pp == p) {
+      *pp = p->next;
+      break;
+    }
+  }
+  for(i=0; i<p->npending; i++)
+    write_result(p->pending[i], -1, "", 0, reason, strlen(reason),
+                 p->max_out_len);
+  if(p->to_fd >= 0) close(p->to_fd);
+  if(p->from_fd >= 0) close(p->from_fd);
+  free(p->path);
+  free(p->wbuf);
+  free(p->rbuf);
+  free(p->pending);
+  free(p);
+}
+
+static mtev_boolean plugin_reaped(pid_t pid) {
+  struct persistent_plugin *p;
+  for(p = plugins; p; p = p->next) {
+    if(p->pid == pid) {
+      p->pid = -1;
+      plugin_fail(p, "plugin exited");
+      return mtev_true;
+    }
+  }
+  return mtev_false;
+}
+
+static struct persistent_plugin *plugin_start(struct proc_state *ps) {
+  struct persistent_plugin *p;
+  int to[2], from[2];
+  char *argv[2] = { ps->argv[0], NULL };
+
+  if(make_pipe(to) != 0) return NULL;
+  if(make_pipe(from) != 0) {
+    close(to[0]);
+    close(to[1]);
+    return NULL;
+  }
+  p = calloc(1, sizeof(*p));
+  p->path = strdup(ps->path);
+  p->max_out_len = ps->max_out_len;
+  p->pid = external_exec(ps->path, argv, ps->envp, to[0], from[1], -1);
+  close(to[0]);
+  close(from[1]);
+  p->to_fd = to[1];
+  p->from_fd = from[0];
+  if(p->pid == -1) {
+    plugin_fail(p, "could not start plugin");
+    return NULL;
+  }
+  fcntl(p->to_fd, F_SETFL, fcntl(p->to_fd, F_GETFL) | O_NONBLOCK);
+  fcntl(p->from_fd, F_SETFL, fcntl(p->from_fd, F_GETFL) | O_NONBLOCK);
+  mtevL(nldeb, "started persistent plugin %s as %d\n", p->path, p->pid);
+  p->next = plugins;
+  plugins = p;
+  return p;
+}
+
+static void plugin_append(struct persistent_plugin *p, const char *d, size_t len) {
+  if(p->wlen + len > p->wsize) {
+    if(p->woff) {
+      memmove(p->wbuf, p->wbuf + p->woff, p->wlen - p->woff);
+      p->wlen -= p->woff;
+      p->woff = 0;
+    }
+    while(p->wlen + len > p->wsize) p->wsize = p->wsize ? p->wsize * 2 : 4096;
+    p->wbuf = realloc(p->wbuf, p->wsize);
+  }
+  memcpy(p->wbuf + p->wlen, d, len);
+  p->wlen += len;
+}
+
+/* Writes as much as the plugin will take; 0 on success. */
+static int plugin_flush(struct persistent_plugin *p) {
+  while(p->woff < p->wlen) {
+    ssize_t len = write(p->to_fd, p->wbuf + p->woff, p->wlen - p->woff);
+    if(len == -1) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN) return 0;
+      plugin_fail(p, "write to plugin failed");
+      return -1;
+    }
+    p->woff += len;
+  }
+  p->woff = p->wlen = 0;
+  return 0;
+}
+
+static void plugin_invoke(struct proc_state *ps) {
+  struct persistent_plugin *p;
+  char hdr[64];
+  int i, nargs, nenv;
+
+  for(p = plugins; p; p = p->next)
+    if(!strcmp(p->path, ps->path)) break;
+  if(p && p->wlen - p->woff > PLUGIN_MAX_BACKLOG) {
+    plugin_fail(p, "plugin is not reading its input");
+    p = NULL;
+  }
+  if(!p) p = plugin_start(ps);
+  if(!p) {
+    const char *reason = "could not start persistent plugin";
+    write_result(ps->check_no, -1, "", 0, reason, strlen(reason),
+                 ps->max_out_len);
+    return;
+  }
+
+  for(nargs=0; ps->argv[nargs]; nargs++);
+  for(nenv=0; ps->envp[nenv]; nenv++);
+  snprintf(hdr, sizeof(hdr), "%lld %d %d\n",
+           (long long int)ps->check_no, nargs - 1, nenv);
+  plugin_append(p, hdr, strlen(hdr));
+  for(i=1; i<nargs; i++) {
+    snprintf(hdr, sizeof(hdr), "%zu\n", strlen(ps->argv[i]));
+    plugin_append(p, hdr, strlen(hdr));
+    plugin_append(p, ps->argv[i], strlen(ps->argv[i]));
+    plugin_append(p, "\n", 1);
+  }
+  for(i=0; i<nenv; i++) {
+    snprintf(hdr, sizeof(hdr), "%zu\n", strlen(ps->envp[i]));
+    plugin_append(p, hdr, strlen(hdr));
+    plugin_append(p, ps->envp[i], strlen(ps->envp[i]));
+    plugin_append(p, "\n", 1);
+  }
+  if(p->npending == p->pending_size) {
+    p->pending_size = p->pending_size ? p->pending_size * 2 : 16;
+    p->pending = realloc(p->pending, p->pending_size * sizeof(*p->pending));
+  }
+  p->pending[p->npending++] = ps->check_no;
+  plugin_flush(p);
+}
+
+/* Reads what the plugin has to say and reports any complete responses. */
+static void plugin_read(struct persistent_plugin *p) {
+  while(1) {
+    ssize_t len;
+    if(p->rlen == p->rsize) {
+      p->rsize = p->rsize ? p->rsize * 2 : 4096;
+      p->rbuf = realloc(p->rbuf, p->rsize);
+    }
+    len = read(p->from_fd, p->rbuf + p->rlen, p->rsize - p->rlen);
+    if(len == -1) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN) break;
+      plugin_fail(p, "read from plugin failed");
+      return;
+    }
+    if(len == 0) {
+      plugin_fail(p, "plugin closed its output");
+      return;
+    }
+    p->rlen += len;
+  }
+
+  while(p->rlen > 0) {
+    char hdr[PLUGIN_MAX_HEADER + 1];
+    char *nl = memchr(p->rbuf, '\n', MIN(p->rlen, PLUGIN_MAX_HEADER));
+    long long int check_no;
+    int code, i;
+    unsigned int outlen;
+    size_t hdrlen;
+
+    if(!nl) {
+      if(p->rlen >= PLUGIN_MAX_HEADER) plugin_fail(p, "bad response header");
+      return;
+    }
+    hdrlen = nl - p->rbuf + 1;
+    memcpy(hdr, p->rbuf, hdrlen - 1);
+    hdr[hdrlen - 1] = '\0';
+    if(sscanf(hdr, "%lld %d %u", &check_no, &code, &outlen) != 3 ||
+       outlen > PLUGIN_MAX_RESPONSE) {
+      plugin_fail(p, "bad response header");
+      return;
+    }
+    if(p->rlen < hdrlen + outlen) return;
+
+    for(i=0; i<p->npending; i++)
+      if(p->pending[i] == check_no) break;
+    if(i < p->npending) {
+      p->pending[i] = p->pending[--p->npending];
+      /* report it as a wait status so it reads like any other exit */
+      write_result(check_no, (code & 0xff) << 8, p->rbuf + hdrlen, outlen,
+                   "", 0, p->max_out_len);
+    }
+    else {
+      mtevL(nldeb, "persistent plugin %s answered unknown check %lld\n",
+            p->path, check_no);
+    }
+    p->rlen -= hdrlen + outlen;
+    memmove(p->rbuf, p->rbuf + hdrlen + outlen, p->rlen);
+  }
+}
+
+static void service_plugins() {
+  struct persistent_plugin *p, *next;
+  for(p = plugins; p; p = next) {
+    next = p->next;
+    if(p->revents_to && plugin_flush(p) != 0) continue;
+    if(p->revents_from) plugin_read(p);
+  }
+}
+
 static void sig_noop(int signum) {
   signal(signum, sig_noop);
 }
 
-int external_child(external_data_t *data) {
-  in_fd = data->pipe_n2e[0];
-  out_fd = data->pipe_e2n[1];
+int external_child(external_data_t *data, external_helper_t *helper) {
+  struct pollfd *pfds = NULL;
+  int i, npfds_alloc = 0;
+
+  in_fd = helper->pipe_n2e[0];
+  out_fd = helper->pipe_e2n[1];
   nlerr = data->nlerr;
   nldeb = data->nldeb;
+  use_posix_spawn = data->use_posix_spawn;
 
   /* switch to / */
   if(chdir("/") != 0) {
@@ -330,6 +671,11 @@ int external_child(external_data_t *data) {
     return -1;
   }
 
+  /* Nothing we hold should leak into what we run. */
+  for(i=3;i<256;i++) set_cloexec(i);
+  /* A plugin going away shouldn't take us with it. */
+  sig_noop(SIGPIPE);
+
   active_procs = mtev_skiplist_alloc();
   mtev_skiplist_init(active_procs);
   mtev_skiplist_set_compare(active_procs, __proc_state_check_no,
@@ -342,18 +688,45 @@ int external_child(external_data_t *data) {
                             __proc_state_check_no_key);
 
   while(1) {
-    struct pollfd pfd;
+    struct persistent_plugin *p;
     struct proc_state *proc_state;
     int64_t check_no;
     int16_t argcnt, *arglens, envcnt, *envlens;
-    int i;
+    uint16_t flags;
+    int npfds;
 
     sig_noop(SIGCHLD);
 
     /* We poll here so that we can be interrupted by the SIGCHLD */
-    pfd.fd = in_fd;
-    pfd.events = POLLIN;
-    while(poll(&pfd, 1, -1) == -1 && errno == EINTR) finish_procs();
+    npfds = 1;
+    for(p = plugins; p; p = p->next) npfds += 2;
+    if(npfds > npfds_alloc) {
+      npfds_alloc = npfds;
+      pfds = realloc(pfds, npfds_alloc * sizeof(*pfds));
+    }
+    pfds[0].fd = in_fd;
+    pfds[0].events = POLLIN;
+    npfds = 1;
+    for(p = plugins; p; p = p->next) {
+      pfds[npfds].fd = p->from_fd;
+      pfds[npfds++].events = POLLIN;
+      pfds[npfds].fd = (p->woff < p->wlen) ? p->to_fd : -1;
+      pfds[npfds++].events = POLLOUT;
+    }
+    if(poll(pfds, npfds, -1) == -1) {
+      if(errno == EINTR) finish_procs();
+      continue;
+    }
+    npfds = 1;
+    for(p = plugins; p; p = p->next) {
+      p->revents_from = pfds[npfds++].revents;
+      p->revents_to = pfds[npfds++].revents;
+    }
+    service_plugins();
+    if(!pfds[0].revents) {
+      finish_procs();
+      continue;
+    }
 
     assert_read(in_fd, &check_no, sizeof(check_no));
     assert_read(in_fd, &argcnt, sizeof(argcnt));
@@ -363,10 +736,12 @@ int external_child(external_data_t *data) {
       continue;
     }
     mtevAssert(argcnt > 1);
+    assert_read(in_fd, &flags, sizeof(flags));
     proc_state = calloc(1, sizeof(*proc_state));
     proc_state->stdout_fd = -1;
     proc_state->stderr_fd = -1;
     proc_state->check_no = check_no;
+    proc_state->flags = flags;
     proc_state->max_out_len = data->max_out_len;
 
     /* read in the argument lengths */
@@ -400,7 +775,12 @@ int external_child(external_data_t *data) {
     free(envlens);
 
     /* All set, this just needs to be run */
-    external_proc_spawn(proc_state);
+    if(proc_state->flags & EXTERNAL_FLAG_PERSISTENT) {
+      plugin_invoke(proc_state);
+      proc_state_free(proc_state);
+      free(proc_state);
+    }
+    else external_proc_spawn(proc_state);
 
     finish_procs();
   }
@@ -56,12 +56,27 @@ struct external_response {
   uint32_t stderrlen;
   char *stderrbuff;
 };
+#define EXTERNAL_FLAG_PERSISTENT 0x1
+#define EXTERNAL_MAX_HELPERS 64
+
+struct external_data;
+
+/* One helper process; checks are sharded across helpers by check id. */
 typedef struct {
-  mtev_log_stream_t nlerr;
-  mtev_log_stream_t nldeb;
+  struct external_data *data;
+  void *self;
   int child;
   int pipe_n2e[2];
   int pipe_e2n[2];
+  struct external_response *cr;
+} external_helper_t;
+
+typedef struct external_data {
+  mtev_log_stream_t nlerr;
+  mtev_log_stream_t nldeb;
+  int nhelpers;
+  external_helper_t *helpers;
+  mtev_boolean use_posix_spawn;
   char* path;
   char* nagios_regex;
   eventer_jobq_t *jobq;
@@ -69,7 +84,6 @@ typedef struct {
   mtev_hash_table external_checks;
   mtev_hash_table *options;
   uint32_t max_out_len;
-  struct external_response *cr;
 } external_data_t;
 
 typedef struct {
@@ -80,6 +94,6 @@ typedef struct {
   uint32_t stdoutlen;
 } __attribute__((packed)) external_header;
 
-int external_child(external_data_t *);
+int external_child(external_data_t *, external_helper_t *);
 
 #endif
@@ -59,6 +59,7 @@ extern "C" {
 #include "noit_check_tools.h"
 #include "noit_mtev_bridge.h"
 #include "prometheus.pb-c.h"
+#include "noit_plaintext.h"
 #include "noit_socket_listener.h"
 }
 
@@ -221,46 +222,28 @@ graphite_handle_pickle(noit_check_t *check, char *buffer, size_t len)
 static int
 graphite_handle_payload(noit_check_t *check, char *buffer, size_t len)
 {
-  char record[4096];
-  char *part;
   char *s = NULL, *e = NULL;
-  const size_t c_length = len;
-  ptrdiff_t length = c_length;
-  ptrdiff_t d = 0;
+  char *const buffer_end = buffer + len;
   int rv = 0;
 
   mtev_memory_begin();
 
-  for (s = buffer; length && *s; s = e + 1) {
+  for (s = buffer; s < buffer_end && *s; s = e + 1) {
     rv++;
 
     /* Find end of line. */
-    e = (char *)memchr(s, '\n', length);
+    e = (char *)memchr(s, '\n', buffer_end - s);
 
     if (e == NULL) {
-
-      length = c_length - (s - buffer);
-      e = s + length;
-
-      if (length == 0 || *e != '\0') {
+      e = buffer_end;
+      if (*e != '\0') {
         /* nothing left? */
         break;
       }
-
-      *e = '\0';
-      d = length + 1;
-      length = 0;
-    } else {
-      /* Update cursor. */
-      d = e - s + 1;
-      length -= d;
-      *e = '\0';
     }
-    part = s;
-    /* save the row for later logging */
-    strncpy(record, part, sizeof(record) - 1);
+    *e = '\0';
+    char *record = s;
 
-    size_t record_len = strlen(part);
     /*
      * a graphite record is of the format:
      *
@@ -270,26 +253,21 @@ graphite_handle_payload(noit_check_t *check, char *buffer, size_t len)
      * We will use the noit_record_parse_m_timestamp function to deal with milliseconds
      * in case they are sent.
      */
-    char *first_space = (char *)memchr(part, ' ', record_len);
+    char *first_space = (char *)noit_plaintext_find_space(record, e);
     if (first_space == NULL) {
-      first_space = (char *)memchr(part, '\t', record_len);
-      if (first_space == NULL) {
-        mtevL(nldeb, "Invalid graphite record, can't find the first space or tab in: %s\n", record);
-        continue;
-      }
+      mtevL(nldeb, "Invalid graphite record, can't find the first space or tab in: %s\n", record);
+      continue;
     }
 
-    char *second_space = (char *)memchr(first_space + 1, ' ', record_len - (part - (first_space + 1)));
+    char *second_space = (char *)noit_plaintext_find_space(first_space + 1, e);
     if (second_space == NULL) {
-      second_space = (char *)memchr(first_space + 1, '\t', record_len - (part - (first_space + 1)));
-      if (second_space == NULL) {
-        mtevL(nldeb, "Invalid graphite record, can't find the second space or tab in: %s\n", record);
-        continue;
-      }
+      mtevL(nldeb, "Invalid graphite record, can't find the second space or tab in: %s\n", record);
+      continue;
     }
 
     mtevL(nldeb, "Graphite record: %s\n", record);
-    char *graphite_metric_name = part;
+    char *graphite_metric_name = record;
+    size_t metric_name_len = first_space - record;
     *first_space = '\0';
     first_space++;
     const char *graphite_value = first_space;
@@ -297,47 +275,27 @@ graphite_handle_payload(noit_check_t *check, char *buffer, size_t len)
     second_space++;
     const char *graphite_timestamp = second_space;
 
-    size_t metric_name_len = strlen(graphite_metric_name);
-
-    char *dp;
-    uint64_t whence_ms = strtoull(graphite_timestamp, &dp, 10);
+    const char *dp = graphite_timestamp;
+    uint64_t whence_ms = 0;
+    if (noit_plaintext_parse_u64(graphite_timestamp, e, &whence_ms, &dp) < 0) whence_ms = 0;
     whence_ms *= 1000; /* s -> ms */
-    if(dp && *dp == '.')
-      whence_ms += (int) (1000.0 * atof(dp));
+    if (*dp == '.') {
+      int scale = 100;
+      for (dp++; scale && *dp >= '0' && *dp <= '9'; dp++, scale /= 10)
+        whence_ms += (*dp - '0') * scale;
+    }
 
-    size_t graphite_value_len = strlen(graphite_value);
+    size_t graphite_value_len = (second_space - 1) - graphite_value;
     if (count_integral_digits(graphite_value, graphite_value_len, mtev_true) == 0) {
-      mtevL(nldeb, "Invalid graphite record, no digits in value: %s\n", record);
+      mtevL(nldeb, "Invalid graphite record, no digits in value: %s\n", graphite_value);
       continue;
     }
 
     double metric_value = 0.0;
-    const char *dot = strchr(graphite_value, '.');
-    if (dot == NULL) {
-      /* attempt fast integer parse, if we fail, jump to strtod parse */
-      if (*graphite_value == '-') {
-        errno = 0;
-        int64_t v = strtoll(graphite_value, NULL, 10);
-        if (errno == ERANGE) {
-          goto strtod_parse;
-        }
-        metric_value = (double)v;
-      } else {
-        errno = 0;
-        uint64_t v = strtoull(graphite_value, NULL, 10);
-        if (errno == ERANGE) {
-          goto strtod_parse;
-        }
-        metric_value = (double)v;
-      }
-    } else {
-    strtod_parse:
-      errno = 0;
-      metric_value = strtod(graphite_value, NULL);
-      if (errno == ERANGE) {
-        mtevL(nldeb, "Invalid graphite record, strtod cannot parse value: %s\n", record);
-        continue;
-      }
+    if (noit_plaintext_parse_double(graphite_value, graphite_value + graphite_value_len,
+                                    &metric_value, NULL) < 0) {
+      mtevL(nldeb, "Invalid graphite record, cannot parse value: %s\n", graphite_value);
+      continue;
     }
 
     /* allow for any length name + tags in the broker */
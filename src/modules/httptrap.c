@@ -38,6 +38,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include <ctype.h>
 #include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
@@ -45,6 +46,8 @@
 #include <mtev_rand.h>
 #include <mtev_rest.h>
 #include <mtev_hash.h>
+#include <mtev_dyn_buffer.h>
+#include <mtev_stats.h>
 #include <mtev_json.h>
 #include <mtev_memory.h>
 #include <mtev_uuid.h>
@@ -63,6 +66,11 @@ yajl_string_encode(const yajl_print_t print, void * ctx,
 
 #define DEFAULT_HTTPTRAP_DELIMITER '`'
 #define MAX_DEPTH 32
+#define HTTPTRAP_POOL_CHUNK (64 * 1024)
+#define HTTPTRAP_MAX_INTERNED 100000
+#define DEFAULT_PARSE_BACKLOG 256
+#define DEFAULT_PARSE_PER_CHECK 4
+#define DEFAULT_PARSE_MAX_BODY (64 * 1024 * 1024)
 
 #define HT_EX_TYPE 0x1
 #define HT_EX_VALUE 0x2
@@ -79,6 +87,18 @@ static uint64_t httptrap_count = 0;
 #define _YD(fmt...) mtevL(nlyajl, fmt)
 
 static mtev_boolean httptrap_surrogate;
+
+/* When parse_concurrency is set, request bodies are buffered on the
+ * eventer thread and parsed on this jobq instead. */
+static eventer_jobq_t *httptrap_parse_jobq;
+static uint32_t httptrap_parse_backlog = DEFAULT_PARSE_BACKLOG;
+static uint32_t httptrap_parse_per_check = DEFAULT_PARSE_PER_CHECK;
+static size_t httptrap_parse_max_body = DEFAULT_PARSE_MAX_BODY;
+static uint32_t httptrap_uploads_pending;
+static uint64_t httptrap_bytes_in_flight;
+static stats_handle_t *stats_queue_latency;
+static stats_handle_t *stats_rejected_busy;
+static stats_handle_t *stats_rejected_check;
 static const char *TRUNCATE_ERROR = "at least one metric exceeded max name length";
 
 typedef struct _mod_config {
@@ -89,8 +109,22 @@ typedef struct _mod_config {
 
 typedef struct httptrap_closure_s {
   noit_module_t *self;
+  /* metric names seen on this check, shared across submissions */
+  pthread_mutex_t names_lock;
+  mtev_hash_table names;
+  /* uploads admitted to the parse jobq */
+  uint32_t uploads_inflight;
 } httptrap_closure_t;
 
+/* Storage for the immediate metrics of one request.  Everything carved from
+ * it is released at once after the bundle has been logged. */
+struct httptrap_pool_chunk {
+  struct httptrap_pool_chunk *next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
 typedef enum {
   HTTPTRAP_VOP_REPLACE,
   HTTPTRAP_VOP_AVERAGE,
@@ -112,7 +146,11 @@ struct rest_json_payload {
   char *error;
   char *supp_err;
   int depth;
-  char *keys[MAX_DEPTH];
+  /* The key at each depth is a prefix of key_buf (-1 when unset); a
+   * nested key is its parent's key plus delimiter and component. */
+  int key_len[MAX_DEPTH];
+  char key_buf[MAX_METRIC_TAGGED_NAME + 2];
+  char *expanded_name;
   int array_depth[MAX_DEPTH];
   unsigned char last_special_key;
   unsigned char saw_complex_type;
@@ -127,39 +165,150 @@ struct rest_json_payload {
   mtev_boolean immediate;
   uint64_t current_counter;
   mtev_hash_table *immediate_metrics;
+  struct httptrap_pool_chunk *pool;
+  httptrap_closure_t *ccl;
+
+  /* parse jobq mode */
+  mtev_boolean buffered;
+  mtev_boolean admitted;
+  mtev_boolean parsed;
+  httptrap_closure_t *admitted_ccl;
+  mtev_dyn_buffer_t body;
+  size_t body_accounted;
+  struct timeval queued_at;
+  int error_code;
 };
 
+static httptrap_closure_t *
+httptrap_closure_alloc(noit_module_t *self) {
+  httptrap_closure_t *ccl = calloc(1, sizeof(*ccl));
+  ccl->self = self;
+  pthread_mutex_init(&ccl->names_lock, NULL);
+  mtev_hash_init(&ccl->names);
+  return ccl;
+}
+
 static void
-track_filtered(struct rest_json_payload *json, char **name) {
-  metric_t m = { .metric_name = *name };
+httptrap_cleanup(noit_module_t *self, noit_check_t *check) {
+  httptrap_closure_t *ccl = check->closure;
+  if(!ccl) return;
+  mtev_hash_destroy(&ccl->names, free, NULL);
+  pthread_mutex_destroy(&ccl->names_lock);
+  free(ccl);
+  check->closure = NULL;
+}
+
+static void *
+httptrap_pool_alloc(struct rest_json_payload *rxc, size_t size) {
+  struct httptrap_pool_chunk *c = rxc->pool;
+  size = (size + 15) & ~(size_t)15;
+  if(!c || c->used + size > c->size) {
+    size_t csize = MAX(size, HTTPTRAP_POOL_CHUNK);
+    c = malloc(sizeof(*c) + csize);
+    c->next = rxc->pool;
+    c->used = 0;
+    c->size = csize;
+    rxc->pool = c;
+  }
+  void *p = c->data + c->used;
+  c->used += size;
+  return p;
+}
+
+static void
+httptrap_pool_reset(struct rest_json_payload *rxc, mtev_boolean release) {
+  struct httptrap_pool_chunk *c = rxc->pool, *next;
+  /* keep one standard chunk around for the rest of the request */
+  if(c && !release && c->size == HTTPTRAP_POOL_CHUNK) {
+    c->used = 0;
+    next = c->next;
+    c->next = NULL;
+    c = next;
+  }
+  else rxc->pool = NULL;
+  for(; c; c = next) {
+    next = c->next;
+    free(c);
+  }
+}
+
+static char *
+httptrap_pool_strdup(struct rest_json_payload *rxc, const char *str, size_t len) {
+  char *copy = httptrap_pool_alloc(rxc, len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+/* Returns a copy of name that lives as long as the check does, falling back
+ * to the request pool for surrogate checks or once a check has seen too many
+ * distinct names. */
+static char *
+httptrap_intern_name(struct rest_json_payload *rxc, const char *name) {
+  httptrap_closure_t *ccl = rxc->ccl;
+  size_t len = strlen(name);
+  void *vname;
+  if(!ccl) return httptrap_pool_strdup(rxc, name, len);
+  pthread_mutex_lock(&ccl->names_lock);
+  if(!mtev_hash_retrieve(&ccl->names, name, len, &vname)) {
+    if(mtev_hash_size(&ccl->names) >= HTTPTRAP_MAX_INTERNED) {
+      pthread_mutex_unlock(&ccl->names_lock);
+      return httptrap_pool_strdup(rxc, name, len);
+    }
+    vname = strdup(name);
+    mtev_hash_store(&ccl->names, vname, len, vname);
+  }
+  pthread_mutex_unlock(&ccl->names_lock);
+  return vname;
+}
+
+static const char *
+track_filtered(struct rest_json_payload *json, const char *name) {
+  metric_t m = { .metric_name = (char *)name };
   if(!noit_apply_filterset(json->check->filterset, json->check, &m)) {
     json->filtered_cnt++;
   }
   if (m.expanded_metric_name) {
-    free(m.metric_name);
-    *name = m.expanded_metric_name;
+    free(json->expanded_name);
+    json->expanded_name = m.expanded_metric_name;
+    return json->expanded_name;
   }
+  return name;
 }
 
 static void
 rest_json_flush_immediate(struct rest_json_payload *rxc) {
   noit_check_log_bundle_metrics(rxc->check, &rxc->start_time, rxc->immediate_metrics);
-  mtev_hash_delete_all(rxc->immediate_metrics, NULL, mtev_memory_safe_free);
+  /* the metrics, their values and any uninterned names live in the pool */
+  mtev_hash_delete_all(rxc->immediate_metrics, NULL, NULL);
+  httptrap_pool_reset(rxc, mtev_false);
 }
 
 static void 
 metric_local_track_or_log(void *vrxc, const char *name, 
                           metric_type_t t, const void *vp, struct timeval *w) {
   struct rest_json_payload *rxc = vrxc;
+  void *unused;
   if(t == METRIC_GUESS) return;
-  metric_t *m = noit_metric_alloc();
-  m->metric_name = strdup(name);
+  if(!rxc->immediate_metrics) {
+    rxc->immediate_metrics = malloc(sizeof(*rxc->immediate_metrics));
+    mtev_hash_init(rxc->immediate_metrics);
+  }
+  if(mtev_hash_retrieve(rxc->immediate_metrics, name, strlen(name), &unused)) {
+    /* collision, just log it out (this releases the pool) */
+    rest_json_flush_immediate(rxc);
+  }
+  metric_t *m = httptrap_pool_alloc(rxc, sizeof(*m));
+  memset(m, 0, sizeof(*m));
+  m->metric_name = httptrap_intern_name(rxc, name);
   m->metric_type = t;
   if(rxc->got_timestamp) {
     memcpy(&m->whence, &rxc->last_timestamp, sizeof(struct timeval));
   }
   if(vp) {
-    if(t == METRIC_STRING) m->metric_value.s = strdup((const char *)vp);
+    if(t == METRIC_STRING) {
+      m->metric_value.s = httptrap_pool_strdup(rxc, (const char *)vp, strlen((const char *)vp));
+    }
     else {
       size_t vsize = 0;
       switch(m->metric_type) {
@@ -182,20 +331,12 @@ metric_local_track_or_log(void *vrxc, const char *name,
           break;
       }
       if(vsize) {
-        m->metric_value.vp = malloc(vsize);
+        m->metric_value.vp = httptrap_pool_alloc(rxc, vsize);
         memcpy(m->metric_value.vp, vp, vsize);
       }
     }
   }
-  if(!rxc->immediate_metrics) {
-    rxc->immediate_metrics = malloc(sizeof(*rxc->immediate_metrics));
-    mtev_hash_init(rxc->immediate_metrics);
-  }
-  if(!mtev_hash_store(rxc->immediate_metrics, m->metric_name, strlen(m->metric_name), m)) {
-    /* collision, just log it out */
-    rest_json_flush_immediate(rxc);
-    mtevAssert(mtev_hash_store(rxc->immediate_metrics, m->metric_name, strlen(m->metric_name), m));
-  }
+  mtevAssert(mtev_hash_store(rxc->immediate_metrics, m->metric_name, strlen(m->metric_name), m));
   noit_stats_mark_metric_logged(noit_check_get_stats_inprogress(rxc->check), m, mtev_false);
 }
 
@@ -256,36 +397,54 @@ noit_httptrap_check_fanout(noit_module_t *self,
   return is_fanout;
 }
 
+static void
+httptrap_key_invalidate_below(struct rest_json_payload *json, int depth) {
+  for(int i = depth + 1; i < MAX_DEPTH && json->key_len[i] >= 0; i++)
+    json->key_len[i] = -1;
+}
+static void
+httptrap_key_clear(struct rest_json_payload *json) {
+  json->key_len[json->depth] = -1;
+  httptrap_key_invalidate_below(json, json->depth);
+}
+static void
+httptrap_key_copy_parent(struct rest_json_payload *json) {
+  json->key_len[json->depth] = json->depth > 0 ? json->key_len[json->depth-1] : -1;
+  httptrap_key_invalidate_below(json, json->depth);
+}
+/* Sets the key at the current depth to the parent key, the delimiter and
+ * component, truncating to the maximum metric name length. */
+static void
+httptrap_key_set(struct rest_json_payload *json, const char *component, size_t len) {
+  int base = 0;
+  if(json->depth > 0 && json->key_len[json->depth-1] >= 0) {
+    base = json->key_len[json->depth-1];
+    json->key_buf[base++] = json->delimiter;
+    if(base + len > MAX_METRIC_TAGGED_NAME) {
+      len = (base > MAX_METRIC_TAGGED_NAME) ? 0 : MAX_METRIC_TAGGED_NAME - base;
+      if(!json->supp_err)
+        json->supp_err = strdup(TRUNCATE_ERROR);
+    }
+  }
+  memcpy(json->key_buf + base, component, len);
+  json->key_len[json->depth] = base + len;
+  httptrap_key_invalidate_below(json, json->depth);
+}
+static const char *
+httptrap_key(struct rest_json_payload *json, int depth) {
+  if(json->key_len[depth] < 0) return NULL;
+  json->key_buf[json->key_len[depth]] = '\0';
+  return json->key_buf;
+}
+
 static int
 set_array_key(struct rest_json_payload *json) {
   if(json->depth >= 0 && json->array_depth[json->depth] > 0) {
-    char str[256];
+    char str[32];
     int strLen;
-    snprintf(str, sizeof(str), "%d", json->array_depth[json->depth] - 1);
+    strLen = snprintf(str, sizeof(str), "%d", json->array_depth[json->depth] - 1);
     json->array_depth[json->depth]++;
-    strLen = strlen(str);
-    if(json->keys[json->depth]) free(json->keys[json->depth]);
-    json->keys[json->depth] = NULL;
-    if(json->depth == 0) {
-      json->keys[json->depth] = malloc(strLen+1);
-      memcpy(json->keys[json->depth], str, strLen);
-      json->keys[json->depth][strLen] = '\0';
-    }
-    else {
-      int uplen = strlen(json->keys[json->depth-1]);
-      /* This is too large.... return an error */
-      if(uplen + 1 + strLen > MAX_METRIC_TAGGED_NAME) {
-	   strLen = MAX_METRIC_TAGGED_NAME - uplen - 1;
-	   if(strLen < 0) strLen = 0;
-        if(!json->supp_err)
-	     json->supp_err = strdup(TRUNCATE_ERROR);
-      }
-      json->keys[json->depth] = malloc(uplen + 1 + strLen + 1);
-      memcpy(json->keys[json->depth], json->keys[json->depth-1], uplen);
-      json->keys[json->depth][uplen] = json->delimiter;
-      memcpy(json->keys[json->depth] + uplen + 1, str, strLen);
-      json->keys[json->depth][uplen + 1 + strLen] = '\0';
-    }
+    httptrap_key_set(json, str, strLen);
   }
   return 0;
 }
@@ -305,13 +464,13 @@ httptrap_yajl_cb_null(void *ctx) {
   }
   if(json->last_special_key) return 0;
   if(rv) return 1;
-  if(json->keys[json->depth]) {
+  const char *name = httptrap_key(json, json->depth);
+  if(name) {
     _YD("[%3d] cb_null\n", json->depth);
-    track_filtered(json, &json->keys[json->depth]);
-    noit_stats_set_metric(json->check,
-        json->keys[json->depth], METRIC_INT32, NULL);
+    name = track_filtered(json, name);
+    noit_stats_set_metric(json->check, name, METRIC_INT32, NULL);
     if(json->immediate || json->got_timestamp)
-      metric_local_accrue(json, json->keys[json->depth], METRIC_INT32, NULL);
+      metric_local_accrue(json, name, METRIC_INT32, NULL);
     json->cnt++;
   }
   return 1;
@@ -332,14 +491,14 @@ httptrap_yajl_cb_boolean(void *ctx, int boolVal) {
   }
   if(json->last_special_key) return 0;
   if(rv) return 1;
-  if(json->keys[json->depth]) {
+  const char *name = httptrap_key(json, json->depth);
+  if(name) {
     ival = boolVal ? 1 : 0;
     _YD("[%3d] cb_boolean -> %s\n", json->depth, boolVal ? "true" : "false");
-    track_filtered(json, &json->keys[json->depth]);
-    noit_stats_set_metric(json->check,
-        json->keys[json->depth], METRIC_INT32, &ival);
+    name = track_filtered(json, name);
+    noit_stats_set_metric(json->check, name, METRIC_INT32, &ival);
     if(json->immediate || json->got_timestamp)
-      metric_local_accrue(json, json->keys[json->depth], METRIC_INT32, &ival);
+      metric_local_accrue(json, name, METRIC_INT32, &ival);
     json->cnt++;
   }
   return 1;
@@ -382,16 +541,16 @@ httptrap_yajl_cb_number(void *ctx, const char * numberVal,
     _YD("[%3d] cb_number [BAD]\n", json->depth);
     return 0;
   }
-  if(json->keys[json->depth]) {
+  const char *name = httptrap_key(json, json->depth);
+  if(name) {
     if(numberLen > sizeof(val)-1) numberLen = sizeof(val)-1;
     memcpy(val, numberVal, numberLen);
     val[numberLen] = '\0';
     _YD("[%3d] cb_number %s\n", json->depth, val);
-    track_filtered(json, &json->keys[json->depth]);
-    noit_stats_set_metric(json->check,
-        json->keys[json->depth], METRIC_GUESS, val);
+    name = track_filtered(json, name);
+    noit_stats_set_metric(json->check, name, METRIC_GUESS, val);
     if(json->immediate || json->got_timestamp)
-      metric_local_accrue(json, json->keys[json->depth], METRIC_GUESS, val);
+      metric_local_accrue(json, name, METRIC_GUESS, val);
     json->cnt++;
   }
   return 1;
@@ -460,16 +619,16 @@ httptrap_yajl_cb_string(void *ctx, const unsigned char * stringVal,
   else if(json->last_special_key == HT_EX_TS) return 1;
   else if(json->last_special_key == HT_EX_TAGS) return 1;
   if(rv) return 1;
-  if(json->keys[json->depth]) {
+  const char *name = httptrap_key(json, json->depth);
+  if(name) {
     if(stringLen > sizeof(val)-1) stringLen = sizeof(val)-1;
     memcpy(val, stringVal, stringLen);
     val[stringLen] = '\0';
     _YD("[%3d] cb_string %s\n", json->depth, val);
-    track_filtered(json, &json->keys[json->depth]);
-    noit_stats_set_metric(json->check,
-        json->keys[json->depth], METRIC_GUESS, val);
+    name = track_filtered(json, name);
+    noit_stats_set_metric(json->check, name, METRIC_GUESS, val);
     if(json->immediate || json->got_timestamp)
-      metric_local_accrue(json, json->keys[json->depth], METRIC_GUESS, val);
+      metric_local_accrue(json, name, METRIC_GUESS, val);
     json->cnt++;
   }
   return 1;
@@ -487,11 +646,11 @@ static int
 httptrap_yajl_cb_end_map(void *ctx) {
   struct value_list *p, *last_p = NULL;
   struct rest_json_payload *json = ctx;
-  char *metric_name = NULL;
+  const char *metric_name = NULL;
 
   _YD("[%3d]%-.*s cb_end_map\n", json->depth, json->depth, "");
   json->depth--;
-  metric_name = json->keys[MAX(json->depth, 0)];
+  metric_name = httptrap_key(json, MAX(json->depth, 0));
   if((json->saw_complex_type & HT_EX_VALUE) &&
      (
        (json->saw_complex_type & HT_EX_TYPE) ||
@@ -526,7 +685,7 @@ httptrap_yajl_cb_end_map(void *ctx) {
        * in progress metrics only (get_metric) not (get_last_metric)
        * and we also much fetch a count...
        */
-      track_filtered(json, &metric_name);
+      metric_name = track_filtered(json, metric_name);
       m = noit_stats_get_metric(json->check, NULL, metric_name);
       double old_value;
       if(noit_metric_as_double(m, &old_value)) {
@@ -542,7 +701,7 @@ httptrap_yajl_cb_end_map(void *ctx) {
        */
       cnt = 1;
       accum = 0;
-      track_filtered(json, &metric_name);
+      metric_name = track_filtered(json, metric_name);
       m = noit_stats_get_last_metric(json->check, metric_name);
       double old_total = 0.0;
       noit_metric_as_double(m, &old_total);
@@ -557,18 +716,18 @@ httptrap_yajl_cb_end_map(void *ctx) {
         if(json->saw_complex_type & HT_EX_TS) {
           if(p == json->last_value && p->next == NULL) {
             /* There can be exactly one, it should be base64 encoded */
-            track_filtered(json, &metric_name);
+            metric_name = track_filtered(json, metric_name);
             noit_stats_log_immediate_histo_tv(json->check, metric_name, p->v, strlen(p->v),
                                               hist_type == METRIC_HISTOGRAM_CUMULATIVE, json->last_timestamp);
           }
         } else {
-          track_filtered(json, &metric_name);
+          metric_name = track_filtered(json, metric_name);
           noit_stats_set_metric_histogram(json->check, metric_name,
                                           hist_type == METRIC_HISTOGRAM_CUMULATIVE, METRIC_GUESS, p->v, 1);
         }
       }
       else {
-        track_filtered(json, &metric_name);
+        metric_name = track_filtered(json, metric_name);
         if(json->got_timestamp) {
           noit_stats_set_metric_coerce_with_timestamp(json->check,
               metric_name,
@@ -601,7 +760,7 @@ httptrap_yajl_cb_end_map(void *ctx) {
     if(use_computed_value) {
       newval = (double)(total / (long double)cnt);
       /* Perform and in-place update of the metric value correcting it */
-      track_filtered(json, &metric_name);
+      metric_name = track_filtered(json, metric_name);
       m = noit_stats_get_metric(json->check, NULL, metric_name);
       if(m && IS_METRIC_TYPE_NUMERIC(m->metric_type)) {
         if(m->metric_value.vp == NULL) {
@@ -670,15 +829,14 @@ httptrap_yajl_cb_map_key(void *ctx, const unsigned char * key,
       json->supp_err = strdup(TRUNCATE_ERROR);
     stringLen = MAX_METRIC_TAGGED_NAME;
   }
-  if(json->keys[json->depth]) free(json->keys[json->depth]);
-  json->keys[json->depth] = NULL;
+  httptrap_key_clear(json);
   if(stringLen == 5 && memcmp(key, "_type", 5) == 0) {
     json->last_special_key = HT_EX_TYPE;
-    if(json->depth > 0) json->keys[json->depth] = strdup(json->keys[json->depth-1]);
+    httptrap_key_copy_parent(json);
     return 1;
   }
   if(stringLen == 6 && memcmp(key, "_value", 6) == 0) {
-    if(json->depth > 0) json->keys[json->depth] = strdup(json->keys[json->depth-1]);
+    httptrap_key_copy_parent(json);
     json->last_special_key = HT_EX_VALUE;
     json->saw_complex_type |= HT_EX_VALUE;
     return 1;
@@ -696,25 +854,7 @@ httptrap_yajl_cb_map_key(void *ctx, const unsigned char * key,
     return 1;
   }
   json->last_special_key = 0;
-  if(json->depth == 0) {
-    json->keys[json->depth] = malloc(stringLen+1);
-    memcpy(json->keys[json->depth], key, stringLen);
-    json->keys[json->depth][stringLen] = '\0';
-  }
-  else {
-    int uplen = strlen(json->keys[json->depth-1]);
-    if(uplen + 1 + stringLen > MAX_METRIC_TAGGED_NAME) {
-      if(MAX_METRIC_TAGGED_NAME - uplen - 1 < 0) stringLen = 0;
-      else stringLen = MAX_METRIC_TAGGED_NAME - uplen - 1;
-      if(!json->supp_err)
-	   json->supp_err = strdup(TRUNCATE_ERROR);
-    }
-    json->keys[json->depth] = malloc(uplen + 1 + stringLen + 1);
-    memcpy(json->keys[json->depth], json->keys[json->depth-1], uplen);
-    json->keys[json->depth][uplen] = json->delimiter;
-    memcpy(json->keys[json->depth] + uplen + 1, key, stringLen);
-    json->keys[json->depth][uplen + 1 + stringLen] = '\0';
-  }
+  httptrap_key_set(json, (const char *)key, stringLen);
   return 1;
 }
 static yajl_callbacks httptrap_yajl_callbacks = {
@@ -729,20 +869,66 @@ static yajl_callbacks httptrap_yajl_callbacks = {
   .yajl_end_array = httptrap_yajl_cb_end_array
 };
 
+static void
+httptrap_release_body(struct rest_json_payload *rxc) {
+  if(!rxc->buffered) return;
+  ck_pr_sub_64(&httptrap_bytes_in_flight, rxc->body_accounted);
+  rxc->body_accounted = 0;
+  mtev_dyn_buffer_destroy(&rxc->body);
+}
+
+/* Bounds the uploads buffered or waiting on the parse jobq, overall and
+ * per check.  Returns the HTTP status to refuse the upload with, or 0. */
+static int
+httptrap_admit(struct rest_json_payload *rxc, const char **error) {
+  httptrap_closure_t *ccl = NULL;
+  if(ck_pr_faa_32(&httptrap_uploads_pending, 1) >= httptrap_parse_backlog) {
+    ck_pr_dec_32(&httptrap_uploads_pending);
+    stats_add64(stats_rejected_busy, 1);
+    *error = "too many uploads pending";
+    return 503;
+  }
+  if(!strcmp(rxc->check->module, "httptrap")) ccl = rxc->check->closure;
+  if(ccl && httptrap_parse_per_check &&
+     ck_pr_faa_32(&ccl->uploads_inflight, 1) >= httptrap_parse_per_check) {
+    ck_pr_dec_32(&ccl->uploads_inflight);
+    ck_pr_dec_32(&httptrap_uploads_pending);
+    stats_add64(stats_rejected_check, 1);
+    *error = "too many uploads pending for check";
+    return 429;
+  }
+  if(ccl && httptrap_parse_per_check) rxc->admitted_ccl = ccl;
+  rxc->admitted = mtev_true;
+  rxc->buffered = mtev_true;
+  mtev_dyn_buffer_init(&rxc->body);
+  return 0;
+}
+
+/* Must run while the request still holds its check reference. */
+static void
+httptrap_release(struct rest_json_payload *rxc) {
+  if(!rxc->admitted) return;
+  rxc->admitted = mtev_false;
+  httptrap_release_body(rxc);
+  if(rxc->admitted_ccl) ck_pr_dec_32(&rxc->admitted_ccl->uploads_inflight);
+  rxc->admitted_ccl = NULL;
+  ck_pr_dec_32(&httptrap_uploads_pending);
+}
+
 static void
 rest_json_payload_free(void *f) {
-  int i;
   struct rest_json_payload *json = f;
+  httptrap_release(json);
   if(json->immediate_metrics) {
     rest_json_flush_immediate(json);
   }
-  mtev_hash_destroy(json->immediate_metrics, NULL, mtev_memory_safe_free);
+  mtev_hash_destroy(json->immediate_metrics, NULL, NULL);
   free(json->immediate_metrics);
+  httptrap_pool_reset(json, mtev_true);
   if(json->parser) yajl_free(json->parser);
   if(json->error) free(json->error);
   if(json->supp_err) free(json->supp_err);
-  for(i=0;i<MAX_DEPTH;i++)
-    if(json->keys[i]) free(json->keys[i]);
+  free(json->expanded_name);
   if(json->last_value) free(json->last_value);
   free(json);
 }
@@ -760,6 +946,7 @@ rest_get_json_upload(mtev_http_rest_closure_t *restc,
   mtevAssert(rxc->check);
 
   if(!strcmp(rxc->check->module, "httptrap")) ccl = rxc->check->closure;
+  rxc->ccl = ccl;
   rxc->immediate = noit_httptrap_check_asynch(ccl ? ccl->self : global_self, rxc->check);
   if(rxc->immediate && !rxc->immediate_metrics) {
     rxc->immediate_metrics = calloc(1, sizeof(*rxc->immediate_metrics));
@@ -772,7 +959,19 @@ rest_get_json_upload(mtev_http_rest_closure_t *restc,
     int len;
     len = mtev_http_session_req_consume(restc->http_ctx, buffer,
                                         sizeof(buffer), sizeof(buffer), mask);
-    if(len > 0) {
+    if(len > 0 && rxc->buffered) {
+      if(rxc->len + len > httptrap_parse_max_body) {
+        *complete = 1;
+        rxc->error = strdup("payload too large");
+        rxc->error_code = 413;
+        return rxc;
+      }
+      mtev_dyn_buffer_add(&rxc->body, (uint8_t *)buffer, len);
+      rxc->body_accounted += len;
+      ck_pr_add_64(&httptrap_bytes_in_flight, len);
+      rxc->len += len;
+    }
+    else if(len > 0) {
       yajl_status status;
       _YD("inbound payload chunk (%d bytes) continuing YAJL parse\n", len);
       status = yajl_parse(rxc->parser, (unsigned char *)buffer, len);
@@ -794,8 +993,10 @@ rest_get_json_upload(mtev_http_rest_closure_t *restc,
     }
     if(len == 0 && mtev_http_request_payload_complete(req)) {
       rxc->complete = 1;
-      _YD("no more data, finishing YAJL parse\n");
-      yajl_complete_parse(rxc->parser);
+      if(!rxc->buffered) {
+        _YD("no more data, finishing YAJL parse\n");
+        yajl_complete_parse(rxc->parser);
+      }
     }
     if (++loop_count % 25 == 0 && !rxc->complete) {
       // Every 25 reads, we should check to see if we're taking too long.
@@ -827,9 +1028,7 @@ static int httptrap_submit(noit_module_t *self, noit_check_t *check,
 
   noit_httptrap_check_asynch(self, check);
   if(!check->closure) {
-    ccl = check->closure = (void *)calloc(1, sizeof(httptrap_closure_t));
-    memset(ccl, 0, sizeof(httptrap_closure_t));
-    ccl->self = self;
+    ccl = check->closure = httptrap_closure_alloc(self);
   } else {
     // Don't count the first run
     struct timeval now;
@@ -993,6 +1192,64 @@ rest_httptrap_options_handler(mtev_http_rest_closure_t *restc,
   return 0;
 }
 
+static int
+rest_httptrap_handler(mtev_http_rest_closure_t *restc, int npats, char **pats);
+
+static void
+httptrap_parse_body(struct rest_json_payload *rxc) {
+  yajl_status status;
+  const unsigned char *data = (const unsigned char *)mtev_dyn_buffer_data(&rxc->body);
+  size_t len = mtev_dyn_buffer_used(&rxc->body);
+
+  _YD("parsing buffered payload (%zu bytes)\n", len);
+  status = yajl_parse(rxc->parser, data, len);
+  if(status != yajl_status_ok) {
+    unsigned char *err = yajl_get_error(rxc->parser, 1, data, len);
+    rxc->error = strdup((char *)err);
+    yajl_free_error(rxc->parser, err);
+  }
+  else {
+    yajl_complete_parse(rxc->parser);
+  }
+  httptrap_release_body(rxc);
+}
+
+static int
+httptrap_parse_asynch(eventer_t e, int mask, void *closure,
+                      struct timeval *now) {
+  mtev_http_rest_closure_t *restc = closure;
+  struct rest_json_payload *rxc = restc->call_closure;
+  if(mask == EVENTER_ASYNCH_WORK) {
+    struct timeval start, diff;
+    mtev_gettimeofday(&start, NULL);
+    sub_timeval(start, rxc->queued_at, &diff);
+    stats_set_hist_intscale(stats_queue_latency, diff.tv_sec * 1000000 + diff.tv_usec, -6, 1);
+    mtev_memory_begin();
+    httptrap_parse_body(rxc);
+    mtev_memory_end();
+  }
+  if(mask == EVENTER_ASYNCH) {
+    mtev_http_session_resume_after_float(restc->http_ctx);
+  }
+  return 0;
+}
+
+/* Hands the buffered body to the parse jobq; the handler is re-entered as
+ * the fastpath to respond once it has been parsed. */
+static void
+httptrap_queue_parse(mtev_http_rest_closure_t *restc, struct rest_json_payload *rxc) {
+  mtev_http_connection *conn = mtev_http_session_connection(restc->http_ctx);
+  eventer_t conne = mtev_http_connection_event_float(conn);
+  if(conne) eventer_remove_fde(conne);
+
+  rxc->parsed = mtev_true;
+  mtev_gettimeofday(&rxc->queued_at, NULL);
+  restc->fastpath = rest_httptrap_handler;
+  eventer_t e = eventer_alloc_asynch(httptrap_parse_asynch, restc);
+  if(conne) eventer_set_owner(e, eventer_get_owner(conne));
+  eventer_add_asynch(httptrap_parse_jobq, e);
+}
+
 static int
 rest_httptrap_handler(mtev_http_rest_closure_t *restc,
                       int npats, char **pats) {
@@ -1068,6 +1325,7 @@ rest_httptrap_handler(mtev_http_rest_closure_t *restc,
     mtev_uuid_copy(rxc->check_id, check_id);
     rxc->parser = yajl_alloc(&httptrap_yajl_callbacks, NULL, rxc);
     rxc->depth = -1;
+    for(int i = 0; i < MAX_DEPTH; i++) rxc->key_len[i] = -1;
     yajl_config(rxc->parser, yajl_allow_comments, 1);
     yajl_config(rxc->parser, yajl_dont_validate_strings, 1);
     yajl_config(rxc->parser, yajl_allow_trailing_garbage, 1);
@@ -1075,6 +1333,14 @@ rest_httptrap_handler(mtev_http_rest_closure_t *restc,
     yajl_config(rxc->parser, yajl_allow_partial_values, 1);
     restc->call_closure_free = rest_json_payload_free;
 
+    if(httptrap_parse_jobq) {
+      int refusal = httptrap_admit(rxc, &error);
+      if(refusal) {
+        error_code = refusal;
+        goto error;
+      }
+    }
+
     /* flip threads */
     mtev_http_connection *conn = mtev_http_session_connection(ctx);
     eventer_t e = mtev_http_connection_event(conn);
@@ -1128,9 +1394,15 @@ rest_httptrap_handler(mtev_http_rest_closure_t *restc,
   }
   if(rxc->error) {
     mtevL(nldeb, "Payload read parse error: %s\n", rxc->error);
-    error_code = 406;
+    error_code = rxc->error_code ? rxc->error_code : 406;
     goto error;
   }
+  if(rxc->buffered && !rxc->parsed) {
+    mtevL(nldeb, "Queueing %d byte payload for %s (%" PRIu64 ")\n", rxc->len, pats[0], current_counter);
+    httptrap_queue_parse(restc, rxc);
+    mtev_memory_end();
+    return 0;
+  }
 
   cnt = rxc->cnt;
   mtevL(nldeb, "Processed %d records for %s (%" PRIu64 ")\n", cnt, pats[0], current_counter);
@@ -1197,6 +1469,7 @@ rest_httptrap_handler(mtev_http_rest_closure_t *restc,
   json_object_put(obj);
   mtev_http_response_end(ctx);
   if (rxc) {
+    httptrap_release(rxc);
     noit_check_deref(rxc->check);
   }
   mtev_memory_end();
@@ -1205,6 +1478,7 @@ rest_httptrap_handler(mtev_http_rest_closure_t *restc,
 
  error:
   if (rxc) {
+    httptrap_release(rxc);
     noit_check_deref(rxc->check);
   }
   mtev_http_response_standard(ctx, error_code, "ERROR", "application/json");
@@ -1225,9 +1499,7 @@ static int noit_httptrap_initiate_check(noit_module_t *self,
                                         int once, noit_check_t *cause) {
   check->flags |= NP_PASSIVE_COLLECTION;
   if (check->closure == NULL) {
-    httptrap_closure_t *ccl;
-    ccl = check->closure = (void *)calloc(1, sizeof(httptrap_closure_t));
-    ccl->self = self;
+    check->closure = httptrap_closure_alloc(self);
   }
   INITIATE_CHECK(httptrap_submit, self, check, cause);
   return 0;
@@ -1288,6 +1560,41 @@ static int noit_httptrap_init(noit_module_t *self) {
       httptrap_surrogate = mtev_true;
   }
 
+  if(mtev_hash_retr_str(conf->options,
+                        "parse_backlog", strlen("parse_backlog"),
+                        (const char **)&config_val)) {
+    httptrap_parse_backlog = strtoul(config_val, NULL, 10);
+  }
+  if(mtev_hash_retr_str(conf->options,
+                        "parse_per_check", strlen("parse_per_check"),
+                        (const char **)&config_val)) {
+    httptrap_parse_per_check = strtoul(config_val, NULL, 10);
+  }
+  if(mtev_hash_retr_str(conf->options,
+                        "parse_max_body", strlen("parse_max_body"),
+                        (const char **)&config_val)) {
+    httptrap_parse_max_body = strtoull(config_val, NULL, 10);
+  }
+  if(mtev_hash_retr_str(conf->options,
+                        "parse_concurrency", strlen("parse_concurrency"),
+                        (const char **)&config_val)) {
+    uint32_t concurrency = strtoul(config_val, NULL, 10);
+    if(concurrency > 0 && !httptrap_parse_jobq) {
+      httptrap_parse_jobq = eventer_jobq_create("httptrap_parse");
+      eventer_jobq_set_concurrency(httptrap_parse_jobq, concurrency);
+    }
+  }
+
+  stats_ns_t *ns = mtev_stats_ns(mtev_stats_ns(NULL, "noit"), "httptrap");
+  stats_ns_add_tag(ns, "module", "httptrap");
+  stats_queue_latency = stats_register(ns, "parse_queue_latency", STATS_TYPE_HISTOGRAM);
+  stats_handle_units(stats_queue_latency, STATS_UNITS_SECONDS);
+  stats_rob_u32(ns, "uploads_pending", &httptrap_uploads_pending);
+  stats_handle_units(stats_rob_u64(ns, "bytes_in_flight", &httptrap_bytes_in_flight),
+                     STATS_UNITS_BYTES);
+  stats_rejected_busy = stats_register(ns, "rejected_busy", STATS_TYPE_COUNTER);
+  stats_rejected_check = stats_register(ns, "rejected_check_limit", STATS_TYPE_COUNTER);
+
   noit_module_set_userdata(self, conf);
 
   /* register rest handler */
@@ -1316,5 +1623,5 @@ noit_module_t httptrap = {
   noit_httptrap_config,
   noit_httptrap_init,
   noit_httptrap_initiate_check,
-  NULL
+  httptrap_cleanup
 };
@@ -751,8 +751,9 @@ noit_check_index_func(lua_State *L) {
         lua_pushcclosure(L, noit_lua_should_run_check, 1);
       }
       else if(!strcmp(k, "is_thread_local")) {
-        if(check->fire_event &&
-           pthread_equal(pthread_self(), eventer_get_owner(check->fire_event))) {
+        pthread_t owner;
+        if(noit_check_next_fire(check, NULL, &owner) &&
+           pthread_equal(pthread_self(), owner)) {
           lua_pushboolean(L, 1);
         }
         else {
@@ -522,6 +522,26 @@ lua_noit_metric_next(lua_State *L) {
   return 0;
 }
 
+#define METRIC_NEXT_BATCH_MAX 256
+/* Returns a table of up to max (default 64) messages and the backlog left. */
+static int
+lua_noit_metric_next_batch(lua_State *L) {
+  noit_metric_message_t *msgs[METRIC_NEXT_BATCH_MAX];
+  uint32_t backlog = 0;
+  lua_Integer max = luaL_optinteger(L, 1, 64);
+  if(max < 1) max = 1;
+  if(max > METRIC_NEXT_BATCH_MAX) max = METRIC_NEXT_BATCH_MAX;
+  size_t cnt = noit_metric_director_lane_next_batch_backlog(msgs, max, &backlog);
+  if(cnt == 0) return 0;
+  lua_createtable(L, cnt, 0);
+  for(size_t i=0; i<cnt; i++) {
+    noit_lua_setup_message(L, msgs[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+  lua_pushinteger(L, backlog);
+  return 2;
+}
+
 static int
 lua_noit_metric_drop_backlogged(lua_State *L) {
   uint32_t t = luaL_checknumber(L, 1);
@@ -727,6 +747,7 @@ static const luaL_Reg libnoit_binding[] = {
   { "metric_director_subscribe", lua_noit_metric_subscribe },
   { "metric_director_unsubscribe", lua_noit_metric_unsubscribe },
   { "metric_director_next", lua_noit_metric_next },
+  { "metric_director_next_batch", lua_noit_metric_next_batch },
   { "metric_director_subscribe_all", lua_noit_metric_subscribe_all},
   { "metric_director_subscribe_account", lua_noit_metric_subscribe_account},
   { "metric_director_drop_backlogged", lua_noit_metric_drop_backlogged},
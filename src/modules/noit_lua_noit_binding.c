@@ -197,6 +197,7 @@ static const luaL_Reg noit_binding[] = {
   { "metric_director_subscribe", lua_noit_metric_subscribe },
   { "metric_director_unsubscribe", lua_noit_metric_unsubscribe },
   { "metric_director_next", lua_noit_metric_next },
+  { "metric_director_next_batch", lua_noit_metric_next_batch },
   { "metric_director_subscribe_all", lua_noit_metric_subscribe_all},
   { "metric_director_subscribe_account", lua_noit_metric_subscribe_account},
   { "metric_director_drop_before", lua_noit_metric_drop_before},
@@ -52,6 +52,7 @@
 #include "noit_check_tools.h"
 #include "noit_mtev_bridge.h"
 #include "prometheus.pb-c.h"
+#include "noit_plaintext.h"
 #include "noit_socket_listener.h"
 
 static mtev_log_stream_t nlerr = NULL;
@@ -60,44 +61,27 @@ static mtev_log_stream_t nldeb = NULL;
 static int
 opentsdb_handle_payload(noit_check_t *check, char *buffer, size_t len)
 {
-  char record[4096];
-  char *part;
   char *s = NULL, *e = NULL;
-  const size_t c_length = len;
-  ptrdiff_t length = c_length;
-  ptrdiff_t d = 0;
+  char *const buffer_end = buffer + len;
   int rv = 0;
 
   mtev_memory_begin();
 
-  for (s = buffer; length && *s; s = e + 1) {
+  for (s = buffer; s < buffer_end && *s; s = e + 1) {
     rv++;
 
     /* Find end of line. */
-    e = (char *)memchr(s, '\n', length);
+    e = (char *)memchr(s, '\n', buffer_end - s);
 
     if (e == NULL) {
-
-      length = c_length - (s - buffer);
-      e = s + length;
-
-      if (length == 0 || *e != '\0') {
+      e = buffer_end;
+      if (*e != '\0') {
         /* nothing left? */
         break;
       }
-
-      *e = '\0';
-      length = 0;
-    } else {
-      /* Update cursor. */
-      d = e - s + 1;
-      length -= d;
-      *e = '\0';
     }
-    part = s;
-    /* save the row for later logging */
-    strlcpy(record, part, sizeof(record) - 1);
-    size_t record_len = strlen(part);
+    *e = '\0';
+    char *record = s;
 
     /*
      * a OpenTSDB telnet record is of the format:
@@ -114,108 +98,81 @@ opentsdb_handle_payload(noit_check_t *check, char *buffer, size_t len)
      */
 
     // first space is metric name
-    char *first_space = (char *)memchr(part, ' ', record_len);
+    char *first_space = (char *)noit_plaintext_find_space(record, e);
     if (first_space == NULL) {
-      first_space = (char *)memchr(part, '\t', record_len);
-      if (first_space == NULL) {
-        mtevL(nldeb, "Invalid OpenTSDB record, can't find the first space or tab in: %s\n", record);
-        continue;
-      }
+      mtevL(nldeb, "Invalid OpenTSDB record, can't find the first space or tab in: %s\n", record);
+      continue;
     }
-    *first_space++ = 0;
-    while (*first_space == ' ' || *first_space == '\t') first_space++;
+    first_space = (char *)noit_plaintext_skip_space(first_space + 1, e);
 
     // second space is timestamp
-    char *second_space = (char *)memchr(first_space + 1, ' ', record_len - (first_space - part +
-                                                                            1));
+    char *second_space = (char *)noit_plaintext_find_space(first_space + 1, e);
     if (second_space == NULL) {
-      second_space = (char *)memchr(first_space + 1, '\t', record_len - (first_space - part + 1));
-      if (second_space == NULL) {
-        mtevL(nldeb, "Invalid OpenTSDB record, can't find the second space or tab in: %s\n", record);
-        continue;
-      }
+      mtevL(nldeb, "Invalid OpenTSDB record, can't find the second space or tab in: %s\n", record);
+      continue;
     }
-    *second_space++ = 0;
-    while (*second_space == ' ' || *second_space == '\t') second_space++;
+    second_space = (char *)noit_plaintext_skip_space(second_space + 1, e);
 
     // third space is value
-    char *third_space = (char *)memchr(second_space + 1, ' ', record_len - (second_space - part +
-                                                                            1));
+    char *third_space = (char *)noit_plaintext_find_space(second_space + 1, e);
     if (third_space == NULL) {
-      third_space = (char *)memchr(second_space + 1, '\t', record_len - (second_space - part + 1));
-      if (third_space == NULL) {
-        mtevL(nldeb, "Invalid OpenTSDB record, can't find the third space or tab in: %s\n", record);
-        continue;
-      }
+      mtevL(nldeb, "Invalid OpenTSDB record, can't find the third space or tab in: %s\n", record);
+      continue;
     }
-    *third_space++ = 0;
-    while (*third_space == ' ' || *third_space == '\t') third_space++;
+    third_space = (char *)noit_plaintext_skip_space(third_space + 1, e);
 
     // fourth space is tags
-    char *fourth_space = (char *)memchr(third_space + 1, ' ', record_len - (third_space - part +
-                                                                            1));
+    char *fourth_space = (char *)noit_plaintext_find_space(third_space + 1, e);
     if (fourth_space == NULL) {
-      fourth_space = (char *)memchr(third_space + 1, '\t', record_len - (third_space - part + 1));
-      if (fourth_space == NULL) {
-        mtevL(nldeb, "Invalid OpenTSDB record, can't find the fourth space or tab in: %s\n", record);
-        continue;
-      }
+      mtevL(nldeb, "Invalid OpenTSDB record, can't find the fourth space or tab in: %s\n", record);
+      continue;
     }
-    *fourth_space++ = 0;
-    while (*fourth_space == ' ' || *fourth_space == '\t') fourth_space++;
+    fourth_space = (char *)noit_plaintext_skip_space(fourth_space + 1, e);
 
     mtevL(nldeb, "OpenTSDB record: %s\n", record);
     char *opentsdb_metric_name = first_space;
     char *opentsdb_timestamp = second_space;
     char *opentsdb_value = third_space;
     char *opentsdb_tags = fourth_space;
+    /* terminate each field at the whitespace that follows it */
+    size_t metric_name_len = noit_plaintext_find_space(opentsdb_metric_name, e) - opentsdb_metric_name;
+    size_t timestamp_len = noit_plaintext_find_space(opentsdb_timestamp, e) - opentsdb_timestamp;
+    size_t opentsdb_value_len = noit_plaintext_find_space(opentsdb_value, e) - opentsdb_value;
+    opentsdb_metric_name[metric_name_len] = '\0';
+    opentsdb_timestamp[timestamp_len] = '\0';
+    opentsdb_value[opentsdb_value_len] = '\0';
 
     // timestamps for telnet are allowed to contain a '.' before the milliseconds
     // otherwise, if it is 10 digits or less it is seconds, more than 10 digits is ms
-    char *dp;
+    const char *dp = opentsdb_timestamp;
     uint64_t whence_ms = 0;
-    if (strlen(opentsdb_timestamp) <= 10)
-    {
+    if (noit_plaintext_parse_u64(opentsdb_timestamp, opentsdb_timestamp + timestamp_len,
+                                 &whence_ms, &dp) < 0) {
+      whence_ms = 0;
+    }
+    if (timestamp_len <= 10) {
       // less than or equal to 10 digits is s -> ms
-      whence_ms = strtoull(opentsdb_timestamp, &dp, 10) * 1000;
+      whence_ms *= 1000;
     }
-    else {
-      // more than 10 is ms
-      whence_ms = strtoull(opentsdb_timestamp, &dp, 10);
-      // unless it is more than 10 with '.', then it is floating point s
-      if (dp && *dp == '.') {
-        // s -> ms
-        whence_ms *= 1000;
-        // add in s (fractional part) -> ms
-        whence_ms += (int)(1000.0 * atof(dp));
-      }
+    else if (*dp == '.') {
+      // more than 10 is ms, unless it is more than 10 with '.', then it is floating point s
+      whence_ms *= 1000;
+      // add in s (fractional part) -> ms
+      int scale = 100;
+      for (dp++; scale && *dp >= '0' && *dp <= '9'; dp++, scale /= 10)
+        whence_ms += (*dp - '0') * scale;
     }
 
-    size_t opentsdb_value_len = strlen(opentsdb_value);
     if (count_integral_digits(opentsdb_value, opentsdb_value_len, mtev_true) == 0) {
-      mtevL(nldeb, "Invalid OpenTSDB record, no digits in value: %s\n", third_space);
+      mtevL(nldeb, "Invalid OpenTSDB record, no digits in value: %s\n", opentsdb_value);
       continue;
     }
 
     double metric_value = 0.0;
-    const char *dot = strchr(opentsdb_value, '.');
-    if (dot == NULL) {
-      /* attempt fast integer parse, if we fail, jump to strtod parse */
-      /* OpenTSDB only supports signed int64 */
-      errno = 0;
-      int64_t v = strtoll(opentsdb_value, NULL, 10);
-      if (errno == ERANGE) {
-        goto strtod_parse;
-      }
-      metric_value = (double)v;
-    } else {
-    strtod_parse:
-      errno = 0;
-      metric_value = strtod(opentsdb_value, NULL);
-      if (errno == ERANGE) {
-        mtevL(nldeb, "Invalid opentsdb record, strtod cannot parse value: %s\n", third_space);
-        continue;
-      }
+    if (noit_plaintext_parse_double(opentsdb_value, opentsdb_value + opentsdb_value_len,
+                                    &metric_value, NULL) < 0) {
+      mtevL(nldeb, "Invalid opentsdb record, cannot parse value: %s\n", opentsdb_value);
+      continue;
     }
 
     /* allow for any length name + tags in the broker */
@@ -475,91 +475,93 @@ void handle_hist(otlp_upload *rxc, name_builder &metric,
   handle_hist(rxc, metric, whence_ns, bins, size, cumulative, dp.sum());
 }
 
+void handle_metric(otlp_upload *rxc, const OtelMetrics::Metric &m)
+{
+  auto name = m.name();
+  auto unit = m.unit();
+
+  mtevL(nldeb_verbose, "[otlp] metric: type %d, name: %s\n", m.data_case(), name.c_str());
+  switch(m.data_case()) {
+  case OtelMetrics::Metric::kGauge:
+  {
+    for( auto dp : m.gauge().data_points() ) {
+      name_builder metric{name, dp.attributes()};
+      double mult = 1;
+      if(unit.size() > 0) {
+        const char *unit_c = units_convert(unit.c_str(), &mult);
+        if(unit_c) metric.add("units", unit_c);
+      }
+      handle_dp(rxc, metric, dp, mult);
+    }
+    break;
+  }
+  case OtelMetrics::Metric::kSum:
+  {
+    auto sum = m.sum();
+    auto cumulative = sum.aggregation_temporality() == OtelMetrics::AGGREGATION_TEMPORALITY_CUMULATIVE;
+    for( auto dp : m.sum().data_points() ) {
+      name_builder metric{name, dp.attributes()};
+      double mult = 1;
+      if(unit.size() > 0) {
+        const char *unit_c = units_convert(unit.c_str(), &mult);
+        if(unit_c) metric.add("units", unit_c);
+      }
+      if(!cumulative && sum.is_monotonic()) {
+        // use histograms?
+      } else {
+        handle_dp(rxc, metric, dp, mult);
+      }
+    }
+    break;
+  }
+  case OtelMetrics::Metric::kHistogram:
+  {
+    auto hist = m.histogram();
+    auto cumulative = hist.aggregation_temporality() == OtelMetrics::AGGREGATION_TEMPORALITY_CUMULATIVE;
+    for( auto dp : hist.data_points() ) {
+      name_builder metric{name, dp.attributes()};
+      double mult = 1;
+      if(unit.size() > 0) {
+        const char *unit_c = units_convert(unit.c_str(), &mult);
+        if(unit_c) metric.add("units", unit_c);
+      }
+      handle_hist(rxc, metric, dp, cumulative, mult);
+    }
+    break;
+  }
+  case OtelMetrics::Metric::kExponentialHistogram:
+  {
+    auto hist = m.exponential_histogram();
+    auto cumulative = hist.aggregation_temporality() == OtelMetrics::AGGREGATION_TEMPORALITY_CUMULATIVE;
+    for( auto dp : hist.data_points() ) {
+      name_builder metric{name, dp.attributes()};
+      double mult = 1;
+      if(unit.size() > 0) {
+        const char *unit_c = units_convert(unit.c_str(), &mult);
+        if(unit_c) metric.add("units", unit_c);
+      }
+      handle_hist(rxc, metric, dp, cumulative, mult);
+    }
+    break;
+  }
+  case OtelMetrics::Metric::kSummary:
+  case OtelMetrics::Metric::DATA_NOT_SET:
+  {
+    break;
+  }
+  }
+}
+
 void handle_message(otlp_upload *rxc, const OtelCollectorMetrics::ExportMetricsServiceRequest &msg)
 {
   mtevL(nldeb_verbose, "[otlp] resource metrics: %d\n", msg.resource_metrics_size());
   for(int i=0; i<msg.resource_metrics_size(); i++) {
-    auto rm = msg.resource_metrics(i);
+    const auto &rm = msg.resource_metrics(i);
     mtevL(nldeb_verbose, "[otlp] resource metrics[%d] ilm: %d\n", i, rm.scope_metrics_size());
     for(int li=0; li<rm.scope_metrics_size(); li++) {
-      auto lm = rm.scope_metrics(li);
-
+      const auto &lm = rm.scope_metrics(li);
       for(int mi=0; mi<lm.metrics_size(); mi++) {
-        auto m = lm.metrics(mi);
-        auto name = m.name();
-        auto unit = m.unit();
-
-        mtevL(nldeb_verbose, "[otlp] resource metrics[%d][%d][%d]: type %d, name: %s\n",
-              i, li, mi, m.data_case(), name.c_str());
-        switch(m.data_case()) {
-        case OtelMetrics::Metric::kGauge:
-        {
-          for( auto dp : m.gauge().data_points() ) {
-            name_builder metric{name, dp.attributes()};
-            double mult = 1;
-            if(unit.size() > 0) {
-              const char *unit_c = units_convert(unit.c_str(), &mult);
-              if(unit_c) metric.add("units", unit_c);
-            }
-            handle_dp(rxc, metric, dp, mult);
-          }
-          break;
-        }
-        case OtelMetrics::Metric::kSum:
-        {
-          auto sum = m.sum();
-          auto cumulative = sum.aggregation_temporality() == OtelMetrics::AGGREGATION_TEMPORALITY_CUMULATIVE;
-          for( auto dp : m.sum().data_points() ) {
-            name_builder metric{name, dp.attributes()};
-            double mult = 1;
-            if(unit.size() > 0) {
-              const char *unit_c = units_convert(unit.c_str(), &mult);
-              if(unit_c) metric.add("units", unit_c);
-            }
-            if(!cumulative && sum.is_monotonic()) {
-              // use histograms?
-            } else {
-              handle_dp(rxc, metric, dp, mult);
-            }
-          }
-          break;
-        }
-        case OtelMetrics::Metric::kHistogram:
-        {
-          auto hist = m.histogram();
-          auto cumulative = hist.aggregation_temporality() == OtelMetrics::AGGREGATION_TEMPORALITY_CUMULATIVE;
-          for( auto dp : hist.data_points() ) {
-            name_builder metric{name, dp.attributes()};
-            double mult = 1;
-            if(unit.size() > 0) {
-              const char *unit_c = units_convert(unit.c_str(), &mult);
-              if(unit_c) metric.add("units", unit_c);
-            }
-            handle_hist(rxc, metric, dp, cumulative, mult);
-          }
-          break;
-        }
-        case OtelMetrics::Metric::kExponentialHistogram:
-        {
-          auto hist = m.exponential_histogram();
-          auto cumulative = hist.aggregation_temporality() == OtelMetrics::AGGREGATION_TEMPORALITY_CUMULATIVE;
-          for( auto dp : hist.data_points() ) {
-            name_builder metric{name, dp.attributes()};
-            double mult = 1;
-            if(unit.size() > 0) {
-              const char *unit_c = units_convert(unit.c_str(), &mult);
-              if(unit_c) metric.add("units", unit_c);
-            }
-            handle_hist(rxc, metric, dp, cumulative, mult);
-          }
-          break;
-        }
-        case OtelMetrics::Metric::kSummary:
-        case OtelMetrics::Metric::DATA_NOT_SET:
-        {
-          break;
-        }
-        }
+        handle_metric(rxc, lm.metrics(mi));
       }
     }
   }
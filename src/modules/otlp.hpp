@@ -58,6 +58,7 @@ extern "C" {
 #include "noit_check_tools.h"
 #include "noit_mtev_bridge.h"
 }
+#include <algorithm>
 #include <tuple>
 #include <thread>
 #include <iostream>
@@ -95,6 +96,13 @@ class otlp_upload final
   struct timeval start_time;
   histogram_approx_mode_t mode;
   mtev_hash_table *immediate_metrics;
+  /* incremental decoding state for http uploads, see otlphttp.cpp */
+  size_t received{0};
+  size_t decode_skip{0};
+  int decode_depth{0};
+  size_t decode_remaining[2]{};
+  bool decode_error{false};
+  OtelMetrics::Metric decode_metric;
 
   otlp_upload() = delete;
   explicit otlp_upload(noit_check_t *check) : complete{false}, check{check}, mode{HIST_APPROX_HIGH} {
@@ -115,6 +123,7 @@ otlp_mod_config *make_new_mod_config();
 void free_otlp_upload(void *pul);
 void metric_local_batch_flush_immediate(otlp_upload *rxc);
 mtev_boolean cross_module_reverse_allowed(noit_check_t *check, const char *secret);
+void handle_metric(otlp_upload *rxc, const OtelMetrics::Metric &m);
 void handle_message(otlp_upload *rxc, const OtelCollectorMetrics::ExportMetricsServiceRequest &msg);
 int noit_otlp_config(noit_module_t *self, mtev_hash_table *options);
 int noit_otlp_initiate_check(noit_module_t *self, noit_check_t *check, int once,
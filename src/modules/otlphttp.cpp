@@ -35,6 +35,106 @@ otlp_mod_config *make_new_mod_config()
   return new otlp_mod_config;
 }
 
+/* ExportMetricsServiceRequest.resource_metrics and ResourceMetrics.scope_metrics
+ * are walked by hand; ScopeMetrics.metrics are parsed one at a time. */
+static constexpr uint32_t descend_field[2]{1, 2};
+static constexpr uint32_t metric_field{2};
+
+/* 1 if read, 0 if more data is needed, -1 if malformed */
+static int
+read_varint(const uint8_t *&cp, const uint8_t *end, uint64_t &out)
+{
+  out = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    if(cp == end) return 0;
+    uint8_t b = *cp++;
+    out |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if(!(b & 0x80)) return 1;
+  }
+  return -1;
+}
+
+/* Handles every Metric that has arrived in full and keeps any partial tail
+ * at the front of rxc->data, so an upload is never held in memory whole. */
+static void
+drain_upload(otlp_upload *rxc, bool final)
+{
+  if(rxc->decode_error) {
+    mtev_dyn_buffer_reset(&rxc->data);
+    return;
+  }
+  uint8_t *start = mtev_dyn_buffer_data(&rxc->data);
+  const uint8_t *cp = start, *end = start + mtev_dyn_buffer_used(&rxc->data);
+  auto consume = [&](size_t n) {
+    cp += n;
+    for(int d = 0; d < rxc->decode_depth; d++) rxc->decode_remaining[d] -= n;
+  };
+
+  mtev_memory_begin();
+  while(!rxc->decode_error) {
+    while(rxc->decode_depth > 0 && rxc->decode_remaining[rxc->decode_depth-1] == 0)
+      rxc->decode_depth--;
+    if(rxc->decode_skip) {
+      size_t n = std::min(rxc->decode_skip, static_cast<size_t>(end - cp));
+      if(n == 0) break;
+      consume(n);
+      rxc->decode_skip -= n;
+      continue;
+    }
+    if(cp == end) break;
+
+    const uint8_t *hp = cp;
+    uint64_t tag, len = 0, ignored;
+    int rv = read_varint(hp, end, tag);
+    if(rv > 0) {
+      switch(tag & 0x7) {
+        case 0: rv = read_varint(hp, end, ignored); break;
+        case 1: len = 8; break;
+        case 2: rv = read_varint(hp, end, len); break;
+        case 5: len = 4; break;
+        default: rv = -1;
+      }
+    }
+    if(rv == 0) break;
+    const size_t hlen = hp - cp;
+    const size_t bound = rxc->decode_depth ? rxc->decode_remaining[rxc->decode_depth-1] : SIZE_MAX;
+    if(rv < 0 || hlen > bound || len > bound - hlen) {
+      rxc->decode_error = true;
+      break;
+    }
+
+    const uint32_t field = tag >> 3;
+    const bool delimited = (tag & 0x7) == 2;
+    if(delimited && rxc->decode_depth < 2 && field == descend_field[rxc->decode_depth]) {
+      consume(hlen);
+      rxc->decode_remaining[rxc->decode_depth++] = len;
+    }
+    else if(delimited && rxc->decode_depth == 2 && field == metric_field) {
+      if(static_cast<size_t>(end - hp) < len) break;
+      if(!rxc->decode_metric.ParseFromArray(hp, static_cast<int>(len))) {
+        rxc->decode_error = true;
+        break;
+      }
+      handle_metric(rxc, rxc->decode_metric);
+      consume(hlen + len);
+    }
+    else {
+      consume(hlen);
+      rxc->decode_skip = len;
+    }
+  }
+  mtev_memory_end();
+
+  size_t left = end - cp;
+  if(cp != start) {
+    memmove(start, cp, left);
+    mtev_dyn_buffer_reset(&rxc->data);
+    mtev_dyn_buffer_advance(&rxc->data, left);
+  }
+  if(final && (left || rxc->decode_skip || rxc->decode_depth))
+    rxc->decode_error = true;
+}
+
 static otlp_upload *
 rest_get_upload(mtev_http_rest_closure_t *restc, int *mask, int *complete)
 {
@@ -53,6 +153,8 @@ rest_get_upload(mtev_http_rest_closure_t *restc, int *mask, int *complete)
                                         mask);
     if(len > 0) {
       mtev_dyn_buffer_advance(&rxc->data, len);
+      rxc->received += len;
+      drain_upload(rxc, false);
     }
     if(len < 0 && errno == EAGAIN) return nullptr;
     else if(len < 0) {
@@ -61,6 +163,7 @@ rest_get_upload(mtev_http_rest_closure_t *restc, int *mask, int *complete)
     }
     if(len == 0 && mtev_http_request_payload_complete(req)) {
       rxc->complete = mtev_true;
+      drain_upload(rxc, true);
     }
   }
 
@@ -150,21 +253,16 @@ rest_otlphttp_handler(mtev_http_rest_closure_t *restc, int npats, char **pats)
     goto error;
   }
   
-  if(OtelCollectorMetrics::ExportMetricsServiceRequest msg;
-     msg.ParseFromArray(mtev_dyn_buffer_data(&rxc->data),
-                        static_cast<int>(mtev_dyn_buffer_used(&rxc->data)))) {
-    mtev_memory_begin();
-    mtevL(nldeb_verbose, "[otlphttp] http payload %zu bytes\n", mtev_dyn_buffer_used(&rxc->data));
-    handle_message(rxc, msg);
-    metric_local_batch_flush_immediate(rxc);
-    mtev_memory_end();
-  }
-  else {
-    mtevL(nlerr, "[otlphttp] error parsing http input %zu bytes\n",
-          mtev_dyn_buffer_used(&rxc->data));
+  /* metrics were handled as they arrived, anything before an error stands */
+  mtev_memory_begin();
+  metric_local_batch_flush_immediate(rxc);
+  mtev_memory_end();
+  if(rxc->decode_error) {
+    mtevL(nlerr, "[otlphttp] error parsing http input %zu bytes\n", rxc->received);
     error = "cannot parse protobuf";
     goto error;
   }
+  mtevL(nldeb_verbose, "[otlphttp] http payload %zu bytes\n", rxc->received);
 
   mtev_http_response_status_set(ctx, 200, "OK");
   mtev_http_response_option_set(ctx, MTEV_HTTP_CLOSE);
@@ -35,12 +35,16 @@
 #include <mtev_memory.h>
 #include <mtev_uuid.h>
 #include <mtev_rand.h>
+#include <mtev_skiplist.h>
 
 #include <stdio.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
+#if defined __linux__
+#include <sys/socket.h>
+#endif
 #ifdef HAVE_SYS_FILIO_H
 #include <sys/filio.h>
 #endif
@@ -69,18 +73,26 @@
 
 #define PING_INTERVAL 2000 /* 2000ms = 2s */
 #define PING_COUNT    5
+#define PING_SEND_BATCH 256
+#define PING_RECV_BATCH 64
+#define PING_RECV_LEN 256
+#define DEFAULT_MAX_IN_FLIGHT 65536
+#define MAX_MAX_IN_FLIGHT (1 << 24)
 
 struct check_info {
   uint16_t check_no;
-  uint8_t check_seq_no;
-  uint8_t seq;
   int8_t expected_count;
   float *turnaround;
   eventer_t timeout_event;
-};
-struct ping_session_key {
-  uintptr_t addr_of_check; /* ticket #288 */
-  uuid_t checkid;
+  /* Sending: the check sits in the due list (ordered by next_due) until
+   * its last echo has gone out.  slot is its index in the in-flight
+   * table, which is carried in the echo id/seq, or -1. */
+  noit_check_t *check;
+  int32_t slot;
+  uint8_t next_pack;
+  mtev_boolean queued;
+  int interval;
+  struct timeval next_due;
 };
 struct ping_payload {
   uintptr_t addr_of_check; /* ticket #288 */
@@ -94,33 +106,82 @@ struct ping_payload {
   uint8_t  size_bookend;
 };
 #define PING_PAYLOAD_LEN offsetof(struct ping_payload, size_bookend)
+#define PING_MAX_PACKET (sizeof(struct icmp) + PING_PAYLOAD_LEN)
 struct ping_closure {
   noit_module_t *self;
   noit_check_t *check;
-  void *payload;
-  int payload_len;
-  int icp_len;
 };
 static mtev_log_stream_t nlerr = NULL;
 static mtev_log_stream_t nldeb = NULL;
 static int in_cksum(u_short *addr, int len);
 static uintptr_t random_num;
 static uint32_t packets_per_cycle = 10;
+static uint32_t max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+
+#if defined __linux__
+typedef struct mmsghdr ping_mmsghdr_t;
+#else
+typedef struct {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+} ping_mmsghdr_t;
+#endif
 
+/* Echoes due within the same millisecond go out in one sendmmsg. */
+struct ping_send_batch {
+  int n;
+  mtev_boolean use_sendmmsg;
+  ping_mmsghdr_t msgs[PING_SEND_BATCH];
+  struct iovec iov[PING_SEND_BATCH];
+  union {
+    struct sockaddr_in  in4;
+    struct sockaddr_in6 in6;
+  } addr[PING_SEND_BATCH];
+  noit_check_t *checks[PING_SEND_BATCH];
+  uint64_t packet[PING_SEND_BATCH][(PING_MAX_PACKET + 7) / 8];
+};
+
+struct ping_recv_batch {
+  mtev_boolean use_recvmmsg;
+  ping_mmsghdr_t msgs[PING_RECV_BATCH];
+  struct iovec iov[PING_RECV_BATCH];
+  union {
+    struct sockaddr_in  in4;
+    struct sockaddr_in6 in6;
+  } from[PING_RECV_BATCH];
+  uint64_t packet[PING_RECV_BATCH][PING_RECV_LEN / 8];
+  uint64_t control[PING_RECV_BATCH][(CMSG_SPACE(sizeof(struct timespec)) + 7) / 8];
+};
 
 typedef struct  {
   int ipv4_fd;
   int ipv6_fd;
-  mtev_hash_table *in_flight;
+  /* in-flight checks by slot, each holding a reference */
+  noit_check_t **slots;
+  uint32_t *free_slots;
+  uint32_t nfree;
   ck_spinlock_t in_flight_lock;
+  /* checks with echoes left to send */
+  pthread_mutex_t due_lock;
+  mtev_skiplist *due;
+  eventer_t send_event;
+  struct timeval send_due;
+  struct ping_send_batch *send4, *send6; /* guarded by due_lock */
+  struct ping_recv_batch *recv4, *recv6;
 } ping_icmp_data_t;
 
 static int ping_icmp_config(noit_module_t *self, mtev_hash_table *options) {
   const char *packets_per_cycle_s = mtev_hash_dict_get(options, "packets_per_cycle");
+  const char *max_in_flight_s = mtev_hash_dict_get(options, "max_in_flight");
   if(packets_per_cycle_s) {
     packets_per_cycle = atoi(packets_per_cycle_s);
     if(packets_per_cycle == 0) packets_per_cycle = 1;
   }
+  if(max_in_flight_s) {
+    max_in_flight = strtoul(max_in_flight_s, NULL, 10);
+    if(max_in_flight == 0) max_in_flight = 1;
+    if(max_in_flight > MAX_MAX_IN_FLIGHT) max_in_flight = MAX_MAX_IN_FLIGHT;
+  }
   return 0;
 }
 static int ping_icmp_is_complete(noit_module_t *self, noit_check_t *check) {
@@ -192,230 +253,326 @@ static void ping_icmp_log_results(noit_module_t *self, noit_check_t *check) {
                         METRIC_DOUBLE, avail > 0.0 ? &avg : NULL);
   noit_check_set_stats(check);
 }
+
+static int
+ping_due_compare(const void *av, const void *bv) {
+  const struct check_info *a = av, *b = bv;
+  if(a->next_due.tv_sec != b->next_due.tv_sec)
+    return (a->next_due.tv_sec < b->next_due.tv_sec) ? -1 : 1;
+  if(a->next_due.tv_usec != b->next_due.tv_usec)
+    return (a->next_due.tv_usec < b->next_due.tv_usec) ? -1 : 1;
+  if(a < b) return -1;
+  if(a == b) return 0;
+  return 1;
+}
+
+/* Claims the check's slot if it still holds one; whoever does is the one
+ * to finish the check and drop the slot's reference. */
+static mtev_boolean
+ping_slot_release(ping_icmp_data_t *ping_data, struct check_info *ci) {
+  mtev_boolean released = mtev_false;
+  ck_spinlock_lock(&ping_data->in_flight_lock);
+  if(ci->slot >= 0 && ping_data->slots[ci->slot] == ci->check) {
+    ping_data->slots[ci->slot] = NULL;
+    ping_data->free_slots[ping_data->nfree++] = ci->slot;
+    released = mtev_true;
+  }
+  ci->slot = -1;
+  ck_spinlock_unlock(&ping_data->in_flight_lock);
+  return released;
+}
+
+static int ping_icmp_send_batch(eventer_t e, int mask,
+                                void *closure, struct timeval *now);
+
+/* Arms the send timer for the head of the due list; due_lock is held. */
+static void
+ping_schedule_send(noit_module_t *self, ping_icmp_data_t *ping_data) {
+  struct check_info *head = mtev_skiplist_peek(ping_data->due);
+  if(!head) return;
+  if(ping_data->send_event) {
+    if(compare_timeval(ping_data->send_due, head->next_due) <= 0) return;
+    eventer_t olde = eventer_remove(ping_data->send_event);
+    ping_data->send_event = NULL;
+    if(olde) {
+      eventer_deref(olde);
+      eventer_deref(olde);
+    }
+    else {
+      /* it is firing now and will reschedule itself */
+      return;
+    }
+  }
+  ping_data->send_due = head->next_due;
+  ping_data->send_event = eventer_alloc_timer(ping_icmp_send_batch, self,
+                                              &ping_data->send_due);
+  eventer_add(ping_data->send_event);
+}
+
+static void
+ping_due_remove(ping_icmp_data_t *ping_data, struct check_info *ci) {
+  pthread_mutex_lock(&ping_data->due_lock);
+  if(ci->queued) {
+    mtev_skiplist_remove(ping_data->due, ci, NULL);
+    ci->queued = mtev_false;
+  }
+  pthread_mutex_unlock(&ping_data->due_lock);
+}
+
 static int ping_icmp_timeout(eventer_t e, int mask,
                              void *closure, struct timeval *now) {
   struct ping_closure *pcl = (struct ping_closure *)closure;
-  struct ping_session_key k;
   struct check_info *data;
   ping_icmp_data_t *ping_data;
 
   mtev_memory_begin();
 
-  if(!NOIT_CHECK_KILLED(pcl->check) && !NOIT_CHECK_DISABLED(pcl->check)) {
-    ping_icmp_log_results(pcl->self, pcl->check);
-  }
   data = (struct check_info *)pcl->check->closure;
   data->timeout_event = NULL;
-  noit_check_end(pcl->check);
   ping_data = noit_module_get_userdata(pcl->self);
-  k.addr_of_check = (uintptr_t)pcl->check ^ random_num;
-  mtev_uuid_copy(k.checkid, pcl->check->checkid);
-  ck_spinlock_lock(&ping_data->in_flight_lock);
-  mtev_boolean should_free = 
-    mtev_hash_delete(ping_data->in_flight, (const char *)&k, sizeof(k),
-                     free, NULL);
-  ck_spinlock_unlock(&ping_data->in_flight_lock);
-  if(should_free) {
+  ping_due_remove(ping_data, data);
+  if(ping_slot_release(ping_data, data)) {
+    if(!NOIT_CHECK_KILLED(pcl->check) && !NOIT_CHECK_DISABLED(pcl->check)) {
+      ping_icmp_log_results(pcl->self, pcl->check);
+    }
+    noit_check_end(pcl->check);
     noit_check_deref(pcl->check);
-    free(pcl);
   }
+  noit_check_deref(pcl->check);
+  free(pcl);
   mtev_memory_end();
   return 0;
 }
 
-static int ping_icmp_handler(eventer_t e, int mask,
-                             void *closure, struct timeval *now,
-                             uint8_t family) {
-  noit_module_t *self = (noit_module_t *)closure;
-  ping_icmp_data_t *ping_data;
+static void
+ping_icmp_process_reply(noit_module_t *self, ping_icmp_data_t *ping_data,
+                        uint8_t family, const char *packet, int inlen,
+                        const struct timeval *arrived, struct timeval *now) {
   struct check_info *data;
-  char packet[1500];
-  int packet_len = sizeof(packet);
-  union {
-   struct sockaddr_in  in4;
-   struct sockaddr_in6 in6;
-  } from;
-  unsigned int from_len;
   struct ping_payload *payload;
+  noit_check_t *check;
+  uint32_t slot;
+  uint8_t iphlen = 0;
+  struct timeval tt, whence;
 
-  if(family != AF_INET && family != AF_INET6) return EVENTER_READ;
-
-  ping_data = noit_module_get_userdata(self);
-  uint32_t packets_remaining = packets_per_cycle;
-  mtev_memory_begin();
-  while(packets_remaining--) {
-    struct ping_session_key k;
-    int inlen;
-    uint8_t iphlen = 0;
-    void *vcheck;
-    noit_check_t *check;
-    struct timeval tt, whence;
-
-    from_len = sizeof(from);
-
-    inlen = recvfrom(eventer_get_fd(e), packet, packet_len, 0,
-                     (struct sockaddr *)&from, &from_len);
-    mtev_gettimeofday(now, NULL); /* set it, as we care about accuracy */
-
-    if(inlen < 0) {
-      if(errno == EAGAIN || errno == EINTR) break;
-      mtevLT(nldeb, now, "ping_icmp recvfrom: %s\n", strerror(errno));
-      break;
-    }
-
-    if(family == AF_INET) {
-      struct icmp *icp4;
-      iphlen = ((struct ip *)packet)->ip_hl << 2;
-      if((inlen-iphlen) != sizeof(struct icmp)+PING_PAYLOAD_LEN) {
-        mtevLT(nldeb, now,
-               "ping_icmp bad size: %d+%d\n", iphlen, inlen-iphlen); 
-        continue;
-      }
-      icp4 = (struct icmp *)(packet + iphlen);
-      payload = (struct ping_payload *)(icp4 + 1);
-      if(icp4->icmp_type != ICMP_ECHOREPLY) {
-        mtevLT(nldeb, now, "ping_icmp bad type: %d\n", icp4->icmp_type);
-        continue;
-      }
-      if((icp4->icmp_id & 0xff00) != (((uintptr_t)self) & 0xff00)) {
-        mtevLT(nldeb, now,
-                 "ping_icmp not sent from this instance (%d:%d) vs. %lu\n",
-                 icp4->icmp_id, ntohs(icp4->icmp_seq),
-                 (unsigned long)(((uintptr_t)self) & 0xff00));
-        continue;
-      }
-    }
-    else if(family == AF_INET6) {
-      struct icmp6_hdr *icp6 = (struct icmp6_hdr *)packet;
-      if((inlen) != sizeof(struct icmp6_hdr)+PING_PAYLOAD_LEN) {
-        mtevLT(nldeb, now,
-               "ping_icmp bad size: %d+%d\n", iphlen, inlen-iphlen); 
-        continue;
-      }
-      payload = (struct ping_payload *)(icp6+1);
-      if(icp6->icmp6_type != ICMP6_ECHO_REPLY) {
-        mtevLT(nldeb, now, "ping_icmp bad type: %d\n", icp6->icmp6_type);
-        continue;
-      }
-      if((icp6->icmp6_id & 0xff00) != (((uintptr_t)self) & 0xff00)) {
-        mtevLT(nldeb, now,
-                 "ping_icmp not sent from this instance (%d:%d) vs. %lu\n",
-                 icp6->icmp6_id, ntohs(icp6->icmp6_seq),
-                 (unsigned long)(((uintptr_t)self) & 0xff00));
-        continue;
-      }
-    }
-    else {
-      /* This should be unreachable */
-      continue;
+  if(family == AF_INET) {
+    struct icmp *icp4;
+    iphlen = ((struct ip *)packet)->ip_hl << 2;
+    if((inlen-iphlen) != sizeof(struct icmp)+PING_PAYLOAD_LEN) {
+      mtevLT(nldeb, now,
+             "ping_icmp bad size: %d+%d\n", iphlen, inlen-iphlen); 
+      return;
     }
-
-    char uuid_str[37];
-    mtev_uuid_unparse_lower(payload->checkid, uuid_str);
-
-    check = NULL;
-    k.addr_of_check = payload->addr_of_check;
-    mtev_uuid_copy(k.checkid, payload->checkid);
-    vcheck = NULL;
-    ck_spinlock_lock(&ping_data->in_flight_lock);
-    mtev_hash_retrieve(ping_data->in_flight,
-                       (const char *)&k, sizeof(k),
-                       &vcheck);
-    ck_spinlock_unlock(&ping_data->in_flight_lock);
-    check = noit_poller_lookup(k.checkid);
-    // if we don't get a match, need to also scan test checks if that module is loaded
-    if(!check) {
-      check = NOIT_TESTCHECK_LOOKUP(k.checkid);
-      if(check) noit_check_ref(check);
+    icp4 = (struct icmp *)(packet + iphlen);
+    payload = (struct ping_payload *)(icp4 + 1);
+    if(icp4->icmp_type != ICMP_ECHOREPLY) {
+      mtevLT(nldeb, now, "ping_icmp bad type: %d\n", icp4->icmp_type);
+      return;
     }
-    if(!check) {
+    if((icp4->icmp_id & 0xff00) != (((uintptr_t)self) & 0xff00)) {
       mtevLT(nldeb, now,
-             "ping_icmp response for missing check '%s'\n", uuid_str);
-      continue;
+               "ping_icmp not sent from this instance (%d:%d) vs. %lu\n",
+               icp4->icmp_id, ntohs(icp4->icmp_seq),
+               (unsigned long)(((uintptr_t)self) & 0xff00));
+      return;
     }
-    if(check != vcheck) {
+    slot = ((icp4->icmp_id & 0xff) << 16) | ntohs(icp4->icmp_seq);
+  }
+  else {
+    struct icmp6_hdr *icp6 = (struct icmp6_hdr *)packet;
+    if((inlen) != sizeof(struct icmp6_hdr)+PING_PAYLOAD_LEN) {
       mtevLT(nldeb, now,
-             "ping_icmp response for mismatched check '%s'\n", uuid_str);
-      continue;
+             "ping_icmp bad size: %d+%d\n", iphlen, inlen-iphlen); 
+      return;
     }
-
-    /* make sure this check is from this generation! */
-    if(!check) {
-      mtevLT(nldeb, now,
-             "ping_icmp response for unknown check '%s'\n", uuid_str);
-      continue;
+    payload = (struct ping_payload *)(icp6+1);
+    if(icp6->icmp6_type != ICMP6_ECHO_REPLY) {
+      mtevLT(nldeb, now, "ping_icmp bad type: %d\n", icp6->icmp6_type);
+      return;
     }
-    if((check->generation & 0xffff) != payload->generation) {
+    if((icp6->icmp6_id & 0xff00) != (((uintptr_t)self) & 0xff00)) {
       mtevLT(nldeb, now,
-             "ping_icmp response in generation gap\n");
-      noit_check_deref(check);
-      continue;
+               "ping_icmp not sent from this instance (%d:%d) vs. %lu\n",
+               icp6->icmp6_id, ntohs(icp6->icmp6_seq),
+               (unsigned long)(((uintptr_t)self) & 0xff00));
+      return;
     }
-    data = (struct check_info *)check->closure;
+    slot = ((icp6->icmp6_id & 0xff) << 16) | ntohs(icp6->icmp6_seq);
+  }
+
+  char uuid_str[37];
+  mtev_uuid_unparse_lower(payload->checkid, uuid_str);
 
-    if(!data) {
+  check = NULL;
+  if(slot < max_in_flight) {
+    ck_spinlock_lock(&ping_data->in_flight_lock);
+    check = noit_check_ref(ping_data->slots[slot]);
+    ck_spinlock_unlock(&ping_data->in_flight_lock);
+  }
+  if(!check) {
+    mtevLT(nldeb, now,
+           "ping_icmp response for missing check '%s'\n", uuid_str);
+    return;
+  }
+  if(payload->addr_of_check != ((uintptr_t)check ^ random_num) ||
+     mtev_uuid_compare(payload->checkid, check->checkid)) {
+    mtevLT(nldeb, now,
+           "ping_icmp response for mismatched check '%s'\n", uuid_str);
+    noit_check_deref(check);
+    return;
+  }
+
+  /* make sure this check is from this generation! */
+  if((check->generation & 0xffff) != payload->generation) {
+    mtevLT(nldeb, now,
+           "ping_icmp response in generation gap\n");
+    noit_check_deref(check);
+    return;
+  }
+  data = (struct check_info *)check->closure;
+
+  if(!data) {
+    noit_check_deref(check);
+    return;
+  }
+  /* If there is no timeout_event, the check must have completed.
+   * We have nothing to do. */
+  if(!data->timeout_event) {
+    mtevLT(nldeb, now,
+           "ping_icmp response timeout/completion for check '%s'\n", uuid_str);
+    noit_check_deref(check);
+    return;
+  }
+
+  /* Sanity check the payload */
+  if(payload->check_no != data->check_no) {
+    mtevLT(nldeb, now,
+           "ping_icmp response check number mismatch for check '%s'\n", uuid_str);
+    noit_check_deref(check);
+    return;
+  }
+  if(payload->check_pack_cnt != data->expected_count) {
+    mtevLT(nldeb, now,
+           "ping_icmp response check packet count mismatch for check '%s'\n", uuid_str);
+    noit_check_deref(check);
+    return;
+  }
+  if(payload->check_pack_no >= data->expected_count) { 
+    mtevLT(nldeb, now,
+           "ping_icmp response check packet number mismatch for check '%s'\n", uuid_str);
+    noit_check_deref(check);
+    return;
+  }
+
+  mtevLT(nldeb, now,
+         "ping_icmp response received for check '%s'\n", uuid_str);
+
+  whence.tv_sec = payload->tv_sec;
+  whence.tv_usec = payload->tv_usec;
+  sub_timeval(*arrived, whence, &tt);
+  data->turnaround[payload->check_pack_no] =
+    (float)tt.tv_sec + (float)tt.tv_usec / 1000000.0;
+  if(ping_icmp_is_complete(self, check)) {
+    if(ping_slot_release(ping_data, data)) {
+      noit_check_end(check);
+      ping_icmp_log_results(self, check);
+      eventer_t olde = eventer_remove(data->timeout_event);
+      if(olde) {
+        free(eventer_get_closure(olde));
+        eventer_deref(olde);
+        eventer_deref(olde);
+        noit_check_deref(check);
+        data->timeout_event = NULL;
+      }
+      /* the slot's reference */
       noit_check_deref(check);
-      continue;
     }
-    /* If there is no timeout_event, the check must have completed.
-     * We have nothing to do. */
-    if(!data->timeout_event) {
-      mtevLT(nldeb, now,
-             "ping_icmp response timeout/completion for check '%s'\n", uuid_str);
-      noit_check_deref(check);
-      continue;
+  }
+  noit_check_deref(check);
+}
+
+/* The kernel receive time if SO_TIMESTAMPNS delivered one. */
+static mtev_boolean
+ping_icmp_rx_time(struct msghdr *msg, struct timeval *arrived) {
+#ifdef SO_TIMESTAMPNS
+  struct cmsghdr *cmsg;
+  for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      arrived->tv_sec = ts.tv_sec;
+      arrived->tv_usec = ts.tv_nsec / 1000;
+      return mtev_true;
     }
+  }
+#endif
+  return mtev_false;
+}
 
-    /* Sanity check the payload */
-    if(payload->check_no != data->check_no) {
-      mtevLT(nldeb, now,
-             "ping_icmp response check number mismatch for check '%s'\n", uuid_str);
-      noit_check_deref(check);
-      continue;
+static int ping_icmp_handler(eventer_t e, int mask,
+                             void *closure, struct timeval *now,
+                             uint8_t family) {
+  noit_module_t *self = (noit_module_t *)closure;
+  ping_icmp_data_t *ping_data;
+  struct ping_recv_batch *rb;
+
+  if(family != AF_INET && family != AF_INET6) return EVENTER_READ;
+
+  ping_data = noit_module_get_userdata(self);
+  rb = (family == AF_INET) ? ping_data->recv4 : ping_data->recv6;
+  uint32_t packets_remaining = packets_per_cycle;
+  mtev_memory_begin();
+  while(packets_remaining > 0) {
+    int i, inlen, want = MIN(packets_remaining, PING_RECV_BATCH);
+
+    for(i=0; i<want; i++) {
+      struct msghdr *msg = &rb->msgs[i].msg_hdr;
+      rb->iov[i].iov_base = rb->packet[i];
+      rb->iov[i].iov_len = sizeof(rb->packet[i]);
+      msg->msg_name = &rb->from[i];
+      msg->msg_namelen = sizeof(rb->from[i]);
+      msg->msg_iov = &rb->iov[i];
+      msg->msg_iovlen = 1;
+      msg->msg_control = rb->control[i];
+      msg->msg_controllen = sizeof(rb->control[i]);
+      msg->msg_flags = 0;
     }
-    if(payload->check_pack_cnt != data->expected_count) {
-      mtevLT(nldeb, now,
-             "ping_icmp response check packet count mismatch for check '%s'\n", uuid_str);
-      noit_check_deref(check);
+    if(rb->use_recvmmsg) {
+#if defined __linux__
+      inlen = recvmmsg(eventer_get_fd(e), rb->msgs, want, 0, NULL);
+      if(inlen < 0 && errno == ENOSYS) {
+        rb->use_recvmmsg = mtev_false;
+        continue;
+      }
+#else
+      rb->use_recvmmsg = mtev_false;
       continue;
+#endif
     }
-    if(payload->check_pack_no >= data->expected_count) { 
-      mtevLT(nldeb, now,
-             "ping_icmp response check packet number mismatch for check '%s'\n", uuid_str);
-      noit_check_deref(check);
-      continue;
+    else {
+      inlen = recvmsg(eventer_get_fd(e), &rb->msgs[0].msg_hdr, 0);
+      if(inlen >= 0) {
+        rb->msgs[0].msg_len = inlen;
+        inlen = 1;
+      }
     }
+    mtev_gettimeofday(now, NULL); /* set it, as we care about accuracy */
 
-    mtevLT(nldeb, now,
-           "ping_icmp response received for check '%s'\n", uuid_str);
-
-    whence.tv_sec = payload->tv_sec;
-    whence.tv_usec = payload->tv_usec;
-    sub_timeval(*now, whence, &tt);
-    data->turnaround[payload->check_pack_no] =
-      (float)tt.tv_sec + (float)tt.tv_usec / 1000000.0;
-    if(ping_icmp_is_complete(self, check)) {
-      k.addr_of_check = (uintptr_t)check ^ random_num;
-      mtev_uuid_copy(k.checkid, check->checkid);
-      ck_spinlock_lock(&ping_data->in_flight_lock);
-      mtev_boolean first_finisher =
-        mtev_hash_delete(ping_data->in_flight, (const char *)&k,
-                         sizeof(k), free, NULL);
-      ck_spinlock_unlock(&ping_data->in_flight_lock);
-      if(first_finisher) {
-        noit_check_end(check);
-        ping_icmp_log_results(self, check);
-        eventer_t olde = eventer_remove(data->timeout_event);
-        if(olde) {
-          free(eventer_get_closure(olde));
-          eventer_deref(olde);
-          eventer_deref(olde);
-          noit_check_deref(check);
-          data->timeout_event = NULL;
-        }
-      }
+    if(inlen < 0) {
+      if(errno == EAGAIN || errno == EINTR) break;
+      mtevLT(nldeb, now, "ping_icmp recvmmsg: %s\n", strerror(errno));
+      break;
     }
-    noit_check_deref(check);
+
+    for(i=0; i<inlen; i++) {
+      struct timeval arrived = *now;
+      (void)ping_icmp_rx_time(&rb->msgs[i].msg_hdr, &arrived);
+      ping_icmp_process_reply(self, ping_data, family,
+                              (const char *)rb->packet[i], rb->msgs[i].msg_len,
+                              &arrived, now);
+    }
+    packets_remaining -= inlen;
+    if(inlen < want) break;
   }
   mtev_memory_end();
   return EVENTER_READ;
@@ -429,6 +586,16 @@ static int ping_icmp6_handler(eventer_t e, int mask,
   return ping_icmp_handler(e, mask, closure, now, AF_INET6);
 }
 
+static void
+ping_icmp_enable_timestamps(int fd) {
+#ifdef SO_TIMESTAMPNS
+  int on = 1;
+  if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0)
+    mtevL(noit_debug, "ping_icmp: SO_TIMESTAMPNS unavailable: %s\n",
+          strerror(errno));
+#endif
+}
+
 static int ping_icmp_init(noit_module_t *self) {
   socklen_t on;
   struct protoent *proto;
@@ -436,10 +603,23 @@ static int ping_icmp_init(noit_module_t *self) {
 
   RAND_bytes((unsigned char *)&random_num, sizeof(uintptr_t));
 
-  data = malloc(sizeof(*data));
-  data->in_flight = calloc(1, sizeof(*data->in_flight));
-  mtev_hash_init(data->in_flight);
+  data = calloc(1, sizeof(*data));
+  data->slots = calloc(max_in_flight, sizeof(*data->slots));
+  data->free_slots = malloc(max_in_flight * sizeof(*data->free_slots));
+  /* hand out low slots first */
+  for(uint32_t i = 0; i < max_in_flight; i++)
+    data->free_slots[i] = max_in_flight - 1 - i;
+  data->nfree = max_in_flight;
   ck_spinlock_init(&data->in_flight_lock);
+  pthread_mutex_init(&data->due_lock, NULL);
+  data->due = mtev_skiplist_alloc();
+  mtev_skiplist_set_compare(data->due, ping_due_compare, ping_due_compare);
+  data->send4 = calloc(1, sizeof(*data->send4));
+  data->send6 = calloc(1, sizeof(*data->send6));
+  data->recv4 = calloc(1, sizeof(*data->recv4));
+  data->recv6 = calloc(1, sizeof(*data->recv6));
+  data->send4->use_sendmmsg = data->send6->use_sendmmsg = mtev_true;
+  data->recv4->use_recvmmsg = data->recv6->use_recvmmsg = mtev_true;
   data->ipv4_fd = data->ipv6_fd = -1;
 
   if ((proto = getprotobyname("icmp")) == NULL) {
@@ -480,6 +660,7 @@ static int ping_icmp_init(noit_module_t *self) {
   }
   if(data->ipv4_fd >= 0) {
     eventer_t newe;
+    ping_icmp_enable_timestamps(data->ipv4_fd);
     newe = eventer_alloc_fd(ping_icmp4_handler, self, data->ipv4_fd, EVENTER_READ);
     eventer_pool_t *dp = noit_check_choose_pool_by_module(self->hdr.name);
     if(dp) eventer_set_owner(newe, eventer_choose_owner_pool(dp, mtev_rand()));
@@ -503,6 +684,7 @@ static int ping_icmp_init(noit_module_t *self) {
     }
     if(data->ipv6_fd >= 0) {
       eventer_t newe;
+      ping_icmp_enable_timestamps(data->ipv6_fd);
       newe = eventer_alloc_fd(ping_icmp6_handler, self, data->ipv6_fd, EVENTER_READ);
       eventer_pool_t *dp = noit_check_choose_pool_by_module(self->hdr.name);
       if(dp) eventer_set_owner(newe, eventer_choose_owner_pool(dp, mtev_rand()));
@@ -516,84 +698,156 @@ static int ping_icmp_init(noit_module_t *self) {
   return 0;
 }
 
-static int ping_icmp_real_send(eventer_t e, int mask,
-                               void *closure, struct timeval *now) {
-  struct ping_closure *pcl = (struct ping_closure *)closure;
-  struct ping_session_key k;
+/* Sends and empties a batch; due_lock is held. */
+static void
+ping_batch_flush(struct ping_send_batch *batch, int fd) {
+  int off = 0;
+  while(off < batch->n) {
+    int sent;
+    if(batch->use_sendmmsg) {
+#if defined __linux__
+      sent = sendmmsg(fd, batch->msgs + off, batch->n - off, 0);
+      if(sent < 0 && errno == ENOSYS) {
+        batch->use_sendmmsg = mtev_false;
+        continue;
+      }
+#else
+      batch->use_sendmmsg = mtev_false;
+      continue;
+#endif
+    }
+    else {
+      sent = sendmsg(fd, &batch->msgs[off].msg_hdr, 0);
+      if(sent >= 0) sent = 1;
+    }
+    if(sent <= 0) {
+      noit_check_t *check = batch->checks[off];
+      mtevL(nlerr, "Error sending ICMP packet to %s(%s): %s\n",
+            check->target, check->target_ip, strerror(errno));
+      sent = 1;
+    }
+    off += sent;
+  }
+  batch->n = 0;
+}
+
+/* Builds the next echo for a check into its family's batch; due_lock is held. */
+static void
+ping_batch_add(noit_module_t *self, ping_icmp_data_t *ping_data,
+               struct check_info *ci, const struct timeval *whence) {
+  noit_check_t *check = ci->check;
+  struct ping_send_batch *batch;
   struct ping_payload *payload;
-  struct timeval whence;
-  ping_icmp_data_t *data;
-  void *vcheck;
-  int i = 0;
+  int fd, icp_len, packet_len, i;
+  void *icp;
+
+  if(check->target_ip[0] == '\0') return;
+  if(check->target_family == AF_INET) {
+    batch = ping_data->send4;
+    fd = ping_data->ipv4_fd;
+    icp_len = sizeof(struct icmp);
+  }
+  else if(check->target_family == AF_INET6) {
+    batch = ping_data->send6;
+    fd = ping_data->ipv6_fd;
+    icp_len = sizeof(struct icmp6_hdr);
+  }
+  else return;
+  if(fd < 0) {
+    mtevL(nldeb, "IPv%d ping unavailable\n",
+          check->target_family == AF_INET ? 4 : 6);
+    return;
+  }
+  if(batch->n == PING_SEND_BATCH) ping_batch_flush(batch, fd);
 
-  data = noit_module_get_userdata(pcl->self);
-  payload = (struct ping_payload *)((char *)pcl->payload + pcl->icp_len);
-  k.addr_of_check = payload->addr_of_check;
-  mtev_uuid_copy(k.checkid, payload->checkid);
+  i = batch->n++;
+  packet_len = icp_len + PING_PAYLOAD_LEN;
+  icp = batch->packet[i];
+  memset(icp, 0, packet_len);
+  payload = (struct ping_payload *)((char *)icp + icp_len);
+  payload->addr_of_check = (uintptr_t)check ^ random_num;
+  mtev_uuid_copy(payload->checkid, check->checkid);
+  payload->tv_sec = whence->tv_sec;
+  payload->tv_usec = whence->tv_usec;
+  payload->generation = check->generation & 0xffff;
+  payload->check_no = ci->check_no;
+  payload->check_pack_no = ci->next_pack;
+  payload->check_pack_cnt = ci->expected_count;
 
-  ck_spinlock_lock(&data->in_flight_lock);
-  if(!mtev_hash_retrieve(data->in_flight, (const char *)&k, sizeof(k),
-                         &vcheck)) {
-    ck_spinlock_unlock(&data->in_flight_lock);
-    mtevLT(nldeb, now, "ping check no longer active, bailing\n");
-    goto cleanup;
+  memset(&batch->addr[i], 0, sizeof(batch->addr[i]));
+  if(check->target_family == AF_INET) {
+    struct icmp *icp4 = icp;
+    icp4->icmp_type = ICMP_ECHO;
+    icp4->icmp_id = (((uintptr_t)self) & 0xff00) | ((ci->slot >> 16) & 0xff);
+    icp4->icmp_seq = htons(ci->slot & 0xffff);
+    icp4->icmp_cksum = in_cksum(icp, packet_len);
+    batch->addr[i].in4.sin_family = AF_INET;
+    memcpy(&batch->addr[i].in4.sin_addr,
+           &check->target_addr.addr, sizeof(batch->addr[i].in4.sin_addr));
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addr[i].in4);
   }
-  ck_spinlock_unlock(&data->in_flight_lock);
+  else {
+    struct icmp6_hdr *icp6 = icp;
+    icp6->icmp6_type = ICMP6_ECHO_REQUEST;
+    icp6->icmp6_id = (((uintptr_t)self) & 0xff00) | ((ci->slot >> 16) & 0xff);
+    icp6->icmp6_seq = htons(ci->slot & 0xffff);
+    icp6->icmp6_cksum = in_cksum(icp, packet_len);
+    batch->addr[i].in6.sin6_family = AF_INET6;
+    memcpy(&batch->addr[i].in6.sin6_addr,
+           &check->target_addr.addr6, sizeof(batch->addr[i].in6.sin6_addr));
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addr[i].in6);
+  }
+  batch->iov[i].iov_base = icp;
+  batch->iov[i].iov_len = packet_len;
+  batch->msgs[i].msg_hdr.msg_name = &batch->addr[i];
+  batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+  batch->msgs[i].msg_hdr.msg_iovlen = 1;
+  batch->msgs[i].msg_hdr.msg_control = NULL;
+  batch->msgs[i].msg_hdr.msg_controllen = 0;
+  batch->msgs[i].msg_hdr.msg_flags = 0;
+  batch->checks[i] = check;
+}
 
-  if(pcl->check->target_ip[0] == '\0') goto cleanup;
+/* Sends every echo due by the end of the current millisecond. */
+static int ping_icmp_send_batch(eventer_t e, int mask,
+                                void *closure, struct timeval *now) {
+  noit_module_t *self = closure;
+  ping_icmp_data_t *ping_data = noit_module_get_userdata(self);
+  struct check_info *ci;
+  struct timeval whence, horizon, one_ms = { 0, 1000 };
 
-  mtevLT(nldeb, now, "ping_icmp_real_send(%s)\n", pcl->check->target_ip);
+  mtev_memory_begin();
   mtev_gettimeofday(&whence, NULL); /* now isn't accurate enough */
-  payload->tv_sec = whence.tv_sec;
-  payload->tv_usec = whence.tv_usec;
-  if(pcl->check->target_family == AF_INET) {
-    struct sockaddr_in sin;
-    struct icmp *icp4 = (struct icmp *)pcl->payload;
-    if(data->ipv4_fd < 0) {
-      mtevLT(nldeb, now, "IPv4 ping unavailable\n");
-      goto cleanup;
+  add_timeval(whence, one_ms, &horizon);
+  pthread_mutex_lock(&ping_data->due_lock);
+  ping_data->send_event = NULL;
+  while((ci = mtev_skiplist_peek(ping_data->due)) != NULL &&
+        compare_timeval(ci->next_due, horizon) <= 0) {
+    struct timeval p_int;
+    mtev_skiplist_pop(ping_data->due, NULL);
+    ci->queued = mtev_false;
+    ping_batch_add(self, ping_data, ci, &whence);
+    if(++ci->next_pack < ci->expected_count) {
+      p_int.tv_sec = ci->interval / 1000;
+      p_int.tv_usec = (ci->interval % 1000) * 1000;
+      add_timeval(ci->next_due, p_int, &ci->next_due);
+      mtev_skiplist_insert(ping_data->due, ci);
+      ci->queued = mtev_true;
     }
-    icp4->icmp_cksum = in_cksum(pcl->payload, pcl->payload_len);
-    memset(&sin, 0, sizeof(sin));
-    sin.sin_family = AF_INET;
-    memcpy(&sin.sin_addr,
-           &pcl->check->target_addr.addr, sizeof(sin.sin_addr));
-    i = sendto(data->ipv4_fd,
-               pcl->payload, pcl->payload_len, 0,
-               (struct sockaddr *)&sin, sizeof(sin));
-  }
-  else if(pcl->check->target_family == AF_INET6) {
-    struct sockaddr_in6 sin;
-    struct icmp6_hdr *icp6 = (struct icmp6_hdr *)pcl->payload;
-    if(data->ipv6_fd < 0) {
-      mtevLT(nldeb, now, "IPv6 ping unavailable\n");
-      goto cleanup;
-    }
-    icp6->icmp6_cksum = in_cksum(pcl->payload, pcl->payload_len);
-    memset(&sin, 0, sizeof(sin));
-    sin.sin6_family = AF_INET6;
-    memcpy(&sin.sin6_addr,
-           &pcl->check->target_addr.addr6, sizeof(sin.sin6_addr));
-    i = sendto(data->ipv6_fd,
-               pcl->payload, pcl->payload_len, 0,
-               (struct sockaddr *)&sin, sizeof(sin));
-  }
-  if(i != pcl->payload_len) {
-    mtevLT(nlerr, now, "Error sending ICMP packet to %s(%s): %s\n",
-             pcl->check->target, pcl->check->target_ip, strerror(errno));
-  }
- cleanup:
-  mtev_memory_begin();
-  noit_check_deref(pcl->check);
+  }
+  /* The batches are shared with other send runs; flush them under the lock. */
+  if(ping_data->send4->n) ping_batch_flush(ping_data->send4, ping_data->ipv4_fd);
+  if(ping_data->send6->n) ping_batch_flush(ping_data->send6, ping_data->ipv6_fd);
+  ping_schedule_send(self, ping_data);
+  pthread_mutex_unlock(&ping_data->due_lock);
   mtev_memory_end();
-  free(pcl->payload);
-  free(pcl);
   return 0;
 }
 static void ping_check_cleanup(noit_module_t *self, noit_check_t *check) {
   struct check_info *ci = (struct check_info *)check->closure;
   check->closure = NULL;
   if(ci) {
+    ping_due_remove(noit_module_get_userdata(self), ci);
     if(ci->timeout_event) {
       eventer_t e = eventer_remove(ci->timeout_event);
       if(e) {
@@ -609,15 +863,12 @@ static void ping_check_cleanup(noit_module_t *self, noit_check_t *check) {
 static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
                           noit_check_t *cause) {
   struct timeval when, p_int;
-  struct ping_payload *payload;
   struct ping_closure *pcl;
   struct check_info *ci = (struct check_info *)check->closure;
-  int packet_len, icp_len, i;
+  int i;
   eventer_t newe;
   const char *config_val;
   ping_icmp_data_t *ping_data;
-  struct ping_session_key *k;
-  void *icp;
 
   int interval = PING_INTERVAL;
   int count = PING_COUNT;
@@ -633,13 +884,6 @@ static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
 
   noit_check_begin(check);
   ping_data = noit_module_get_userdata(self);
-  k = calloc(1, sizeof(*k));
-  k->addr_of_check = (uintptr_t)check ^ random_num;
-  mtev_uuid_copy(k->checkid, check->checkid);
-  if(!mtev_hash_store(ping_data->in_flight, (const char *)k, sizeof(*k),
-                      check)) {
-    free(k);
-  }
   mtevL(nldeb, "ping_icmp_send(%p,%s,%d,%d)\n",
         self, check->target_ip, interval, count);
 
@@ -649,70 +893,54 @@ static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
   if(ci->timeout_event) {
     eventer_t olde = eventer_remove(ci->timeout_event);
     if(olde) {
-      free(eventer_get_closure(olde));
+      struct ping_closure *oldpcl = eventer_get_closure(olde);
+      noit_check_deref(oldpcl->check);
+      free(oldpcl);
       eventer_deref(olde);
       eventer_deref(olde);
     }
     ci->timeout_event = NULL;
   }
+  /* and anything left of the last run */
+  ping_due_remove(ping_data, ci);
+  if(ping_slot_release(ping_data, ci)) noit_check_deref(check);
+
+  ci->check = check;
+  ck_spinlock_lock(&ping_data->in_flight_lock);
+  if(ping_data->nfree > 0) {
+    ci->slot = ping_data->free_slots[--ping_data->nfree];
+    ping_data->slots[ci->slot] = noit_check_ref(check);
+  }
+  ck_spinlock_unlock(&ping_data->in_flight_lock);
+  if(ci->slot < 0) {
+    mtevL(nlerr, "ping_icmp: %u checks already in flight, skipping %s\n",
+          max_in_flight, check->target_ip);
+    noit_check_end(check);
+    return 0;
+  }
 
   mtev_gettimeofday(&when, NULL);
   memcpy(&check->last_fire_time, &when, sizeof(when));
 
-  /* Setup some stuff used in the loop */
-  icp_len = (check->target_family == AF_INET6) ?
-              sizeof(struct icmp6_hdr) : sizeof(struct icmp);
-  packet_len = icp_len + PING_PAYLOAD_LEN;
-
   /* Prep holding spots for return info */
   ci->expected_count = count;
   if(ci->turnaround) free(ci->turnaround);
   ci->turnaround = malloc(count * sizeof(*ci->turnaround));
+  /* Negative means we've not received a response */
+  for(i=0; i<count; i++) ci->turnaround[i] = -1.0;
 
   ++ci->check_no;
-  for(i=0; i<count; i++) {
-    /* Negative means we've not received a response */
-    ci->turnaround[i] = -1.0;
-
-    icp = calloc(1,packet_len);
-    payload = (struct ping_payload *)((char *)icp + icp_len);
-
-    if(check->target_family == AF_INET) {
-      struct icmp *icp4 = icp;
-      icp4->icmp_type = ICMP_ECHO;
-      icp4->icmp_code = 0;
-      icp4->icmp_cksum = 0;
-      icp4->icmp_id = (((uintptr_t)self) & 0xff00) | (ci->seq & 0xff);
-      icp4->icmp_seq = htons(ci->seq++);
-    }
-    else if(check->target_family == AF_INET6) {
-      struct icmp6_hdr *icp6 = icp;
-      icp6->icmp6_type = ICMP6_ECHO_REQUEST;
-      icp6->icmp6_code = 0;
-      icp6->icmp6_cksum = 0;
-      icp6->icmp6_id = (((uintptr_t)self) & 0xff00) | (ci->seq & 0xff);
-      icp6->icmp6_seq = htons(ci->seq++);
-    }
-
-    payload->addr_of_check = (uintptr_t)check ^ random_num;
-    mtev_uuid_copy(payload->checkid, check->checkid);
-    payload->generation = check->generation & 0xffff;
-    payload->check_no = ci->check_no;
-    payload->check_pack_no = i;
-    payload->check_pack_cnt = count;
-
-    pcl = calloc(1, sizeof(*pcl));
-    pcl->self = self;
-    pcl->check = noit_check_ref(check);
-    pcl->payload = icp;
-    pcl->payload_len = packet_len;
-    pcl->icp_len = icp_len;
-
-    p_int.tv_sec = (i * interval) / 1000;
-    p_int.tv_usec = ((i * interval) % 1000) * 1000;
-    newe = eventer_in(ping_icmp_real_send, pcl, p_int);
-    eventer_add(newe);
+  ci->interval = interval;
+  ci->next_pack = 0;
+  ci->next_due = when;
+  if(count > 0) {
+    pthread_mutex_lock(&ping_data->due_lock);
+    mtev_skiplist_insert(ping_data->due, ci);
+    ci->queued = mtev_true;
+    ping_schedule_send(self, ping_data);
+    pthread_mutex_unlock(&ping_data->due_lock);
   }
+
   p_int.tv_sec = check->timeout / 1000;
   p_int.tv_usec = (check->timeout % 1000) * 1000;
   pcl = calloc(1, sizeof(*pcl));
@@ -726,7 +954,11 @@ static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
 }
 static int ping_icmp_initiate_check(noit_module_t *self, noit_check_t *check,
                                     int once, noit_check_t *cause) {
-  if(!check->closure) check->closure = calloc(1, sizeof(struct check_info));
+  if(!check->closure) {
+    struct check_info *ci = calloc(1, sizeof(struct check_info));
+    ci->slot = -1;
+    check->closure = ci;
+  }
   INITIATE_CHECK(ping_icmp_send, self, check, cause);
   return 0;
 }
@@ -780,7 +1012,7 @@ static int ping_icmp_onload(mtev_image_t *self) {
   eventer_name_callback("ping_icmp/timeout", ping_icmp_timeout);
   eventer_name_callback("ping_icmp/handler", ping_icmp4_handler);
   eventer_name_callback("ping_icmp6/handler", ping_icmp6_handler);
-  eventer_name_callback("ping_icmp/send", ping_icmp_real_send);
+  eventer_name_callback("ping_icmp/send", ping_icmp_send_batch);
   return 0;
 }
 #include "ping_icmp.xmlh"
@@ -1095,6 +1095,7 @@ build_insert_batch(pg_interim_journal_t *ij) {
         switch(lcp[1]) {
           case '1': /* version 1 */
           case '2': /* version 2 */
+          case '3': /* version 3 */
               expand_b_record(&head, &last, lcp, cp - lcp);
             break;
           default:
@@ -104,19 +104,6 @@ typedef struct prometheus_upload
 
 #define READ_CHUNK 32768
 
-static void *__c_allocator_alloc(void *d, size_t size) {
-  return malloc(size);
-}
-static void __c_allocator_free(void *d, void *p) {
-  free(p);
-}
-static ProtobufCAllocator __c_allocator = {
-  .alloc = __c_allocator_alloc,
-  .free = __c_allocator_free,
-  .allocator_data = NULL
-};
-#define protobuf_c_system_allocator __c_allocator
-
 static void
 free_prometheus_upload(void *pul)
 {
@@ -318,6 +305,34 @@ metric_local_batch(prometheus_upload_t *rxc, const char *name, double val, struc
   mtev_memory_end();
 }
 
+static void
+handle_timeseries(Prometheus__Label **labels, size_t n_labels,
+                  Prometheus__Sample **samples, size_t n_samples, void *closure) {
+  prometheus_upload_t *rxc = closure;
+  /* each timeseries has a list of labels (Tags) and a list of samples */
+  prometheus_coercion_t coercion = {};
+  if(rxc->extract_units || rxc->coerce_histograms) {
+    coercion = noit_prometheus_metric_name_coerce(labels, n_labels, rxc->extract_units,
+                                  rxc->coerce_histograms, rxc->allowed_units);
+  }
+  prometheus_metric_name_t *metric_data = noit_prometheus_metric_name_from_labels(labels, n_labels, coercion.units,
+                                                                                  coercion.is_histogram && rxc->coerce_histograms);
+
+  for (size_t j = 0; j < n_samples; j++) {
+    Prometheus__Sample *sample = samples[j];
+    struct timeval tv;
+    tv.tv_sec = (time_t)(sample->timestamp / 1000L);
+    tv.tv_usec = (suseconds_t)((sample->timestamp % 1000L) * 1000);
+
+    if(coercion.is_histogram) {
+      noit_prometheus_track_histogram(&rxc->hists, metric_data, coercion.hist_boundary, sample->value, tv);
+    } else {
+      metric_local_batch(rxc, metric_data->name, sample->value, tv);
+    }
+  }
+  noit_prometheus_metric_name_free(metric_data);
+}
+
 static int
 rest_prometheus_handler(mtev_http_rest_closure_t *restc, int npats, char **pats)
 {
@@ -452,50 +467,26 @@ rest_prometheus_handler(mtev_http_rest_closure_t *restc, int npats, char **pats)
     goto error;
   }
   mtev_dyn_buffer_advance(&uncompressed, uncompressed_size);
-
-  /* decode prometheus protobuf */
-  /* decode the protobuf */
-  Prometheus__WriteRequest *write = prometheus__write_request__unpack(&protobuf_c_system_allocator, 
-                                                                      mtev_dyn_buffer_used(&uncompressed),
-                                                                      mtev_dyn_buffer_data(&uncompressed));
-  if(!write) {
-    mtev_dyn_buffer_destroy(&uncompressed);
+  /* The snappy block format can only be decompressed whole, but we're done
+   * with the compressed copy now. */
+  mtev_dyn_buffer_destroy(&rxc->data);
+  mtev_dyn_buffer_init(&rxc->data);
+
+  /* decode prometheus protobuf, series by series */
+  cnt = noit_prometheus_decode_write_request(mtev_dyn_buffer_data(&uncompressed),
+                                             mtev_dyn_buffer_used(&uncompressed),
+                                             handle_timeseries, rxc);
+  mtev_dyn_buffer_destroy(&uncompressed);
+  if(cnt < 0) {
+    /* anything already batched was valid, let it through */
+    metric_local_batch_flush_immediate(rxc);
     error = "Prometheus__WriteRequest decode: protobuf invalid";
     error_code = 400;
     mtevL(noit_error, "%s\n", error);
     goto error;
   }
-
-  cnt = write->n_timeseries;
-  for (size_t i = 0; i < write->n_timeseries; i++) {
-    Prometheus__TimeSeries *ts = write->timeseries[i];
-    /* each timeseries has a list of labels (Tags) and a list of samples */
-    prometheus_coercion_t coercion = {};
-    if(rxc->extract_units || rxc->coerce_histograms) {
-      coercion = noit_prometheus_metric_name_coerce(ts->labels, ts->n_labels, rxc->extract_units,
-                                    rxc->coerce_histograms, rxc->allowed_units);
-    }
-    prometheus_metric_name_t *metric_data = noit_prometheus_metric_name_from_labels(ts->labels, ts->n_labels, coercion.units,
-                                                                                    coercion.is_histogram && rxc->coerce_histograms);
-
-    for (size_t j = 0; j < ts->n_samples; j++) {
-      Prometheus__Sample *sample = ts->samples[j];
-      struct timeval tv;
-      tv.tv_sec = (time_t)(sample->timestamp / 1000L);
-      tv.tv_usec = (suseconds_t)((sample->timestamp % 1000L) * 1000);
-
-      if(coercion.is_histogram) {
-        noit_prometheus_track_histogram(&rxc->hists, metric_data, coercion.hist_boundary, sample->value, tv);
-      } else {
-        metric_local_batch(rxc, metric_data->name, sample->value, tv);
-      }
-    }
-    noit_prometheus_metric_name_free(metric_data);
-  }
   metric_local_batch_flush_immediate(rxc);
   flush_histograms(rxc);
-  prometheus__write_request__free_unpacked(write, &protobuf_c_system_allocator);
-  mtev_dyn_buffer_destroy(&uncompressed);
 
   mtev_http_response_status_set(ctx, 200, "OK");
   mtev_http_response_option_set(ctx, MTEV_HTTP_CLOSE);
@@ -329,7 +329,7 @@ noit_rabbimq_submit(iep_thread_driver_t *dr,
      *payload == 'C' ||
      (*payload == 'H' && payload[1] == '1') ||
      (*payload == 'F' && payload[1] == '1') ||
-     (*payload == 'B' && (payload[1] == '1' || payload[1] == '2'))) {
+     (*payload == 'B' && (payload[1] == '1' || payload[1] == '2' || payload[1] == '3'))) {
     char uuid_str[32 * 2 + 1];
     if(extract_uuid_from_jlog(payload, payloadlen, uuid_str)) {
       if(*routingkey) {
@@ -48,6 +48,10 @@
 #include <mtev_hash.h>
 #include <mtev_memory.h>
 #include <mtev_rand.h>
+#include <ck_pr.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <circllhist.h>
 
 #include "noit_module.h"
 #include "noit_check.h"
@@ -57,8 +61,12 @@
 
 #define MAX_CHECKS 3
 #define RECV_BUFFER_CAPACITY (128*1024)
+#define IP_CACHE_MAX 8192
+#define AGG_SHARDS 8
+#define AGG_INITIAL_SLOTS 64
+#define AGG_MAX_KEYS 65536
 
-static size_t Cstat, Mstat, Gstat, Pstat;
+static uint64_t Cstat, Mstat, Gstat, Pstat;
 static mtev_log_stream_t nlerr = NULL;
 static mtev_log_stream_t nldeb = NULL;
 static mtev_log_stream_t nlperf = NULL;
@@ -69,6 +77,30 @@ typedef union {
   struct sockaddr_in6 in6;
 } addr_t;
 
+/* The checks (by target ip and 0.0.0.0) a source address feeds. */
+typedef struct {
+  int nchecks;
+  noit_check_t *checks[MAX_CHECKS-1];
+  size_t keylen;
+  char key[1 + sizeof(struct in6_addr)];
+} ip_cache_entry_t;
+
+/* One socket and the buffers it is drained into.  Each receiver is owned
+ * by a single eventer thread, so neither needs locking. */
+typedef struct {
+  noit_module_t *self;
+  int fd;
+  size_t payload_len;
+  struct iovec *payload;
+  addr_t *addr;
+  bool use_recvmmsg;
+  int shard; /* aggregation shard, or -1 to apply samples as they arrive */
+  /* holds check references, so it is emptied whenever the poller
+   * generation moves on from ip_cache_generation */
+  mtev_hash_table ip_cache;
+  uint64_t ip_cache_generation;
+} statsd_receiver_t;
+
 typedef struct statsd_mod_config {
   mtev_hash_table *options;
   int packets_per_cycle;
@@ -76,19 +108,195 @@ typedef struct statsd_mod_config {
   uuid_t primary;
   int primary_active;
   noit_check_t *check;
-  int ipv4_fd;
-  int ipv6_fd;
-  size_t payload_len;
-  struct iovec *payload;
-  addr_t *addr;
-  bool use_recvmmsg;
+  int nreceivers;
+  statsd_receiver_t **receivers;
+  bool aggregate;
 } statsd_mod_config_t;
 
+/* The samples seen for one raw key (and type) since the last flush. */
+typedef struct {
+  uint32_t hash;
+  char type;
+  uint64_t seq;
+  double gauge;
+  uint64_t count;
+  histogram_t *timings;
+  size_t keylen;
+  char key[];
+} statsd_agg_entry_t;
+
+/* An open-addressing table of entries.  Receivers feed the shard matching
+ * their index, so the lock is only contended by a flush. */
+typedef struct {
+  pthread_mutex_t lock;
+  uint64_t seq;
+  size_t nslots;
+  size_t used;
+  statsd_agg_entry_t **slots;
+} statsd_agg_shard_t;
+
 typedef struct {
   noit_module_t *self;
   int stats_count;
+  statsd_agg_shard_t agg[AGG_SHARDS];
 } statsd_closure_t;
 
+static statsd_closure_t *
+statsd_closure_alloc(noit_module_t *self) {
+  statsd_closure_t *ccl = calloc(1, sizeof(*ccl));
+  ccl->self = self;
+  for(int i=0; i<AGG_SHARDS; i++) pthread_mutex_init(&ccl->agg[i].lock, NULL);
+  return ccl;
+}
+
+static void
+statsd_agg_entry_free(statsd_agg_entry_t *entry) {
+  if(entry->timings) hist_free(entry->timings);
+  free(entry);
+}
+
+static mtev_boolean
+statsd_agg_grow(statsd_agg_shard_t *s) {
+  size_t nslots = s->nslots ? s->nslots * 2 : AGG_INITIAL_SLOTS;
+  statsd_agg_entry_t **slots = calloc(nslots, sizeof(*slots));
+  if(!slots) return mtev_false;
+  for(size_t i=0; i<s->nslots; i++) {
+    statsd_agg_entry_t *entry = s->slots[i];
+    if(!entry) continue;
+    size_t j = entry->hash & (nslots - 1);
+    while(slots[j]) j = (j + 1) & (nslots - 1);
+    slots[j] = entry;
+  }
+  free(s->slots);
+  s->slots = slots;
+  s->nslots = nslots;
+  return mtev_true;
+}
+
+/* Finds or adds the entry for key, called with the shard locked.  Returns
+ * NULL if the shard is full. */
+static statsd_agg_entry_t *
+statsd_agg_find(statsd_agg_shard_t *s, const char *key, size_t keylen,
+                uint32_t hash, char type) {
+  if(s->used * 2 >= s->nslots && !statsd_agg_grow(s)) return NULL;
+
+  const size_t mask = s->nslots - 1;
+  size_t i;
+  for(i = hash & mask; s->slots[i]; i = (i + 1) & mask) {
+    statsd_agg_entry_t *entry = s->slots[i];
+    if(entry->hash == hash && entry->type == type && entry->keylen == keylen &&
+       !memcmp(entry->key, key, keylen))
+      return entry;
+  }
+  if(s->used >= AGG_MAX_KEYS) return NULL;
+
+  statsd_agg_entry_t *entry = calloc(1, sizeof(*entry) + keylen + 1);
+  if(!entry) return NULL;
+  entry->hash = hash;
+  entry->type = type;
+  entry->keylen = keylen;
+  memcpy(entry->key, key, keylen);
+  if(type == 'm') entry->timings = hist_alloc();
+  s->slots[i] = entry;
+  s->used++;
+  return entry;
+}
+
+static int
+statsd_agg_entry_order(const void *av, const void *bv) {
+  const statsd_agg_entry_t *a = *(const statsd_agg_entry_t * const *)av;
+  const statsd_agg_entry_t *b = *(const statsd_agg_entry_t * const *)bv;
+  if(a->seq < b->seq) return -1;
+  return a->seq > b->seq;
+}
+
+static void
+statsd_agg_emit(noit_check_t *check, statsd_agg_entry_t *entry) {
+  char buff[MAX_METRIC_TAGGED_NAME + 24];
+  double bin = 0;
+
+  switch(entry->type) {
+    case 'c':
+      snprintf(buff, sizeof(buff), "%.*s|ST[statsd_type:count]", (int)entry->keylen, entry->key);
+      noit_stats_set_metric_histogram(check, buff, mtev_false, METRIC_DOUBLE, &bin, entry->count);
+      break;
+    case 'm': {
+      ssize_t est = hist_serialize_b64_estimate(entry->timings);
+      if(est <= 0 || hist_num_buckets(entry->timings) == 0) break;
+      char *hist_encoded = malloc(est + 1);
+      ssize_t hist_encoded_len = hist_serialize_b64(entry->timings, hist_encoded, est);
+      if(hist_encoded_len > 0) {
+        hist_encoded[hist_encoded_len] = '\0';
+        snprintf(buff, sizeof(buff), "%.*s|ST[statsd_type:timing]", (int)entry->keylen, entry->key);
+        noit_stats_set_metric_histogram(check, buff, mtev_false, METRIC_STRING, hist_encoded, 1);
+      }
+      free(hist_encoded);
+      break;
+    }
+    default:
+      snprintf(buff, sizeof(buff), "%.*s|ST[statsd_type:gauge]", (int)entry->keylen, entry->key);
+      noit_stats_set_metric(check, buff, METRIC_DOUBLE, &entry->gauge);
+      break;
+  }
+}
+
+/* Materializes everything aggregated since the last flush as metrics on
+ * check and returns how many there were.  Each shard's table is swapped for
+ * an empty one of the same size so receivers are only held up briefly.
+ * Gauges are set in the order they were last updated (within a shard) so
+ * that raw keys naming the same metric resolve as they did per sample. */
+static int
+statsd_agg_flush(noit_check_t *check, statsd_closure_t *ccl) {
+  statsd_agg_entry_t **entries = NULL;
+  size_t nentries = 0;
+
+  for(int i=0; i<AGG_SHARDS; i++) {
+    statsd_agg_shard_t *s = &ccl->agg[i];
+    statsd_agg_entry_t **slots, **fresh;
+    size_t nslots, used;
+
+    pthread_mutex_lock(&s->lock);
+    if(s->used == 0 || (fresh = calloc(s->nslots, sizeof(*fresh))) == NULL) {
+      pthread_mutex_unlock(&s->lock);
+      continue;
+    }
+    slots = s->slots;
+    nslots = s->nslots;
+    used = s->used;
+    s->slots = fresh;
+    s->used = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    entries = realloc(entries, (nentries + used) * sizeof(*entries));
+    for(size_t j=0; j<nslots; j++)
+      if(slots[j]) entries[nentries++] = slots[j];
+    free(slots);
+  }
+
+  qsort(entries, nentries, sizeof(*entries), statsd_agg_entry_order);
+  for(size_t i=0; i<nentries; i++) {
+    statsd_agg_emit(check, entries[i]);
+    statsd_agg_entry_free(entries[i]);
+  }
+  free(entries);
+  return nentries;
+}
+
+static void
+statsd_cleanup(noit_module_t *self, noit_check_t *check) {
+  statsd_closure_t *ccl = check->closure;
+  if(!ccl) return;
+  for(int i=0; i<AGG_SHARDS; i++) {
+    statsd_agg_shard_t *s = &ccl->agg[i];
+    for(size_t j=0; j<s->nslots; j++)
+      if(s->slots[j]) statsd_agg_entry_free(s->slots[j]);
+    free(s->slots);
+    pthread_mutex_destroy(&s->lock);
+  }
+  free(ccl);
+  check->closure = NULL;
+}
+
 static int
 statsd_submit(noit_module_t *self, noit_check_t *check,
               noit_check_t *cause) {
@@ -110,14 +318,14 @@ statsd_submit(noit_module_t *self, noit_check_t *check,
   if(check->flags & NP_TRANSIENT) return 0;
 
   if(!check->closure) {
-    ccl = check->closure = calloc(1, sizeof(*ccl));
-    ccl->self = self;
+    ccl = check->closure = statsd_closure_alloc(self);
   } else {
     // Don't count the first run
     char human_buffer[256];
     ccl = (statsd_closure_t*)check->closure;
     mtev_gettimeofday(&now, NULL);
     mtev_memory_begin();
+    ccl->stats_count = statsd_agg_flush(check, ccl);
     sub_timeval(now, check->last_fire_time, &duration);
     noit_stats_set_whence(check, &now);
     noit_stats_set_duration(check, duration.tv_sec * 1000 + duration.tv_usec / 1000);
@@ -169,18 +377,56 @@ update_check(noit_check_t *check, const char *key, char type,
     uint64_t count = diff / sample;
     double bin = 0;
     noit_stats_set_metric_histogram(check, buff, mtev_false, METRIC_DOUBLE, &bin, count);
-    Cstat++;
+    ck_pr_inc_64(&Cstat);
   } else if(type == 'm') {
     noit_stats_set_metric_histogram(check, buff, mtev_false, METRIC_DOUBLE, &diff, (uint64_t)(1.0/sample));
-    Mstat++;
+    ck_pr_inc_64(&Mstat);
   } else {
     noit_stats_set_metric(check, buff, METRIC_DOUBLE, &diff);
-    Gstat++;
+    ck_pr_inc_64(&Gstat);
+  }
+}
+
+/* As update_check, but accumulates into the check's aggregation table to be
+ * materialized by the next statsd_submit.  Falls back to update_check if the
+ * check has no table or the table is full. */
+static void
+aggregate_check(noit_check_t *check, int shard, const char *key, size_t keylen,
+                uint32_t hash, char type, double diff, double sample) {
+  statsd_closure_t *ccl = check->closure;
+
+  if (sample == 0.0) return; /* would be a div-by-zero */
+  if (ccl == NULL) {
+    update_check(check, key, type, diff, sample);
+    return;
   }
+
+  statsd_agg_shard_t *s = &ccl->agg[shard];
+  pthread_mutex_lock(&s->lock);
+  statsd_agg_entry_t *entry = statsd_agg_find(s, key, keylen, hash, type);
+  if(entry) {
+    if(type == 'c') {
+      entry->count += (uint64_t)(diff / sample);
+      ck_pr_inc_64(&Cstat);
+    } else if(type == 'm') {
+      uint64_t count = 1.0/sample;
+      if(count) hist_insert(entry->timings, diff, count);
+      ck_pr_inc_64(&Mstat);
+    } else {
+      entry->gauge = diff;
+      entry->seq = ++s->seq;
+      ck_pr_inc_64(&Gstat);
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  if(!entry) update_check(check, key, type, diff, sample);
 }
 
+/* Applies each line of payload to checks.  With shard >= 0 the checks must
+ * be statsd checks and samples are aggregated in that shard of their tables,
+ * otherwise they are set on the check as they arrive. */
 static void
-statsd_handle_payload(noit_check_t **checks, int nchecks,
+statsd_handle_payload(noit_check_t **checks, int nchecks, int shard,
                       char *payload, int len) {
   char *cp, *ecp, *endptr;
   cp = ecp = payload;
@@ -258,6 +504,7 @@ statsd_handle_payload(noit_check_t **checks, int nchecks,
 
     if(tags) key[idx++] = ']';
     key[idx] = '\0';
+    const uint32_t hash = shard >= 0 ? mtev_hash__hash(key, idx, 0) : 0;
 
     while((NULL != cp) && NULL != (value = strchr(cp, ':'))) {
       double sampleRate = 1.0;
@@ -294,7 +541,10 @@ statsd_handle_payload(noit_check_t **checks, int nchecks,
         case 'c':
         case 'm':
           for(i=0;i<nchecks;i++) {
-            update_check(checks[i], key, *type, diff, sampleRate);
+            if(shard >= 0)
+              aggregate_check(checks[i], shard, key, idx, hash, *type, diff, sampleRate);
+            else
+              update_check(checks[i], key, *type, diff, sampleRate);
           }
           break;
         default:
@@ -308,15 +558,52 @@ statsd_handle_payload(noit_check_t **checks, int nchecks,
 }
 
 static void
-statsd_handle_single_message(noit_module_t *const self,
-                             noit_check_t *parent,
-                             struct iovec *payload,
-                             addr_t *addr) {
-  noit_check_t *checks[MAX_CHECKS];
+ip_cache_entry_free(void *vent) {
+  ip_cache_entry_t *entry = vent;
+  for(int i=0; i<entry->nchecks; i++) noit_check_deref(entry->checks[i]);
+  free(entry);
+}
+
+/* Fills checks with the checks fed by addr, as borrowed from the
+ * receiver's cache, and returns how many there are. */
+static int
+statsd_lookup_checks(statsd_receiver_t *r, addr_t *addr, noit_check_t **checks) {
+  char key[1 + sizeof(struct in6_addr)];
+  size_t keylen = 1;
   char ip[INET6_ADDRSTRLEN];
-  int nchecks = 0;
+  ip_cache_entry_t *entry;
+  void *vent;
+  const uint64_t generation = noit_poller_generation();
 
-  mtev_memory_begin();
+  key[0] = addr->in.sin_family;
+  switch(addr->in.sin_family) {
+  case AF_INET:
+    memcpy(key + 1, &addr->in.sin_addr, sizeof(addr->in.sin_addr));
+    keylen += sizeof(addr->in.sin_addr);
+    break;
+  case AF_INET6:
+    memcpy(key + 1, &addr->in6.sin6_addr, sizeof(addr->in6.sin6_addr));
+    keylen += sizeof(addr->in6.sin6_addr);
+    break;
+  default:
+    key[0] = 0;
+  }
+
+  if(r->ip_cache_generation != generation) {
+    mtev_hash_delete_all(&r->ip_cache, NULL, ip_cache_entry_free);
+    r->ip_cache_generation = generation;
+  }
+  if(mtev_hash_retrieve(&r->ip_cache, key, keylen, &vent)) {
+    entry = vent;
+    memcpy(checks, entry->checks, entry->nchecks * sizeof(*checks));
+    return entry->nchecks;
+  }
+  if(mtev_hash_size(&r->ip_cache) >= IP_CACHE_MAX)
+    mtev_hash_delete_all(&r->ip_cache, NULL, ip_cache_entry_free);
+  entry = calloc(1, sizeof(*entry));
+  memcpy(entry->key, key, keylen);
+  entry->keylen = keylen;
+  mtev_hash_store(&r->ip_cache, entry->key, entry->keylen, entry);
 
   switch(addr->in.sin_family) {
   case AF_INET:
@@ -328,20 +615,33 @@ statsd_handle_single_message(noit_module_t *const self,
   default:
     ip[0] = '\0';
   }
-
+  entry->nchecks = 0;
   if(*ip)
-    nchecks = noit_poller_lookup_by_ip_module(ip, self->hdr.name,
-                                              checks, MAX_CHECKS-1);
-  nchecks += noit_poller_lookup_by_ip_module("0.0.0.0", self->hdr.name,
-                                              checks+nchecks, MAX_CHECKS-1-nchecks);
-  mtevL(nldeb, "statsd(%zu bytes) from '%s' -> %d checks%s\n", payload->iov_len,
-        ip, (int)nchecks, parent ? " + a parent" : "");
+    entry->nchecks = noit_poller_lookup_by_ip_module(ip, r->self->hdr.name,
+                                                     entry->checks, MAX_CHECKS-1);
+  entry->nchecks += noit_poller_lookup_by_ip_module("0.0.0.0", r->self->hdr.name,
+                                                    entry->checks+entry->nchecks,
+                                                    MAX_CHECKS-1-entry->nchecks);
+  memcpy(checks, entry->checks, entry->nchecks * sizeof(*checks));
+  return entry->nchecks;
+}
+
+static void
+statsd_handle_single_message(statsd_receiver_t *r,
+                             noit_check_t *parent,
+                             struct iovec *payload,
+                             addr_t *addr) {
+  noit_check_t *checks[MAX_CHECKS];
+  int nchecks = 0;
+
+  mtev_memory_begin();
+
+  nchecks = statsd_lookup_checks(r, addr, checks);
+  mtevL(nldeb, "statsd(%zu bytes) -> %d checks%s\n", payload->iov_len,
+        (int)nchecks, parent ? " + a parent" : "");
   if(parent) checks[nchecks++] = parent;
   if(nchecks) {
-    statsd_handle_payload(checks, nchecks, payload->iov_base, payload->iov_len);
-    for (size_t i = 0; i < nchecks; i++) {
-      noit_check_deref(checks[i]);
-    }
+    statsd_handle_payload(checks, nchecks, r->shard, payload->iov_base, payload->iov_len);
   }
 
   mtev_memory_end();
@@ -350,8 +650,8 @@ statsd_handle_single_message(noit_module_t *const self,
 static int
 statsd_handler(eventer_t e, int mask, void *closure,
                struct timeval *now) {
-  noit_module_t *self = (noit_module_t *)closure;
-  statsd_mod_config_t *const conf = noit_module_get_userdata(self);
+  statsd_receiver_t *r = (statsd_receiver_t *)closure;
+  statsd_mod_config_t *const conf = noit_module_get_userdata(r->self);
   noit_check_t *parent = NULL;
 
   if(conf->primary_active) parent = noit_poller_lookup(conf->primary);
@@ -359,22 +659,22 @@ statsd_handler(eventer_t e, int mask, void *closure,
   for(int packets_per_cycle = MAX(conf->packets_per_cycle, 1); packets_per_cycle > 0; packets_per_cycle--) {
     const int fd = eventer_get_fd(e);
 
-    if (conf->use_recvmmsg) {
+    if (r->use_recvmmsg) {
 #if defined __linux__
-      struct mmsghdr msgs[conf->payload_len];
+      struct mmsghdr msgs[r->payload_len];
       int nmmsgs;
 
       memset(msgs, 0, sizeof(msgs));
 
-      for (size_t i = 0; i < conf->payload_len; i++) {
-        conf->payload[i].iov_len = RECV_BUFFER_CAPACITY - 1;
-        msgs[i].msg_hdr.msg_iov = &conf->payload[i];
+      for (size_t i = 0; i < r->payload_len; i++) {
+        r->payload[i].iov_len = RECV_BUFFER_CAPACITY - 1;
+        msgs[i].msg_hdr.msg_iov = &r->payload[i];
         msgs[i].msg_hdr.msg_iovlen = 1;
-        msgs[i].msg_hdr.msg_name = &conf->addr[i];
+        msgs[i].msg_hdr.msg_name = &r->addr[i];
         msgs[i].msg_hdr.msg_namelen = sizeof(addr_t);
       }
 
-      nmmsgs = recvmmsg(fd, msgs, conf->payload_len, 0, NULL);
+      nmmsgs = recvmmsg(fd, msgs, r->payload_len, 0, NULL);
 
       if (nmmsgs == -1) {
         if (errno != EAGAIN) {
@@ -385,21 +685,21 @@ statsd_handler(eventer_t e, int mask, void *closure,
       }
 
       for (size_t i = 0; i < nmmsgs; i++) {
-        ((char*)conf->payload[i].iov_base)[msgs[i].msg_len] = 0;
-        conf->payload[i].iov_len = msgs[i].msg_len;
-        statsd_handle_single_message(self, parent, &conf->payload[i], &conf->addr[i]);
-        Pstat++;
+        ((char*)r->payload[i].iov_base)[msgs[i].msg_len] = 0;
+        r->payload[i].iov_len = msgs[i].msg_len;
+        statsd_handle_single_message(r, parent, &r->payload[i], &r->addr[i]);
       }
+      ck_pr_add_64(&Pstat, nmmsgs);
 #else
-      conf->use_recvmmsg = false;
+      r->use_recvmmsg = false;
 #endif
     }
 
-    if (!conf->use_recvmmsg) {
+    if (!r->use_recvmmsg) {
       socklen_t addrlen = sizeof(addr_t);
       ssize_t len;
-      len = recvfrom(fd, conf->payload[0].iov_base, conf->payload[0].iov_len-1, 0,
-                      (struct sockaddr *)&conf->addr[0], &addrlen);
+      len = recvfrom(fd, r->payload[0].iov_base, r->payload[0].iov_len-1, 0,
+                      (struct sockaddr *)&r->addr[0], &addrlen);
 
       if(len < 0) {
         if(errno != EAGAIN)
@@ -407,12 +707,13 @@ statsd_handler(eventer_t e, int mask, void *closure,
         break;
       }
 
-      ((char*)conf->payload[0].iov_base)[len] = 0;
-      conf->payload[0].iov_len = len;
-      statsd_handle_single_message(self, parent, &conf->payload[0], &conf->addr[0]);
-      Pstat++;
+      ((char*)r->payload[0].iov_base)[len] = 0;
+      r->payload[0].iov_len = len;
+      statsd_handle_single_message(r, parent, &r->payload[0], &r->addr[0]);
+      ck_pr_inc_64(&Pstat);
     }
   }
+  if(parent) noit_check_deref(parent);
   return EVENTER_READ | EVENTER_EXCEPTION;
 }
 
@@ -422,9 +723,7 @@ static int noit_statsd_initiate_check(noit_module_t *self,
   check->flags |= NP_PASSIVE_COLLECTION;
   if (check->flags & NP_TRANSIENT) return 0;
   if (check->closure == NULL) {
-    statsd_closure_t *ccl;
-    ccl = check->closure = (void *)calloc(1, sizeof(statsd_closure_t));
-    ccl->self = self;
+    check->closure = statsd_closure_alloc(self);
   }
   INITIATE_CHECK(statsd_submit, self, check, cause);
   return 0;
@@ -454,24 +753,154 @@ static int noit_statsd_onload(mtev_image_t *self) {
 }
 
 static void report(void) {
-  size_t last = 0, Plast = 0;
+  uint64_t last = 0, Plast = 0;
   while(1) {
     eventer_aco_sleep(&(struct timeval){ 1UL, 0UL });
-    size_t current = Cstat + Mstat + Gstat;
-    mtevL(nlperf, "STATSD: C=%zu, M=%zu, G=%zu, (%zu/s) packets: %zu (%zu/s)\n",
-          Cstat, Mstat, Gstat, current - last, Pstat, Pstat - Plast);
+    uint64_t C = ck_pr_load_64(&Cstat), M = ck_pr_load_64(&Mstat),
+             G = ck_pr_load_64(&Gstat), P = ck_pr_load_64(&Pstat);
+    uint64_t current = C + M + G;
+    mtevL(nlperf, "STATSD: C=%" PRIu64 ", M=%" PRIu64 ", G=%" PRIu64 ", (%" PRIu64 "/s) "
+          "packets: %" PRIu64 " (%" PRIu64 "/s)\n",
+          C, M, G, current - last, P, P - Plast);
     last = current;
-    Plast = Pstat;
+    Plast = P;
+  }
+}
+
+static statsd_receiver_t *
+statsd_receiver_alloc(noit_module_t *self, int fd, size_t payload_len, bool use_recvmmsg) {
+  statsd_receiver_t *r = calloc(1, sizeof(*r));
+  r->self = self;
+  r->fd = fd;
+  r->use_recvmmsg = use_recvmmsg;
+  r->payload_len = payload_len;
+  r->payload = calloc(r->payload_len, sizeof(struct iovec));
+  r->addr = calloc(r->payload_len, sizeof(addr_t));
+  mtev_hash_init(&r->ip_cache);
+
+  for (size_t i = 0; i < r->payload_len; i++) {
+    r->payload[i].iov_len = RECV_BUFFER_CAPACITY;
+    r->payload[i].iov_base = malloc(RECV_BUFFER_CAPACITY);
+    if(!r->payload[i].iov_base) {
+      for (size_t j = 0; j < i; j++) {
+        free(r->payload[j].iov_base);
+      }
+
+      free(r->payload);
+      free(r->addr);
+      mtev_hash_destroy(&r->ip_cache, NULL, NULL);
+      free(r);
+      mtevL(noit_error, "statsd malloc() failed\n");
+      return NULL;
+    }
+  }
+  return r;
+}
+
+/* Opens a bound, non-blocking UDP socket.  With require_reuseport the
+ * socket is only returned if SO_REUSEPORT could be set, as further sockets
+ * on the same port depend on it. */
+static int
+statsd_socket(int family, unsigned short port, socklen_t desired_rcvbuf,
+              bool require_reuseport) {
+  const char *fam = (family == AF_INET) ? "IPv4" : "IPv6";
+  int fd = socket(family, NE_SOCK_CLOEXEC|SOCK_DGRAM, IPPROTO_UDP);
+  if(fd < 0) {
+    mtevL(noit_error, "statsd: %s socket failed: %s\n", fam, strerror(errno));
+    return -1;
+  }
+  if(eventer_set_fd_nonblocking(fd)) {
+    mtevL(noit_error, "statsd: could not set %s socket non-blocking: %s\n",
+          fam, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  socklen_t reuse = 1;
+  if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(reuse)) != 0) {
+    mtevL(nlerr, "statsd listener(%s) failed(%s) to set REUSEADDR (doing our best)\n", fam, strerror(errno));
+  }
+  bool reuseport = false;
+#ifdef SO_REUSEPORT
+  reuse = 1;
+  if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(reuse)) != 0) {
+    mtevL(nlerr, "statsd listener(%s) failed(%s) to set REUSEPORT (doing our best)\n", fam, strerror(errno));
+  }
+  else reuseport = true;
+#endif
+  if(require_reuseport && !reuseport) {
+    close(fd);
+    return -1;
+  }
+  if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &desired_rcvbuf, sizeof(desired_rcvbuf)) < 0) {
+    mtevL(nlerr, "statsd listener(%s) failed(%s) to set recieve buffer\n", fam, strerror(errno));
+  }
+
+  int rv;
+  if(family == AF_INET) {
+    struct sockaddr_in skaddr;
+    memset(&skaddr, 0, sizeof(skaddr));
+    skaddr.sin_family = AF_INET;
+    skaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    skaddr.sin_port = htons(port);
+    rv = bind(fd, (struct sockaddr *)&skaddr, sizeof(skaddr));
+  }
+  else {
+    struct sockaddr_in6 skaddr6;
+    memset(&skaddr6, 0, sizeof(skaddr6));
+    skaddr6.sin6_family = AF_INET6;
+    skaddr6.sin6_addr = in6addr_any;
+    skaddr6.sin6_port = htons(port);
+    rv = bind(fd, (struct sockaddr *)&skaddr6, sizeof(skaddr6));
+  }
+  if(rv < 0) {
+    mtevL(noit_error, "bind(%s) failed[%d]: %s\n", fam, port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Opens up to nreceivers sockets for the family, each drained by its own
+ * eventer thread, and returns how many were opened. */
+static int
+statsd_add_receivers(noit_module_t *self, int family, int nreceivers,
+                     socklen_t desired_rcvbuf, size_t payload_len, bool use_recvmmsg) {
+  statsd_mod_config_t *conf = noit_module_get_userdata(self);
+  eventer_pool_t *dp = noit_check_choose_pool_by_module(self->hdr.name);
+  int nthreads = dp ? eventer_pool_concurrency(dp) : eventer_loop_concurrency();
+  int start = mtev_rand() % MAX(nthreads, 1);
+  int opened = 0;
+
+  for(int i=0; i<nreceivers; i++) {
+    int fd = statsd_socket(family, conf->port, desired_rcvbuf, nreceivers > 1);
+    if(fd < 0) break;
+    statsd_receiver_t *r = statsd_receiver_alloc(self, fd, payload_len, use_recvmmsg);
+    if(!r) {
+      close(fd);
+      break;
+    }
+    r->shard = conf->aggregate ? conf->nreceivers % AGG_SHARDS : -1;
+    conf->receivers = realloc(conf->receivers, (conf->nreceivers + 1) * sizeof(*conf->receivers));
+    conf->receivers[conf->nreceivers++] = r;
+
+    eventer_t newe = eventer_alloc_fd(statsd_handler, r, fd,
+                                      EVENTER_READ | EVENTER_EXCEPTION);
+    /* consecutive receivers land on consecutive threads */
+    int owner = (start + i) % MAX(nthreads, 1) + nthreads;
+    if(dp) eventer_set_owner(newe, eventer_choose_owner_pool(dp, owner));
+    else if(nreceivers > 1) eventer_set_owner(newe, eventer_choose_owner(owner));
+    eventer_add(newe);
+    opened++;
   }
+  return opened;
 }
 
 static int noit_statsd_init(noit_module_t *self) {
   unsigned short port = 8125;
   int packets_per_cycle = 1000;
+  int nreceivers = 1;
   size_t recv_buffer_len = 20;
   bool use_recvmmsg = true;
-  struct sockaddr_in skaddr;
-  int sockaddr_len;
   const char *config_val;
   statsd_mod_config_t *conf;
   eventer_aco_start(report, NULL);
@@ -506,138 +935,46 @@ static int noit_statsd_init(noit_module_t *self) {
   }
   conf->packets_per_cycle = packets_per_cycle;
 
+  conf->aggregate = true;
+  if(mtev_hash_retr_str(conf->options, "aggregate",
+                        strlen("aggregate"),
+                        (const char **)&config_val)) {
+    conf->aggregate = strcasecmp(config_val, "false") && strcasecmp(config_val, "off");
+  }
+
   if(mtev_hash_retr_str(conf->options, "use_recvmmsg",
                         strlen("use_recvmmsg"),
                         (const char **)&config_val)) {
     use_recvmmsg = atoi(config_val);
   }
-  conf->use_recvmmsg = use_recvmmsg;
   if(mtev_hash_retr_str(conf->options, "recv_buffer_len",
                         strlen("recv_buffer_len"),
                         (const char **)&config_val)) {
     recv_buffer_len = atoll(config_val);
   }
-
-  conf->payload_len = use_recvmmsg ? recv_buffer_len : 1;
-  conf->payload = calloc(conf->payload_len, sizeof(struct iovec));
-  conf->addr = calloc(conf->payload_len, sizeof(addr_t));
-
-  for (size_t i = 0; i < conf->payload_len; i++) {
-    conf->payload[i].iov_len = RECV_BUFFER_CAPACITY;
-    conf->payload[i].iov_base = malloc(RECV_BUFFER_CAPACITY);
-    if(!conf->payload[i].iov_base) {
-      for (size_t j = 0; j < i; j++) {
-        free(conf->payload[j].iov_base);
-      }
-
-      free(conf->payload);
-      free(conf->addr);
-      mtevL(noit_error, "statsd malloc() failed\n");
-      return -1;
-    }
-  }
-
-  conf->ipv4_fd = socket(PF_INET, NE_SOCK_CLOEXEC|SOCK_DGRAM, IPPROTO_UDP);
-  if(conf->ipv4_fd < 0) {
-    mtevL(noit_error, "statsd: socket failed: %s\n", strerror(errno));
-    return -1;
-  }
-  else {
-    if(eventer_set_fd_nonblocking(conf->ipv4_fd)) {
-      close(conf->ipv4_fd);
-      conf->ipv4_fd = -1;
-      mtevL(noit_error,
-            "collectd: could not set socket non-blocking: %s\n",
-            strerror(errno));
-      return -1;
-    }
-  }
-  socklen_t reuse = 1;
-  if(setsockopt(conf->ipv4_fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(reuse)) != 0) {
-    mtevL(nlerr, "statsd listener(IPv4) failed(%s) to set REUSEADDR (doing our best)\n", strerror(errno));
-  }
-#ifdef SO_REUSEPORT
-  reuse = 1;
-  if(setsockopt(conf->ipv4_fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(reuse)) != 0) {
-    mtevL(nlerr, "statsd listener(IPv4) failed(%s) to set REUSEPORT (doing our best)\n", strerror(errno));
-  }
-#endif
-  if(setsockopt(conf->ipv4_fd, SOL_SOCKET, SO_RCVBUF, &desired_rcvbuf, sizeof(desired_rcvbuf)) < 0) {
-    mtevL(nlerr, "statsd listener(IPv4) failed(%s) to set recieve buffer\n", strerror(errno));
-  }
-  memset(&skaddr, 0, sizeof(skaddr));
-  skaddr.sin_family = AF_INET;
-  skaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  skaddr.sin_port = htons(conf->port);
-  sockaddr_len = sizeof(skaddr);
-  if(bind(conf->ipv4_fd, (struct sockaddr *)&skaddr, sockaddr_len) < 0) {
-    mtevL(noit_error, "bind failed[%d]: %s\n", conf->port, strerror(errno));
-    close(conf->ipv4_fd);
-    return -1;
-  }
-
-  if(conf->ipv4_fd >= 0) {
-    eventer_t newe;
-    newe = eventer_alloc_fd(statsd_handler, self, conf->ipv4_fd,
-                            EVENTER_READ | EVENTER_EXCEPTION);
-    eventer_pool_t *dp = noit_check_choose_pool_by_module(self->hdr.name);
-    if(dp) eventer_set_owner(newe, eventer_choose_owner_pool(dp, mtev_rand()));
-    eventer_add(newe);
-  }
-
-  conf->ipv6_fd = socket(AF_INET6, NE_SOCK_CLOEXEC|SOCK_DGRAM, IPPROTO_UDP);
-  if(conf->ipv6_fd < 0) {
-    mtevL(noit_error, "statsd: IPv6 socket failed: %s\n",
-          strerror(errno));
+  if(mtev_hash_retr_str(conf->options, "receivers",
+                        strlen("receivers"),
+                        (const char **)&config_val)) {
+    nreceivers = MAX(atoi(config_val), 1);
   }
-  else {
-    if(eventer_set_fd_nonblocking(conf->ipv6_fd)) {
-      close(conf->ipv6_fd);
-      conf->ipv6_fd = -1;
-      mtevL(noit_error,
-            "statsd: could not set socket non-blocking: %s\n",
-            strerror(errno));
-    }
-    else {
-      struct sockaddr_in6 skaddr6;
-      struct in6_addr in6addr_any;
-      sockaddr_len = sizeof(skaddr6);
-      memset(&skaddr6, 0, sizeof(skaddr6));
-      skaddr6.sin6_family = AF_INET6;
-      memset(&in6addr_any, 0, sizeof(in6addr_any));
-      skaddr6.sin6_addr = in6addr_any;
-      skaddr6.sin6_port = htons(conf->port);
 
-      socklen_t reuse = 1;
-      if(setsockopt(conf->ipv6_fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(reuse)) != 0) {
-        mtevL(nlerr, "statsd listener(IPv6) failed(%s) to set REUSEADDR (doing our best)\n", strerror(errno));
-      }
-#ifdef SO_REUSEPORT
-      reuse = 1;
-      if(setsockopt(conf->ipv6_fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(reuse)) != 0) {
-        mtevL(nlerr, "statsd listener(IPv6) failed(%s) to set REUSEPORT (doing our best)\n", strerror(errno));
-      }
-#endif
-      if(setsockopt(conf->ipv6_fd, SOL_SOCKET, SO_RCVBUF, &desired_rcvbuf, sizeof(desired_rcvbuf)) < 0) {
-        mtevL(nlerr, "statsd listener(IPv6) failed(%s) to set recieve buffer\n", strerror(errno));
-      }
-      if(bind(conf->ipv6_fd, (struct sockaddr *)&skaddr6, sockaddr_len) < 0) {
-        mtevL(noit_error, "bind(IPv6) failed[%d]: %s\n",
-              conf->port, strerror(errno));
-        close(conf->ipv6_fd);
-        conf->ipv6_fd = -1;
-      }
-    }
+  size_t payload_len = use_recvmmsg ? recv_buffer_len : 1;
+  int nipv4 = statsd_add_receivers(self, AF_INET, nreceivers, desired_rcvbuf,
+                                   payload_len, use_recvmmsg);
+  if(nipv4 == 0 && nreceivers > 1) {
+    mtevL(noit_error, "statsd: cannot open %d receivers on port %d, using one\n",
+          nreceivers, conf->port);
+    nreceivers = 1;
+    nipv4 = statsd_add_receivers(self, AF_INET, 1, desired_rcvbuf,
+                                 payload_len, use_recvmmsg);
   }
-
-  if(conf->ipv6_fd >= 0) {
-    eventer_t newe;
-    newe = eventer_alloc_fd(statsd_handler, self, conf->ipv6_fd,
-                            EVENTER_READ | EVENTER_EXCEPTION);
-    eventer_pool_t *dp = noit_check_choose_pool_by_module(self->hdr.name);
-    if(dp) eventer_set_owner(newe, eventer_choose_owner_pool(dp, mtev_rand()));
-    eventer_add(newe);
+  if(nipv4 == 0) return -1;
+  if(nipv4 < nreceivers) {
+    mtevL(noit_error, "statsd: only %d of %d IPv4 receivers opened on port %d\n",
+          nipv4, nreceivers, conf->port);
   }
+  statsd_add_receivers(self, AF_INET6, nipv4, desired_rcvbuf,
+                       payload_len, use_recvmmsg);
 
   noit_module_set_userdata(self, conf);
   return 0;
@@ -656,11 +993,11 @@ noit_module_t statsd = {
   noit_statsd_config,
   noit_statsd_init,
   noit_statsd_initiate_check,
-  NULL
+  statsd_cleanup
 };
 
 static int statsd_tcp_handle_payload(noit_check_t *check, char *payload, size_t len) {
-  statsd_handle_payload(&check, 1, payload, len);
+  statsd_handle_payload(&check, 1, -1, payload, len);
   return 0;
 }
 static int statsd_tcp_handler(eventer_t e, int m, void *c, struct timeval *t) {
@@ -38,23 +38,122 @@
 #include <string.h>
 #include <mtev_defines.h>
 #include <mtev_log.h>
+#include <mtev_perftimer.h>
 #include "noit_check_log_helpers.h"
 
 static void usage(const char *prog) {
-  fprintf(stderr, "%s [-p]\n", prog);
-  fprintf(stderr, "This tool takes B{1,2} records from stdin and emits S/M records to stdout\n");
+  fprintf(stderr, "%s [-p | -c]\n", prog);
+  fprintf(stderr, "This tool takes B{1,2,3,F} records from stdin and emits S/M records to stdout\n");
   fprintf(stderr, "\n	-p	pass thru records that are not parseable\n");
+  fprintf(stderr, "	-c	instead, recompress each bundle every way and report ratio and cost\n");
 }
 static mtev_boolean passthru = mtev_false;
+static mtev_boolean compare = mtev_false;
 char buff[1024*1024*16];
+
+#define COMPARE_ROUNDS 10
+static struct {
+  const char *name;
+  noit_compression_type_t ctype;
+  uint64_t encoded;
+  uint64_t compress_ns;
+  uint64_t decompress_ns;
+} compare_types[] = {
+  { "none", NOIT_COMPRESS_NONE },
+  { "zlib", NOIT_COMPRESS_ZLIB },
+  { "lz4",  NOIT_COMPRESS_LZ4 },
+};
+static uint64_t compare_bundles = 0, compare_raw = 0;
+
+static void
+compare_record(const char *line, int len) {
+  noit_compression_type_t ctype;
+  const char *payload, *size_str;
+  char *raw, *out;
+  unsigned int raw_len, out_len;
+  size_t i;
+  int r;
+
+  if(len < 3 || line[0] != 'B' || line[2] != '\t') return;
+  switch(line[1]) {
+    case '1': ctype = NOIT_COMPRESS_ZLIB; break;
+    case '2': ctype = NOIT_COMPRESS_NONE; break;
+    case '3': case 'F': ctype = NOIT_COMPRESS_LZ4; break;
+    default: return;
+  }
+  /* Every bundle format ends in ... \t raw length \t base64 payload */
+  while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\t')) len--;
+  for(payload = line + len; payload > line && payload[-1] != '\t'; payload--);
+  for(size_str = payload - 1; size_str > line && size_str[-1] != '\t'; size_str--);
+  if(size_str <= line) return;
+  raw_len = strtoul(size_str, NULL, 10);
+  if(raw_len == 0) return;
+  raw = malloc(raw_len);
+  if(noit_check_log_bundle_decompress_b64(ctype, payload, line + len - payload,
+                                          raw, &raw_len) != 0) {
+    free(raw);
+    return;
+  }
+  compare_bundles++;
+  compare_raw += raw_len;
+  for(i=0; i<sizeof(compare_types)/sizeof(*compare_types); i++) {
+    char *back = malloc(raw_len);
+    unsigned int back_len = raw_len;
+    mtev_perftimer_t start;
+    mtev_perftimer_start(&start);
+    for(r=0; r<COMPARE_ROUNDS; r++) {
+      if(noit_check_log_bundle_compress_b64(compare_types[i].ctype, raw, raw_len,
+                                            &out, &out_len) != 0) break;
+      if(r < COMPARE_ROUNDS - 1) free(out);
+    }
+    compare_types[i].compress_ns += mtev_perftimer_elapsed(&start) / COMPARE_ROUNDS;
+    if(r < COMPARE_ROUNDS) {
+      free(back);
+      continue;
+    }
+    compare_types[i].encoded += out_len;
+    mtev_perftimer_start(&start);
+    for(r=0; r<COMPARE_ROUNDS; r++) {
+      back_len = raw_len;
+      noit_check_log_bundle_decompress_b64(compare_types[i].ctype, out, out_len,
+                                           back, &back_len);
+    }
+    compare_types[i].decompress_ns += mtev_perftimer_elapsed(&start) / COMPARE_ROUNDS;
+    free(back);
+    free(out);
+  }
+  free(raw);
+}
+
+static void
+compare_report(void) {
+  size_t i;
+  printf("%llu bundles, %llu raw bytes\n",
+         (unsigned long long)compare_bundles, (unsigned long long)compare_raw);
+  if(compare_bundles == 0) return;
+  printf("%-6s %14s %8s %14s %14s\n", "type", "b64 bytes", "ratio", "comp ns/bndl", "decomp ns/bndl");
+  for(i=0; i<sizeof(compare_types)/sizeof(*compare_types); i++) {
+    printf("%-6s %14llu %7.2f%% %14llu %14llu\n", compare_types[i].name,
+           (unsigned long long)compare_types[i].encoded,
+           100.0 * (double)compare_types[i].encoded / (double)compare_raw,
+           (unsigned long long)(compare_types[i].compress_ns / compare_bundles),
+           (unsigned long long)(compare_types[i].decompress_ns / compare_bundles));
+  }
+}
+
 int main(int argc, char **argv) {
   mtev_log_init(0);
   if(argc == 2 && !strcmp(argv[1], "-p")) passthru = mtev_true;
+  else if(argc == 2 && !strcmp(argv[1], "-c")) compare = mtev_true;
   else if(argc > 1) {
     usage(argv[0]);
     return 2;
   }
   while(fgets(buff, sizeof(buff), stdin) != NULL) {
+    if(compare) {
+      compare_record(buff, strlen(buff));
+      continue;
+    }
     char **lines = NULL;
     int i;
     char *dp = buff, *sp = buff;
@@ -78,4 +177,6 @@ int main(int argc, char **argv) {
     if(passthru && nm == 0) printf("%s", buff);
     free(lines);
   }
+  if(compare) compare_report();
+  return 0;
 }
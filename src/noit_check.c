@@ -184,9 +184,82 @@ noit_check_build_tag_extended_name(char *tgt, size_t tgtlen, const char *name, c
   return mtev_true;
 }
 
-#define stats_inprogress(c) ((stats_t **)(c->statistics))[STATS_INPROGRESS]
-#define stats_current(c) ((stats_t **)(c->statistics))[STATS_CURRENT]
-#define stats_previous(c) ((stats_t **)(c->statistics))[STATS_PREVIOUS]
+typedef union {
+  double n;
+  int32_t i;
+  uint32_t I;
+  int64_t l;
+  uint64_t L;
+} metric_num_t;
+
+/* Metrics recorded into a stats_t live in slots owned by its storage.  A
+ * storage outlives the stats_t it backs: once a retired stats_t is past its
+ * SMR grace period, its storage goes back to the check's pool and backs the
+ * next in-progress stats_t.  Slots are indexed by name across those uses so
+ * a steady set of metrics reuses the same names and value buffers period
+ * after period.  A slot is handed out at most once per use (epoch); setting
+ * a name twice in one period takes an unindexed extra slot so that metrics
+ * already visible to readers are never written.
+ */
+typedef struct stats_slot {
+  metric_t m;
+  uint64_t epoch;
+  size_t name_cap;
+  size_t str_cap;
+  char *str;
+  metric_num_t num;
+  struct stats_slot *next;
+} stats_slot_t;
+
+typedef struct stats_storage {
+  pthread_mutex_t lock;
+  uint64_t epoch;
+  mtev_hash_table live;  /* name -> metric_t, this period's metrics */
+  mtev_hash_table slots; /* name -> indexed stats_slot_t, kept across uses */
+  stats_slot_t *extras;  /* unindexed slots handed out this epoch */
+  stats_slot_t *spare;   /* unindexed slots free for reuse, at most as many
+                          * as the last period used */
+  struct stats_storage *next;
+} stats_storage_t;
+
+/* Indexed slots beyond twice the last period's metrics (plus this) that went
+ * unused in the last period are freed when their storage is reused. */
+#define STATS_SLOT_SLACK 1024
+#define STATS_POOL_SIZE 3
+
+typedef struct {
+  uint32_t refcnt;
+  mtev_boolean closed;
+  pthread_mutex_t lock;
+  int nfree;
+  stats_storage_t *free;
+} stats_pool_t;
+
+/* What a check contributes to the projected load of its start slot and of
+ * the eventer thread it runs on, under load-aware scheduling. */
+typedef struct check_thread_loads check_thread_loads_t;
+typedef struct {
+  double cost_us;             /* EWMA of the measured cost of a run */
+  int slot;                   /* -1 when not charged to a slot */
+  int64_t slot_charge;
+  check_thread_loads_t *threads;
+  int thread_idx;             /* -1 until placed on a thread */
+  int64_t thread_charge;
+} check_placement_t;
+
+typedef struct {
+  stats_t *stats[3];
+  stats_pool_t *pool;
+  check_placement_t placement;
+} check_stats_set_t;
+
+static size_t noit_metric_sizes(metric_type_t type, const void *value);
+static metric_type_t noit_metric_guess_type_num(const char *s, metric_num_t *num);
+
+#define stats_inprogress(c) ((check_stats_set_t *)(c->statistics))->stats[STATS_INPROGRESS]
+#define stats_current(c) ((check_stats_set_t *)(c->statistics))->stats[STATS_CURRENT]
+#define stats_previous(c) ((check_stats_set_t *)(c->statistics))->stats[STATS_PREVIOUS]
+#define stats_pool(c) ((check_stats_set_t *)(c->statistics))->pool
 
 stats_t *
 noit_check_get_stats_inprogress(noit_check_t *c) {
@@ -224,7 +297,8 @@ struct stats_t {
   int8_t available;
   int8_t state;
   uint32_t duration;
-  mtev_hash_table name_to_metric;
+  stats_storage_t *storage;
+  stats_pool_t *pool;
   char status[256];
 };
 
@@ -255,7 +329,7 @@ noit_check_stats_status(stats_t *s, const char *n) {
 }
 mtev_hash_table *
 noit_check_stats_metrics(stats_t *s) {
-  return &s->name_to_metric;
+  return &s->storage->live;
 }
 void
 noit_stats_set_whence(noit_check_t *c, struct timeval *t) {
@@ -282,31 +356,289 @@ noit_stats_set_available(noit_check_t *c, int8_t t) {
   mtevAssert(mtev_memory_in_cs());
   (void)noit_check_stats_available(noit_check_get_stats_inprogress(c), &t);
 }
+
+static void
+stats_slot_clear_value(stats_slot_t *slot) {
+  metric_t *m = &slot->m;
+  /* Someone may have swapped in their own value allocation */
+  if(m->metric_value.vp && m->metric_value.vp != (void *)&slot->num &&
+     m->metric_value.vp != (void *)slot->str) {
+    free(m->metric_value.vp);
+  }
+  m->metric_value.vp = NULL;
+  free(m->expanded_metric_name);
+  m->expanded_metric_name = NULL;
+  m->accumulator = 0;
+  memset(&m->whence, 0, sizeof(m->whence));
+  m->logged = mtev_false;
+}
+static void
+stats_slot_free(stats_slot_t *slot) {
+  stats_slot_clear_value(slot);
+  free(slot->m.metric_name);
+  free(slot->str);
+  free(slot);
+}
+static void
+stats_slot_list_free(stats_slot_t *slot) {
+  while(slot) {
+    stats_slot_t *next = slot->next;
+    stats_slot_free(slot);
+    slot = next;
+  }
+}
+static stats_storage_t *
+stats_storage_alloc(void) {
+  stats_storage_t *st = calloc(1, sizeof(*st));
+  pthread_mutex_init(&st->lock, NULL);
+  mtev_hash_init_mtev_memory(&st->live, MTEV_HASH_DEFAULT_SIZE, MTEV_HASH_LOCK_MODE_MUTEX);
+  mtev_hash_init(&st->slots);
+  return st;
+}
+static void
+stats_storage_free(stats_storage_t *st) {
+  mtev_hash_destroy(&st->live, NULL, NULL);
+  mtev_hash_destroy(&st->slots, NULL, (NoitHashFreeFunc)stats_slot_free);
+  stats_slot_list_free(st->extras);
+  stats_slot_list_free(st->spare);
+  pthread_mutex_destroy(&st->lock);
+  free(st);
+}
+/* Called on storage that no reader can see; readies it for a new period. */
+static void
+stats_storage_reset(stats_storage_t *st) {
+  uint64_t last_epoch = st->epoch++;
+  size_t last_live = mtev_hash_size(&st->live);
+  size_t last_extras = 0;
+  stats_slot_t **spare;
+  mtev_hash_delete_all(&st->live, NULL, NULL);
+  while(st->extras) {
+    stats_slot_t *slot = st->extras;
+    st->extras = slot->next;
+    stats_slot_clear_value(slot);
+    slot->next = st->spare;
+    st->spare = slot;
+    last_extras++;
+  }
+  /* Keep only as many spares as the last period used; free the rest. */
+  for(spare = &st->spare; *spare && last_extras; spare = &(*spare)->next)
+    last_extras--;
+  stats_slot_list_free(*spare);
+  *spare = NULL;
+  if(mtev_hash_size(&st->slots) > 2 * last_live + STATS_SLOT_SLACK) {
+    mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+    stats_slot_t *stale = NULL;
+    while(mtev_hash_adv(&st->slots, &iter)) {
+      stats_slot_t *slot = iter.value.ptr;
+      if(slot->epoch == last_epoch) continue;
+      slot->next = stale;
+      stale = slot;
+    }
+    while(stale) {
+      stats_slot_t *slot = stale;
+      stale = slot->next;
+      mtev_hash_delete(&st->slots, slot->m.metric_name, strlen(slot->m.metric_name), NULL, NULL);
+      stats_slot_free(slot);
+    }
+  }
+}
+
+static stats_pool_t *
+stats_pool_alloc(void) {
+  stats_pool_t *pool = calloc(1, sizeof(*pool));
+  pool->refcnt = 1;
+  pthread_mutex_init(&pool->lock, NULL);
+  return pool;
+}
+static void
+stats_pool_deref(stats_pool_t *pool) {
+  bool zero;
+  ck_pr_dec_32_zero(&pool->refcnt, &zero);
+  if(!zero) return;
+  while(pool->free) {
+    stats_storage_t *st = pool->free;
+    pool->free = st->next;
+    stats_storage_free(st);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+static void
+stats_pool_put(stats_pool_t *pool, stats_storage_t *st) {
+  pthread_mutex_lock(&pool->lock);
+  if(!pool->closed && pool->nfree < STATS_POOL_SIZE) {
+    st->next = pool->free;
+    pool->free = st;
+    pool->nfree++;
+    st = NULL;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  if(st) stats_storage_free(st);
+}
+static stats_storage_t *
+stats_pool_get(stats_pool_t *pool) {
+  stats_storage_t *st;
+  pthread_mutex_lock(&pool->lock);
+  st = pool->free;
+  if(st) {
+    pool->free = st->next;
+    pool->nfree--;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  if(st) stats_storage_reset(st);
+  else st = stats_storage_alloc();
+  return st;
+}
+/* The check is going away: stop pooling and drop its reference */
+static void
+stats_pool_close(stats_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->closed = mtev_true;
+  stats_storage_t *st = pool->free;
+  pool->free = NULL;
+  pool->nfree = 0;
+  pthread_mutex_unlock(&pool->lock);
+  while(st) {
+    stats_storage_t *next = st->next;
+    stats_storage_free(st);
+    st = next;
+  }
+  stats_pool_deref(pool);
+}
+
 static void
 noit_check_safe_free_stats(void *vs) {
   stats_t *s = vs;
-  mtev_hash_destroy(&s->name_to_metric, NULL, mtev_memory_safe_free);
+  stats_pool_put(s->pool, s->storage);
+  stats_pool_deref(s->pool);
 }
 static stats_t *
-noit_check_stats_alloc() {
+noit_check_stats_alloc(stats_pool_t *pool) {
   stats_t *n;
   mtevAssert(mtev_memory_in_cs());
   n = mtev_memory_safe_malloc_cleanup(sizeof(*n), noit_check_safe_free_stats);
   memset(n, 0, sizeof(*n));
-  mtev_hash_init_mtev_memory(&n->name_to_metric, MTEV_HASH_DEFAULT_SIZE, MTEV_HASH_LOCK_MODE_MUTEX);
+  ck_pr_inc_32(&pool->refcnt);
+  n->pool = pool;
+  n->storage = stats_pool_get(pool);
   return n;
 }
 static void *
 noit_check_stats_set_calloc() {
   int i;
-  stats_t **s;
-  s = calloc(sizeof(stats_t *), 3);
-  for(i=0;i<3;i++) s[i] = noit_check_stats_alloc();
+  check_stats_set_t *s;
+  s = calloc(1, sizeof(*s));
+  s->pool = stats_pool_alloc();
+  for(i=0;i<3;i++) s->stats[i] = noit_check_stats_alloc(s->pool);
+  s->placement.slot = -1;
+  s->placement.thread_idx = -1;
   return s;
 }
 
+/* Hands out a slot for name in s, not yet visible in s's metrics. */
+static stats_slot_t *
+stats_slot_claim(stats_t *s, const char *name) {
+  stats_storage_t *st = s->storage;
+  stats_slot_t *slot;
+  void *vslot;
+  size_t name_len = strlen(name);
+  mtev_boolean indexed = mtev_false;
+
+  pthread_mutex_lock(&st->lock);
+  if(mtev_hash_retrieve(&st->slots, name, name_len, &vslot)) {
+    slot = vslot;
+    if(slot->epoch != st->epoch) {
+      slot->epoch = st->epoch;
+      pthread_mutex_unlock(&st->lock);
+      stats_slot_clear_value(slot);
+      return slot;
+    }
+  }
+  else indexed = mtev_true;
+
+  slot = st->spare;
+  if(slot) st->spare = slot->next;
+  else slot = calloc(1, sizeof(*slot));
+  slot->next = NULL;
+  slot->epoch = st->epoch;
+  if(slot->name_cap < name_len + 1) {
+    free(slot->m.metric_name);
+    slot->name_cap = name_len + 1;
+    slot->m.metric_name = malloc(slot->name_cap);
+  }
+  memcpy(slot->m.metric_name, name, name_len + 1);
+  if(indexed) {
+    mtev_hash_store(&st->slots, slot->m.metric_name, name_len, slot);
+  }
+  else {
+    slot->next = st->extras;
+    st->extras = slot;
+  }
+  pthread_mutex_unlock(&st->lock);
+  stats_slot_clear_value(slot);
+  return slot;
+}
+static int
+stats_slot_set_value(stats_slot_t *slot, metric_type_t type, const void *value) {
+  metric_t *m = &slot->m;
+  mtev_boolean guessed = mtev_false;
+  if(type == METRIC_GUESS) {
+    type = noit_metric_guess_type_num((const char *)value, &slot->num);
+    guessed = (type != METRIC_STRING);
+  }
+  if(type == METRIC_GUESS) return -1;
+
+  m->metric_type = type;
+  if(guessed) m->metric_value.vp = &slot->num;
+  else if(value) {
+    size_t len = noit_metric_sizes(type, value);
+    if(type == METRIC_STRING) {
+      if(slot->str_cap < len) {
+        free(slot->str);
+        slot->str_cap = len;
+        slot->str = malloc(slot->str_cap);
+      }
+      memcpy(slot->str, value, len);
+      slot->str[len-1] = 0;
+      m->metric_value.vp = slot->str;
+    }
+    else {
+      memcpy(&slot->num, value, len);
+      m->metric_value.vp = &slot->num;
+    }
+  }
+  else m->metric_value.vp = NULL;
+  return 0;
+}
+static void
+stats_slot_publish(stats_t *s, stats_slot_t *slot) {
+  mtevAssert(mtev_memory_in_cs());
+  mtev_hash_replace(&s->storage->live, slot->m.metric_name, strlen(slot->m.metric_name),
+                    &slot->m, NULL, NULL);
+}
+/* Records a copy of m in s */
+static void
+stats_copy_metric(stats_t *s, const metric_t *m) {
+  stats_slot_t *slot = stats_slot_claim(s, m->metric_name);
+  if(m->metric_value.vp && m->metric_type == METRIC_STRING) {
+    (void)stats_slot_set_value(slot, METRIC_STRING, m->metric_value.s);
+  }
+  else {
+    slot->m.metric_type = m->metric_type;
+    if(m->metric_value.vp && IS_METRIC_TYPE_NUMERIC(m->metric_type)) {
+      memcpy(&slot->num, m->metric_value.vp, noit_metric_sizes(m->metric_type, m->metric_value.vp));
+      slot->m.metric_value.vp = &slot->num;
+    }
+  }
+  slot->m.accumulator = m->accumulator;
+  slot->m.whence = m->whence;
+  slot->m.logged = m->logged;
+  if(m->expanded_metric_name) slot->m.expanded_metric_name = strdup(m->expanded_metric_name);
+  stats_slot_publish(s, slot);
+}
+
 /* 20 ms slots over 60 second for distribution */
-#define SCHEDULE_GRANULARITY 20
+#define SCHEDULE_GRANULARITY NOIT_CHECK_SCHEDULE_GRANULARITY
 #define SLOTS_PER_SECOND (1000/SCHEDULE_GRANULARITY)
 #define MAX_MODULE_REGISTRATIONS 64
 
@@ -331,10 +663,33 @@ static mtev_skiplist *watchlist;
 static pthread_mutex_t watchlist_lock = PTHREAD_MUTEX_INITIALIZER;
 static mtev_skiplist *polls_by_name;
 static uint32_t __config_load_generation = 0;
+/* bumped whenever polls_by_name changes, see noit_poller_generation */
+static uint64_t polls_generation = 0;
 static unsigned short check_slots_count[60000 / SCHEDULE_GRANULARITY] = { 0 },
                       check_slots_seconds_count[60] = { 0 };
 static mtev_boolean priority_scheduling = mtev_false;
 static int priority_dead_zone_seconds = 3;
+
+/* Load-aware scheduling weighs each check by an EWMA of what its runs cost:
+ * the time they take plus an allowance per metric produced.  Slots are then
+ * balanced by the projected cost of the checks starting in them (in
+ * microseconds per run) and eventer threads by the projected cost of the
+ * checks they run (in microseconds per minute). */
+#define CHECK_COST_ALPHA 0.3
+#define CHECK_COST_DEFAULT_US 1000.0
+struct check_thread_loads {
+  eventer_pool_t *pool;
+  int nthreads;
+  int64_t *load;
+};
+static mtev_boolean load_aware_scheduling = mtev_false;
+static uint32_t check_metric_cost_us = 10;
+static pthread_mutex_t check_load_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t check_slots_load[60000 / SCHEDULE_GRANULARITY] = { 0 },
+               check_slots_seconds_load[60] = { 0 };
+static mtev_hash_table check_module_costs;
+static mtev_hash_table check_thread_loads;
+static void check_placement_release(check_placement_t *p);
 static noit_lmdb_instance_t *lmdb_instance = NULL;
 
 static void
@@ -403,6 +758,12 @@ noit_check_safe_release(void *p) {
   mtev_memory_safe_free(stats_inprogress(checker));
   mtev_memory_safe_free(stats_current(checker));
   mtev_memory_safe_free(stats_previous(checker));
+  stats_pool_close(stats_pool(checker));
+  if(load_aware_scheduling) {
+    pthread_mutex_lock(&check_load_lock);
+    check_placement_release(check_placement(checker));
+    pthread_mutex_unlock(&check_load_lock);
+  }
 
   free(checker->statistics);
 
@@ -458,6 +819,29 @@ noit_console_show_timing_slots(mtev_console_closure_t ncct,
   }
   return 0;
 }
+static void
+noit_console_show_thread_load(void *closure, const char *pool, int thread, int64_t load) {
+  mtev_console_closure_t ncct = closure;
+  nc_printf(ncct, "  %s/%d: %.3f ms/min\n", pool, thread, (double)load / 1000.0);
+}
+static int
+noit_console_show_timing_load(mtev_console_closure_t ncct,
+                              int argc, char **argv,
+                              mtev_console_state_t *dstate,
+                              void *closure) {
+  uint32_t counts[60];
+  int64_t loads[60];
+  if(!load_aware_scheduling) {
+    nc_printf(ncct, "load-aware scheduling is not enabled\n");
+    return 0;
+  }
+  noit_check_slots_projection(counts, loads);
+  for(int i=0;i<60;i++)
+    nc_printf(ncct, "[%02d] %04u checks, %.3f ms/run\n", i, counts[i], (double)loads[i] / 1000.0);
+  nc_printf(ncct, "threads:\n");
+  noit_check_thread_loads_foreach(noit_console_show_thread_load, ncct);
+  return 0;
+}
 static int
 noit_check_add_to_list(noit_check_t *new_check, const char *newname, const char *newip) {
   int rv = 1;
@@ -510,10 +894,16 @@ noit_check_add_to_list(noit_check_t *new_check, const char *newname, const char
       strlcpy(new_check->target_ip, newip, sizeof(new_check->target_ip));
     }
   }
+  ck_pr_inc_64(&polls_generation);
   pthread_mutex_unlock(&polls_lock);
   return rv;
 }
 
+uint64_t
+noit_poller_generation(void) {
+  return ck_pr_load_64(&polls_generation);
+}
+
 noit_lmdb_instance_t *noit_check_get_lmdb_instance() {
   return lmdb_instance;
 }
@@ -532,10 +922,16 @@ static void register_console_check_commands();
 static int check_recycle_bin_processor(eventer_t, int, void *,
                                        struct timeval *);
 
+/* Under load-aware scheduling slots are weighed by projected cost rather
+ * than by the number of checks starting in them. */
+#define SECOND_WEIGHT(i) (load_aware_scheduling ? check_slots_seconds_load[i] \
+                                                : (int64_t)check_slots_seconds_count[i])
+#define SLOT_WEIGHT(j) (load_aware_scheduling ? check_slots_load[j] \
+                                              : (int64_t)check_slots_count[j])
 static int
 check_slots_find_smallest(int sec, struct timeval* period, int timeout) {
   int i, j, cyclic, random_offset, jbase = 0, mini = 0, minj = 0;
-  unsigned short min_running_i = 0xffff, min_running_j = 0xffff;
+  int64_t min_running_i = INT64_MAX, min_running_j = INT64_MAX;
   int period_seconds = period->tv_sec;
 
   /* If we're greater than sixty seconds, we should do our
@@ -555,8 +951,8 @@ check_slots_find_smallest(int sec, struct timeval* period, int timeout) {
     int max_seconds = MIN(60-priority_dead_zone_seconds, allowable_time);
     for(i=0;i<max_seconds;i++) {
       int adj_i = (i + sec) % max_seconds;
-      if(check_slots_seconds_count[adj_i] < min_running_i) {
-        min_running_i = check_slots_seconds_count[adj_i];
+      if(SECOND_WEIGHT(adj_i) < min_running_i) {
+        min_running_i = SECOND_WEIGHT(adj_i);
         mini = adj_i;
       }
     }
@@ -565,8 +961,8 @@ check_slots_find_smallest(int sec, struct timeval* period, int timeout) {
     /* Just schedule normally*/
     for(i=0;i<period_seconds;i++) {
       int adj_i = (i + sec) % 60;
-      if(check_slots_seconds_count[adj_i] < min_running_i) {
-        min_running_i = check_slots_seconds_count[adj_i];
+      if(SECOND_WEIGHT(adj_i) < min_running_i) {
+        min_running_i = SECOND_WEIGHT(adj_i);
         mini = adj_i;
       }
     }
@@ -575,8 +971,8 @@ check_slots_find_smallest(int sec, struct timeval* period, int timeout) {
   random_offset = drand48() * SLOTS_PER_SECOND;
   for(cyclic=0;cyclic<SLOTS_PER_SECOND;cyclic++) {
     j = jbase + ((random_offset + cyclic) % SLOTS_PER_SECOND);
-    if(check_slots_count[j] < min_running_j) {
-      min_running_j = check_slots_count[j];
+    if(SLOT_WEIGHT(j) < min_running_j) {
+      min_running_j = SLOT_WEIGHT(j);
       minj = j;
     }
   }
@@ -596,6 +992,163 @@ void check_slots_inc_tv(struct timeval *tv) {
 void check_slots_dec_tv(struct timeval *tv) {
   check_slots_adjust_tv(tv, -1);
 }
+
+#define check_placement(c) (&((check_stats_set_t *)(c)->statistics)->placement)
+
+/* All of the below require check_load_lock */
+static double
+check_module_cost(const char *module) {
+  void *vcost;
+  if(module && mtev_hash_retrieve(&check_module_costs, module, strlen(module), &vcost))
+    return *(double *)vcost;
+  return CHECK_COST_DEFAULT_US;
+}
+static void
+check_module_cost_update(const char *module, double cost) {
+  void *vcost;
+  if(!module) return;
+  if(mtev_hash_retrieve(&check_module_costs, module, strlen(module), &vcost)) {
+    double *ewma = vcost;
+    *ewma = *ewma + CHECK_COST_ALPHA * (cost - *ewma);
+    return;
+  }
+  double *ewma = malloc(sizeof(*ewma));
+  *ewma = cost;
+  char *key = strdup(module);
+  mtev_hash_store(&check_module_costs, key, strlen(key), ewma);
+}
+static void
+check_placement_charge(noit_check_t *check, check_placement_t *p) {
+  if(p->slot >= 0) {
+    int64_t charge = (int64_t)p->cost_us;
+    check_slots_load[p->slot] += charge - p->slot_charge;
+    check_slots_seconds_load[p->slot / SLOTS_PER_SECOND] += charge - p->slot_charge;
+    p->slot_charge = charge;
+  }
+  if(p->thread_idx >= 0) {
+    int64_t charge = check->period ? (int64_t)(p->cost_us * 60000.0 / check->period) : 0;
+    p->threads->load[p->thread_idx] += charge - p->thread_charge;
+    p->thread_charge = charge;
+  }
+}
+static void
+check_placement_release(check_placement_t *p) {
+  if(p->slot >= 0) {
+    check_slots_load[p->slot] -= p->slot_charge;
+    check_slots_seconds_load[p->slot / SLOTS_PER_SECOND] -= p->slot_charge;
+    p->slot = -1;
+    p->slot_charge = 0;
+  }
+  if(p->thread_idx >= 0) {
+    p->threads->load[p->thread_idx] -= p->thread_charge;
+    p->threads = NULL;
+    p->thread_idx = -1;
+    p->thread_charge = 0;
+  }
+}
+static void
+check_placement_place(noit_check_t *check, struct timeval *tv) {
+  check_placement_t *p = check_placement(check);
+  int offset_ms = (tv->tv_sec % 60) * 1000 + (tv->tv_usec / 1000);
+  pthread_mutex_lock(&check_load_lock);
+  if(p->slot >= 0) {
+    check_slots_load[p->slot] -= p->slot_charge;
+    check_slots_seconds_load[p->slot / SLOTS_PER_SECOND] -= p->slot_charge;
+    p->slot_charge = 0;
+  }
+  if(p->cost_us == 0) p->cost_us = check_module_cost(check->module);
+  p->slot = offset_ms / SCHEDULE_GRANULARITY;
+  check_placement_charge(check, p);
+  pthread_mutex_unlock(&check_load_lock);
+}
+static void
+check_placement_measured(noit_check_t *check, stats_t *s) {
+  check_placement_t *p = check_placement(check);
+  double cost = (double)s->duration * 1000.0 +
+                (double)mtev_hash_size(&s->storage->live) * check_metric_cost_us;
+  pthread_mutex_lock(&check_load_lock);
+  if(p->cost_us == 0) p->cost_us = cost;
+  else p->cost_us += CHECK_COST_ALPHA * (cost - p->cost_us);
+  check_module_cost_update(check->module, cost);
+  check_placement_charge(check, p);
+  pthread_mutex_unlock(&check_load_lock);
+}
+
+void
+noit_check_slots_release(noit_check_t *check, struct timeval *tv) {
+  check_slots_dec_tv(tv);
+  if(!load_aware_scheduling || !check->statistics) return;
+  pthread_mutex_lock(&check_load_lock);
+  check_placement_release(check_placement(check));
+  pthread_mutex_unlock(&check_load_lock);
+}
+
+int
+noit_check_balanced_thread_index(noit_check_t *check, eventer_pool_t *pool, int nthreads) {
+  check_placement_t *p;
+  check_thread_loads_t *loads;
+  void *vloads;
+  int i;
+
+  if(!load_aware_scheduling || !check->statistics || nthreads <= 0) return -1;
+  p = check_placement(check);
+  pthread_mutex_lock(&check_load_lock);
+  if(p->thread_idx >= 0 && p->threads->pool == pool && p->thread_idx < p->threads->nthreads) {
+    i = p->thread_idx;
+    pthread_mutex_unlock(&check_load_lock);
+    return i;
+  }
+  if(p->thread_idx >= 0) {
+    p->threads->load[p->thread_idx] -= p->thread_charge;
+    p->thread_charge = 0;
+  }
+  if(mtev_hash_retrieve(&check_thread_loads, (const char *)&pool, sizeof(pool), &vloads)) {
+    loads = vloads;
+  }
+  else {
+    loads = calloc(1, sizeof(*loads));
+    loads->pool = pool;
+    loads->nthreads = nthreads;
+    loads->load = calloc(nthreads, sizeof(*loads->load));
+    mtev_hash_store(&check_thread_loads, (const char *)&loads->pool, sizeof(loads->pool), loads);
+  }
+  p->threads = loads;
+  p->thread_idx = 0;
+  for(i=1; i<MIN(nthreads, loads->nthreads); i++)
+    if(loads->load[i] < loads->load[p->thread_idx]) p->thread_idx = i;
+  if(p->cost_us == 0) p->cost_us = check_module_cost(check->module);
+  check_placement_charge(check, p);
+  i = p->thread_idx;
+  pthread_mutex_unlock(&check_load_lock);
+  return i;
+}
+
+mtev_boolean
+noit_check_load_aware_scheduling(void) {
+  return load_aware_scheduling;
+}
+
+void
+noit_check_slots_projection(uint32_t counts[60], int64_t loads[60]) {
+  pthread_mutex_lock(&check_load_lock);
+  for(int i=0; i<60; i++) {
+    counts[i] = check_slots_seconds_count[i];
+    loads[i] = check_slots_seconds_load[i];
+  }
+  pthread_mutex_unlock(&check_load_lock);
+}
+
+void
+noit_check_thread_loads_foreach(void (*f)(void *, const char *, int, int64_t), void *closure) {
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  pthread_mutex_lock(&check_load_lock);
+  while(mtev_hash_adv(&check_thread_loads, &iter)) {
+    check_thread_loads_t *loads = iter.value.ptr;
+    const char *name = loads->pool ? eventer_pool_name(loads->pool) : "default";
+    for(int i=0; i<loads->nthreads; i++) f(closure, name, i, loads->load[i]);
+  }
+  pthread_mutex_unlock(&check_load_lock);
+}
 static int
 noit_check_generic_safe_string(const char *p) {
   if(!p) return 0;
@@ -724,7 +1277,10 @@ noit_check_fake_last_check(noit_check_t *check,
   }
   
   /* now, we're going to do an even distribution using the slots */
-  if(!(check->flags & NP_TRANSIENT)) check_slots_inc_tv(&lc_copy);
+  if(!(check->flags & NP_TRANSIENT)) {
+    check_slots_inc_tv(&lc_copy);
+    if(load_aware_scheduling && check->statistics) check_placement_place(check, &lc_copy);
+  }
 }
 static void
 noit_poller_process_check_conf(mtev_conf_section_t section) {
@@ -1153,6 +1709,12 @@ noit_poller_init() {
   }
 
   mtev_conf_get_boolean(MTEV_CONF_ROOT, "//checks/@priority_scheduling", &priority_scheduling);
+  mtev_conf_get_boolean(MTEV_CONF_ROOT, "//checks/@load_aware_scheduling", &load_aware_scheduling);
+  mtev_conf_get_uint32(MTEV_CONF_ROOT, "//checks/@metric_cost_us", &check_metric_cost_us);
+  if(load_aware_scheduling) {
+    mtev_hash_init(&check_module_costs);
+    mtev_hash_init(&check_thread_loads);
+  }
   mtev_conf_get_boolean(MTEV_CONF_ROOT, "//checks/@perpetual_metrics", &perpetual_metrics);
 
   /* lmdb_path dictates where an LMDB backing store for checks would live.
@@ -1268,6 +1830,7 @@ noit_check_clone(uuid_t in) {
   new_check->filterset = strdup(new_check->filterset);
   new_check->flags = 0;
   new_check->fire_event = NULL;
+  new_check->fire_schedule = NULL;
   memset(&new_check->last_fire_time, 0, sizeof(new_check->last_fire_time));
   new_check->statistics = noit_check_stats_set_calloc();
   new_check->closure = NULL;
@@ -1670,6 +2233,7 @@ noit_check_update(noit_check_t *new_check,
   new_check->target = strdup(target);
   if(existing == new_check) {
     mtev_skiplist_insert(polls_by_name, existing);
+    ck_pr_inc_64(&polls_generation);
   }
   pthread_mutex_unlock(&polls_lock);
 
@@ -1951,6 +2515,7 @@ noit_poller_deschedule_no_lock(uuid_t in, mtev_boolean log, mtev_boolean readdin
 
   if(checker->config_seq == 0 || readding) {
     mtevAssert(mtev_skiplist_remove(polls_by_name, checker, NULL));
+    ck_pr_inc_64(&polls_generation);
     noit_check_deref(checker);
     mtevAssert(mtev_hash_delete(&polls, (char *)in, UUID_SIZE, NULL, NULL));
     noit_check_deref(checker);
@@ -2422,52 +2987,24 @@ void noit_check_end(noit_check_t *check) {
 }
 void
 noit_check_stats_clear(noit_check_t *check, stats_t *s) {
-  memset(s, 0, sizeof(*s));
+  memset(&s->whence, 0, sizeof(s->whence));
+  s->duration = 0;
+  s->status[0] = '\0';
   s->state = NP_UNKNOWN;
   s->available = NP_UNKNOWN;
 }
 
-static void
-__stats_add_metric(stats_t *newstate, metric_t *m) {
-  mtevAssert(mtev_memory_in_cs());
-  mtev_hash_replace(&newstate->name_to_metric, m->metric_name, strlen(m->metric_name),
-                    m, NULL, mtev_memory_safe_free);
-}
-
-static metric_t *
- noit_metric_dup(metric_t *m)
-{
-  metric_t *d = noit_metric_alloc();
-
-  memcpy(d, m, sizeof(*m));
-
-  if (d->metric_name) {
-    d->metric_name = strdup(d->metric_name);
-  }
-
-  if (d->expanded_metric_name) {
-    d->expanded_metric_name = strdup(d->expanded_metric_name);
-  }
-
-  d->metric_value.vp = m->metric_value.vp;
-  // don't need the value
-  m->metric_value.vp = NULL;
-  return d;
-}
-
 mtev_boolean
 noit_stats_mark_metric_logged(stats_t *newstate, metric_t *m, mtev_boolean create) {
   void *vm;
   mtevAssert(mtev_memory_in_cs());
-  if(mtev_hash_retrieve(&newstate->name_to_metric,
+  if(mtev_hash_retrieve(&newstate->storage->live,
       m->metric_name, strlen(m->metric_name), &vm)) {
     ((metric_t *)vm)->logged = mtev_true;
     return mtev_false;
   } else if(create) {
     m->logged = mtev_true;
-    m = noit_metric_dup(m);
-    mtev_hash_replace(&newstate->name_to_metric, m->metric_name, strlen(m->metric_name),
-                        m, NULL, mtev_memory_safe_free);
+    stats_copy_metric(newstate, m);
     return mtev_true;
   }
   return mtev_false;
@@ -2499,14 +3036,22 @@ noit_metric_sizes(metric_type_t type, const void *value) {
   mtevAssert(type != type);
   return 0;
 }
+/* Like noit_metric_guess_type, but numeric results are written to *num
+ * rather than to a fresh allocation. */
 static metric_type_t
-noit_metric_guess_type(const char *s, void **replacement) {
+noit_metric_guess_type_num(const char *s, metric_num_t *num) {
   char *copy, *cp, *trailer, *rpl;
+  char copy_buf[256];
   int negative = 0;
   metric_type_t type = METRIC_STRING;
 
   if(!s) return METRIC_GUESS;
-  copy = cp = strdup(s);
+  size_t slen = strlen(s);
+  if(slen < sizeof(copy_buf)) {
+    memcpy(copy_buf, s, slen + 1);
+    copy = cp = copy_buf;
+  }
+  else copy = cp = strdup(s);
 
   /* TRIM the string */
   while(*cp && isspace(*cp)) cp++; /* ltrim */
@@ -2585,34 +3130,33 @@ noit_metric_guess_type(const char *s, void **replacement) {
 
  scanint:
    if(negative) {
-     int64_t *v;
-     v = malloc(sizeof(*v));
-     *v = strtoll(rpl, NULL, 10);
-     *replacement = v;
+     num->l = strtoll(rpl, NULL, 10);
      type = METRIC_INT64;
      goto alldone;
    }
    else {
-     uint64_t *v;
-     v = malloc(sizeof(*v));
-     *v = strtoull(rpl, NULL, 10);
-     *replacement = v;
+     num->L = strtoull(rpl, NULL, 10);
      type = METRIC_UINT64;
      goto alldone;
    }
  scandouble:
-   {
-     double *v;
-     v = malloc(sizeof(*v));
-     *v = strtod(rpl, NULL);
-     *replacement = v;
-     type = METRIC_DOUBLE;
-     goto alldone;
-   }
+   num->n = strtod(rpl, NULL);
+   type = METRIC_DOUBLE;
+   goto alldone;
 
  alldone:
  notanumber:
-  free(copy);
+  if(copy != copy_buf) free(copy);
+  return type;
+}
+static metric_type_t
+noit_metric_guess_type(const char *s, void **replacement) {
+  metric_num_t num;
+  metric_type_t type = noit_metric_guess_type_num(s, &num);
+  if(type != METRIC_GUESS && type != METRIC_STRING) {
+    *replacement = malloc(sizeof(num));
+    memcpy(*replacement, &num, sizeof(num));
+  }
   return type;
 }
 
@@ -2664,7 +3208,7 @@ noit_stats_get_metric(noit_check_t *check,
     newstate = stats_inprogress(check);
     pthread_mutex_unlock(&check->statistics_lock);
   }
-  if(mtev_hash_retrieve(&newstate->name_to_metric, name_copy, strlen(name_copy), &v))
+  if(mtev_hash_retrieve(&newstate->storage->live, name_copy, strlen(name_copy), &v))
     return (metric_t *)v;
   return NULL;
 }
@@ -2695,18 +3239,13 @@ noit_stats_set_metric_with_timestamp(noit_check_t *check,
 
   mtevAssert(mtev_memory_in_cs());
 
-  metric_t *m = noit_metric_alloc();
-
-  if(noit_stats_populate_metric_with_tagset(m, tagged_name, type, value)) {
-    mtev_memory_safe_free(m);
-    return;
-  }
-  noit_check_metric_count_add(1);
   c = noit_check_get_stats_inprogress(check);
-  if(check_stats_set_metric_hook_invoke(check, c, m) == MTEV_HOOK_CONTINUE) {
-    __stats_add_metric(c, m);
-  } else {
-    mtev_memory_safe_free(m);
+  /* An unpublished slot is simply left for the next period */
+  stats_slot_t *slot = stats_slot_claim(c, tagged_name);
+  if(stats_slot_set_value(slot, type, value)) return;
+  noit_check_metric_count_add(1);
+  if(check_stats_set_metric_hook_invoke(check, c, &slot->m) == MTEV_HOOK_CONTINUE) {
+    stats_slot_publish(c, slot);
   }
 }
 
@@ -3021,25 +3560,31 @@ noit_check_passive_set_stats(noit_check_t *check) {
     noit_check_deref(wcheck);
   }
 }
+/* Fills tgt with src's status and the union of all's and src's metrics,
+ * src's taking precedence. */
 static void
-stats_merge(stats_t *tgt, stats_t *src) {
+stats_merge(stats_t *tgt, stats_t *all, stats_t *src) {
   mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
   const char *name;
   int namelen;
   void *vm;
 
-  if(!src) return;
-
   memcpy(&tgt->whence, &src->whence, sizeof(struct timeval));
   memcpy(tgt->status, src->status, sizeof(tgt->status));
   tgt->available = src->available;
   tgt->state = src->state;
   tgt->duration = src->duration;
 
-  while(mtev_hash_next(&src->name_to_metric, &iter, &name, &namelen, &vm)) {
-    __stats_add_metric(tgt, (metric_t *)vm);
+  while(mtev_hash_next(&src->storage->live, &iter, &name, &namelen, &vm)) {
+    stats_copy_metric(tgt, (metric_t *)vm);
+  }
+  if(!all) return;
+  memset(&iter, 0, sizeof(iter));
+  while(mtev_hash_next(&all->storage->live, &iter, &name, &namelen, &vm)) {
+    void *unused;
+    if(mtev_hash_retrieve(&tgt->storage->live, name, namelen, &unused)) continue;
+    stats_copy_metric(tgt, (metric_t *)vm);
   }
-  mtev_hash_delete_all(&src->name_to_metric, NULL, NULL);
 }
 void
 noit_check_set_stats(noit_check_t *check) {
@@ -3054,22 +3599,27 @@ noit_check_set_stats(noit_check_t *check) {
   pthread_mutex_lock(&check->statistics_lock);
 
   if(perpetual_metrics) {
-    if(!stats_previous(check)) {
-      stats_previous(check) = noit_check_stats_alloc();
-    }
+    /* Published stats are never written, so the running union is rebuilt
+     * into recycled storage rather than merged in place. */
     stats_t *all = stats_previous(check);
     prev = stats_current(check);
     if(prev) {
-      stats_merge(all,prev);
+      stats_t *merged = noit_check_stats_alloc(stats_pool(check));
+      stats_merge(merged, all, prev);
+      stats_previous(check) = merged;
+      if(all) mtev_memory_safe_free(all);
       mtev_memory_safe_free(prev);
     }
+    else if(!all) {
+      stats_previous(check) = noit_check_stats_alloc(stats_pool(check));
+    }
   }
   else {
     mtev_memory_safe_free(stats_previous(check));
     stats_previous(check) = stats_current(check);
   }
   current = stats_current(check) = stats_inprogress(check);
-  stats_inprogress(check) = noit_check_stats_alloc();
+  stats_inprogress(check) = noit_check_stats_alloc(stats_pool(check));
   
   if(current) {
     for(cp = current->status; cp && *cp; cp++)
@@ -3108,6 +3658,7 @@ noit_check_set_stats(noit_check_t *check) {
     /* Write out the bundled information */
     noit_check_log_bundle(check);
   }
+  if(load_aware_scheduling && current) check_placement_measured(check, current);
   /* count the check as complete */
   check_completion_count++;
   pthread_mutex_unlock(&check->statistics_lock);
@@ -3377,6 +3928,9 @@ register_console_check_commands() {
   mtev_console_state_add_cmd(showcmd->dstate,
     NCSCMD("timing_slots", noit_console_show_timing_slots, NULL, NULL, NULL));
 
+  mtev_console_state_add_cmd(showcmd->dstate,
+    NCSCMD("timing_load", noit_console_show_timing_load, NULL, NULL, NULL));
+
   mtev_console_state_add_cmd(showcmd->dstate,
     NCSCMD("checks", noit_console_show_checks, NULL, NULL, NULL));
 
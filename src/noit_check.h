@@ -142,6 +142,8 @@ typedef struct noit_check {
 
   dep_list_t *causal_checks;
   eventer_t fire_event;
+  struct noit_check_schedule *fire_schedule; /* used instead of fire_event by
+                                                the wheel scheduler */
   struct timeval last_fire_time;
   uint32_t generation;                   /* This can roll, we don't care */
   void *closure;
@@ -164,7 +166,7 @@ API_EXPORT(void) noit_check_end(noit_check_t *);
 API_EXPORT(noit_check_t*) noit_check_ref(noit_check_t *check);
 API_EXPORT(void) noit_check_deref(noit_check_t *check);
 
-#define NOIT_CHECK_LIVE(a) ((a)->fire_event != NULL)
+#define NOIT_CHECK_LIVE(a) ((a)->fire_event != NULL || (a)->fire_schedule != NULL)
 #define NOIT_CHECK_DISABLED(a) ((a)->flags & NP_DISABLED)
 #define NOIT_CHECK_CONFIGURED(a) (((a)->flags & NP_UNCONFIG) == 0)
 #define NOIT_CHECK_RUNNING(a) ((a)->flags & NP_RUNNING)
@@ -251,6 +253,11 @@ API_EXPORT(int)
   noit_poller_lookup_by_ip_module(const char *ip, const char *mod,
                                   noit_check_t **checks, int nchecks);
 
+/* Changes whenever a check is added to, removed from or moved within the
+ * name and target ip indexes, so lookups against them can be cached. */
+API_EXPORT(uint64_t)
+  noit_poller_generation(void);
+
 API_EXPORT(int)
    noit_poller_target_ip_do(const char *target,
                             int (*f)(noit_check_t *, void *),
@@ -456,8 +463,29 @@ API_EXPORT(char *)
                                mtev_console_state_t *dstate,
                                int argc, char **argv, int idx);
 
+/* Checks are spread over slots of this many milliseconds in each minute. */
+#define NOIT_CHECK_SCHEDULE_GRANULARITY 20
+
 API_EXPORT(void) check_slots_inc_tv(struct timeval *tv);
 API_EXPORT(void) check_slots_dec_tv(struct timeval *tv);
+/* Releases a check's slot (and under load-aware scheduling its projected
+ * load) when it stops being scheduled. */
+API_EXPORT(void) noit_check_slots_release(noit_check_t *check, struct timeval *tv);
+
+/* Under load-aware scheduling (//checks/@load_aware_scheduling) this returns
+ * the least loaded of nthreads threads in pool for the check, sticking with
+ * it once chosen; otherwise it returns -1. */
+API_EXPORT(int) noit_check_balanced_thread_index(noit_check_t *check, eventer_pool_t *pool,
+                                                 int nthreads);
+API_EXPORT(mtev_boolean) noit_check_load_aware_scheduling(void);
+/* Per second of the minute: how many checks start and their projected cost
+ * in microseconds per run. */
+API_EXPORT(void) noit_check_slots_projection(uint32_t counts[60], int64_t loads[60]);
+/* Calls f with the projected load, in microseconds per minute, of each
+ * eventer thread checks have been placed on. */
+API_EXPORT(void) noit_check_thread_loads_foreach(void (*f)(void *closure, const char *pool,
+                                                           int thread, int64_t load),
+                                                 void *closure);
 
 API_EXPORT(struct timeval *)
   noit_check_stats_whence(stats_t *s, const struct timeval *n);
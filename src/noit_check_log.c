@@ -36,6 +36,8 @@
 #include <mtev_memory.h>
 #include <mtev_uuid.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <ck_pr.h>
 
 #include "noit_dtrace_probes.h"
 #include "noit_fb.h"
@@ -66,9 +68,9 @@
  *    'M' TIMESTAMP UUID NAME TYPE VALUE
  *  | 'M' BROKER TIMESTAMP UUID NAME TYPE VALUE
  *
- * BUNDLE:
- *    'B#' TIMESTAMP UUID TARGET MODULE NAME strlen(base64(gzipped(payload))) base64(gzipped(payload))
- *  | 'B#' BROKER TIMESTAMP UUID TARGET MODULE NAME strlen(base64(gzipped(payload))) base64(gzipped(payload))
+ * BUNDLE (# is 1 for zlib, 2 for uncompressed, 3 for lz4):
+ *    'B#' TIMESTAMP UUID TARGET MODULE NAME strlen(payload) base64(compressed(payload))
+ *  | 'B#' BROKER TIMESTAMP UUID TARGET MODULE NAME strlen(payload) base64(compressed(payload))
  *
  *
  * UUID:
@@ -98,6 +100,7 @@ static int
   _noit_check_log_bundle_metric(mtev_log_stream_t, Metric *, metric_t *);
 
 #define METRICS_PER_BUNDLE 500
+#define BUNDLE_SERIALIZE_CONCURRENCY 4
 #define SECPART(a) ((unsigned long)(a)->tv_sec)
 #define MSECPART(a) ((unsigned long)((a)->tv_usec / 1000))
 #define MAKE_CHECK_UUID_STR(uuid_str, len, ls, check) do { \
@@ -300,6 +303,24 @@ noit_check_log_bundle_metric_flatbuffer_serialize_log(mtev_log_stream_t ls,
 
 }
 
+/* The "compression" property of a stream picks the B record written:
+ * "off" gives B2 (uncompressed), "lz4" gives B3 (LZ4 frame) and anything
+ * else B1 (zlib). */
+static char
+bundle_format_for_stream(mtev_log_stream_t ls, noit_compression_type_t *comp) {
+  const char *v_comp = mtev_log_stream_get_property(ls, "compression");
+  if(v_comp && !strcmp(v_comp, "off")) {
+    *comp = NOIT_COMPRESS_NONE;
+    return '2';
+  }
+  if(v_comp && !strcmp(v_comp, "lz4")) {
+    *comp = NOIT_COMPRESS_LZ4;
+    return '3';
+  }
+  *comp = NOIT_COMPRESS_ZLIB;
+  return '1';
+}
+
 static int
 noit_check_log_bundle_metric_serialize(mtev_log_stream_t ls,
                                        noit_check_t *check,
@@ -312,8 +333,7 @@ noit_check_log_bundle_metric_serialize(mtev_log_stream_t ls,
   Bundle bundle = BUNDLE__INIT;
   char uuid_str[256*3+37];
   char *buf, *out_buf;
-  mtev_boolean use_compression = mtev_true;
-  const char *v_comp;
+  char format;
   struct timeval whence = *in_whence;
 
   if(!noit_apply_filterset(check->filterset, check, m)) return 0;
@@ -322,8 +342,7 @@ noit_check_log_bundle_metric_serialize(mtev_log_stream_t ls,
   if(m->whence.tv_sec) whence = m->whence;
 
   MAKE_CHECK_UUID_STR(uuid_str, sizeof(uuid_str), ls, check);
-  v_comp = mtev_log_stream_get_property(ls, "compression");
-  if(v_comp && !strcmp(v_comp, "off")) use_compression = mtev_false;
+  format = bundle_format_for_stream(ls, &comp);
 
   bundle.status = NULL;
   bundle.has_period = mtev_false;
@@ -355,11 +374,10 @@ noit_check_log_bundle_metric_serialize(mtev_log_stream_t ls,
   bundle__pack(&bundle, (uint8_t*)buf);
 
   // Compress + B64
-  comp = use_compression ? NOIT_COMPRESS_ZLIB : NOIT_COMPRESS_NONE;
   if(noit_check_log_bundle_compress_b64(comp, buf, size, &out_buf, &out_size) == 0) {
     rv = mtev_log(ls, in_whence, __FILE__, __LINE__,
                  "B%c\t%lu.%03lu\t%s\t%s\t%s\t%s\t%d\t%.*s\n",
-                  use_compression ? '1' : '2',
+                  format,
                   SECPART(&whence), MSECPART(&whence),
                   uuid_str, check->target, check->module, check->name, size,
                   (unsigned int)out_size, out_buf);
@@ -540,9 +558,286 @@ _noit_check_log_bundle_metric(mtev_log_stream_t ls, Metric *metric, metric_t *m)
   return 0;
 }
 
+/* Bundles are emitted through a stream as soon as they fill.  Normally each
+ * is compressed, encoded and logged inline.  When the log stream has the
+ * "parallel_bundles" property set, compression and encoding are handed to the
+ * "bundle_serialize" jobq instead and the results are written back to the
+ * log through a lane shared by every stream for that check and log, so
+ * bundles go out in the order they were produced even when an earlier
+ * serialization is still in flight.  A bundle with nothing ahead of it in
+ * its lane is serialized inline.
+ */
+typedef struct bundle_stream bundle_stream_t;
+
+typedef struct {
+  bundle_stream_t *stream;
+  mtev_boolean failed;
+  int raw_size;
+  int nmetrics;
+  struct timeval time;
+  char *outbuf;
+  unsigned int outsize;
+} bundle_output_t;
+
+typedef struct {
+  mtev_log_stream_t ls;
+  uuid_t checkid;
+} bundle_lane_key_t;
+
+typedef struct {
+  bundle_lane_key_t key;
+  uint32_t refcnt; /* protected by bundle_lanes_lock */
+  noit_bundle_sequencer_t seq;
+} bundle_lane_t;
+
+struct bundle_stream {
+  uint32_t refcnt;
+  mtev_log_stream_t ls;
+  eventer_jobq_t *jobq;
+  bundle_lane_t *lane;
+  struct timeval whence;
+  noit_compression_type_t comp;
+  char format; /* 'F' for BF lines, otherwise the B# version */
+  char *uuid_str;
+  char *target;
+  char *module;
+  char *name;
+  int rv_sum; /* written under the lane's lock once it has one */
+  int rv_err;
+};
+
+typedef struct {
+  uint32_t seq;
+  char *buf;
+  bundle_stream_t *stream; /* referenced; out may be written and freed first */
+  bundle_output_t *out;
+  mtev_boolean done;
+} bundle_job_t;
+
+static eventer_jobq_t *bundle_serialize_jobq = NULL;
+static pthread_mutex_t bundle_serialize_jobq_lock = PTHREAD_MUTEX_INITIALIZER;
+static mtev_hash_table bundle_lanes;
+static pthread_mutex_t bundle_lanes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static eventer_jobq_t *
+bundle_serialize_jobq_get(void) {
+  eventer_jobq_t *jobq = ck_pr_load_ptr(&bundle_serialize_jobq);
+  if(jobq) return jobq;
+  pthread_mutex_lock(&bundle_serialize_jobq_lock);
+  if(!bundle_serialize_jobq) {
+    jobq = eventer_jobq_retrieve("bundle_serialize");
+    if(!jobq) {
+      jobq = eventer_jobq_create("bundle_serialize");
+      if(jobq) eventer_jobq_set_concurrency(jobq, BUNDLE_SERIALIZE_CONCURRENCY);
+    }
+    /* lanes are only used by streams with a jobq */
+    mtev_hash_init(&bundle_lanes);
+    ck_pr_fence_store();
+    ck_pr_store_ptr(&bundle_serialize_jobq, jobq);
+  }
+  jobq = bundle_serialize_jobq;
+  pthread_mutex_unlock(&bundle_serialize_jobq_lock);
+  return jobq;
+}
+
+static void bundle_stream_write(bundle_stream_t *stream, bundle_output_t *out);
+static void bundle_stream_deref(bundle_stream_t *stream);
+
+static void
+bundle_lane_write(void *item, void *unused) {
+  bundle_output_t *out = item;
+  bundle_stream_write(out->stream, out);
+  bundle_stream_deref(out->stream);
+  free(out->outbuf);
+  free(out);
+}
+
+static bundle_lane_t *
+bundle_lane_get(mtev_log_stream_t ls, noit_check_t *check) {
+  bundle_lane_key_t key;
+  void *vlane;
+  bundle_lane_t *lane;
+  memset(&key, 0, sizeof(key));
+  key.ls = ls;
+  mtev_uuid_copy(key.checkid, check->checkid);
+  pthread_mutex_lock(&bundle_lanes_lock);
+  if(mtev_hash_retrieve(&bundle_lanes, (const char *)&key, sizeof(key), &vlane)) {
+    lane = vlane;
+  }
+  else {
+    lane = calloc(1, sizeof(*lane));
+    lane->key = key;
+    noit_bundle_sequencer_init(&lane->seq, bundle_lane_write, NULL);
+    mtev_hash_store(&bundle_lanes, (const char *)&lane->key, sizeof(lane->key), lane);
+  }
+  lane->refcnt++;
+  pthread_mutex_unlock(&bundle_lanes_lock);
+  return lane;
+}
+
+/* Every stream on a lane holds it until its last bundle is written, so a
+ * lane is only removed once nothing is waiting in it. */
+static void
+bundle_lane_release(bundle_lane_t *lane) {
+  pthread_mutex_lock(&bundle_lanes_lock);
+  if(--lane->refcnt == 0) {
+    mtev_hash_delete(&bundle_lanes, (const char *)&lane->key, sizeof(lane->key), NULL, NULL);
+  }
+  else lane = NULL;
+  pthread_mutex_unlock(&bundle_lanes_lock);
+  if(lane) {
+    noit_bundle_sequencer_destroy(&lane->seq);
+    free(lane);
+  }
+}
+
+static bundle_stream_t *
+bundle_stream_alloc(mtev_log_stream_t ls, noit_check_t *check,
+                    const struct timeval *whence, char format,
+                    noit_compression_type_t comp, const char *uuid_str) {
+  bundle_stream_t *stream = calloc(1, sizeof(*stream));
+  stream->refcnt = 1;
+  stream->ls = ls;
+  stream->whence = *whence;
+  stream->format = format;
+  stream->comp = comp;
+  if(uuid_str) stream->uuid_str = strdup(uuid_str);
+  stream->target = strdup(check->target);
+  stream->module = strdup(check->module);
+  stream->name = strdup(check->name);
+  const char *v = mtev_log_stream_get_property(ls, "parallel_bundles");
+  if(v && (!strcmp(v, "on") || !strcmp(v, "true")))
+    stream->jobq = bundle_serialize_jobq_get();
+  if(stream->jobq) stream->lane = bundle_lane_get(ls, check);
+  return stream;
+}
+
+static void
+bundle_stream_deref(bundle_stream_t *stream) {
+  if(!ck_pr_dec_32_is_zero(&stream->refcnt)) return;
+  if(stream->lane) bundle_lane_release(stream->lane);
+  free(stream->uuid_str);
+  free(stream->target);
+  free(stream->module);
+  free(stream->name);
+  free(stream);
+}
+
+static void
+bundle_stream_compress(bundle_stream_t *stream, bundle_output_t *out, const char *buf) {
+  if(noit_check_log_bundle_compress_b64(stream->comp, buf, out->raw_size,
+                                        &out->outbuf, &out->outsize) != 0) {
+    if(stream->format != 'F') mtevL(mtev_error, "bundle compression failed\n");
+    out->failed = mtev_true;
+    out->outbuf = NULL;
+    return;
+  }
+  if(stream->format == 'F')
+    mtevL(mtev_debug, "BF compression batchsize %d: %f%%\n", out->nmetrics,
+          100 * ((double)out->raw_size - (double)out->outsize)/(double)out->raw_size);
+}
+
+static void
+bundle_stream_write(bundle_stream_t *stream, bundle_output_t *out) {
+  int rv;
+  const struct timeval *time_to_use = &out->time;
+  if(out->failed) {
+    stream->rv_err = -1;
+    return;
+  }
+  if(stream->format == 'F') {
+    rv = mtev_log(stream->ls, &stream->whence, __FILE__, __LINE__,
+                  "BF\t%lu.%03lu\t%d\t%.*s\n", SECPART(time_to_use), MSECPART(time_to_use),
+                  out->raw_size, out->outsize, out->outbuf);
+  }
+  else {
+    rv = mtev_log(stream->ls, &stream->whence, __FILE__, __LINE__,
+                  "B%c\t%lu.%03lu\t%s\t%s\t%s\t%s\t%d\t%.*s\n",
+                  stream->format, SECPART(time_to_use), MSECPART(time_to_use),
+                  stream->uuid_str, stream->target, stream->module, stream->name,
+                  out->raw_size, out->outsize, out->outbuf);
+  }
+  if(rv < 0) stream->rv_err = rv;
+  else stream->rv_sum += rv;
+}
+
+static int
+bundle_stream_job(eventer_t e, int mask, void *closure, struct timeval *now) {
+  bundle_job_t *job = (bundle_job_t *)closure;
+  /* Called with WORK, then CLEANUP, then EVENTER_ASYNCH (both bits) back on
+   * the eventer; the job is gone by the last call, so match masks exactly
+   * and only touch it inside them. */
+  if(mask == EVENTER_ASYNCH_WORK) {
+    bundle_stream_t *stream = job->stream;
+    bundle_stream_compress(stream, job->out, job->buf);
+    noit_bundle_sequencer_complete(&stream->lane->seq, job->seq, job->out);
+    job->done = mtev_true;
+  }
+  if(mask == EVENTER_ASYNCH_CLEANUP) {
+    bundle_stream_t *stream = job->stream;
+    if(!job->done) {
+      /* Never ran; fail it so the bundles behind it are not held up. */
+      job->out->failed = mtev_true;
+      noit_bundle_sequencer_complete(&stream->lane->seq, job->seq, job->out);
+    }
+    free(job->buf);
+    bundle_stream_deref(stream);
+    free(job);
+  }
+  return 0;
+}
+
+/* Takes ownership of buf */
+static void
+bundle_stream_emit(bundle_stream_t *stream, char *buf, int size, int nmetrics,
+                   const struct timeval *time_to_use, mtev_boolean last) {
+  if(!stream->jobq) {
+    bundle_output_t out = { .stream = stream, .raw_size = size, .nmetrics = nmetrics,
+                            .time = *time_to_use };
+    bundle_stream_compress(stream, &out, buf);
+    free(buf);
+    bundle_stream_write(stream, &out);
+    free(out.outbuf);
+    return;
+  }
+
+  /* the output holds a stream reference until the lane has written it */
+  mtev_boolean idle;
+  bundle_output_t *out = calloc(1, sizeof(*out));
+  *out = (bundle_output_t) { .stream = stream, .raw_size = size, .nmetrics = nmetrics,
+                             .time = *time_to_use };
+  ck_pr_inc_32(&stream->refcnt);
+  uint32_t seq = noit_bundle_sequencer_reserve(&stream->lane->seq, &idle);
+  if(last && idle) {
+    bundle_stream_compress(stream, out, buf);
+    free(buf);
+    noit_bundle_sequencer_complete(&stream->lane->seq, seq, out);
+    return;
+  }
+
+  /* the job's own reference keeps the lane alive while it completes */
+  ck_pr_inc_32(&stream->refcnt);
+  bundle_job_t *job = calloc(1, sizeof(*job));
+  job->seq = seq;
+  job->buf = buf;
+  job->stream = stream;
+  job->out = out;
+  eventer_add_asynch(stream->jobq, eventer_alloc_asynch(bundle_stream_job, job));
+}
+
+/* Returns what has been written so far; bundles still in flight are
+ * accounted for by the stream alone. */
+static int
+bundle_stream_finish(bundle_stream_t *stream) {
+  if(stream->lane) pthread_mutex_lock(&stream->lane->seq.lock);
+  int rv = stream->rv_err ? stream->rv_err : stream->rv_sum;
+  if(stream->lane) pthread_mutex_unlock(&stream->lane->seq.lock);
+  bundle_stream_deref(stream);
+  return rv;
+}
+
 static int
 noit_check_log_bundle_fb_serialize(mtev_log_stream_t ls, noit_check_t *check, const struct timeval *w, mtev_hash_table *in_metrics) {
-  int rv_sum = 0, rv_err = 0;
   char check_name[256 * 3] = {0};
   int len = sizeof(check_name);
   const char *key;
@@ -581,21 +876,23 @@ noit_check_log_bundle_fb_serialize(mtev_log_stream_t ls, noit_check_t *check, co
   int account_id = account_id_from_name(check_name);
   size_t fb_size;
   int current_in_batch = 0;
-  char *outbuf = NULL;
+  mtev_boolean last = mtev_false;
   void *buffer = NULL;
-  unsigned int outsize;
 
   void *B = NULL;
   uint64_t whence_ms = (SECPART(whence) * 1000) + MSECPART(whence);
+  bundle_stream_t *stream = bundle_stream_alloc(ls, check, whence, 'F', NOIT_COMPRESS_LZ4, NULL);
  
   mtev_memory_begin(); 
 
+  noit_filterset_run_t filter_run;
+  noit_filterset_run_begin(&filter_run, check->filterset, check);
   mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
   while(mtev_hash_next(metrics, &iter, &key, &klen, &vm)) {
     /* If we apply the filter set and it returns false, we don't log */
     metric_t *m = (metric_t *)vm;
     if(!m) continue;
-    if(!noit_apply_filterset(check->filterset, check, m)) continue;
+    if(!noit_filterset_run_apply(&filter_run, m)) continue;
     if(m->logged) continue;
 
     if(m->whence.tv_sec == 0) {
@@ -611,59 +908,59 @@ noit_check_log_bundle_fb_serialize(mtev_log_stream_t ls, noit_check_t *check, co
     if(current_in_batch >= metrics_per_bundle) {
 do_batch:
       buffer = noit_fb_finalize_metricbatch(B, &fb_size);
-      if(noit_check_log_bundle_compress_b64(NOIT_COMPRESS_LZ4, buffer, fb_size, &outbuf, &outsize) != 0) {
-        rv_err = -1;
-      } else {
-        int rv;
-        const struct timeval *time_to_use = whence;
-        /* If whence is unset OR if latest_metric is set and less than whence,
-         * then use the latest whence of metrics seen */
-        if(whence->tv_sec == 0 ||
-           (latest_metric_whence.tv_sec && compare_timeval(latest_metric_whence, *whence) < 0)) {
-          time_to_use = &latest_metric_whence;
-        }
-        mtevL(mtev_debug, "BF compression batchsize %d: %f%%\n", current_in_batch, 100 * ((double)fb_size - (double)outsize)/(double)fb_size);
-        rv = mtev_log(ls, whence, __FILE__, __LINE__,
-                      "BF\t%lu.%03lu\t%d\t%.*s\n", SECPART(time_to_use), MSECPART(time_to_use),
-                      (int)fb_size, (unsigned int)outsize, outbuf);
-        if(rv < 0) rv_err =-1;
-        else rv_sum += rv;
-        free(outbuf);
+      const struct timeval *time_to_use = whence;
+      /* If whence is unset OR if latest_metric is set and less than whence,
+       * then use the latest whence of metrics seen */
+      if(whence->tv_sec == 0 ||
+         (latest_metric_whence.tv_sec && compare_timeval(latest_metric_whence, *whence) < 0)) {
+        time_to_use = &latest_metric_whence;
       }
+      bundle_stream_emit(stream, buffer, (int)fb_size, current_in_batch, time_to_use, last);
       memset(&latest_metric_whence, 0, sizeof(latest_metric_whence));
-      free(buffer);
-      outbuf = NULL;
       buffer = NULL;
       B = NULL;
       current_in_batch = 0;
     }
   }
-  if(current_in_batch) goto do_batch;
+  if(current_in_batch) {
+    last = mtev_true;
+    goto do_batch;
+  }
+  noit_filterset_run_end(&filter_run);
 
   mtev_memory_end(); 
 
-  return rv_err ? rv_err : rv_sum;
+  return bundle_stream_finish(stream);
+}
+
+static void
+noit_check_log_bundle_emit(bundle_stream_t *stream, Bundle *bundle,
+                           const struct timeval *bundle_time, mtev_boolean last) {
+  int size = bundle__get_packed_size(bundle);
+  char *buf = malloc(size);
+  bundle__pack(bundle, (uint8_t*)buf);
+
+  const struct timeval *time_to_use = &stream->whence;
+  if(bundle_time->tv_sec && compare_timeval(*bundle_time, stream->whence) < 0) {
+    time_to_use = bundle_time;
+  }
+  bundle_stream_emit(stream, buf, size, bundle->n_metrics, time_to_use, last);
 }
 
 static int
 noit_check_log_bundle_serialize(mtev_log_stream_t ls, noit_check_t *check, const struct timeval *w, mtev_hash_table *in_metrics) {
-  int rv = 0;
   static char *ip_str = "ip";
   char uuid_str[256*3+37];
   const char *key;
-  int klen, i=0, size, j, n_metrics = 0;
-  unsigned int out_size;
+  int klen, n_bundles = 0;
   stats_t *c;
   void *vm;
   const struct timeval *whence;
-  char *buf, *out_buf;
   mtev_hash_table *metrics;
-  noit_compression_type_t comp;
   MAKE_CHECK_UUID_STR(uuid_str, sizeof(uuid_str), bundle_log, check);
-  mtev_boolean use_compression = mtev_true;
-  const char *v_comp, *v_mpb;
-  v_comp = mtev_log_stream_get_property(ls, "compression");
-  if(v_comp && !strcmp(v_comp, "off")) use_compression = mtev_false;
+  noit_compression_type_t comp;
+  char format = bundle_format_for_stream(ls, &comp);
+  const char *v_mpb;
   v_mpb = mtev_log_stream_get_property(ls, "metrics_per_bundle");
   int metrics_per_bundle = 0;
   if(v_mpb) metrics_per_bundle = atoi(v_mpb);
@@ -678,145 +975,110 @@ noit_check_log_bundle_serialize(mtev_log_stream_t ls, noit_check_t *check, const
     whence = noit_check_stats_whence(c, NULL);
   }
 
-  // Just count
   metrics = in_metrics ? in_metrics : noit_check_stats_metrics(c);
 
+  bundle_stream_t *stream =
+    bundle_stream_alloc(ls, check, whence, format, comp, uuid_str);
+
+  /* One bundle is reused for each batch of metrics_per_bundle metrics;
+   * it is packed and handed off as soon as it fills. */
+  Bundle bundle;
+  Status status;
+  Metadata metadata, *metadatap = &metadata;
+  bundle__init(&bundle);
+  status__init(&status);
+  metadata__init(&metadata);
+
+  // Only the first one gets a status
+  status.available = noit_check_stats_available(c, NULL);
+  status.state = noit_check_stats_state(c, NULL);
+  status.duration = noit_check_stats_duration(c, NULL);
+  status.status = (char *)noit_check_stats_status(c, NULL);
+  bundle.status = &status;
+  bundle.has_period = mtev_true;
+  bundle.period = check->period;
+  bundle.has_timeout = mtev_true;
+  bundle.timeout = check->timeout;
+
+  // Set attributes
+  metadata.key = ip_str;
+  metadata.value = check->target_ip;
+  bundle.n_metadata = 1;
+  bundle.metadata = &metadatap;
+
+  int n_metrics = mtev_hash_size(metrics);
+  int batch_size = MIN(MAX(n_metrics, 1), metrics_per_bundle);
+  Metric *metric_space = calloc(batch_size, sizeof(*metric_space));
+  Metric **metric_ptrs = calloc(batch_size, sizeof(*metric_ptrs));
+  struct timeval bundle_time = { 0, 0 };
+  bundle.metrics = metric_ptrs;
+  bundle.n_metrics = 0;
+
   mtev_memory_begin();
 
-  n_metrics = mtev_hash_size(metrics);
-
-  int n_bundles = ((MAX(n_metrics,1) - 1) / metrics_per_bundle) + 1;
-  Bundle *bundles = malloc(n_bundles * sizeof(*bundles));
-  struct timeval *bundle_times = calloc(n_bundles, sizeof(*bundle_times));
-
-  for(i=0; i<n_bundles; i++) {
-    Bundle *bundle = &bundles[i];
-    bundle__init(bundle);
-    if(i==0) { // Only the first one gets a status
-      bundle->status = malloc(sizeof(Status));
-      status__init(bundle->status);
-      bundle->status->available = noit_check_stats_available(c, NULL);
-      bundle->status->state = noit_check_stats_state(c, NULL);
-      bundle->status->duration = noit_check_stats_duration(c, NULL);
-      bundle->status->status = (char *)noit_check_stats_status(c, NULL);
-      bundle->has_period = mtev_true;
-      bundle->period = check->period;
-      bundle->has_timeout = mtev_true;
-      bundle->timeout = check->timeout;
+  noit_filterset_run_t filter_run;
+  noit_filterset_run_begin(&filter_run, check->filterset, check);
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  while(mtev_hash_next(metrics, &iter, &key, &klen, &vm)) {
+    /* Make sure nobody added a null metric to the hash table...
+     * if they did, just move on */
+    if (!vm) {
+      continue;
     }
 
-    // Set attributes
-    bundle->n_metadata = 1;
-    bundle->metadata = malloc(sizeof(Metadata*));
-    bundle->metadata[0] = malloc(sizeof(Metadata));
-    metadata__init(bundle->metadata[0]);
-    bundle->metadata[0]->key = ip_str;
-    bundle->metadata[0]->value = check->target_ip;
-    bundle->n_metrics = 0;
-    if(n_metrics > 0) {
-      /* All bundles have METRICS_PER_BUNDLE except the last,
-       * which has the remainder of metrics
-       */
-      bundle->metrics = calloc(metrics_per_bundle, sizeof(Metric*));
+    /* If we apply the filter set and it returns false, we don't log */
+    metric_t *m = (metric_t *)vm;
+    if(!noit_filterset_run_apply(&filter_run, m)) {
+      continue;
     }
-  }
-
-  i = 0;
-  if(n_metrics > 0) {
-    // Now convert
-    mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-    while(mtev_hash_next(metrics, &iter, &key, &klen, &vm)) {
-      /* make sure we don't go past our allocation for some reason*/
-      if((i / metrics_per_bundle) >= n_bundles) {
-        break;
-      }
-
-      /* Make sure nobody added a null metric to the hash table...
-       * if they did, just move on */
-      if (!vm) {
-        continue;
-      }
-
-      int b_idx = i / metrics_per_bundle;
-      Bundle *bundle = &bundles[b_idx];
-      int b_i = i % metrics_per_bundle;
-      /* If we apply the filter set and it returns false, we don't log */
-      metric_t *m = (metric_t *)vm;
-      if(!noit_apply_filterset(check->filterset, check, m)) {
-        continue;
-      }
-      if(m->logged) {
-        continue;
-      }
-      if(m->whence.tv_sec == 0)
-        bundle_times[b_idx] = *whence;
-      else if(compare_timeval(m->whence, bundle_times[b_idx]) > 0) {
-        bundle_times[b_idx] = m->whence;
-      }
-      bundle->metrics[b_i] = malloc(sizeof(Metric));
-      metric__init(bundle->metrics[b_i]);
-      _noit_check_log_bundle_metric(ls, bundle->metrics[b_i], m);
-      if(NOIT_CHECK_METRIC_ENABLED()) {
-        char buff[MAX_METRIC_TAGGED_NAME];
-        noit_stats_snprint_metric(buff, sizeof(buff), m);
-        NOIT_CHECK_METRIC(uuid_str, check->module, check->name, check->target,
-                          noit_metric_get_full_metric_name(m), m->metric_type, buff);
-      }
-      i++;
-      bundle->n_metrics = b_i + 1;
+    if(m->logged) {
+      continue;
     }
-  }
-
-  mtev_memory_end();
-
-  int rv_sum = 0;
-  int rv_err = 0;
-  for(i=0; i<n_bundles; i++) {
-    Bundle *bundle = &bundles[i];
-    size = bundle__get_packed_size(bundle);
-    buf = malloc(size);
-    bundle__pack(bundle, (uint8_t*)buf);
-
-    // Compress + B64
-    comp = use_compression ? NOIT_COMPRESS_ZLIB : NOIT_COMPRESS_NONE;
-    if(noit_check_log_bundle_compress_b64(comp, buf, size, &out_buf, &out_size) != 0) {
-      mtevL(mtev_error, "bundle compression failed\n");
-      rv_err = -1;
+    if(m->whence.tv_sec == 0)
+      bundle_time = *whence;
+    else if(compare_timeval(m->whence, bundle_time) > 0) {
+      bundle_time = m->whence;
     }
-    else {
-      /* Uncomment this to debug compression issues
-       * mtevL(mtev_debug, "B%c compression: %f%%\n", use_compression ? '1' : '2',
-       *     100 * ((double)size - (double)out_size)/(double)size);
-       */
-      const struct timeval *time_to_use = whence;
-      if(bundle_times[i].tv_sec && compare_timeval(bundle_times[i], *whence) < 0) {
-        time_to_use = &bundle_times[i];
-      }
-      rv = mtev_log(ls, whence, __FILE__, __LINE__,
-                    "B%c\t%lu.%03lu\t%s\t%s\t%s\t%s\t%d\t%.*s\n",
-                    use_compression ? '1' : '2',
-                    SECPART(time_to_use), MSECPART(time_to_use),
-                    uuid_str, check->target, check->module, check->name, size,
-                    (unsigned int)out_size, out_buf);
-      if(rv < 0) rv_err = rv;
-      else if(rv_sum >= 0) rv_sum += rv;
-      free(out_buf);
+    /* The table may have grown since we sized the batch */
+    if(bundle.n_metrics >= batch_size) {
+      noit_check_log_bundle_emit(stream, &bundle, &bundle_time, mtev_false);
+      n_bundles++;
+      bundle.status = NULL;
+      bundle.has_period = bundle.has_timeout = mtev_false;
+      bundle.n_metrics = 0;
+      memset(&bundle_time, 0, sizeof(bundle_time));
     }
-    free(buf);
-    // Free all the resources
-    for (j=0; j<bundle->n_metrics; j++) {
-      free(bundle->metrics[j]);
+    Metric *metric = &metric_space[bundle.n_metrics];
+    metric__init(metric);
+    _noit_check_log_bundle_metric(ls, metric, m);
+    bundle.metrics[bundle.n_metrics++] = metric;
+    if(NOIT_CHECK_METRIC_ENABLED()) {
+      char buff[MAX_METRIC_TAGGED_NAME];
+      noit_stats_snprint_metric(buff, sizeof(buff), m);
+      NOIT_CHECK_METRIC(uuid_str, check->module, check->name, check->target,
+                        noit_metric_get_full_metric_name(m), m->metric_type, buff);
+    }
+    if(bundle.n_metrics >= metrics_per_bundle) {
+      noit_check_log_bundle_emit(stream, &bundle, &bundle_time, mtev_false);
+      n_bundles++;
+      bundle.status = NULL;
+      bundle.has_period = bundle.has_timeout = mtev_false;
+      bundle.n_metrics = 0;
+      memset(&bundle_time, 0, sizeof(bundle_time));
     }
-    free(bundle->metrics);
-    free(bundle->status);
-    free(bundle->metadata[0]);
-    free(bundle->metadata);
   }
-  free(bundle_times);
-  free(bundles);
-  return rv_err ? rv_err : rv_sum;
-}
+  noit_filterset_run_end(&filter_run);
+
+  /* The status always goes out, even with no metrics */
+  if(bundle.n_metrics || n_bundles == 0)
+    noit_check_log_bundle_emit(stream, &bundle, &bundle_time, mtev_true);
 
+  mtev_memory_end();
+
+  free(metric_ptrs);
+  free(metric_space);
+  return bundle_stream_finish(stream);
+}
 void
 noit_check_log_bundle_metrics(noit_check_t *check, struct timeval *w, mtev_hash_table *in_metrics) {
   mtev_memory_begin();
@@ -47,24 +47,12 @@
 #include "noit_metric.h"
 #include "noit_check_log_helpers.h"
 #include "noit_message_decoder.h"
+#include "noit_protobuf_arena.h"
 
 #include "flatbuffers/metric_reader.h"
 #include "flatbuffers/metric_batch_reader.h"
 #include "flatbuffers/metric_batch_verifier.h"
 
-static void *__c_allocator_alloc(void *d, size_t size) {
-  return malloc(size);
-}
-static void __c_allocator_free(void *d, void *p) {
-  free(p);
-}
-static ProtobufCAllocator __c_allocator = {
-  .alloc = __c_allocator_alloc,
-  .free = __c_allocator_free,
-  .allocator_data = NULL
-};
-#define protobuf_c_system_allocator __c_allocator
-
 #undef noit_ns
 #define noit_ns(x) FLATBUFFERS_WRAP_NAMESPACE(noit, x)
 
@@ -155,19 +143,25 @@ noit_check_log_bundle_decompress_b64(noit_compression_type_t ctype,
       break;
   }
 
+  /* buf_out holds exactly the declared length; a truncated or corrupt
+   * payload that decompresses to anything shorter is rejected */
   size_t size_t_len_out = *len_out;
+  int rv = 0;
   if (0 != mtev_stream_decompress(ctx, (const unsigned char *)compbuff, &dlen, (unsigned char *)buf_out, (size_t *)&size_t_len_out)) {
     mtevL(noit_error, "Failed to decompress b64 encoded chunk\n");
-    if(compbuff) free(compbuff);
-    return -1;
+    rv = -1;
+  }
+  else if (size_t_len_out != *len_out) {
+    mtevL(noit_error, "Decompressed b64 encoded chunk to %zu bytes, expected %u\n",
+          size_t_len_out, *len_out);
+    rv = -1;
   }
-  *len_out = size_t_len_out;
   free(compbuff);
 
   mtev_stream_decompress_finish(ctx);
   mtev_destroy_stream_decompress_ctx(ctx);
 
-  return 0;
+  return rv;
 }
 
 int
@@ -213,6 +207,7 @@ noit_check_log_b12_to_sm(const char *line, int len, char ***out, int noit_ip, no
   switch(line[1]) {
     case '1': ctype = NOIT_COMPRESS_ZLIB; break;
     case '2': ctype = NOIT_COMPRESS_NONE; break;
+    case '3': ctype = NOIT_COMPRESS_LZ4; break;
     default: return 0;
   }
 
@@ -245,7 +240,9 @@ noit_check_log_b12_to_sm(const char *line, int len, char ***out, int noit_ip, no
   rest = cp1;
 
   ulen = strtoul(ulen_str, NULL, 10);
-  raw_protobuf = malloc(ulen);
+  /* both the raw and unpacked bundle come from the arena, reset below */
+  ProtobufCAllocator *arena = noit_protobuf_arena_allocator();
+  raw_protobuf = arena->alloc(arena->allocator_data, ulen);
   if(!raw_protobuf) {
     mtevL(noit_error, "bundle decode: memory exhausted\n");
     goto bad_line;
@@ -258,7 +255,7 @@ noit_check_log_b12_to_sm(const char *line, int len, char ***out, int noit_ip, no
     goto bad_line;
   }
   /* decode the protobuf */
-  bundle = bundle__unpack(&protobuf_c_system_allocator, ulen, raw_protobuf);
+  bundle = bundle__unpack(arena, ulen, raw_protobuf);
   if(!bundle) {
     mtevL(noit_error, "bundle decode: protobuf invalid: %s\n", uuid_str);
     goto bad_line;
@@ -357,8 +354,7 @@ noit_check_log_b12_to_sm(const char *line, int len, char ***out, int noit_ip, no
   }
 
  good_line:
-  if(bundle) bundle__free_unpacked(bundle, &protobuf_c_system_allocator);
-  if(raw_protobuf) free(raw_protobuf);
+  if(raw_protobuf) noit_protobuf_arena_reset();
   free(nipstr);
   free(ulen_str);
   free(name);
@@ -370,22 +366,18 @@ noit_check_log_b12_to_sm(const char *line, int len, char ***out, int noit_ip, no
   return cnt + has_status;
 }
 
-static int 
-noit_check_log_bf_to_sm(const char *line, int len, char ***out, int noit_ip)
+/* Decompresses and verifies the MetricBatch in a BF line.  On success the
+ * batch is returned and *raw_data must be freed by the caller. */
+static noit_ns(MetricBatch_table_t)
+noit_check_log_bf_decode(const char *line, int len, unsigned char **raw_data)
 {
   unsigned int ulen;
-  int size;
   const char *cp1 = NULL, *cp2 = NULL, *rest = NULL, *error_str = NULL;
   char *whence_str = NULL, *ulen_str = NULL;
-  unsigned char *raw_data = NULL;
-  const char *value_str = NULL;
-  size_t value_size;
-  size_t metrics_len = 0;
-  char scratch[64];
 
-  *out = NULL;
-  if(len < 3) return 0;
-  if(line[0] != 'B' || line[1] != 'F' || line[2] != '\t') return 0;
+  *raw_data = NULL;
+  if(len < 3) return NULL;
+  if(line[0] != 'B' || line[1] != 'F' || line[2] != '\t') return NULL;
 
   line += 3; len -= 3;
   cp1 = line;
@@ -404,54 +396,98 @@ noit_check_log_bf_to_sm(const char *line, int len, char ***out, int noit_ip)
   rest = cp1;
 
   ulen = strtoul(ulen_str, NULL, 10);
-  raw_data = malloc(ulen);
-  if(!raw_data) {
+  *raw_data = malloc(ulen);
+  if(!*raw_data) {
     mtevL(noit_error, "bundle decode: memory exhausted\n");
     goto bad_line;
   }
   if(noit_check_log_bundle_decompress_b64(NOIT_COMPRESS_LZ4,
                                           rest, len - (rest - line),
-                                          (char *)raw_data,
+                                          (char *)*raw_data,
                                           &ulen)) {
     mtevL(noit_error, "bundle decode: failed to decompress\n");
-    abort();
     goto bad_line;
   }
 
   /* flatbuffers reader */
-  int fb_ret = noit_ns(MetricBatch_verify_as_root(raw_data, ulen));
+  int fb_ret = noit_ns(MetricBatch_verify_as_root(*raw_data, ulen));
   if(fb_ret != 0) {
     mtevL(mtev_error, "Corrupt metric batch flatbuffer: %s\n", flatcc_verify_error_string(fb_ret));
     goto bad_line;
   }
-  noit_ns(MetricBatch_table_t) message = noit_ns(MetricBatch_as_root(raw_data));
-
+  noit_ns(MetricBatch_table_t) message = noit_ns(MetricBatch_as_root(*raw_data));
   mtevAssert(message != NULL);
 
-  uint64_t timestamp = noit_ns(MetricBatch_timestamp(message));
-  flatbuffers_string_t check_name = noit_ns(MetricBatch_check_name(message));
+  free(ulen_str);
+  free(whence_str);
+  return message;
+
+ bad_line:
+  free(*raw_data);
+  *raw_data = NULL;
+  free(ulen_str);
+  free(whence_str);
+  if(error_str) mtevL(noit_error, "bundle: bad line due to %s\n", error_str);
+  return NULL;
+}
+
+static void
+noit_check_log_bf_check_uuid(noit_ns(MetricBatch_table_t) message, uuid_t check_uuid_raw)
+{
   flatbuffers_uint8_vec_t check_uuid_vec = noit_ns(MetricBatch_check_uuid(message));
-  uuid_t check_uuid_raw;
   if(flatbuffers_uint8_vec_len(check_uuid_vec) != UUID_SIZE) {
     mtev_uuid_clear(check_uuid_raw);
   } else {
     mtev_uuid_copy(check_uuid_raw, check_uuid_vec);
   }
-  char check_uuid[UUID_STR_LEN+1];
-  mtev_uuid_unparse_lower(check_uuid_raw, check_uuid);
+}
 
-  noit_ns(MetricValue_vec_t) metrics = noit_ns(MetricBatch_metrics(message));
-  metrics_len = noit_ns(MetricValue_vec_len(metrics));
+static int
+noit_check_log_bf_total_samples(noit_ns(MetricValue_vec_t) metrics)
+{
   int total_lines = 0;
+  size_t metrics_len = noit_ns(MetricValue_vec_len(metrics));
   for (int i = 0; i < metrics_len; i++) {
     noit_ns(MetricValue_table_t) m = noit_ns(MetricValue_vec_at(metrics, i));
     noit_ns(MetricSample_vec_t) samples = noit_ns(MetricValue_samples(m));
     total_lines += noit_ns(MetricSample_vec_len(samples));
   }
+  return total_lines;
+}
+
+static int 
+noit_check_log_bf_to_sm(const char *line, int len, char ***out, int noit_ip)
+{
+  int size;
+  unsigned char *raw_data = NULL;
+  const char *value_str = NULL;
+  size_t value_size;
+  size_t metrics_len = 0;
+  char scratch[64];
+
+  *out = NULL;
+  noit_ns(MetricBatch_table_t) message = noit_check_log_bf_decode(line, len, &raw_data);
+  if(!message) return 0;
+
+  uint64_t timestamp = noit_ns(MetricBatch_timestamp(message));
+  flatbuffers_string_t check_name = noit_ns(MetricBatch_check_name(message));
+  uuid_t check_uuid_raw;
+  noit_check_log_bf_check_uuid(message, check_uuid_raw);
+  char check_uuid[UUID_STR_LEN+1];
+  mtev_uuid_unparse_lower(check_uuid_raw, check_uuid);
+
+  noit_ns(MetricValue_vec_t) metrics = noit_ns(MetricBatch_metrics(message));
+  metrics_len = noit_ns(MetricValue_vec_len(metrics));
+  int total_lines = noit_check_log_bf_total_samples(metrics);
 
   *out = calloc(sizeof(**out), total_lines);
-  if(!*out) { error_str = "memory exhaustion"; goto bad_line; }
+  if(!*out) {
+    mtevL(noit_error, "bundle: bad line due to memory exhaustion\n");
+    free(raw_data);
+    return 0;
+  }
  
+  int line_no = 0;
   mtev_dyn_buffer_t uuid_str;
   mtev_dyn_buffer_init(&uuid_str); 
   for (int i = 0; i < metrics_len; i++) {
@@ -546,31 +582,123 @@ noit_check_log_bf_to_sm(const char *line, int len, char ***out, int noit_ip)
       size = 2 /* M\t */ + strlen(ts) + 1 /* \t */ +
         mtev_dyn_buffer_used(&uuid_str) + 1 /* \t */ + flatbuffers_string_len(metric_name) +
              3 /* \t<type>\t */ + value_size + 1 /* \0 */;
-      (*out)[i] = malloc(size);
-      snprintf((*out)[i], size, "M\t%s\t%.*s\t%s\t%c\t%s",
+      (*out)[line_no] = malloc(size);
+      snprintf((*out)[line_no], size, "M\t%s\t%.*s\t%s\t%c\t%s",
                ts, (int)mtev_dyn_buffer_used(&uuid_str), mtev_dyn_buffer_data(&uuid_str),
                metric_name, type, value_str);
+      line_no++;
     }
   }
-
-  free(ulen_str);
-  free(whence_str);
+  mtev_dyn_buffer_destroy(&uuid_str);
+  free(raw_data);
 
   return total_lines;
+}
 
- bad_line:
-  if(*out) {
-    /* bad_line is not called during the loop through the values
-     * so there is no need to free (*out)[i] malloc'd for each row
-     */
-    *out = NULL;
+int
+noit_check_log_bf_to_messages(const char *line, int len,
+                              noit_metric_message_arena_t *arena, const noit_noit_t *noit,
+                              noit_metric_message_t ***out)
+{
+  unsigned char *raw_data = NULL;
+  int cnt = 0;
+
+  *out = NULL;
+  noit_ns(MetricBatch_table_t) message = noit_check_log_bf_decode(line, len, &raw_data);
+  if(!message) return 0;
+
+  uint64_t timestamp = noit_ns(MetricBatch_timestamp(message));
+  flatbuffers_string_t check_name = noit_ns(MetricBatch_check_name(message));
+  size_t check_name_len = flatbuffers_string_len(check_name);
+  uuid_t check_uuid;
+  noit_check_log_bf_check_uuid(message, check_uuid);
+
+  noit_ns(MetricValue_vec_t) metrics = noit_ns(MetricBatch_metrics(message));
+  size_t metrics_len = noit_ns(MetricValue_vec_len(metrics));
+  int total = noit_check_log_bf_total_samples(metrics);
+  if(total == 0) {
+    free(raw_data);
+    return 0;
   }
-  free(ulen_str);
-  free(whence_str);
-  if(error_str) mtevL(noit_error, "bundle: bad line due to %s\n", error_str);
 
-  return 0; 
- 
+  *out = calloc(sizeof(**out), total);
+  if(!*out) {
+    mtevL(noit_error, "bundle: bad line due to memory exhaustion\n");
+    free(raw_data);
+    return 0;
+  }
+
+  for (int i = 0; i < metrics_len; i++) {
+    noit_ns(MetricValue_table_t) m = noit_ns(MetricValue_vec_at(metrics, i));
+    flatbuffers_string_t metric_name = noit_ns(MetricValue_name(m));
+    size_t metric_name_len = flatbuffers_string_len(metric_name);
+    noit_ns(MetricSample_vec_t) samples = noit_ns(MetricValue_samples(m));
+    size_t samples_len = noit_ns(MetricSample_vec_len(samples));
+
+    for (int j=0; j < samples_len; j++) {
+      noit_ns(MetricSample_table_t) sample = noit_ns(MetricSample_vec_at(samples, j));
+      noit_metric_value_t value = { .whence_ms = noit_ns(MetricSample_timestamp(sample)) };
+      size_t string_len = 0;
+
+      if(value.whence_ms == 0) value.whence_ms = timestamp;
+      switch(noit_ns(MetricSample_value_type(sample))) {
+        case noit_ns(MetricValueUnion_IntValue):
+          value.type = METRIC_INT32;
+          value.value.v_int32 = noit_ns(IntValue_value(noit_ns(MetricSample_value(sample))));
+          break;
+        case noit_ns(MetricValueUnion_UintValue):
+          value.type = METRIC_UINT32;
+          value.value.v_uint32 = noit_ns(UintValue_value(noit_ns(MetricSample_value(sample))));
+          break;
+        case noit_ns(MetricValueUnion_LongValue):
+          value.type = METRIC_INT64;
+          value.value.v_int64 = noit_ns(LongValue_value(noit_ns(MetricSample_value(sample))));
+          break;
+        case noit_ns(MetricValueUnion_UlongValue):
+          value.type = METRIC_UINT64;
+          value.value.v_uint64 = noit_ns(UlongValue_value(noit_ns(MetricSample_value(sample))));
+          break;
+        case noit_ns(MetricValueUnion_DoubleValue):
+          value.type = METRIC_DOUBLE;
+          value.value.v_double = noit_ns(DoubleValue_value(noit_ns(MetricSample_value(sample))));
+          break;
+        case noit_ns(MetricValueUnion_AbsentNumericValue):
+          value.type = METRIC_DOUBLE;
+          value.is_null = mtev_true;
+          break;
+        case noit_ns(MetricValueUnion_StringValue):
+        {
+          flatbuffers_string_t sv = noit_ns(StringValue_value(noit_ns(MetricSample_value(sample))));
+          value.type = METRIC_STRING;
+          value.value.v_string = (char *)sv;
+          string_len = sv ? flatbuffers_string_len(sv) : 0;
+          break;
+        }
+        case noit_ns(MetricValueUnion_AbsentStringValue):
+          value.type = METRIC_STRING;
+          value.is_null = mtev_true;
+          break;
+        default:
+          continue;
+      }
+
+      int rv = 0;
+      noit_metric_message_t *msg =
+        noit_metric_message_build(arena, check_name, check_name_len, check_uuid,
+                                  metric_name, metric_name_len, &value, string_len,
+                                  noit, &rv);
+      if(!msg) continue;
+      if(rv != 1) {
+        mtevL(noit_error, "bundle: bad metric name '%.*s' (%d)\n",
+              (int)metric_name_len, metric_name, rv);
+        noit_metric_message_deref(msg);
+        continue;
+      }
+      (*out)[cnt++] = msg;
+    }
+  }
+  free(raw_data);
+  return cnt;
 }
 
 int
@@ -583,6 +711,8 @@ noit_check_log_b_to_sm(const char *line, int len, char ***out, int noit_ip)
       return noit_check_log_b12_to_sm(line, len, out, noit_ip, NOIT_COMPRESS_ZLIB);
     case '2':
       return noit_check_log_b12_to_sm(line, len, out, noit_ip, NOIT_COMPRESS_NONE);
+    case '3':
+      return noit_check_log_b12_to_sm(line, len, out, noit_ip, NOIT_COMPRESS_LZ4);
     case 'F':
       return noit_check_log_bf_to_sm(line, len, out, noit_ip);
     default: return 0;
@@ -629,3 +759,62 @@ noit_conf_write_log(void *unused) {
   last_write_gen = mtev_conf_config_gen();
   return 0;
 }
+
+void
+noit_bundle_sequencer_init(noit_bundle_sequencer_t *seq,
+                           void (*write)(void *item, void *closure), void *closure) {
+  memset(seq, 0, sizeof(*seq));
+  pthread_mutex_init(&seq->lock, NULL);
+  seq->write = write;
+  seq->closure = closure;
+}
+
+void
+noit_bundle_sequencer_destroy(noit_bundle_sequencer_t *seq) {
+  mtevAssert(seq->head == seq->next);
+  free(seq->items);
+  free(seq->ready);
+  pthread_mutex_destroy(&seq->lock);
+}
+
+uint32_t
+noit_bundle_sequencer_reserve(noit_bundle_sequencer_t *seq, mtev_boolean *idle) {
+  pthread_mutex_lock(&seq->lock);
+  uint32_t inflight = seq->next - seq->head;
+  if(inflight == seq->nallocd) {
+    /* grow the ring, laying the outstanding entries out from the head */
+    uint32_t nallocd = seq->nallocd ? seq->nallocd * 2 : 8;
+    void **items = calloc(nallocd, sizeof(*items));
+    mtev_boolean *ready = calloc(nallocd, sizeof(*ready));
+    for(uint32_t i = 0; i < inflight; i++) {
+      uint32_t from = (seq->head + i) & (seq->nallocd - 1);
+      uint32_t to = (seq->head + i) & (nallocd - 1);
+      items[to] = seq->items[from];
+      ready[to] = seq->ready[from];
+    }
+    free(seq->items);
+    free(seq->ready);
+    seq->items = items;
+    seq->ready = ready;
+    seq->nallocd = nallocd;
+  }
+  if(idle) *idle = (inflight == 0);
+  uint32_t n = seq->next++;
+  seq->ready[n & (seq->nallocd - 1)] = mtev_false;
+  pthread_mutex_unlock(&seq->lock);
+  return n;
+}
+
+void
+noit_bundle_sequencer_complete(noit_bundle_sequencer_t *seq, uint32_t n, void *item) {
+  pthread_mutex_lock(&seq->lock);
+  seq->items[n & (seq->nallocd - 1)] = item;
+  seq->ready[n & (seq->nallocd - 1)] = mtev_true;
+  while(seq->head != seq->next && seq->ready[seq->head & (seq->nallocd - 1)]) {
+    uint32_t slot = seq->head++ & (seq->nallocd - 1);
+    seq->ready[slot] = mtev_false;
+    seq->write(seq->items[slot], seq->closure);
+    seq->items[slot] = NULL;
+  }
+  pthread_mutex_unlock(&seq->lock);
+}
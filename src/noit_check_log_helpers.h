@@ -34,6 +34,10 @@
 #ifndef _NOIT_CHECK_LOG_HELPERS_H
 #define _NOIT_CHECK_LOG_HELPERS_H
 
+#include <pthread.h>
+#include "noit_metric.h"
+#include "noit_message_decoder.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -61,8 +65,46 @@ noit_check_log_bundle_decompress_b64(noit_compression_type_t ctype,
 int
 noit_check_log_b_to_sm(const char *line, int len, char ***out, int noit_ip);
 
+/* Decodes a BF (flatbuffer) bundle line straight into messages, without
+ * rendering and re-parsing M lines.  Messages are carved from arena if it is
+ * non-NULL, each carries one reference.  *out is allocated and must be freed;
+ * the number of messages in it is returned. */
+int
+noit_check_log_bf_to_messages(const char *line, int len,
+                              noit_metric_message_arena_t *arena, const noit_noit_t *noit,
+                              noit_metric_message_t ***out);
+
 int noit_conf_write_log(void *);
 
+/* Hands completed items to write() in the order their sequence numbers were
+ * reserved, however out of order the work producing them finishes.  write()
+ * is called with the sequencer locked, so it must not call back into it. */
+typedef struct {
+  pthread_mutex_t lock;
+  uint32_t next;    /* next sequence number to reserve */
+  uint32_t head;    /* next sequence number to write */
+  uint32_t nallocd; /* ring size, a power of two */
+  void **items;
+  mtev_boolean *ready;
+  void (*write)(void *item, void *closure);
+  void *closure;
+} noit_bundle_sequencer_t;
+
+void
+noit_bundle_sequencer_init(noit_bundle_sequencer_t *seq,
+                           void (*write)(void *item, void *closure), void *closure);
+
+/* Only valid once every reserved sequence number has been completed. */
+void
+noit_bundle_sequencer_destroy(noit_bundle_sequencer_t *seq);
+
+/* *idle is set if nothing reserved earlier is still waiting to be written */
+uint32_t
+noit_bundle_sequencer_reserve(noit_bundle_sequencer_t *seq, mtev_boolean *idle);
+
+void
+noit_bundle_sequencer_complete(noit_bundle_sequencer_t *seq, uint32_t n, void *item);
+
 #ifdef __cplusplus
 }
 #endif
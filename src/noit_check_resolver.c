@@ -47,6 +47,7 @@
 
 #include <eventer/eventer.h>
 #include <mtev_log.h>
+#include <mtev_memory.h>
 #include <mtev_skiplist.h>
 #include <mtev_hash.h>
 #include <mtev_hooks.h>
@@ -61,11 +62,17 @@
 #define MAX_TTL 3600 /* an hour */
 
 static struct dns_ctx *dns_ctx;
+/* Readers go straight to nc_dns_cache (lock-free, within an mtev_memory
+ * critical section) and see a node's answers through one pointer that
+ * is replaced wholesale.  Writers serialize on nc_dns_cache_lock, which
+ * also guards nc_dns_refresh, the refresh ordering. */
 static pthread_mutex_t nc_dns_cache_lock = PTHREAD_MUTEX_INITIALIZER;
-static mtev_skiplist *nc_dns_cache;
+static mtev_hash_table nc_dns_cache;
+static mtev_skiplist *nc_dns_refresh;
 static eventer_t dns_cache_timeout = NULL;
-static mtev_hash_table etc_hosts_cache;
+static mtev_hash_table *etc_hosts_cache;
 static int dns_search_flag = DNS_NOSRCH;
+static int resolver_initialized = 0;
 
 MTEV_HOOK_IMPL(noit_resolver_cache_store,
                (const char *key, const void *data, int len),
@@ -90,55 +97,100 @@ MTEV_HOOK_IMPL(noit_resolver_cache_load,
   int ip6_cnt; \
   unsigned char dn[DNS_MAXDN]
 
+/* Immutable once published; the addresses follow the struct. */
 typedef struct {
-  dns_cache_SHARED;
+  int ip4_cnt;
+  int ip6_cnt;
+  struct in_addr *ip4;
+  struct in6_addr *ip6;
+} dns_cache_answers_t;
+
+typedef struct {
+  time_t last_needed;
+  time_t last_updated;
+  time_t ttl;
+  unsigned char dn[DNS_MAXDN];
   char *target;
   mtev_boolean lookup_inflight_v4;
   mtev_boolean lookup_inflight_v6;
-  struct in_addr *ip4;
-  struct in6_addr *ip6;
+  mtev_boolean in_refresh;
+  dns_cache_answers_t *answers; /* NULL until first resolved */
 } dns_cache_node;
 
 typedef struct {
   dns_cache_SHARED;
 } dns_cache_serial_t;
 
+static dns_cache_answers_t *
+dns_cache_answers_alloc(int ip4_cnt, const struct in_addr *ip4,
+                        int ip6_cnt, const struct in6_addr *ip6) {
+  dns_cache_answers_t *a;
+  size_t ip4len = ip4_cnt * sizeof(struct in_addr);
+  size_t ip6len = ip6_cnt * sizeof(struct in6_addr);
+  a = mtev_memory_safe_malloc(sizeof(*a) + ip4len + ip6len);
+  a->ip4_cnt = ip4_cnt;
+  a->ip6_cnt = ip6_cnt;
+  a->ip4 = (struct in_addr *)(a + 1);
+  a->ip6 = (struct in6_addr *)((char *)(a + 1) + ip4len);
+  if(ip4len) memcpy(a->ip4, ip4, ip4len);
+  if(ip6len) memcpy(a->ip6, ip6, ip6len);
+  return a;
+}
+
+/* Publish new answers for one family, keeping the other. Lock held. */
+static void
+dns_cache_node_publish(dns_cache_node *n, int rtype, int cnt, const void *addrs) {
+  dns_cache_answers_t *old = n->answers, *a;
+  if(rtype == DNS_T_A)
+    a = dns_cache_answers_alloc(cnt, addrs,
+                                old ? old->ip6_cnt : 0, old ? old->ip6 : NULL);
+  else
+    a = dns_cache_answers_alloc(old ? old->ip4_cnt : 0, old ? old->ip4 : NULL,
+                                cnt, addrs);
+  ck_pr_store_ptr(&n->answers, a);
+  if(old) mtev_memory_safe_free(old);
+}
+
 static int dns_cache_node_serialize(void *b, int blen, dns_cache_node *n) {
   int needed_len, ip4len, ip6len;
-  ip4len = n->ip4_cnt * sizeof(struct in_addr);
-  ip6len = n->ip6_cnt * sizeof(struct in6_addr);
+  dns_cache_serial_t s;
+  dns_cache_answers_t *a = n->answers;
+
+  memset(&s, 0, sizeof(s));
+  s.last_needed = n->last_needed;
+  s.last_updated = n->last_updated;
+  s.ttl = n->ttl;
+  s.ip4_cnt = a ? a->ip4_cnt : 0;
+  s.ip6_cnt = a ? a->ip6_cnt : 0;
+  memcpy(s.dn, n->dn, sizeof(s.dn));
+  ip4len = s.ip4_cnt * sizeof(struct in_addr);
+  ip6len = s.ip6_cnt * sizeof(struct in6_addr);
   needed_len = sizeof(dns_cache_serial_t) + ip4len + ip6len;
 
   if(needed_len > blen) return -1;
-  memcpy(b, n, sizeof(dns_cache_serial_t));
-  memcpy(b + sizeof(dns_cache_serial_t), n->ip4, ip4len);
-  memcpy(b + sizeof(dns_cache_serial_t) + ip4len, n->ip6, ip6len);
+  memcpy(b, &s, sizeof(dns_cache_serial_t));
+  if(ip4len) memcpy(b + sizeof(dns_cache_serial_t), a->ip4, ip4len);
+  if(ip6len) memcpy(b + sizeof(dns_cache_serial_t) + ip4len, a->ip6, ip6len);
   return needed_len;
 }
 
 static int dns_cache_node_deserialize(dns_cache_node *n, void *b, int blen) {
   int ip4len, ip6len;
-  if(n->ip4) free(n->ip4);
-  n->ip4 = NULL;
-  if(n->ip6) free(n->ip6);
-  n->ip6 = NULL;
+  dns_cache_serial_t s;
+  if(n->answers) mtev_memory_safe_free(n->answers);
+  n->answers = NULL;
   if(blen < sizeof(dns_cache_serial_t)) return -1;
-  memcpy(n, b, sizeof(dns_cache_serial_t));
-  ip4len = n->ip4_cnt * sizeof(struct in_addr);
-  ip6len = n->ip6_cnt * sizeof(struct in6_addr);
-  if(blen != (sizeof(dns_cache_serial_t) + ip4len + ip6len)) {
-    n->ip4_cnt = 0;
-    n->ip6_cnt = 0;
-    return -1;
-  }
-  if(ip4len) {
-    n->ip4 = malloc(ip4len);
-    memcpy(n->ip4, b + sizeof(dns_cache_serial_t), ip4len);
-  }
-  if(ip6len) {
-    n->ip6 = malloc(ip6len);
-    memcpy(n->ip6, b + sizeof(dns_cache_serial_t) + ip4len, ip6len);
-  }
+  memcpy(&s, b, sizeof(dns_cache_serial_t));
+  n->last_needed = s.last_needed;
+  n->last_updated = s.last_updated;
+  n->ttl = s.ttl;
+  memcpy(n->dn, s.dn, sizeof(n->dn));
+  if(s.ip4_cnt < 0 || s.ip6_cnt < 0) return -1;
+  ip4len = s.ip4_cnt * sizeof(struct in_addr);
+  ip6len = s.ip6_cnt * sizeof(struct in6_addr);
+  if(blen != (sizeof(dns_cache_serial_t) + ip4len + ip6len)) return -1;
+  n->answers = dns_cache_answers_alloc(s.ip4_cnt, b + sizeof(dns_cache_serial_t),
+                                       s.ip6_cnt, b + sizeof(dns_cache_serial_t) + ip4len);
   return sizeof(dns_cache_serial_t) + ip4len + ip6len;
 }
 
@@ -150,55 +202,98 @@ typedef struct {
   unsigned int has_ip6:1;
 } static_host_node;
 
-void dns_cache_node_free(void *vn) {
+static void static_host_node_free(void *vn) {
+  static_host_node *node = vn;
+  free(node->target);
+  free(node);
+}
+
+static void etc_hosts_cache_free(void *vh) {
+  mtev_hash_destroy((mtev_hash_table *)vh, NULL, static_host_node_free);
+}
+
+static void dns_cache_node_cleanup(void *vn) {
   dns_cache_node *n = vn;
-  if(!n) return;
   if(n->target) free(n->target);
-  if(n->ip4) free(n->ip4);
-  if(n->ip6) free(n->ip6);
-  free(n);
+  if(n->answers) mtev_memory_safe_free(n->answers);
 }
 
-static int name_lookup(const void *av, const void *bv) {
-  const dns_cache_node *a = av;
-  const dns_cache_node *b = bv;
-  return strcmp(a->target, b->target);
+static dns_cache_node *dns_cache_node_alloc(const char *target) {
+  dns_cache_node *n;
+  n = mtev_memory_safe_malloc_cleanup(sizeof(*n), dns_cache_node_cleanup);
+  memset(n, 0, sizeof(*n));
+  if(target) n->target = strdup(target);
+  return n;
 }
-static int name_lookup_k(const void *akv, const void *bv) {
-  const char *ak = akv;
-  const dns_cache_node *b = bv;
-  return strcmp(ak, b->target);
+
+void dns_cache_node_free(void *vn) {
+  if(!vn) return;
+  mtev_memory_safe_free(vn);
 }
-static int refresh_idx(const void *av, const void *bv) {
+
+static int refresh_order(const void *av, const void *bv) {
   const dns_cache_node *a = av;
   const dns_cache_node *b = bv;
   if((a->last_updated + a->ttl) < (b->last_updated + b->ttl)) return -1;
-  return 1;
+  if((a->last_updated + a->ttl) > (b->last_updated + b->ttl)) return 1;
+  if(a < b) return -1;
+  if(a > b) return 1;
+  return 0;
 }
-static int refresh_idx_k(const void *akv, const void *bv) {
-  time_t f = (time_t) akv;
-  const dns_cache_node *b = bv;
-  if(f < (b->last_updated + b->ttl)) return -1;
-  return 1;
+
+/* Changes to last_updated or ttl must happen out of the refresh list. */
+static void dns_cache_refresh_remove(dns_cache_node *n) {
+  if(!n->in_refresh) return;
+  mtev_skiplist_remove(nc_dns_refresh, n, NULL);
+  n->in_refresh = mtev_false;
+}
+static void dns_cache_refresh_insert(dns_cache_node *n) {
+  if(n->in_refresh) return;
+  mtev_skiplist_insert(nc_dns_refresh, n);
+  n->in_refresh = mtev_true;
+}
+
+static void dns_cache_add(dns_cache_node *n) {
+  mtev_hash_store(&nc_dns_cache, n->target, strlen(n->target), n);
+  dns_cache_refresh_insert(n);
+}
+static void dns_cache_delete(dns_cache_node *n) {
+  dns_cache_refresh_remove(n);
+  mtev_hash_delete(&nc_dns_cache, n->target, strlen(n->target), NULL, NULL);
+  dns_cache_node_free(n);
+}
+
+static dns_cache_node *dns_cache_find(const char *target, int len) {
+  void *vn;
+  if(mtev_hash_retrieve(&nc_dns_cache, target, len, &vn)) return vn;
+  return NULL;
 }
 
 static void
 noit_check_resolver_remind_internal(const char *target,
                                     mtev_boolean needs_lock) {
   dns_cache_node *n;
+  int len;
   if(!target) return;
-  if(needs_lock) DCLOCK();
-  n = mtev_skiplist_find(nc_dns_cache, target, NULL);
+  len = strlen(target);
+  mtev_memory_begin();
+  n = dns_cache_find(target, len);
   if(n != NULL) {
     n->last_needed = time(NULL);
-    if(needs_lock) DCUNLOCK();
+    mtev_memory_end();
     return; 
   }
-  n = calloc(1, sizeof(*n));
-  n->target = strdup(target);
-  n->last_needed = time(NULL);
-  mtev_skiplist_insert(nc_dns_cache, n);
+  if(needs_lock) DCLOCK();
+  /* someone may have beaten us to it */
+  n = dns_cache_find(target, len);
+  if(n != NULL) n->last_needed = time(NULL);
+  else {
+    n = dns_cache_node_alloc(target);
+    n->last_needed = time(NULL);
+    dns_cache_add(n);
+  }
   if(needs_lock) DCUNLOCK();
+  mtev_memory_end();
 }
 
 void noit_check_resolver_remind(const char *target) {
@@ -207,9 +302,11 @@ void noit_check_resolver_remind(const char *target) {
 
 int noit_check_resolver_fetch(const char *target, char *buff, int len,
                               uint8_t prefer_family) {
-  int i, rv;
+  int i, rv, target_len;
   uint8_t progression[2];
   dns_cache_node *n;
+  dns_cache_answers_t *a;
+  mtev_hash_table *etc_hosts;
   void *vnode;
 
   noit_check_resolver_init();
@@ -218,20 +315,26 @@ int noit_check_resolver_fetch(const char *target, char *buff, int len,
   if(!target) return -1;
   progression[0] = prefer_family;
   progression[1] = (prefer_family == AF_INET) ? AF_INET6 : AF_INET;
+  target_len = strlen(target);
 
-  if(mtev_hash_retrieve(&etc_hosts_cache, target, strlen(target), &vnode)) {
+  mtev_memory_begin();
+  etc_hosts = ck_pr_load_ptr(&etc_hosts_cache);
+  if(etc_hosts && mtev_hash_size(etc_hosts) > 0 &&
+     mtev_hash_retrieve(etc_hosts, target, target_len, &vnode)) {
     static_host_node *node = vnode;
     for(i=0; i<2; i++) {
       switch(progression[i]) {
         case AF_INET:
           if(node->has_ip4) {
             inet_ntop(AF_INET, &node->ip4, buff, len);
+            mtev_memory_end();
             return 1;
           }
           break;
         case AF_INET6:
           if(node->has_ip6) {
             inet_ntop(AF_INET6, &node->ip6, buff, len);
+            mtev_memory_end();
             return 1;
           }
           break;
@@ -240,22 +343,21 @@ int noit_check_resolver_fetch(const char *target, char *buff, int len,
   }
 
   rv = -1;
-  DCLOCK();
-  n = mtev_skiplist_find(nc_dns_cache, target, NULL);
-  if(n != NULL) {
-    if(n->last_updated == 0) goto leave; /* not resolved yet */
-    rv = n->ip4_cnt + n->ip6_cnt;
+  n = dns_cache_find(target, target_len);
+  a = n ? ck_pr_load_ptr(&n->answers) : NULL;
+  if(a != NULL) {
+    rv = a->ip4_cnt + a->ip6_cnt;
     for(i=0; i<2; i++) {
       switch(progression[i]) {
         case AF_INET:
-          if(n->ip4_cnt > 0) {
-            inet_ntop(AF_INET, &n->ip4[0], buff, len);
+          if(a->ip4_cnt > 0) {
+            inet_ntop(AF_INET, &a->ip4[0], buff, len);
             goto leave;
           }
           break;
         case AF_INET6:
-          if(n->ip6_cnt > 0) {
-            inet_ntop(AF_INET6, &n->ip6[0], buff, len);
+          if(a->ip6_cnt > 0) {
+            inet_ntop(AF_INET6, &a->ip6[0], buff, len);
             goto leave;
           }
           break;
@@ -263,34 +365,30 @@ int noit_check_resolver_fetch(const char *target, char *buff, int len,
     }
   }
  leave:
-  DCUNLOCK();
+  mtev_memory_end();
   return rv;
 }
 
 /* You are assumed to be holding the lock when in these blanking functions */
 static void blank_update_v4(dns_cache_node *n) {
-  if(n->ip4) free(n->ip4);
-  n->ip4 = NULL;
-  n->ip4_cnt = 0;
-  mtev_skiplist_remove(nc_dns_cache, n->target, NULL);
+  dns_cache_refresh_remove(n);
+  dns_cache_node_publish(n, DNS_T_A, 0, NULL);
   n->last_updated = time(NULL);
   if (n->lookup_inflight_v6) {
     n->ttl = DEFAULT_FAILED_TTL;
   }
   n->lookup_inflight_v4 = mtev_false;
-  mtev_skiplist_insert(nc_dns_cache, n);
+  dns_cache_refresh_insert(n);
 }
 static void blank_update_v6(dns_cache_node *n) {
-  if(n->ip6) free(n->ip6);
-  n->ip6 = NULL;
-  n->ip6_cnt = 0;
-  mtev_skiplist_remove(nc_dns_cache, n->target, NULL);
+  dns_cache_refresh_remove(n);
+  dns_cache_node_publish(n, DNS_T_AAAA, 0, NULL);
   n->last_updated = time(NULL);
   if (n->lookup_inflight_v4) {
     n->ttl = DEFAULT_FAILED_TTL;
   }
   n->lookup_inflight_v6 = mtev_false;
-  mtev_skiplist_insert(nc_dns_cache, n);
+  dns_cache_refresh_insert(n);
 }
 static void blank_update(dns_cache_node *n) {
   blank_update_v4(n);
@@ -411,28 +509,26 @@ static void dns_cache_resolve(struct dns_ctx *ctx, void *result, void *data,
     ttl = 0;
   if(ttl > MAX_TTL)
     ttl = MAX_TTL;
+  if(rtype != DNS_T_A && rtype != DNS_T_AAAA) {
+    if(result) free(result);
+    return;
+  }
+  DCLOCK();
+  dns_cache_refresh_remove(n);
   n->ttl = ttl;
   if(rtype == DNS_T_A) {
-    if(n->ip4) free(n->ip4);
-    n->ip4_cnt = acnt;
-    n->ip4 = answers4;
+    dns_cache_node_publish(n, rtype, acnt, answers4);
     n->lookup_inflight_v4 = mtev_false;
   }
-  else if(rtype == DNS_T_AAAA) {
-    if(n->ip6) free(n->ip6);
-    n->ip6_cnt = acnt;
-    n->ip6 = answers6;
-    n->lookup_inflight_v6 = mtev_false;
-  }
   else {
-    if(result) free(result);
-    return;
+    dns_cache_node_publish(n, rtype, acnt, answers6);
+    n->lookup_inflight_v6 = mtev_false;
   }
-  DCLOCK();
-  mtev_skiplist_remove(nc_dns_cache, n->target, NULL);
   n->last_updated = time(NULL);
-  mtev_skiplist_insert(nc_dns_cache, n);
+  dns_cache_refresh_insert(n);
   DCUNLOCK();
+  free(answers4);
+  free(answers6);
   mtevL(noit_debug, "Resolved %s/%s -> %d records\n", n->target,
         (rtype == DNS_T_AAAA ? "IPv6" : (rtype == DNS_T_A ? "IPv4" : "???")),
         acnt);
@@ -456,66 +552,113 @@ static void dns_cache_resolve_v6(struct dns_ctx *ctx, void *result, void *data)
   dns_cache_resolve(ctx, result, data, DNS_T_AAAA);
 }
 
+/* A node popped for refresh and the lookups to submit for it. */
+typedef struct {
+  dns_cache_node *n;
+  int abs;
+  mtev_boolean v4;
+  mtev_boolean v6;
+} dns_cache_pending_t;
+
 void noit_check_resolver_maintain() {
   time_t now;
-  mtev_skiplist *tlist;
-  mtev_skiplist_node *sn;
+  dns_cache_node *n;
+  dns_cache_pending_t *pending = NULL;
+  int i, npending = 0, pending_size = 0;
 
   now = time(NULL);
-  sn = mtev_skiplist_getlist(mtev_skiplist_indexes(nc_dns_cache));
-  mtevAssert(sn);
-  tlist = mtev_skiplist_data(sn);
-  mtevAssert(tlist);
-  sn = mtev_skiplist_getlist(tlist);
-  while(sn) {
-    dns_cache_node *n = mtev_skiplist_data(sn);
-    mtev_skiplist_next(tlist, &sn); /* move forward */
-    /* remove if needed */
+  mtev_memory_begin();
+  DCLOCK();
+  /* Nodes leave the refresh list while their lookups are in flight and
+   * return when the answers (or blanks) come back.  udns may call the
+   * resolve callbacks, which take the lock, from within the submit and
+   * timeout calls, so those happen after it is released. */
+  while((n = mtev_skiplist_peek(nc_dns_refresh)) != NULL) {
+    int abs;
     if(n->last_updated + n->ttl > now) break;
+    dns_cache_refresh_remove(n);
+    /* remove if needed */
     if(n->last_needed + DEFAULT_PURGE_AGE < now &&
-       !(n->lookup_inflight_v4 || n->lookup_inflight_v6))
-      mtev_skiplist_remove(nc_dns_cache, n->target, dns_cache_node_free);
-    else {
-      int abs;
-      if(!dns_ptodn(n->target, strlen(n->target),
-                    n->dn, sizeof(n->dn), &abs)) {
-        blank_update(n);
-      }
-      else {
-        if(!n->lookup_inflight_v4) {
-          n->lookup_inflight_v4 = mtev_true;
-          if(!dns_submit_dn(dns_ctx, n->dn, DNS_C_IN, DNS_T_A,
-                            abs | dns_search_flag, NULL, dns_cache_resolve_v4, n))
-            blank_update_v4(n);
-          else
-            dns_timeouts(dns_ctx, -1, now);
-        }
-        if(!n->lookup_inflight_v6) {
-          n->lookup_inflight_v6 = mtev_true;
-          if(!dns_submit_dn(dns_ctx, n->dn, DNS_C_IN, DNS_T_AAAA,
-                            abs | dns_search_flag, NULL, dns_cache_resolve_v6, n))
-            blank_update_v6(n);
-          else
-            dns_timeouts(dns_ctx, -1, now);
-        }
+       !(n->lookup_inflight_v4 || n->lookup_inflight_v6)) {
+      dns_cache_delete(n);
+      continue;
+    }
+    if(!dns_ptodn(n->target, strlen(n->target),
+                  n->dn, sizeof(n->dn), &abs)) {
+      blank_update(n);
+      /* it is back in the list and due; pick it up next sweep */
+      dns_cache_refresh_remove(n);
+      if(npending == pending_size) {
+        pending_size = pending_size ? pending_size * 2 : 16;
+        pending = realloc(pending, pending_size * sizeof(*pending));
       }
-      mtevL(noit_debug, "Firing lookup for '%s'\n", n->target);
+      pending[npending].n = n;
+      pending[npending].abs = 0;
+      pending[npending].v4 = pending[npending].v6 = mtev_false;
+      npending++;
+      continue;
+    }
+    if(npending == pending_size) {
+      pending_size = pending_size ? pending_size * 2 : 16;
+      pending = realloc(pending, pending_size * sizeof(*pending));
+    }
+    pending[npending].n = n;
+    pending[npending].abs = abs;
+    pending[npending].v4 = !n->lookup_inflight_v4;
+    pending[npending].v6 = !n->lookup_inflight_v6;
+    n->lookup_inflight_v4 = n->lookup_inflight_v6 = mtev_true;
+    npending++;
+  }
+  DCUNLOCK();
+
+  /* Nodes with lookups in flight are never purged, so these stay put. */
+  for(i=0; i<npending; i++) {
+    dns_cache_pending_t *p = &pending[i];
+    n = p->n;
+    if(!p->v4 && !p->v6) {
+      /* blanked above; put it back unless it was removed meanwhile */
+      DCLOCK();
+      if(!(n->lookup_inflight_v4 || n->lookup_inflight_v6) &&
+         dns_cache_find(n->target, strlen(n->target)) == n)
+        dns_cache_refresh_insert(n);
+      DCUNLOCK();
       continue;
     }
+    if(p->v4) {
+      if(!dns_submit_dn(dns_ctx, n->dn, DNS_C_IN, DNS_T_A,
+                        p->abs | dns_search_flag, NULL, dns_cache_resolve_v4, n)) {
+        DCLOCK();
+        blank_update_v4(n);
+        DCUNLOCK();
+      }
+      else
+        dns_timeouts(dns_ctx, -1, now);
+    }
+    if(p->v6) {
+      if(!dns_submit_dn(dns_ctx, n->dn, DNS_C_IN, DNS_T_AAAA,
+                        p->abs | dns_search_flag, NULL, dns_cache_resolve_v6, n)) {
+        DCLOCK();
+        blank_update_v6(n);
+        DCUNLOCK();
+      }
+      else
+        dns_timeouts(dns_ctx, -1, now);
+    }
+    mtevL(noit_debug, "Firing lookup for '%s'\n", n->target);
   }
+  free(pending);
 
   /* If we have a cache implementation */
   if(noit_resolver_cache_store_hook_exists()) {
     /* And that implementation is interested in getting a dump... */
     if(noit_resolver_cache_store_hook_invoke(NULL, NULL, 0) == MTEV_HOOK_CONTINUE) {
-      mtev_skiplist_node *sn;
+      mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
       /* dump it all */
       DCLOCK();
-      for(sn = mtev_skiplist_getlist(nc_dns_cache); sn;
-          mtev_skiplist_next(nc_dns_cache, &sn)) {
+      while(mtev_hash_adv(&nc_dns_cache, &iter)) {
         int sbuffsize;
         char sbuff[1024];
-        dns_cache_node *n = (dns_cache_node *)mtev_skiplist_data(sn);
+        dns_cache_node *n = (dns_cache_node *)iter.value.ptr;
         sbuffsize = dns_cache_node_serialize(sbuff, sizeof(sbuff), n);
         if(sbuffsize > 0)
           noit_resolver_cache_store_hook_invoke(n->target, sbuff, sbuffsize);
@@ -523,6 +666,7 @@ void noit_check_resolver_maintain() {
       DCUNLOCK();
     }
   }
+  mtev_memory_end();
 }
 
 int noit_check_resolver_loop(eventer_t e, int mask, void *c,
@@ -545,17 +689,18 @@ nc_print_dns_cache_node(mtev_console_closure_t ncct,
     int i;
     char buff[INET6_ADDRSTRLEN];
     time_t now = time(NULL);
+    dns_cache_answers_t *a = n->answers;
     nc_printf(ncct, "%16s: %ds ago\n", "last needed", now - n->last_needed);
     nc_printf(ncct, "%16s: %ds ago\n", "resolved", now - n->last_updated);
     nc_printf(ncct, "%16s: %ds\n", "ttl", n->ttl);
     if(n->lookup_inflight_v4) nc_printf(ncct, "actively resolving A RRs\n");
     if(n->lookup_inflight_v6) nc_printf(ncct, "actively resolving AAAA RRs\n");
-    for(i=0;i<n->ip4_cnt;i++) {
-      inet_ntop(AF_INET, &n->ip4[i], buff, sizeof(buff));
+    for(i=0;a && i<a->ip4_cnt;i++) {
+      inet_ntop(AF_INET, &a->ip4[i], buff, sizeof(buff));
       nc_printf(ncct, "%17s %s\n", i?"":"IPv4:", buff);
     }
-    for(i=0;i<n->ip6_cnt;i++) {
-      inet_ntop(AF_INET6, &n->ip6[i], buff, sizeof(buff));
+    for(i=0;a && i<a->ip6_cnt;i++) {
+      inet_ntop(AF_INET6, &a->ip6[i], buff, sizeof(buff));
       nc_printf(ncct, "%17s %s\n", i?"":"IPv6:", buff);
     }
   }
@@ -568,21 +713,22 @@ noit_console_show_dns_cache(mtev_console_closure_t ncct,
                             void *closure) {
   int i;
 
+  mtev_memory_begin();
   DCLOCK();
   if(argc == 0) {
-    mtev_skiplist_node *sn;
-    for(sn = mtev_skiplist_getlist(nc_dns_cache); sn;
-        mtev_skiplist_next(nc_dns_cache, &sn)) {
-      dns_cache_node *n = (dns_cache_node *)mtev_skiplist_data(sn);
+    mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+    while(mtev_hash_adv(&nc_dns_cache, &iter)) {
+      dns_cache_node *n = (dns_cache_node *)iter.value.ptr;
       nc_print_dns_cache_node(ncct, n->target, n);
     }
   }
   for(i=0;i<argc;i++) {
     dns_cache_node *n;
-    n = mtev_skiplist_find(nc_dns_cache, argv[i], NULL);
+    n = dns_cache_find(argv[i], strlen(argv[i]));
     nc_print_dns_cache_node(ncct, argv[i], n);
   }
   DCUNLOCK();
+  mtev_memory_end();
   return 0;
 }
 static int
@@ -595,12 +741,13 @@ noit_console_manip_dns_cache(mtev_console_closure_t ncct,
     nc_printf(ncct, "dns_cache what?\n");
     return 0;
   }
+  mtev_memory_begin();
   DCLOCK();
   if(closure == NULL) {
     /* adding */
     for(i=0;i<argc;i++) {
       dns_cache_node *n;
-      n = mtev_skiplist_find(nc_dns_cache, argv[i], NULL);
+      n = dns_cache_find(argv[i], strlen(argv[i]));
       if(NULL != n) {
         nc_printf(ncct, " == Already in system ==\n");
         nc_print_dns_cache_node(ncct, argv[i], n);
@@ -614,12 +761,12 @@ noit_console_manip_dns_cache(mtev_console_closure_t ncct,
   else {
     for(i=0;i<argc;i++) {
       dns_cache_node *n;
-      n = mtev_skiplist_find(nc_dns_cache, argv[i], NULL);
+      n = dns_cache_find(argv[i], strlen(argv[i]));
       if(NULL != n) {
         if(n->lookup_inflight_v4 || n->lookup_inflight_v6)
           nc_printf(ncct, "%s is currently resolving and cannot be removed.\n");
         else {
-          mtev_skiplist_remove(nc_dns_cache, argv[i], dns_cache_node_free);
+          dns_cache_delete(n);
           nc_printf(ncct, "%s removed.\n", argv[i]);
         }
       }
@@ -627,6 +774,7 @@ noit_console_manip_dns_cache(mtev_console_closure_t ncct,
     }
   }
   DCUNLOCK();
+  mtev_memory_end();
   return 0;
 }
 
@@ -668,17 +816,21 @@ noit_check_etc_hosts_cache_refresh(eventer_t e, int mask, void *closure,
   memcpy(&last_stat, &sb, sizeof(sb));
 
   if(reload) {
-    mtev_hash_delete_all(&etc_hosts_cache, free, free);
+    mtev_hash_table *newhosts, *oldhosts;
+    /* Build a fresh table and swap it in; readers may still be on the old one. */
+    mtev_memory_begin();
+    newhosts = mtev_memory_safe_malloc_cleanup(sizeof(*newhosts), etc_hosts_cache_free);
+    mtev_hash_init(newhosts);
     while(NULL != (ent = gethostent())) {
       int i = 0;
       char *name = ent->h_name;
       while(name) {
         void *vnode;
         static_host_node *node;
-        if(!mtev_hash_retrieve(&etc_hosts_cache, name, strlen(name), &vnode)) {
+        if(!mtev_hash_retrieve(newhosts, name, strlen(name), &vnode)) {
           vnode = node = calloc(1, sizeof(*node));
           node->target = strdup(name);
-          mtev_hash_store(&etc_hosts_cache, node->target, strlen(node->target), node);
+          mtev_hash_store(newhosts, node->target, strlen(node->target), node);
         }
         node = vnode;
   
@@ -695,7 +847,10 @@ noit_check_etc_hosts_cache_refresh(eventer_t e, int mask, void *closure,
       }
     }
     endhostent();
-    mtevL(noit_debug, "reloaded %d /etc/hosts targets\n", mtev_hash_size(&etc_hosts_cache));
+    oldhosts = ck_pr_fas_ptr(&etc_hosts_cache, newhosts);
+    if(oldhosts) mtev_memory_safe_free(oldhosts);
+    mtevL(noit_debug, "reloaded %d /etc/hosts targets\n", mtev_hash_size(newhosts));
+    mtev_memory_end();
   }
 
   eventer_add_in_s_us(noit_check_etc_hosts_cache_refresh, NULL, 1, 0);
@@ -703,13 +858,14 @@ noit_check_etc_hosts_cache_refresh(eventer_t e, int mask, void *closure,
 }
 
 void noit_check_resolver_init() {
-  static int initialized = 0;
   int32_t cnt;
   mtev_conf_section_t *servers, *searchdomains;
   eventer_t e;
 
+  /* every fetch comes through here, keep it off the lock */
+  if(ck_pr_load_int(&resolver_initialized)) return;
   DCLOCK();
-  if(initialized != 0) {
+  if(resolver_initialized != 0) {
     DCUNLOCK();
     return;
   }
@@ -782,11 +938,9 @@ void noit_check_resolver_init() {
                        EVENTER_READ|EVENTER_EXCEPTION);
   eventer_add(e);
 
-  mtev_skiplist *dc = mtev_skiplist_alloc();
-  mtev_skiplist_set_compare(dc, name_lookup, name_lookup_k);
-  mtev_skiplist_add_index(dc, refresh_idx, refresh_idx_k);
-  ck_pr_barrier();
-  nc_dns_cache = dc;
+  mtev_hash_init_mtev_memory(&nc_dns_cache, MTEV_HASH_DEFAULT_SIZE, MTEV_HASH_LOCK_MODE_MUTEX);
+  nc_dns_refresh = mtev_skiplist_alloc();
+  mtev_skiplist_set_compare(nc_dns_refresh, refresh_order, refresh_order);
 
   /* maybe load it from cache */
   if(noit_resolver_cache_load_hook_exists()) {
@@ -797,7 +951,7 @@ void noit_check_resolver_init() {
     mtev_gettimeofday(&now, NULL);
     while(noit_resolver_cache_load_hook_invoke(&key, &data, &len) == MTEV_HOOK_CONTINUE) {
       dns_cache_node *n;
-      n = calloc(1, sizeof(*n));
+      n = dns_cache_node_alloc(NULL);
       if(dns_cache_node_deserialize(n, data, len) >= 0) {
         n->target = strdup(key);
         /* if the TTL indicates that it will expire in less than 60 seconds
@@ -817,7 +971,10 @@ void noit_check_resolver_init() {
           int fudge = MIN(60, n->ttl) + 1;
           n->last_updated = now.tv_sec - n->ttl + (lrand48() % fudge);
         }
-        mtev_skiplist_insert(nc_dns_cache, n);
+        if(dns_cache_find(n->target, strlen(n->target))) {
+          dns_cache_node_free(n);
+        }
+        else dns_cache_add(n);
         n = NULL;
       }
       else {
@@ -832,9 +989,8 @@ void noit_check_resolver_init() {
   start_noit_check_resolver_loop();
   register_console_dns_cache_commands();
 
-  mtev_hash_init(&etc_hosts_cache);
   noit_check_etc_hosts_cache_refresh(NULL, 0, NULL, NULL);
-  initialized = 1;
+  ck_pr_store_int(&resolver_initialized, 1);
   DCUNLOCK();
 }
 
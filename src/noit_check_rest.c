@@ -286,8 +286,7 @@ noit_check_state_as_json(noit_check_t *check, int full) {
   json_object_set_uint64(j_last_run, ms);
   json_object_object_add(doc, "last_run", j_last_run);
 
-  if(check->fire_event) {
-    check_whence = eventer_get_whence(check->fire_event);
+  if(noit_check_next_fire(check, &check_whence, NULL)) {
     t = &check_whence;
   }
   else t = NULL;
@@ -406,6 +405,46 @@ rest_show_checks_json(mtev_http_rest_closure_t *restc,
   mtev_http_response_end(restc->http_ctx);
   return 0;
 }
+static void
+json_thread_load_accum(void *closure, const char *pool, int thread, int64_t load) {
+  struct json_object *pools = closure, *threads;
+  if(!json_object_object_get_ex(pools, pool, &threads)) {
+    threads = json_object_new_array();
+    json_object_object_add(pools, pool, threads);
+  }
+  json_object_array_put_idx(threads, thread, json_object_new_int64(load));
+}
+static int
+rest_show_check_slots(mtev_http_rest_closure_t *restc,
+                      int npats, char **pats) {
+  const char *jsonstr;
+  struct json_object *doc, *seconds, *pools;
+  uint32_t counts[60];
+  int64_t loads[60];
+
+  noit_check_slots_projection(counts, loads);
+  doc = json_object_new_object();
+  json_object_object_add(doc, "load_aware", json_object_new_boolean(noit_check_load_aware_scheduling()));
+  seconds = json_object_new_array();
+  for(int i=0; i<60; i++) {
+    struct json_object *second = json_object_new_object();
+    json_object_object_add(second, "checks", json_object_new_int(counts[i]));
+    json_object_object_add(second, "cost_us", json_object_new_int64(loads[i]));
+    json_object_array_add(seconds, second);
+  }
+  json_object_object_add(doc, "seconds", seconds);
+  pools = json_object_new_object();
+  noit_check_thread_loads_foreach(json_thread_load_accum, pools);
+  json_object_object_add(doc, "thread_cost_us_per_minute", pools);
+
+  mtev_http_response_ok(restc->http_ctx, "application/json");
+  jsonstr = json_object_to_json_string(doc);
+  mtev_http_response_append(restc->http_ctx, jsonstr, strlen(jsonstr));
+  mtev_http_response_append(restc->http_ctx, "\n", 1);
+  json_object_put(doc);
+  mtev_http_response_end(restc->http_ctx);
+  return 0;
+}
 static int
 rest_show_checks(mtev_http_rest_closure_t *restc,
                  int npats, char **pats) {
@@ -1410,6 +1449,10 @@ noit_check_rest_init() {
     "GET", "/checks/", "^owner/(" UUID_REGEX ")$",
     rest_show_check_owner, mtev_http_rest_client_cert_auth
   ) == 0);
+  mtevAssert(mtev_http_rest_register_auth(
+    "GET", "/checks/", "^slots\\.json$",
+    rest_show_check_slots, mtev_http_rest_client_cert_auth
+  ) == 0);
   mtevAssert(mtev_http_rest_register_auth(
     "GET", "/checks/", "^show(\\.json)?$",
     rest_show_checks, mtev_http_rest_client_cert_auth
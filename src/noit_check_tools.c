@@ -35,6 +35,7 @@
 #include <mtev_memory.h>
 #include <mtev_str.h>
 #include <mtev_json.h>
+#include <mtev_stats.h>
 #include <eventer/eventer.h>
 
 #include "noit_mtev_bridge.h"
@@ -73,6 +74,210 @@ noit_check_recur_name_details(char *buf, int buflen,
   snprintf(buf, buflen, "fire(%s)", id_str);
   return;
 }
+
+/* The timing wheel scheduler (//checks/@scheduler="wheel").
+ *
+ * Rather than allocating a timer event per run, each check gets one
+ * schedule that is reused from run to run and lives in a wheel (see
+ * noit_check_wheel_t) owned by the eventer thread the check runs on.  A
+ * single timer per thread drives the wheel and every run that is due is
+ * fired in one pass.
+ *
+ * Schedules are only ever touched by their owning thread.  Scheduling from
+ * any other thread hands the schedule over with a one-off event.
+ */
+struct noit_check_schedule {
+  noit_check_wheel_entry_t entry; /* must be first */
+  noit_module_t *self;
+  noit_check_t *check;
+  noit_check_t *cause;
+  dispatch_func_t dispatch;
+  pthread_t owner;
+  struct timeval whence;
+  mtev_boolean queued;
+};
+typedef struct noit_check_schedule check_schedule_t;
+
+typedef struct {
+  noit_check_wheel_t wheel;
+  eventer_t tick;
+  uint64_t tick_ms;
+} check_wheel_t;
+
+static mtev_boolean use_check_wheel = mtev_false;
+static __thread check_wheel_t *my_check_wheel;
+static stats_handle_t *check_wheel_lateness[60];
+
+static inline uint64_t
+timeval_to_ms(const struct timeval *tv) {
+  return (uint64_t)tv->tv_sec * 1000ULL + tv->tv_usec / 1000;
+}
+
+static uint64_t
+check_wheel_now_ms(void) {
+  struct timeval now;
+  mtev_gettimeofday(&now, NULL);
+  return timeval_to_ms(&now);
+}
+
+static check_wheel_t *
+check_wheel_get(void) {
+  if(!my_check_wheel) {
+    my_check_wheel = calloc(1, sizeof(*my_check_wheel));
+    noit_check_wheel_init(&my_check_wheel->wheel, check_wheel_now_ms());
+  }
+  return my_check_wheel;
+}
+
+static int check_wheel_tick(eventer_t e, int mask, void *closure, struct timeval *now);
+static void check_schedule_release(check_schedule_t *s);
+
+static void
+check_wheel_arm(check_wheel_t *w) {
+  uint64_t next = noit_check_wheel_next_ms(&w->wheel);
+  if(w->tick) {
+    if(next && w->tick_ms <= next) return;
+    eventer_t removed = eventer_remove(w->tick);
+    if(removed) eventer_free(removed);
+    w->tick = NULL;
+  }
+  if(!next) return;
+  struct timeval tgt = { .tv_sec = next / 1000, .tv_usec = (next % 1000) * 1000 };
+  w->tick = eventer_alloc_timer(check_wheel_tick, w, &tgt);
+  eventer_set_owner(w->tick, pthread_self());
+  w->tick_ms = next;
+  eventer_add(w->tick);
+}
+
+static void
+noit_check_recur_fire(noit_module_t *self, noit_check_t *check,
+                      noit_check_t *cause, dispatch_func_t dispatch, int ms) {
+  if(NOIT_CHECK_RESOLVED(check)) {
+    if(MTEV_HOOK_CONTINUE ==
+       check_preflight_hook_invoke(self, check, cause)) {
+      if(NOIT_CHECK_DISPATCH_ENABLED()) {
+        char id[UUID_STR_LEN+1];
+        mtev_uuid_unparse_lower(check->checkid, id);
+        NOIT_CHECK_DISPATCH(id, check->module, check->name,
+                            check->target);
+      }
+      if(ms < check->timeout && !(check->flags & NP_TRANSIENT))
+        mtevL(((ms == 0) ? noit_debug : noit_error), 
+              "%s might not finish in %dms (timeout %dms)\n",
+              check->name, ms, check->timeout);
+      dispatch(self, check, cause);
+    }
+    check_postflight_hook_invoke(self, check, cause);
+  }
+  else
+    mtevL(noit_debug, "skipping %s`%s`%s, unresolved\n",
+          check->target, check->module, check->name);
+}
+
+static int
+check_wheel_tick(eventer_t e, int mask, void *closure, struct timeval *now) {
+  check_wheel_t *w = closure;
+  check_schedule_t *s, *next;
+  uint64_t now_ms = timeval_to_ms(now);
+
+  (void)mask;
+  if(w->tick == e) w->tick = NULL;
+
+  check_schedule_t *due = (check_schedule_t *)noit_check_wheel_take_due(&w->wheel, now_ms);
+  mtev_memory_begin();
+  for(s = due; s; s = next) {
+    noit_check_t *check = noit_check_ref(s->check);
+    noit_module_t *self = s->self;
+    noit_check_t *cause = s->cause;
+    dispatch_func_t dispatch = s->dispatch;
+    int ms;
+
+    next = (check_schedule_t *)s->entry.next;
+    stats_set_hist_intscale(check_wheel_lateness[(s->entry.due_ms / 1000) % 60],
+                            (now_ms - s->entry.due_ms), -3, 1);
+    noit_check_resolve(check);
+    s->queued = mtev_false;
+    ms = noit_check_schedule_next(self, NULL, check, now, dispatch, NULL);
+    if(!s->queued) check_schedule_release(s);
+    noit_check_recur_fire(self, check, cause, dispatch, ms);
+    noit_check_deref(check);
+  }
+  mtev_memory_end();
+
+  check_wheel_arm(w);
+  return 0;
+}
+
+static void
+check_schedule_add(check_schedule_t *s) {
+  check_wheel_t *w = check_wheel_get();
+  noit_check_wheel_add(&w->wheel, &s->entry, check_wheel_now_ms());
+  check_wheel_arm(w);
+}
+
+static int
+check_schedule_adopt(eventer_t e, int mask, void *closure, struct timeval *now) {
+  (void)e;
+  (void)mask;
+  (void)now;
+  check_schedule_add(closure);
+  return 0;
+}
+
+static void
+check_schedule_release(check_schedule_t *s) {
+  s->check->fire_schedule = NULL;
+  noit_check_deref(s->check);
+  mtev_memory_safe_free(s);
+}
+
+static void
+check_wheel_schedule(noit_module_t *self, noit_check_t *check,
+                     noit_check_t *cause, dispatch_func_t dispatch,
+                     struct timeval *tgt, pthread_t owner) {
+  check_schedule_t *s = check->fire_schedule;
+  if(!s) {
+    s = mtev_memory_safe_calloc(1, sizeof(*s));
+    s->check = noit_check_ref(check);
+    check->fire_schedule = s;
+  }
+  s->self = self;
+  s->cause = cause;
+  s->dispatch = dispatch;
+  s->whence = *tgt;
+  s->entry.due_ms = timeval_to_ms(tgt);
+  s->owner = owner;
+  s->queued = mtev_true;
+  if(pthread_equal(owner, pthread_self())) {
+    check_schedule_add(s);
+  }
+  else {
+    eventer_t e = eventer_in_s_us(check_schedule_adopt, s, 0, 0);
+    eventer_set_owner(e, owner);
+    eventer_add(e);
+  }
+}
+
+mtev_boolean
+noit_check_next_fire(noit_check_t *check, struct timeval *whence, pthread_t *owner) {
+  mtev_boolean rv = mtev_false;
+  eventer_t e = check->fire_event;
+  if(e) {
+    if(whence) *whence = eventer_get_whence(e);
+    if(owner) *owner = eventer_get_owner(e);
+    return mtev_true;
+  }
+  mtev_memory_begin();
+  check_schedule_t *s = ck_pr_load_ptr(&check->fire_schedule);
+  if(s) {
+    if(whence) *whence = s->whence;
+    if(owner) *owner = s->owner;
+    rv = mtev_true;
+  }
+  mtev_memory_end();
+  return rv;
+}
+
 static int
 noit_check_recur_handler(eventer_t e, int mask, void *closure,
                               struct timeval *now) {
@@ -88,26 +293,7 @@ noit_check_recur_handler(eventer_t e, int mask, void *closure,
                                 rcl->dispatch, NULL);
   if(ms == 0)
     rcl->check->fire_event = NULL; /* This is us, we get freed post-return */
-  if(NOIT_CHECK_RESOLVED(rcl->check)) {
-    if(MTEV_HOOK_CONTINUE ==
-       check_preflight_hook_invoke(rcl->self, rcl->check, rcl->cause)) {
-      if(NOIT_CHECK_DISPATCH_ENABLED()) {
-        char id[UUID_STR_LEN+1];
-        mtev_uuid_unparse_lower(rcl->check->checkid, id);
-        NOIT_CHECK_DISPATCH(id, rcl->check->module, rcl->check->name,
-                            rcl->check->target);
-      }
-      if(ms < rcl->check->timeout && !(rcl->check->flags & NP_TRANSIENT))
-        mtevL(((ms == 0) ? noit_debug : noit_error), 
-              "%s might not finish in %dms (timeout %dms)\n",
-              rcl->check->name, ms, rcl->check->timeout);
-      rcl->dispatch(rcl->self, rcl->check, rcl->cause);
-    }
-    check_postflight_hook_invoke(rcl->self, rcl->check, rcl->cause);
-  }
-  else
-    mtevL(noit_debug, "skipping %s`%s`%s, unresolved\n",
-          rcl->check->target, rcl->check->module, rcl->check->name);
+  noit_check_recur_fire(rcl->self, rcl->check, rcl->cause, rcl->dispatch, ms);
   noit_check_deref(rcl->check);
   free(rcl);
   mtev_memory_end();
@@ -135,7 +321,7 @@ noit_check_schedule_next(noit_module_t *self,
   else memcpy(&check->initial_schedule_time, last_check, sizeof(*last_check));
 
   if(NOIT_CHECK_DISABLED(check) || NOIT_CHECK_KILLED(check)) {
-    if(!(check->flags & NP_TRANSIENT)) check_slots_dec_tv(last_check);
+    if(!(check->flags & NP_TRANSIENT)) noit_check_slots_release(check, last_check);
     memset(&check->initial_schedule_time, 0, sizeof(struct timeval));
     return 0;
   }
@@ -185,6 +371,13 @@ noit_check_schedule_next(noit_module_t *self,
   diffms = (int64_t)diff.tv_sec * 1000 + (int)diff.tv_usec / 1000;
   mtevAssert(compare_timeval(tgt, earliest) > 0);
 
+  if(use_check_wheel) {
+    check_wheel_schedule(self, check, cause, dispatch, &tgt,
+                         self->thread_unsafe ? eventer_choose_owner(0)
+                                             : CHOOSE_EVENTER_THREAD_FOR_CHECK(check));
+    return diffms;
+  }
+
   rcl = calloc(1, sizeof(*rcl));
   rcl->self = self;
   rcl->check = noit_check_ref(check);
@@ -224,9 +417,31 @@ noit_check_run_full_asynch(noit_check_t *check, eventer_func_t callback) {
 
 void
 noit_check_tools_init() {
+  char *scheduler = NULL;
   eventer_name_callback_ext("noit_check_recur_handler",
                             noit_check_recur_handler,
                             noit_check_recur_name_details, NULL);
+  eventer_name_callback("noit_check_wheel_tick", check_wheel_tick);
+  eventer_name_callback("noit_check_schedule_adopt", check_schedule_adopt);
+
+  if(mtev_conf_get_string(MTEV_CONF_ROOT, "//checks/@scheduler", &scheduler)) {
+    if(!strcmp(scheduler, "wheel")) use_check_wheel = mtev_true;
+    else if(strcmp(scheduler, "timer"))
+      mtevL(noit_error, "Unknown check scheduler '%s', using timers\n", scheduler);
+    free(scheduler);
+  }
+  if(use_check_wheel) {
+    stats_ns_t *ns = mtev_stats_ns(mtev_stats_ns(mtev_stats_ns(NULL, "noit"), "checks"), "lateness");
+    stats_ns_add_tag(ns, "subsystem", "scheduler");
+    for(int i=0; i<60; i++) {
+      char slot[3];
+      snprintf(slot, sizeof(slot), "%02d", i);
+      check_wheel_lateness[i] = stats_register_fanout(ns, slot, STATS_TYPE_HISTOGRAM, 16);
+      stats_handle_units(check_wheel_lateness[i], STATS_UNITS_SECONDS);
+      stats_handle_tagged_name(check_wheel_lateness[i], "lateness");
+      stats_handle_add_tag(check_wheel_lateness[i], "slot", slot);
+    }
+  }
 }
 
 static int
@@ -452,6 +667,14 @@ eventer_pool_t *noit_check_choose_pool(noit_check_t *check) {
 
 pthread_t noit_check_choose_eventer_thread(noit_check_t *check) {
   eventer_pool_t *dedicated_pool = noit_check_choose_pool(check);
+  int nthreads = dedicated_pool ? eventer_pool_concurrency(dedicated_pool)
+                                : eventer_loop_concurrency();
+  int idx = noit_check_balanced_thread_index(check, dedicated_pool, nthreads);
+  if(idx >= 0) {
+    /* offset so we never ask for owner 0, which is not a fixed thread */
+    if(dedicated_pool) return eventer_choose_owner_pool(dedicated_pool, idx + nthreads);
+    return eventer_choose_owner(idx + nthreads);
+  }
   int rnd = noit_check_uuid_to_integer(check->checkid) / sizeof(*(check)) * 2654435761;
   if(dedicated_pool) return eventer_choose_owner_pool(dedicated_pool, rnd);
   return eventer_choose_owner(rnd);
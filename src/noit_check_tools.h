@@ -60,6 +60,12 @@ API_EXPORT(int)
                            struct timeval *now, dispatch_func_t recur,
                            noit_check_t *cause);
 
+/* When and on which thread a check is next scheduled to fire, regardless
+ * of scheduler.  Returns mtev_false if the check is not scheduled. */
+API_EXPORT(mtev_boolean)
+  noit_check_next_fire(noit_check_t *check, struct timeval *whence,
+                       pthread_t *owner);
+
 API_EXPORT(void)
   noit_check_run_full_asynch_opts(noit_check_t *check, eventer_func_t callback,
                                   int mask);
@@ -177,7 +183,7 @@ MTEV_HOOK_PROTO(check_postflight,
       oncefunc(self, check, cause); \
     check_postflight_hook_invoke(self, check, cause); \
   } \
-  else if(!check->fire_event) { \
+  else if(!NOIT_CHECK_LIVE(check)) { \
     struct timeval epoch = { 0L, 0L }; \
     noit_check_fake_last_check(check, &epoch, NULL); \
     noit_check_schedule_next(self, &epoch, check, NULL, func, cause); \
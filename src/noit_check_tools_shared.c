@@ -247,6 +247,105 @@ interpolate_oper_random(char *buff, int len, const char *key,
   return snprintf(buff, len, "random_what");
 }
 
+#define L0_SLOT(t) (((t) / NOIT_CHECK_SCHEDULE_GRANULARITY) % NOIT_CHECK_WHEEL_L0_SLOTS)
+
+void
+noit_check_wheel_init(noit_check_wheel_t *w, uint64_t now_ms) {
+  memset(w, 0, sizeof(*w));
+  w->now_ms = now_ms - (now_ms % NOIT_CHECK_SCHEDULE_GRANULARITY);
+}
+
+static void
+check_wheel_insert(noit_check_wheel_t *w, noit_check_wheel_entry_t *e) {
+  noit_check_wheel_entry_t **slot;
+  uint64_t due = MAX(e->due_ms, w->now_ms);
+  uint64_t delta = due - w->now_ms;
+
+  if(delta < NOIT_CHECK_WHEEL_L1_WIDTH) {
+    uint32_t idx = L0_SLOT(due);
+    w->l0_occupied[idx / 64] |= 1ULL << (idx % 64);
+    slot = &w->l0[idx];
+  }
+  else if(delta < NOIT_CHECK_WHEEL_L2_WIDTH)
+    slot = &w->l1[(due / NOIT_CHECK_WHEEL_L1_WIDTH) % NOIT_CHECK_WHEEL_L1_SLOTS];
+  else
+    slot = &w->l2[(due / NOIT_CHECK_WHEEL_L2_WIDTH) % NOIT_CHECK_WHEEL_L2_SLOTS];
+  e->next = *slot;
+  *slot = e;
+}
+
+static void
+check_wheel_cascade(noit_check_wheel_t *w, noit_check_wheel_entry_t **slot) {
+  noit_check_wheel_entry_t *e = *slot, *next;
+  *slot = NULL;
+  for(; e; e = next) {
+    next = e->next;
+    check_wheel_insert(w, e);
+  }
+}
+
+void
+noit_check_wheel_add(noit_check_wheel_t *w, noit_check_wheel_entry_t *e,
+                     uint64_t now_ms) {
+  /* An idle wheel's clock has stopped wherever it last ran; nothing is in
+   * it, so it can jump straight to now rather than walk the gap. */
+  if(w->cnt == 0) w->now_ms = now_ms - (now_ms % NOIT_CHECK_SCHEDULE_GRANULARITY);
+  w->cnt++;
+  check_wheel_insert(w, e);
+}
+
+uint64_t
+noit_check_wheel_next_ms(noit_check_wheel_t *w) {
+  uint64_t boundary;
+  if(w->cnt == 0) return 0;
+  boundary = w->now_ms - (w->now_ms % NOIT_CHECK_WHEEL_L1_WIDTH) + NOIT_CHECK_WHEEL_L1_WIDTH;
+  /* the rest of this minute is every slot from now_ms's to the last */
+  for(uint32_t idx = L0_SLOT(w->now_ms); idx < NOIT_CHECK_WHEEL_L0_SLOTS; idx = (idx | 63) + 1) {
+    uint64_t bits = w->l0_occupied[idx / 64] >> (idx % 64);
+    if(!bits) continue;
+    idx += __builtin_ctzll(bits);
+    if(idx >= NOIT_CHECK_WHEEL_L0_SLOTS) break;
+    noit_check_wheel_entry_t *e = w->l0[idx];
+    uint64_t earliest = e->due_ms;
+    for(e = e->next; e; e = e->next) earliest = MIN(earliest, e->due_ms);
+    return MAX(earliest, w->now_ms);
+  }
+  return boundary;
+}
+
+noit_check_wheel_entry_t *
+noit_check_wheel_take_due(noit_check_wheel_t *w, uint64_t now_ms) {
+  noit_check_wheel_entry_t *due = NULL, **due_tail = &due, *e;
+
+  /* Collect everything that is due, cascading the outer levels down as
+   * their boundaries are crossed. */
+  for(uint64_t t = w->now_ms; t <= now_ms; t += NOIT_CHECK_SCHEDULE_GRANULARITY) {
+    if(t % NOIT_CHECK_WHEEL_L2_WIDTH == 0)
+      check_wheel_cascade(w, &w->l2[(t / NOIT_CHECK_WHEEL_L2_WIDTH) % NOIT_CHECK_WHEEL_L2_SLOTS]);
+    if(t % NOIT_CHECK_WHEEL_L1_WIDTH == 0)
+      check_wheel_cascade(w, &w->l1[(t / NOIT_CHECK_WHEEL_L1_WIDTH) % NOIT_CHECK_WHEEL_L1_SLOTS]);
+    uint32_t idx = L0_SLOT(t);
+    noit_check_wheel_entry_t **slot = &w->l0[idx];
+    while(*slot) {
+      e = *slot;
+      if(e->due_ms > now_ms) {
+        slot = &e->next;
+        continue;
+      }
+      *slot = e->next;
+      e->next = NULL;
+      *due_tail = e;
+      due_tail = &e->next;
+      w->cnt--;
+    }
+    if(!w->l0[idx]) w->l0_occupied[idx / 64] &= ~(1ULL << (idx % 64));
+    /* The current slot may still hold entries due later within it */
+    if(t + NOIT_CHECK_SCHEDULE_GRANULARITY > now_ms) break;
+    w->now_ms = t + NOIT_CHECK_SCHEDULE_GRANULARITY;
+  }
+  return due;
+}
+
 void
 noit_check_tools_shared_init() {
   noit_check_interpolate_register_oper_fn("copy", interpolate_oper_copy);
@@ -65,6 +65,49 @@ API_EXPORT(void) noit_check_extended_id_split(const char *in, int len,
                                               char *name, int name_len,
                                               char *uuid, int uuid_len);
 
+/* The timing wheel behind the "wheel" check scheduler.  The innermost level
+ * has one slot per NOIT_CHECK_SCHEDULE_GRANULARITY ms over a minute, the
+ * next one slot a minute over an hour and the outermost one slot an hour
+ * over a day; entries further out than that cascade around the outer level
+ * again.  A wheel is not thread safe. */
+#define NOIT_CHECK_WHEEL_L0_SLOTS (60000 / NOIT_CHECK_SCHEDULE_GRANULARITY)
+#define NOIT_CHECK_WHEEL_L1_SLOTS 60
+#define NOIT_CHECK_WHEEL_L2_SLOTS 24
+#define NOIT_CHECK_WHEEL_L1_WIDTH 60000ULL
+#define NOIT_CHECK_WHEEL_L2_WIDTH (60ULL * NOIT_CHECK_WHEEL_L1_WIDTH)
+
+typedef struct noit_check_wheel_entry {
+  uint64_t due_ms;
+  struct noit_check_wheel_entry *next;
+} noit_check_wheel_entry_t;
+
+typedef struct {
+  uint64_t now_ms; /* every slot before this one has been run */
+  uint32_t cnt;
+  uint64_t l0_occupied[(NOIT_CHECK_WHEEL_L0_SLOTS + 63) / 64];
+  noit_check_wheel_entry_t *l0[NOIT_CHECK_WHEEL_L0_SLOTS];
+  noit_check_wheel_entry_t *l1[NOIT_CHECK_WHEEL_L1_SLOTS];
+  noit_check_wheel_entry_t *l2[NOIT_CHECK_WHEEL_L2_SLOTS];
+} noit_check_wheel_t;
+
+API_EXPORT(void)
+  noit_check_wheel_init(noit_check_wheel_t *w, uint64_t now_ms);
+
+/* now_ms is only used to restart the clock of a wheel that is empty */
+API_EXPORT(void)
+  noit_check_wheel_add(noit_check_wheel_t *w, noit_check_wheel_entry_t *e,
+                       uint64_t now_ms);
+
+/* When the wheel next needs to run: the earliest entry due before the next
+ * minute boundary, or that boundary if anything waits in the outer levels.
+ * 0 if the wheel is empty. */
+API_EXPORT(uint64_t)
+  noit_check_wheel_next_ms(noit_check_wheel_t *w);
+
+/* Removes and returns, linked through next, every entry due by now_ms. */
+API_EXPORT(noit_check_wheel_entry_t *)
+  noit_check_wheel_take_due(noit_check_wheel_t *w, uint64_t now_ms);
+
 API_EXPORT(void)
   noit_check_tools_shared_init();
 
@@ -511,10 +511,10 @@ noit_console_get_running_stats(mtev_console_closure_t ncct,
       return;
     }
 
-    if (check->fire_event != NULL) {
-      struct timeval then, now, diff;
+    struct timeval then;
+    if (noit_check_next_fire(check, &then, NULL)) {
+      struct timeval now, diff;
       mtev_gettimeofday(&now, NULL);
-      then = eventer_get_whence(check->fire_event);
       sub_timeval(then, now, &diff);
       nc_printf(ncct, " next run: %0.3f seconds\n",
                 diff.tv_sec + (diff.tv_usec / 1000000.0));
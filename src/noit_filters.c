@@ -68,6 +68,36 @@ static char* filtersets_replication_path = NULL;
 static noit_lmdb_instance_t *lmdb_instance = NULL;
 static uint64_t cull_idle_threshold_ms = 300000;
 static bool initialized = false;
+static uint32_t metric_cache_max = 10000;
+static uint32_t check_cache_max = 10000;
+
+#define FILTER_MISS_TARGET 0x1
+#define FILTER_MISS_MODULE 0x2
+#define FILTER_MISS_NAME   0x4
+
+/* The check-level outcome of every rule in a filterset for one check.  It is
+ * valid while the check's identity and the filterset's hash tables are
+ * unchanged.  A reload compiles a new filterset with an empty cache, deleted
+ * checks are evicted by filters_check_deleted and the cache is flushed when
+ * it reaches check_cache_max entries. */
+typedef struct {
+  uuid_t checkid;
+  uint32_t check_generation;
+  uint32_t fs_gen;
+  char *target;
+  char *module;
+  char *name;
+  uint8_t misses[0]; /* FILTER_MISS_* bits, indexed by rule */
+} filterset_check_cache_t;
+
+static void
+filterset_check_cache_free(void *vp) {
+  filterset_check_cache_t *cc = vp;
+  free(cc->target);
+  free(cc->module);
+  free(cc->name);
+  free(cc);
+}
 
 #define FILTERSET_DB_HEADER_STRING "X-Filterset-DB-Type"
 
@@ -104,6 +134,11 @@ filterrule_free(void *vp) {
   free(r->skipto);
   measurement_tag_free(&r->measurement_tag);
   pthread_mutex_destroy(&r->flush_lock);
+  if(r->metric_cache) {
+    mtev_hash_destroy(r->metric_cache, free, NULL);
+    free(r->metric_cache);
+    pthread_rwlock_destroy(&r->metric_cache_rw_lock);
+  }
   free(r);
 }
 noit_lmdb_instance_t *noit_filters_get_lmdb_instance() {
@@ -177,6 +212,11 @@ noit_filter_filterset_free(void *vp) {
     filterrule_free(fs->rules);
     fs->rules = r;
   }
+  if(fs->check_cache) {
+    mtev_hash_destroy(fs->check_cache, NULL, filterset_check_cache_free);
+    free(fs->check_cache);
+    pthread_mutex_destroy(&fs->check_cache_lock);
+  }
   if(fs->name) free(fs->name);
   free(fs);
 }
@@ -267,10 +307,29 @@ noit_filter_validate_filter(xmlDocPtr doc, char *name, int64_t *seq, const char
   return root;
 }
 
+/* Number the rules and set up the caches used by noit_filterset_run_apply */
+static void
+noit_filter_compile_program(filterset_t *set) {
+  int idx = 0;
+  for(filterrule_t *r = set->rules; r; r = r->next) {
+    r->index = idx++;
+    if(metric_cache_max > 0 && r->metric_ht == NULL &&
+       (r->metric || r->metric_override || r->stsearch || r->mtsearch)) {
+      r->metric_cache = calloc(1, sizeof(*r->metric_cache));
+      mtev_hash_init(r->metric_cache);
+      pthread_rwlock_init(&r->metric_cache_rw_lock, NULL);
+    }
+  }
+  set->rule_cnt = idx;
+  pthread_mutex_init(&set->check_cache_lock, NULL);
+  set->check_cache = calloc(1, sizeof(*set->check_cache));
+  mtev_hash_init(set->check_cache);
+}
 mtev_boolean
 noit_filter_compile_add_load_set(filterset_t *set) {
   mtev_boolean used_new_one = mtev_false;
   void *vset;
+  noit_filter_compile_program(set);
   LOCKFS();
   if(mtev_hash_retrieve(filtersets, set->name, strlen(set->name), &vset)) {
     filterset_t *oldset = vset;
@@ -759,178 +818,325 @@ noit_update_metric_name(char *expanded_metric_name,
   }
 }
 
-mtev_boolean
-noit_apply_filterset(const char *filterset,
-                     noit_check_t *check,
-                     metric_t *metric) {
-  /* We pass in filterset here just in case someone wants to apply
-   * a filterset other than check->filterset.. You never know.
-   */
-  void *vfs;
-  if(!filterset) return mtev_true;   /* No filter */
-  if(!filtersets) return mtev_false; /* Couldn't possibly match */
-  if(!metric) return mtev_false;     /* Can't match a null metric */
-  struct timeval now;
-  const char *local_metric_name = noit_metric_get_full_metric_name(metric);
-  mtev_gettimeofday(&now, NULL);
+#define MATCHES(rname, value) noit_apply_filterrule(r->rname##_ht, r->rname ? r->rname : r->rname##_override, r->rname ? r->rname##_e : NULL, value)
 
+/* Per-metric view of the tags, parsed only when a rule needs them. */
+typedef struct {
+  metric_t *metric;
+  const char *full_name;
+  mtev_boolean parsed;
+  mtev_boolean tags_extended;
+  int mlen;
+  int mt_tag_start;
+  noit_metric_tag_t stags[MAX_TAGS], mtags[MAX_TAGS];
+  noit_metric_tagset_t stset, mtset;
   char encoded_nametag[NOIT_TAG_MAX_PAIR_LEN+1];
+} filter_metric_t;
+
+static void
+filter_metric_parse(filter_metric_t *fm) {
   char decoded_nametag[NOIT_TAG_MAX_PAIR_LEN+1];
-  noit_metric_tag_t stags[MAX_TAGS], mtags[MAX_TAGS];
-  noit_metric_tagset_t stset = { .tags = stags, .tag_count = MAX_TAGS };
-  noit_metric_tagset_t mtset = { .tags = mtags, .tag_count = MAX_TAGS };
-  int mlen = noit_metric_parse_tags(local_metric_name, strlen(metric->metric_name), &stset, &mtset);
-  if(mlen < 0) {
-    stset.tag_count = mtset.tag_count = 0;
-    mlen = strlen(local_metric_name);
-  }
-  if(stset.tag_count < MAX_TAGS-1) {
+  if(fm->parsed) return;
+  fm->parsed = mtev_true;
+  fm->stset.tags = fm->stags;
+  fm->stset.tag_count = MAX_TAGS;
+  fm->mtset.tags = fm->mtags;
+  fm->mtset.tag_count = MAX_TAGS;
+  fm->mlen = noit_metric_parse_tags(fm->full_name, strlen(fm->metric->metric_name), &fm->stset, &fm->mtset);
+  if(fm->mlen < 0) {
+    fm->stset.tag_count = fm->mtset.tag_count = 0;
+    fm->mlen = strlen(fm->full_name);
+  }
+  if(fm->stset.tag_count < MAX_TAGS-1) {
     /* add __name */
     snprintf(decoded_nametag, sizeof(decoded_nametag), "__name%c%.*s",
-             NOIT_TAG_DECODED_SEPARATOR, mlen, local_metric_name);
-    size_t nlen = noit_metric_tagset_encode_tag(encoded_nametag, sizeof(encoded_nametag),
+             NOIT_TAG_DECODED_SEPARATOR, fm->mlen, fm->full_name);
+    size_t nlen = noit_metric_tagset_encode_tag(fm->encoded_nametag, sizeof(fm->encoded_nametag),
                                                 decoded_nametag, strlen(decoded_nametag));
-    stset.tags[stset.tag_count].category_size = 7;
-    stset.tags[stset.tag_count].total_size = nlen;
-    stset.tags[stset.tag_count].tag = encoded_nametag;
-    stset.tag_count++;
+    fm->stset.tags[fm->stset.tag_count].category_size = 7;
+    fm->stset.tags[fm->stset.tag_count].total_size = nlen;
+    fm->stset.tags[fm->stset.tag_count].tag = fm->encoded_nametag;
+    fm->stset.tag_count++;
   }
-  bool mt_modified = false;
-  int mt_tag_start = mtset.tag_count;
-  char *expanded_metric_name = NULL;
+  fm->mt_tag_start = fm->mtset.tag_count;
+}
+
+/* The metric predicates of a rule (regex and tag searches) depend only on the
+ * metric's full name, so their verdicts are cached per rule by that name.
+ * Hash table rules are already a probe and may change under auto_add, so they
+ * are not cached; nor is anything once measurement tags have been added.
+ */
+static mtev_boolean
+filterrule_metric_matches(filterrule_t *r, filter_metric_t *fm) {
+  if(!r->metric_ht && !r->metric && !r->metric_override && !r->stsearch && !r->mtsearch) {
+    return mtev_true;
+  }
+  if(!r->metric_cache || fm->tags_extended) {
+    filter_metric_parse(fm);
+    return noit_apply_filterrule_metric(r, fm->metric->metric_name, fm->mlen, &fm->stset, &fm->mtset);
+  }
+  void *vverdict;
+  size_t keylen = strlen(fm->full_name);
+  pthread_rwlock_rdlock(&r->metric_cache_rw_lock);
+  int found = mtev_hash_retrieve(r->metric_cache, fm->full_name, keylen, &vverdict);
+  pthread_rwlock_unlock(&r->metric_cache_rw_lock);
+  if(found) return vverdict != NULL;
+
+  filter_metric_parse(fm);
+  mtev_boolean rv = noit_apply_filterrule_metric(r, fm->metric->metric_name, fm->mlen, &fm->stset, &fm->mtset);
+  pthread_rwlock_wrlock(&r->metric_cache_rw_lock);
+  if(mtev_hash_size(r->metric_cache) >= metric_cache_max) {
+    mtev_hash_delete_all(r->metric_cache, free, NULL);
+  }
+  char *key = mtev_strndup(fm->full_name, keylen);
+  if(!mtev_hash_store(r->metric_cache, key, keylen, rv ? (void *)r : NULL)) free(key);
+  pthread_rwlock_unlock(&r->metric_cache_rw_lock);
+  return rv;
+}
+
+static uint8_t
+filterrule_check_misses(filterrule_t *r, noit_check_t *check) {
+  uint8_t misses = 0;
+  if(!MATCHES(target, check->target)) misses |= FILTER_MISS_TARGET;
+  if(!MATCHES(module, check->module)) misses |= FILTER_MISS_MODULE;
+  if(!MATCHES(name, check->name)) misses |= FILTER_MISS_NAME;
+  return misses;
+}
+
+/* Evaluates (or fetches from the filterset's cache) the check-level
+ * predicates of every rule for the run's check. */
+static void
+filterset_run_compute_misses(noit_filterset_run_t *run) {
+  filterset_t *fs = run->fs;
+  noit_check_t *check = run->check;
+  filterset_check_cache_t *cc = NULL;
+  void *vcc;
+
+  run->gen = ck_pr_load_32(&fs->gen);
+  pthread_mutex_lock(&fs->check_cache_lock);
+  if(mtev_hash_retrieve(fs->check_cache, (const char *)check->checkid, UUID_SIZE, &vcc)) {
+    cc = vcc;
+    if(cc->fs_gen != run->gen || cc->check_generation != check->generation ||
+       strcmp(cc->target, check->target) || strcmp(cc->module, check->module) ||
+       strcmp(cc->name, check->name)) {
+      cc = NULL;
+    }
+  }
+  if(cc == NULL) {
+    if(mtev_hash_size(fs->check_cache) >= check_cache_max) {
+      mtev_hash_delete_all(fs->check_cache, NULL, filterset_check_cache_free);
+    }
+    cc = calloc(1, sizeof(*cc) + fs->rule_cnt);
+    mtev_uuid_copy(cc->checkid, check->checkid);
+    cc->check_generation = check->generation;
+    cc->fs_gen = run->gen;
+    cc->target = strdup(check->target);
+    cc->module = strdup(check->module);
+    cc->name = strdup(check->name);
+    for(filterrule_t *r = fs->rules; r; r = r->next) {
+      cc->misses[r->index] = filterrule_check_misses(r, check);
+    }
+    mtev_hash_replace(fs->check_cache, (const char *)cc->checkid, UUID_SIZE, cc,
+                      NULL, filterset_check_cache_free);
+  }
+  memcpy(run->misses, cc->misses, fs->rule_cnt);
+  pthread_mutex_unlock(&fs->check_cache_lock);
+}
+
+void
+noit_filterset_run_begin(noit_filterset_run_t *run, const char *filterset, noit_check_t *check) {
+  /* We pass in filterset here just in case someone wants to apply
+   * a filterset other than check->filterset.. You never know.
+   */
+  void *vfs;
+  memset(run, 0, sizeof(*run));
+  run->check = check;
+  if(!filterset) {
+    run->no_filter = mtev_true;
+    return;
+  }
+  if(!filtersets) return;
+  mtev_gettimeofday(&run->now, NULL);
   LOCKFS();
   if(mtev_hash_retrieve(filtersets, filterset, strlen(filterset), &vfs)) {
-    filterset_t *fs = (filterset_t *)vfs;
-    noit_filter_update_last_touched(fs);
-    filterrule_t *r, *skipto_rule = NULL;
-    mtev_boolean ret = mtev_false;
-    ck_pr_inc_32(&fs->ref_cnt);
-    ck_pr_inc_32(&fs->executions);
-    UNLOCKFS();
-#define MATCHES(rname, value) noit_apply_filterrule(r->rname##_ht, r->rname ? r->rname : r->rname##_override, r->rname ? r->rname##_e : NULL, value)
-    for(r = fs->rules; r; r = r->next) {
-      int need_target, need_module, need_name, need_metric;
-      /* If we're targeting a skipto rule, match or continue */
-      if(skipto_rule && skipto_rule != r) continue;
-      skipto_rule = NULL;
-
-      ck_pr_inc_32(&r->executions);
-
-      need_target = !MATCHES(target, check->target);
-      need_module = !MATCHES(module, check->module);
-      need_name = !MATCHES(name, check->name);
-      need_metric = !noit_apply_filterrule_metric(r, metric->metric_name, mlen, &stset, &mtset);
-
-      if(!need_target && !need_module && !need_name && !need_metric) {
-        if(r->type == NOIT_FILTER_SKIPTO) {
-          skipto_rule = r->skipto_rule;
-          continue;
-        }
-        else if (r->type == NOIT_FILTER_ADD_MEASUREMENT_TAG) {
-          int result = noit_add_measurement_tag(r, metric, &expanded_metric_name, &mtset);
-          if (result == 0) {
-            mt_modified = true;
-          }
-          else if (result < 0) {
-            mtevL(nf_error, "could not apply measurement tag - <%s:%s>\n",
-              r->measurement_tag.add_measurement_tag_cat,
-              r->measurement_tag.add_measurement_tag_val ? r->measurement_tag.add_measurement_tag_val : "");
-          }
-          continue;
+    run->fs = (filterset_t *)vfs;
+    noit_filter_update_last_touched(run->fs);
+    ck_pr_inc_32(&run->fs->ref_cnt);
+  }
+  UNLOCKFS();
+  if(run->fs) {
+    run->misses = malloc(run->fs->rule_cnt + 1);
+    filterset_run_compute_misses(run);
+  }
+}
+
+void
+noit_filterset_run_end(noit_filterset_run_t *run) {
+  if(run->fs) noit_filter_filterset_free(run->fs);
+  free(run->misses);
+  run->fs = NULL;
+  run->misses = NULL;
+}
+
+mtev_boolean
+noit_filterset_run_apply(noit_filterset_run_t *run, metric_t *metric) {
+  if(run->no_filter) return mtev_true; /* No filter */
+  if(!run->fs) return mtev_false;      /* Couldn't possibly match */
+  if(!metric) return mtev_false;       /* Can't match a null metric */
+  filterset_t *fs = run->fs;
+  noit_check_t *check = run->check;
+  struct timeval now = run->now;
+
+  /* An auto_add or flush changed what the check-level predicates see */
+  if(ck_pr_load_32(&fs->gen) != run->gen) filterset_run_compute_misses(run);
+
+  filter_metric_t fm;
+  fm.metric = metric;
+  fm.full_name = noit_metric_get_full_metric_name(metric);
+  fm.parsed = mtev_false;
+  fm.tags_extended = mtev_false;
+  bool mt_modified = false;
+  char *expanded_metric_name = NULL;
+  filterrule_t *r, *skipto_rule = NULL;
+  mtev_boolean ret = mtev_false;
+  ck_pr_inc_32(&fs->executions);
+  for(r = fs->rules; r; r = r->next) {
+    int need_target, need_module, need_name, need_metric;
+    /* If we're targeting a skipto rule, match or continue */
+    if(skipto_rule && skipto_rule != r) continue;
+    skipto_rule = NULL;
+
+    ck_pr_inc_32(&r->executions);
+
+    uint8_t misses = run->misses[r->index];
+    need_target = (misses & FILTER_MISS_TARGET) != 0;
+    need_module = (misses & FILTER_MISS_MODULE) != 0;
+    need_name = (misses & FILTER_MISS_NAME) != 0;
+    /* If the check can never satisfy this rule, the metric is irrelevant */
+#define CANNOT_ADD(rname) (need_##rname && !(r->rname##_auto_hash_max > 0 && r->rname##_ht))
+    if(CANNOT_ADD(target) || CANNOT_ADD(module) || CANNOT_ADD(name)) need_metric = 1;
+    else need_metric = !filterrule_metric_matches(r, &fm);
+
+    if(!need_target && !need_module && !need_name && !need_metric) {
+      if(r->type == NOIT_FILTER_SKIPTO) {
+        skipto_rule = r->skipto_rule;
+        continue;
+      }
+      else if (r->type == NOIT_FILTER_ADD_MEASUREMENT_TAG) {
+        filter_metric_parse(&fm);
+        int result = noit_add_measurement_tag(r, metric, &expanded_metric_name, &fm.mtset);
+        if (result == 0) {
+          mt_modified = true;
+          fm.tags_extended = mtev_true;
         }
-        ck_pr_inc_32(&r->matches);
-        ret = (r->type == NOIT_FILTER_ACCEPT) ? mtev_true : mtev_false;
-        if (mt_modified) {
-          noit_update_metric_name(expanded_metric_name, &mtset, mt_tag_start, metric);
-          mt_modified = false;
+        else if (result < 0) {
+          mtevL(nf_error, "could not apply measurement tag - <%s:%s>\n",
+            r->measurement_tag.add_measurement_tag_cat,
+            r->measurement_tag.add_measurement_tag_val ? r->measurement_tag.add_measurement_tag_val : "");
         }
-        break;
+        continue;
       }
-      /* If we need some of these and we have an auto setting that isn't fulfilled for each of them, we can add and succeed */
+      ck_pr_inc_32(&r->matches);
+      ret = (r->type == NOIT_FILTER_ACCEPT) ? mtev_true : mtev_false;
+      if (mt_modified) {
+        noit_update_metric_name(expanded_metric_name, &fm.mtset, fm.mt_tag_start, metric);
+        mt_modified = false;
+      }
+      break;
+    }
+    /* If we need some of these and we have an auto setting that isn't fulfilled for each of them, we can add and succeed */
 #define CHECK_ADD(rname) (!need_##rname || (r->rname##_auto_hash_max > 0 && r->rname##_ht && mtev_hash_size(r->rname##_ht) < r->rname##_auto_hash_max))
 #define UPDATE_FILTER_RULE(rname, value) pthread_rwlock_wrlock(&r->rname##_ht_rw_lock); \
   mtev_hash_replace(r->rname##_ht, strdup(value), strlen(value), NULL, free, NULL); \
-  pthread_rwlock_unlock(&r->rname##_ht_rw_lock);
-
-      /* flush if required */
-      if(r->flush_interval.tv_sec || r->flush_interval.tv_usec) {
-        struct timeval reset;
-        pthread_mutex_lock(&r->flush_lock);
-        add_timeval(r->last_flush, r->flush_interval, &reset);
-        if(compare_timeval(now, reset) >= 0) {
-          mtev_boolean did_work = mtev_false;
-          if(r->target_auto_hash_max) {
-            pthread_rwlock_wrlock(&r->target_ht_rw_lock);
-            mtev_hash_delete_all(r->target_ht, free, NULL);
-            pthread_rwlock_unlock(&r->target_ht_rw_lock);
-            did_work = mtev_true;
-          }
-          if(r->module_auto_hash_max) {
-            pthread_rwlock_wrlock(&r->module_ht_rw_lock);
-            mtev_hash_delete_all(r->module_ht, free, NULL);
-            pthread_rwlock_unlock(&r->module_ht_rw_lock);
-            did_work = mtev_true;
-          }
-          if(r->name_auto_hash_max) {
-            pthread_rwlock_wrlock(&r->name_ht_rw_lock);
-            mtev_hash_delete_all(r->name_ht, free, NULL);
-            pthread_rwlock_unlock(&r->name_ht_rw_lock);
-            did_work = mtev_true;
-          }
-          if(r->metric_auto_hash_max) {
-            pthread_rwlock_wrlock(&r->metric_ht_rw_lock);
-            mtev_hash_delete_all(r->metric_ht, free, NULL);
-            pthread_rwlock_unlock(&r->metric_ht_rw_lock);
-            did_work = mtev_true;
-          }
-          memcpy(&r->last_flush, &now, sizeof(now));
-          if(did_work) {
-            mtevL(nf_debug, "flushed auto_add rule %s%s%s\n", fs->name, r->ruleid ? ":" : "", r->ruleid ? r->ruleid : "");
-          }
+  pthread_rwlock_unlock(&r->rname##_ht_rw_lock); \
+  ck_pr_inc_32(&fs->gen);
+
+    /* flush if required */
+    if(r->flush_interval.tv_sec || r->flush_interval.tv_usec) {
+      struct timeval reset;
+      pthread_mutex_lock(&r->flush_lock);
+      add_timeval(r->last_flush, r->flush_interval, &reset);
+      if(compare_timeval(now, reset) >= 0) {
+        mtev_boolean did_work = mtev_false;
+        if(r->target_auto_hash_max) {
+          pthread_rwlock_wrlock(&r->target_ht_rw_lock);
+          mtev_hash_delete_all(r->target_ht, free, NULL);
+          pthread_rwlock_unlock(&r->target_ht_rw_lock);
+          did_work = mtev_true;
+        }
+        if(r->module_auto_hash_max) {
+          pthread_rwlock_wrlock(&r->module_ht_rw_lock);
+          mtev_hash_delete_all(r->module_ht, free, NULL);
+          pthread_rwlock_unlock(&r->module_ht_rw_lock);
+          did_work = mtev_true;
+        }
+        if(r->name_auto_hash_max) {
+          pthread_rwlock_wrlock(&r->name_ht_rw_lock);
+          mtev_hash_delete_all(r->name_ht, free, NULL);
+          pthread_rwlock_unlock(&r->name_ht_rw_lock);
+          did_work = mtev_true;
+        }
+        if(r->metric_auto_hash_max) {
+          pthread_rwlock_wrlock(&r->metric_ht_rw_lock);
+          mtev_hash_delete_all(r->metric_ht, free, NULL);
+          pthread_rwlock_unlock(&r->metric_ht_rw_lock);
+          did_work = mtev_true;
+        }
+        memcpy(&r->last_flush, &now, sizeof(now));
+        if(did_work) {
+          ck_pr_inc_32(&fs->gen);
+          mtevL(nf_debug, "flushed auto_add rule %s%s%s\n", fs->name, r->ruleid ? ":" : "", r->ruleid ? r->ruleid : "");
         }
-        pthread_mutex_unlock(&r->flush_lock);
       }
+      pthread_mutex_unlock(&r->flush_lock);
+    }
 
-      if(CHECK_ADD(target) && CHECK_ADD(module) && CHECK_ADD(name) && CHECK_ADD(metric)) {
-        if(r->type == NOIT_FILTER_SKIPTO) {
-          skipto_rule = r->skipto_rule;
-          continue;
-        }
-        else if (r->type == NOIT_FILTER_ADD_MEASUREMENT_TAG) {
-          int result = noit_add_measurement_tag(r, metric, &expanded_metric_name, &mtset);
-          if (result == 0) {
-            mt_modified = true;
-          }
-          else if (result < 0) {
-            mtevL(nf_error, "could not apply measurement tag - <%s:%s>\n",
-              r->measurement_tag.add_measurement_tag_cat,
-              r->measurement_tag.add_measurement_tag_val ? r->measurement_tag.add_measurement_tag_val : "");
-          }
-          continue;
+    if(CHECK_ADD(target) && CHECK_ADD(module) && CHECK_ADD(name) && CHECK_ADD(metric)) {
+      if(r->type == NOIT_FILTER_SKIPTO) {
+        skipto_rule = r->skipto_rule;
+        continue;
+      }
+      else if (r->type == NOIT_FILTER_ADD_MEASUREMENT_TAG) {
+        filter_metric_parse(&fm);
+        int result = noit_add_measurement_tag(r, metric, &expanded_metric_name, &fm.mtset);
+        if (result == 0) {
+          mt_modified = true;
+          fm.tags_extended = mtev_true;
         }
-        if (mt_modified) {
-          noit_update_metric_name(expanded_metric_name, &mtset, mt_tag_start, metric);
-          mt_modified = false;
+        else if (result < 0) {
+          mtevL(nf_error, "could not apply measurement tag - <%s:%s>\n",
+            r->measurement_tag.add_measurement_tag_cat,
+            r->measurement_tag.add_measurement_tag_val ? r->measurement_tag.add_measurement_tag_val : "");
         }
-        if(need_target) { UPDATE_FILTER_RULE(target, check->target); }
-        if(need_module) { UPDATE_FILTER_RULE(module, check->module); }
-        if(need_name) { UPDATE_FILTER_RULE(name, check->name); }
-        if(need_metric) { UPDATE_FILTER_RULE(metric, metric->metric_name); }
-
-        ck_pr_inc_32(&r->matches);
-        ret = (r->type == NOIT_FILTER_ACCEPT) ? mtev_true : mtev_false;
-        break;
+        continue;
+      }
+      if (mt_modified) {
+        noit_update_metric_name(expanded_metric_name, &fm.mtset, fm.mt_tag_start, metric);
+        mt_modified = false;
       }
+      if(need_target) { UPDATE_FILTER_RULE(target, check->target); }
+      if(need_module) { UPDATE_FILTER_RULE(module, check->module); }
+      if(need_name) { UPDATE_FILTER_RULE(name, check->name); }
+      if(need_metric) { UPDATE_FILTER_RULE(metric, metric->metric_name); }
+
+      ck_pr_inc_32(&r->matches);
+      ret = (r->type == NOIT_FILTER_ACCEPT) ? mtev_true : mtev_false;
+      break;
     }
-    noit_filter_filterset_free(fs);
-    if(!ret) ck_pr_inc_32(&fs->denies);
-    return ret;
   }
-  UNLOCKFS();
-  if (mt_modified) {
-    noit_update_metric_name(expanded_metric_name, &mtset, mt_tag_start, metric);
-  }
-  return mtev_false;
+  if(!ret) ck_pr_inc_32(&fs->denies);
+  return ret;
+}
+
+mtev_boolean
+noit_apply_filterset(const char *filterset,
+                     noit_check_t *check,
+                     metric_t *metric) {
+  noit_filterset_run_t run;
+  noit_filterset_run_begin(&run, filterset, check);
+  mtev_boolean ret = noit_filterset_run_apply(&run, metric);
+  noit_filterset_run_end(&run);
+  return ret;
 }
 
 static char *
@@ -1454,6 +1660,27 @@ register_console_filter_commands() {
     NCSCMD("filterset", noit_console_filter_configure, NULL, NULL, (void *)1));
 }
 
+static mtev_hook_return_t
+filters_check_deleted(void *closure, noit_check_t *check) {
+  (void)closure;
+  void *vfs;
+  filterset_t *fs = NULL;
+  if(!check->filterset || !filtersets) return MTEV_HOOK_CONTINUE;
+  LOCKFS();
+  if(mtev_hash_retrieve(filtersets, check->filterset, strlen(check->filterset), &vfs)) {
+    fs = (filterset_t *)vfs;
+    ck_pr_inc_32(&fs->ref_cnt);
+  }
+  UNLOCKFS();
+  if(!fs) return MTEV_HOOK_CONTINUE;
+  pthread_mutex_lock(&fs->check_cache_lock);
+  mtev_hash_delete(fs->check_cache, (const char *)check->checkid, UUID_SIZE,
+                   NULL, filterset_check_cache_free);
+  pthread_mutex_unlock(&fs->check_cache_lock);
+  noit_filter_filterset_free(fs);
+  return MTEV_HOOK_CONTINUE;
+}
+
 void
 noit_filters_init() {
   const char *error;
@@ -1463,6 +1690,8 @@ noit_filters_init() {
   nf_debug = mtev_log_stream_find("debug/noit/filters");
 
   mtev_conf_get_uint64(MTEV_CONF_ROOT, "//filtersets/@cull_idle_threshold", &cull_idle_threshold_ms);
+  mtev_conf_get_uint32(MTEV_CONF_ROOT, "//filtersets/@metric_cache_size", &metric_cache_max);
+  mtev_conf_get_uint32(MTEV_CONF_ROOT, "//filtersets/@check_cache_size", &check_cache_max);
 
   /* lmdb_path dictates where an LMDB backing store for checks would live.
    * use_lmdb defaults to the existence of an lmdb_path...
@@ -1505,6 +1734,7 @@ noit_filters_init() {
   }
   mtev_capabilities_add_feature("filterset:hash", NULL);
   register_console_filter_commands();
+  check_deleted_hook_register("filters", filters_check_deleted, NULL);
 
   if (use_lmdb == mtev_true) {
     noit_filters_lmdb_filters_from_lmdb();
@@ -111,6 +111,9 @@ typedef struct _filterrule {
   struct timeval last_flush;
   struct timeval flush_interval;
   pthread_mutex_t flush_lock;
+  int index;                      /* position within the filterset */
+  mtev_hash_table *metric_cache;  /* metric name -> verdict of the metric predicates */
+  pthread_rwlock_t metric_cache_rw_lock;
 } filterrule_t;
 
 typedef struct {
@@ -121,8 +124,25 @@ typedef struct {
   filterrule_t *rules;
   uint32_t executions;
   uint32_t denies;
+  int rule_cnt;
+  uint32_t gen;                   /* bumped when auto_add tables change */
+  pthread_mutex_t check_cache_lock;
+  mtev_hash_table *check_cache;   /* check uuid -> check-level rule outcomes */
 } filterset_t;
 
+/* Applying a filterset to many metrics of one check: begin a run, apply it
+ * to each metric and end it.  The filterset is looked up and the rules'
+ * target/module/name predicates evaluated once per run rather than once per
+ * metric.  A run must not outlive the check. */
+typedef struct {
+  filterset_t *fs;
+  noit_check_t *check;
+  mtev_boolean no_filter;
+  uint32_t gen;
+  uint8_t *misses;
+  struct timeval now;
+} noit_filterset_run_t;
+
 API_EXPORT(bool)
   noit_filter_initialized();
 
@@ -156,6 +176,16 @@ API_EXPORT(mtev_boolean)
                        noit_check_t *check,
                        metric_t *metric);
 
+API_EXPORT(void)
+  noit_filterset_run_begin(noit_filterset_run_t *run, const char *filterset,
+                           noit_check_t *check);
+
+API_EXPORT(mtev_boolean)
+  noit_filterset_run_apply(noit_filterset_run_t *run, metric_t *metric);
+
+API_EXPORT(void)
+  noit_filterset_run_end(noit_filterset_run_t *run);
+
 API_EXPORT(mtev_boolean)
   noit_filter_compile_add_load_set(filterset_t *set);
 
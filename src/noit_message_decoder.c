@@ -38,9 +38,34 @@
 #include <ctype.h>
 #include <mtev_log.h>
 #include <mtev_str.h>
+#include <ck_pr.h>
 
 #include "noit_metric.h"
 
+struct noit_metric_message_block {
+  uint32_t refcnt;
+  uint32_t size;
+  uint32_t used;
+  uint32_t pad;
+  char data[];
+};
+
+struct noit_metric_message_arena {
+  size_t block_size;
+  noit_metric_message_block_t *current;
+  uint64_t blocks_allocated;
+};
+
+#define BLOCK_ALIGN(x) (((x) + 7) & ~((size_t)7))
+
+static inline void *
+block_alloc(noit_metric_message_block_t *block, size_t len) {
+  size_t off = BLOCK_ALIGN(block->used);
+  if(off + len > block->size) return NULL;
+  block->used = off + len;
+  return block->data + off;
+}
+
 #define MOVE_TO_NEXT_TAB(message, cp, lvalue) do { \
   ssize_t adv = cp - (message)->original_message; \
   lvalue = memchr(cp, '\t', (message)->original_message_len - adv); \
@@ -231,7 +256,27 @@ int noit_is_timestamp(const char *line, int len) {
   }
   return is_ts;
 }
-int noit_message_decoder_parse_line(noit_metric_message_t *message, int has_noit) {
+size_t noit_metric_tags_count(const char *str, size_t strlen);
+ssize_t noit_metric_tags_parse(const char *tagnm, size_t tagnmlen,
+                               noit_metric_tag_t *tags, size_t tag_count,
+                               size_t *canonical_size_out);
+static int noit_metric_process_tags_in_block(noit_metric_message_t *message);
+
+/* Check names look like target`module`c_<account>_<check>::... */
+static void
+account_id_from_check_name(const char *check_name, const char *end, uint64_t *account_id) {
+  const char *acctid_str = check_name;
+  acctid_str = memchr(acctid_str, '`', end - acctid_str);
+  if(acctid_str) acctid_str = memchr(acctid_str+1, '`', end - acctid_str - 1);
+  if(acctid_str && acctid_str < end - 6 && memcmp(acctid_str, "`c_", 3) == 0) {
+    acctid_str += 3;
+    const char *fe = memchr(acctid_str, '_', end - acctid_str);
+    if(fe) *account_id = strtoull(acctid_str, NULL, 10);
+  }
+}
+
+static int
+noit_message_decoder_parse_line_internal(noit_metric_message_t *message, int has_noit) {
   const char *cp, *metric_type_str, *time_str, *check_id_str;
   char *value_str;
   char *dp, id_str_copy[UUID_PRINTABLE_STRING_LENGTH];
@@ -273,14 +318,7 @@ int noit_message_decoder_parse_line(noit_metric_message_t *message, int has_noit
   if(!message->id.name)
     return -3;
 
-  const char *acctid_str = check_id_str;
-  acctid_str = memchr(acctid_str, '`', message->id.name - acctid_str);
-  if(acctid_str) acctid_str = memchr(acctid_str+1, '`', message->id.name - acctid_str - 1);
-  if(acctid_str && acctid_str < message->id.name - 6 && memcmp(acctid_str, "`c_", 3) == 0) {
-    acctid_str += 3;
-    const char *fe = memchr(acctid_str, '_', message->id.name - acctid_str);
-    if(fe) message->id.account_id = strtoull(acctid_str, NULL, 10);
-  }
+  account_id_from_check_name(check_id_str, message->id.name, &message->id.account_id);
 
   memcpy(id_str_copy, message->id.name - UUID_STR_LEN - 1, UUID_STR_LEN);
   id_str_copy[UUID_STR_LEN] = '\0';
@@ -305,7 +343,8 @@ int noit_message_decoder_parse_line(noit_metric_message_t *message, int has_noit
     if(message->id.name_len > MAX_METRIC_TAGGED_NAME) {
       return -8;
     }
-    if(noit_metric_process_tags(message) != 0) {
+    if((message->block ? noit_metric_process_tags_in_block(message)
+                       : noit_metric_process_tags(message)) != 0) {
       return -9;
     }
 
@@ -342,7 +381,12 @@ int noit_message_decoder_parse_line(noit_metric_message_t *message, int has_noit
       case METRIC_STRING:
         /* It's possible for M records that the \n is included, it should not be. */
         if(vlen > 0 && value_str[vlen-1] == '\n') vlen--;
-        message->value.value.v_string = mtev_strndup(value_str, vlen);
+        if(message->block) {
+          /* The value is the tail of our own copy, terminate it in place. */
+          value_str[vlen] = '\0';
+          message->value.value.v_string = value_str;
+        }
+        else message->value.value.v_string = mtev_strndup(value_str, vlen);
         break;
       default:
         return -9;
@@ -357,7 +401,8 @@ int noit_message_decoder_parse_line(noit_metric_message_t *message, int has_noit
       return -4;
 
     message->id.name_len = value_str - message->id.name - 1;
-    if(noit_metric_process_tags(message) != 0) {
+    if((message->block ? noit_metric_process_tags_in_block(message)
+                       : noit_metric_process_tags(message)) != 0) {
       return -7;
     }
 
@@ -374,6 +419,10 @@ int noit_message_decoder_parse_line(noit_metric_message_t *message, int has_noit
     }
     if(vstrlen == 0)
       message->value.value.v_string = NULL;
+    else if(message->block) {
+      value_str[vstrlen] = '\0';
+      message->value.value.v_string = value_str;
+    }
     else {
       message->value.value.v_string = mtev_strndup(value_str, vstrlen);
     }
@@ -391,6 +440,328 @@ int noit_message_decoder_parse_line(noit_metric_message_t *message, int has_noit
   return 0;
 }
 
+int noit_message_decoder_parse_line(noit_metric_message_t *message, int has_noit) {
+  return noit_message_decoder_parse_line_internal(message, has_noit);
+}
+
+static void
+block_release(noit_metric_message_block_t *block) {
+  bool zero;
+  ck_pr_dec_32_zero(&block->refcnt, &zero);
+  if(zero) free(block);
+}
+
+static noit_metric_message_block_t *
+block_new(noit_metric_message_arena_t *arena, size_t need) {
+  size_t size = arena->block_size;
+  if(need > size) size = need; /* oversized payloads get a dedicated block */
+  noit_metric_message_block_t *block = malloc(sizeof(*block) + size);
+  if(!block) return NULL;
+  block->refcnt = 1; /* held by the arena until it moves on */
+  block->size = size;
+  block->used = 0;
+  arena->blocks_allocated++;
+  return block;
+}
+
+/* Move any heap memory the generic tag processing left on an id into the block. */
+static mtev_boolean
+block_adopt_id(noit_metric_message_block_t *block, noit_metric_id_t *id) {
+  noit_metric_tagset_t *sets[2] = { &id->stream, &id->measurement };
+  if(id->alloc_name) {
+    char *name = block_alloc(block, id->name_len_with_tags + 1);
+    if(!name) return mtev_false;
+    memcpy(name, id->alloc_name, id->name_len_with_tags);
+    name[id->name_len_with_tags] = '\0';
+    for(int i=0; i<2; i++) relative_tags_adjust(sets[i], id->alloc_name, name);
+    free(id->alloc_name);
+    id->alloc_name = NULL;
+    id->name = name;
+  }
+  for(int i=0; i<2; i++) {
+    if(!sets[i]->tags) continue;
+    noit_metric_tag_t *tags = NULL;
+    if(sets[i]->tag_count > 0) {
+      tags = block_alloc(block, sets[i]->tag_count * sizeof(*tags));
+      if(!tags) return mtev_false;
+      memcpy(tags, sets[i]->tags, sets[i]->tag_count * sizeof(*tags));
+    }
+    free(sets[i]->tags);
+    sets[i]->tags = tags;
+  }
+  return mtev_true;
+}
+
+static mtev_boolean
+block_parse_tagset(noit_metric_message_block_t *block, const char *section, size_t len,
+                   noit_metric_tagset_t *out) {
+  char canon[MAX_METRIC_TAGGED_NAME];
+  size_t tag_count = noit_metric_tags_count(section, len);
+  size_t canonical_size = 0;
+  if(tag_count == 0) return mtev_false;
+  noit_metric_tag_t *tags = block_alloc(block, tag_count * sizeof(*tags));
+  if(!tags) return mtev_false;
+  ssize_t parsed = noit_metric_tags_parse(section, len, tags, tag_count, &canonical_size);
+  if(parsed <= 0) return mtev_false;
+  /* Only accept the fast path if the input is already canonical, so the
+   * tags can keep pointing into the name as-is. */
+  if(noit_metric_tags_canonical(tags, parsed, canon, sizeof(canon), mtev_false) != (ssize_t)len ||
+     memcmp(canon, section, len)) {
+    return mtev_false;
+  }
+  out->tags = tags;
+  out->tag_count = parsed;
+  out->canonical_size = canonical_size;
+  return mtev_true;
+}
+
+static int
+noit_metric_process_tags_in_block(noit_metric_message_t *message) {
+  noit_metric_message_block_t *block = message->block;
+  noit_metric_id_t *id = &message->id;
+  uint32_t mark = block->used;
+  const char *name = id->name;
+  int len = id->name_len;
+  const char *st = mtev_memmem(name, len, "|ST[", 4);
+  const char *mt = mtev_memmem(name, len, "|MT{", 4);
+  const char *end = name + len;
+  int base_len = len;
+
+  /* Try the common canonical shapes: name, name|ST[..], name|MT{..}, name|ST[..]|MT{..}
+   * Anything else (repeated sections, empty sections, unclean names, unsorted
+   * tags) goes down the generic path and has its results adopted into the block. */
+  if(st) base_len = st - name;
+  if(mt && mt - name < base_len) base_len = mt - name;
+  if(base_len > 0 && noit_metric_name_is_clean(name, base_len)) {
+    mtev_boolean ok = mtev_true;
+    const char *st_end = end, *mt_start = mt;
+    if(mt && st && mt < st) ok = mtev_false;
+    if(ok && st) {
+      st_end = mt ? mt : end;
+      if(st_end - st < 6 || st_end[-1] != ']' ||
+         mtev_memmem(st + 4, st_end - st - 4, "|ST[", 4) ||
+         !block_parse_tagset(block, st + 4, st_end - st - 5, &id->stream)) ok = mtev_false;
+    }
+    if(ok && mt_start) {
+      if(end - mt_start < 6 || end[-1] != '}' ||
+         mtev_memmem(mt_start + 4, end - mt_start - 4, "|MT{", 4) ||
+         !block_parse_tagset(block, mt_start + 4, end - mt_start - 5, &id->measurement)) ok = mtev_false;
+    }
+    if(ok) {
+      id->name_len_with_tags = len;
+      id->name_len = base_len;
+      return 0;
+    }
+    memset(&id->stream, 0, sizeof(id->stream));
+    memset(&id->measurement, 0, sizeof(id->measurement));
+    block->used = mark;
+  }
+
+  int rv = noit_metric_process_tags(message);
+  if(!block_adopt_id(block, id)) {
+    noit_metric_id_clear(id);
+    return -1;
+  }
+  return rv;
+}
+
+noit_metric_message_arena_t *
+noit_metric_message_arena_alloc(size_t block_size) {
+  noit_metric_message_arena_t *arena = calloc(1, sizeof(*arena));
+  arena->block_size = block_size;
+  return arena;
+}
+
+void
+noit_metric_message_arena_free(noit_metric_message_arena_t *arena) {
+  if(!arena) return;
+  if(arena->current) block_release(arena->current);
+  free(arena);
+}
+
+uint64_t
+noit_metric_message_arena_blocks_allocated(noit_metric_message_arena_t *arena) {
+  return arena->blocks_allocated;
+}
+
+/* The most tag processing of a name within these len bytes can take from a
+ * block: a copy of the name (canonicalization never lengthens it) and both
+ * tagsets' arrays.  Every tag section opens with '[' or '{' and holds one
+ * more tag than it has commas, however many sections the name repeats. */
+static size_t
+block_tags_need(const char *str, size_t len) {
+  size_t seps = 0;
+  for(const char *cp = str; cp < str + len; cp++)
+    if(*cp == ',' || *cp == '[' || *cp == '{') seps++;
+  return BLOCK_ALIGN(len + 1) + BLOCK_ALIGN((seps + 1) * sizeof(noit_metric_tag_t)) + 8;
+}
+
+/* Returns a block with at least need bytes free, moving the arena on if required. */
+static noit_metric_message_block_t *
+arena_reserve(noit_metric_message_arena_t *arena, size_t need) {
+  noit_metric_message_block_t *block = arena->current;
+  if(!block || BLOCK_ALIGN(block->used) + need > block->size) {
+    noit_metric_message_block_t *nblock = block_new(arena, need);
+    if(!nblock) return NULL;
+    if(block) block_release(block);
+    block = arena->current = nblock;
+  }
+  return block;
+}
+
+noit_metric_message_t *
+noit_metric_message_arena_decode(noit_metric_message_arena_t *arena,
+                                 const char *payload, size_t payload_len,
+                                 int has_noit, const noit_noit_t *noit, int *rv) {
+  size_t copy_len = payload_len + 1;
+  if(noit) copy_len += noit->name_len + 1;
+  /* the name is somewhere in the payload, so bound its tags by the payload's */
+  size_t need = BLOCK_ALIGN(sizeof(noit_metric_message_t)) + BLOCK_ALIGN(copy_len) +
+                block_tags_need(payload, payload_len);
+
+  noit_metric_message_block_t *block = arena_reserve(arena, need);
+  if(!block) return NULL;
+
+  noit_metric_message_t *message = block_alloc(block, sizeof(*message));
+  char *copy = block_alloc(block, copy_len);
+  memset(message, 0, sizeof(*message));
+  memcpy(copy, payload, payload_len);
+  copy[payload_len] = '\0';
+  if(noit) {
+    memcpy(copy + payload_len + 1, noit->name, noit->name_len);
+    copy[payload_len + 1 + noit->name_len] = '\0';
+  }
+  message->block = block;
+  message->type = copy[0];
+  message->original_allocated = mtev_false;
+  message->original_message = copy;
+  message->original_message_len = payload_len;
+  ck_pr_inc_32(&block->refcnt);
+
+  int prv = noit_message_decoder_parse_line_internal(message, has_noit);
+  if(rv) *rv = prv;
+  if(message->noit.name == NULL && noit) {
+    message->noit.name_len = noit->name_len;
+    message->noit.name = copy + payload_len + 1;
+  }
+  return message;
+}
+
+noit_metric_message_t *
+noit_metric_message_build(noit_metric_message_arena_t *arena,
+                          const char *check_name, size_t check_name_len,
+                          const uuid_t check_uuid,
+                          const char *metric_name, size_t metric_name_len,
+                          const noit_metric_value_t *value, size_t string_len,
+                          const noit_noit_t *noit, int *rv) {
+  noit_metric_message_t *message;
+  char *copy, *str = NULL;
+  mtev_boolean has_string = !value->is_null && value->type == METRIC_STRING &&
+                            value->value.v_string != NULL;
+  size_t copy_len = metric_name_len + 1;
+  if(noit) copy_len += noit->name_len + 1;
+
+  if(arena) {
+    size_t need = BLOCK_ALIGN(sizeof(noit_metric_message_t)) + BLOCK_ALIGN(copy_len) +
+                  block_tags_need(metric_name, metric_name_len) + BLOCK_ALIGN(string_len + 1);
+    noit_metric_message_block_t *block = arena_reserve(arena, need);
+    if(!block) return NULL;
+    message = block_alloc(block, sizeof(*message));
+    copy = block_alloc(block, copy_len);
+    if(has_string) str = block_alloc(block, string_len + 1);
+    memset(message, 0, sizeof(*message));
+    message->block = block;
+    ck_pr_inc_32(&block->refcnt);
+  }
+  else {
+    message = calloc(1, sizeof(*message));
+    copy = malloc(copy_len);
+    if(has_string) str = malloc(string_len + 1);
+    message->original_allocated = mtev_true;
+    message->refcnt = 1;
+  }
+
+  /* As with other non-line sources, the "original" is just the metric name. */
+  memcpy(copy, metric_name, metric_name_len);
+  copy[metric_name_len] = '\0';
+  message->type = MESSAGE_TYPE_M;
+  message->original_message = copy;
+  message->original_message_len = metric_name_len;
+  if(noit) {
+    memcpy(copy + metric_name_len + 1, noit->name, noit->name_len);
+    copy[metric_name_len + 1 + noit->name_len] = '\0';
+    message->noit.name = copy + metric_name_len + 1;
+    message->noit.name_len = noit->name_len;
+  }
+
+  message->value = *value;
+  if(has_string) {
+    memcpy(str, value->value.v_string, string_len);
+    str[string_len] = '\0';
+    message->value.value.v_string = str;
+  }
+  else if(value->type == METRIC_STRING) message->value.value.v_string = NULL;
+
+  mtev_uuid_copy(message->id.id, check_uuid);
+  account_id_from_check_name(check_name, check_name + check_name_len, &message->id.account_id);
+  message->id.name = copy;
+  message->id.name_len = metric_name_len;
+  if(metric_name_len > MAX_METRIC_TAGGED_NAME) {
+    if(rv) *rv = -8;
+  }
+  else if((message->block ? noit_metric_process_tags_in_block(message)
+                          : noit_metric_process_tags(message)) != 0) {
+    if(rv) *rv = -9;
+  }
+  else if(rv) *rv = 1;
+  return message;
+}
+
+void
+noit_metric_message_ref(noit_metric_message_t *message) {
+  if(message->block) ck_pr_inc_32(&message->block->refcnt);
+  else ck_pr_inc_32(&message->refcnt);
+}
+
+void
+noit_metric_message_ref_n(noit_metric_message_t *message, uint32_t n) {
+  if(message->block) ck_pr_add_32(&message->block->refcnt, n);
+  else ck_pr_add_32(&message->refcnt, n);
+}
+
+static void
+block_release_n(noit_metric_message_block_t *block, uint32_t n) {
+  if(ck_pr_faa_32(&block->refcnt, -n) == n) free(block);
+}
+
+void
+noit_metric_message_deref_batch(noit_metric_message_t **messages, size_t cnt) {
+  size_t i = 0;
+  while(i < cnt) {
+    noit_metric_message_block_t *block = messages[i]->block;
+    if(block == NULL) {
+      noit_metric_message_deref(messages[i++]);
+      continue;
+    }
+    /* consecutive messages from the same block release together */
+    uint32_t run = 1;
+    while(i + run < cnt && messages[i + run]->block == block) run++;
+    block_release_n(block, run);
+    i += run;
+  }
+}
+
+void
+noit_metric_message_deref(noit_metric_message_t *message) {
+  if(message->block) {
+    block_release(message->block);
+    return;
+  }
+  bool zero;
+  ck_pr_dec_32_zero(&message->refcnt, &zero);
+  if(zero) noit_metric_message_free(message);
+}
+
 void noit_metric_id_clear(noit_metric_id_t *id) {
   free(id->alloc_name);
   free(id->stream.tags);
@@ -399,6 +770,10 @@ void noit_metric_id_clear(noit_metric_id_t *id) {
 }
 
 void noit_metric_message_clear(noit_metric_message_t* message) {
+  if(message->block) {
+    /* everything lives in the block; it is released by deref */
+    return;
+  }
   if(message->original_message) {
     if((message->value.type == METRIC_STRING ||
         message->value.type == METRIC_HISTOGRAM ||
@@ -412,6 +787,10 @@ void noit_metric_message_clear(noit_metric_message_t* message) {
   noit_metric_id_clear(&message->id);
 }
 void noit_metric_message_free(noit_metric_message_t* message) {
+  if(message->block) {
+    noit_metric_message_deref(message);
+    return;
+  }
   noit_metric_message_clear(message);
   free(message);
 }
@@ -62,6 +62,62 @@ API_EXPORT(void)
 API_EXPORT(void)
   noit_metric_message_free(noit_metric_message_t* message);
 
+/* An arena carves decoded messages out of large refcounted blocks.
+ * Messages decoded into an arena do not own any heap memory: the copy of
+ * the payload, string/histogram values and tag arrays are all placed in the
+ * block (values and tags pointing into the copied payload).  A block is freed
+ * when the arena has moved on from it and the last message within has been
+ * dereferenced.  An arena is not thread-safe; use one per producing thread.
+ */
+typedef struct noit_metric_message_arena noit_metric_message_arena_t;
+
+API_EXPORT(noit_metric_message_arena_t *)
+  noit_metric_message_arena_alloc(size_t block_size);
+
+API_EXPORT(void)
+  noit_metric_message_arena_free(noit_metric_message_arena_t *arena);
+
+/* Copies payload (and optionally the noit name) into the arena and decodes it.
+ * The returned message carries one reference that the caller must release
+ * with noit_metric_message_deref.  *rv is set to the result of the parse
+ * (see noit_message_decoder_parse_line). */
+API_EXPORT(noit_metric_message_t *)
+  noit_metric_message_arena_decode(noit_metric_message_arena_t *arena,
+                                   const char *payload, size_t payload_len,
+                                   int has_noit, const noit_noit_t *noit, int *rv);
+
+API_EXPORT(uint64_t)
+  noit_metric_message_arena_blocks_allocated(noit_metric_message_arena_t *arena);
+
+/* Builds an M message straight from its parts rather than formatting and
+ * re-parsing a line.  Values are taken as-is; a string value of string_len
+ * bytes is copied.  The metric name (and noit name) are copied and become the
+ * message's original_message.  If arena is NULL the message is allocated on
+ * the heap.  The returned message carries one reference and *rv is set as it
+ * would be by noit_message_decoder_parse_line. */
+API_EXPORT(noit_metric_message_t *)
+  noit_metric_message_build(noit_metric_message_arena_t *arena,
+                            const char *check_name, size_t check_name_len,
+                            const uuid_t check_uuid,
+                            const char *metric_name, size_t metric_name_len,
+                            const noit_metric_value_t *value, size_t string_len,
+                            const noit_noit_t *noit, int *rv);
+
+/* Reference counting that works for both heap and arena messages. */
+API_EXPORT(void)
+  noit_metric_message_ref(noit_metric_message_t *message);
+
+API_EXPORT(void)
+  noit_metric_message_ref_n(noit_metric_message_t *message, uint32_t n);
+
+API_EXPORT(void)
+  noit_metric_message_deref(noit_metric_message_t *message);
+
+/* Releases a reference on each message, coalescing releases of
+ * consecutive messages that share an arena block. */
+API_EXPORT(void)
+  noit_metric_message_deref_batch(noit_metric_message_t **messages, size_t cnt);
+
 #ifdef __cplusplus
 }
 #endif
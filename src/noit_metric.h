@@ -159,6 +159,9 @@ typedef struct {
   } value; /* the data itself */
 } noit_metric_value_t;
 
+/* Opaque, see noit_message_decoder.c */
+typedef struct noit_metric_message_block noit_metric_message_block_t;
+
 typedef struct {
   noit_metric_id_t id;
   noit_metric_value_t value;
@@ -168,6 +171,9 @@ typedef struct {
   size_t original_message_len;
   uint32_t refcnt;
   noit_noit_t noit;
+  /* If non-NULL, this message, its original, its values and its tags all live
+   * in this block and references are counted on the block, not the message. */
+  noit_metric_message_block_t *block;
 } noit_metric_message_t;
 
 void noit_metric_to_json(noit_metric_message_t *metric, char **json, size_t *len, mtev_boolean include_original);
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2026, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mtev_defines.h>
+#include <mtev_log.h>
+#include <mtev_stats.h>
+#include <mtev_time.h>
+#include <ck_pr.h>
+#include <ck_md.h>
+#include <math.h>
+
+#include "noit_metric_dedupe.h"
+
+/* Fingerprinting: MurmurHash3 x64/128 with both halves of the seed taken
+ * from the running fingerprint. */
+
+#define FP_SEED_LO 0x9e3779b97f4a7c15ULL
+#define FP_SEED_HI 0xc2b2ae3d27d4eb4fULL
+
+static inline uint64_t rotl64(uint64_t x, int8_t r) {
+  return (x << r) | (x >> (64 - r));
+}
+static inline uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+static inline uint64_t load64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+void
+noit_fingerprint128_init(noit_fingerprint128_t *fp) {
+  fp->lo = FP_SEED_LO;
+  fp->hi = FP_SEED_HI;
+}
+
+void
+noit_fingerprint128_update(noit_fingerprint128_t *fp, const void *key, size_t len) {
+  const uint8_t *data = (const uint8_t *)key;
+  const size_t nblocks = len / 16;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = fp->lo, h2 = fp->hi;
+
+  for(size_t i = 0; i < nblocks; i++) {
+    uint64_t k1 = load64(data + i*16);
+    uint64_t k2 = load64(data + i*16 + 8);
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+  }
+
+  const uint8_t *tail = data + nblocks*16;
+  uint64_t k1 = 0, k2 = 0;
+  switch(len & 15) {
+    case 15: k2 ^= ((uint64_t)tail[14]) << 48; /* fallthrough */
+    case 14: k2 ^= ((uint64_t)tail[13]) << 40; /* fallthrough */
+    case 13: k2 ^= ((uint64_t)tail[12]) << 32; /* fallthrough */
+    case 12: k2 ^= ((uint64_t)tail[11]) << 24; /* fallthrough */
+    case 11: k2 ^= ((uint64_t)tail[10]) << 16; /* fallthrough */
+    case 10: k2 ^= ((uint64_t)tail[ 9]) << 8;  /* fallthrough */
+    case  9: k2 ^= ((uint64_t)tail[ 8]);
+             k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+             /* fallthrough */
+    case  8: k1 ^= ((uint64_t)tail[ 7]) << 56; /* fallthrough */
+    case  7: k1 ^= ((uint64_t)tail[ 6]) << 48; /* fallthrough */
+    case  6: k1 ^= ((uint64_t)tail[ 5]) << 40; /* fallthrough */
+    case  5: k1 ^= ((uint64_t)tail[ 4]) << 32; /* fallthrough */
+    case  4: k1 ^= ((uint64_t)tail[ 3]) << 24; /* fallthrough */
+    case  3: k1 ^= ((uint64_t)tail[ 2]) << 16; /* fallthrough */
+    case  2: k1 ^= ((uint64_t)tail[ 1]) << 8;  /* fallthrough */
+    case  1: k1 ^= ((uint64_t)tail[ 0]);
+             k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= len; h2 ^= len;
+  h1 += h2; h2 += h1;
+  h1 = fmix64(h1); h2 = fmix64(h2);
+  h1 += h2; h2 += h1;
+  fp->lo = h1;
+  fp->hi = h2;
+}
+
+/* The dedupe ring.
+ *
+ * Each bucket is a power-of-two array of { lo, hi } slot pairs.  An empty
+ * slot has lo == 0; writers claim a slot by CAS on lo and then publish hi.
+ * Fingerprints are nudged so neither half is ever 0, which lets readers
+ * distinguish "claimed but not yet published" from a complete key.
+ *
+ * The ring holds one more bucket than the window needs; that spare is the
+ * one cleared ahead of time by noit_metric_dedupe_maintain().  A bucket's
+ * slots are allocated the first time it is claimed, so an engine that is
+ * never used costs nothing.
+ *
+ * A bucket past max_load stops taking new keys (lookups still work) until it
+ * is recycled for a later epoch, i.e. for at most bucket_seconds.
+ */
+
+#define DEDUPE_MAX_PROBE 32
+#define DEDUPE_SPIN_LIMIT 1024
+#define DEDUPE_SHARDS 16
+#define DEDUPE_EPOCH_RESETTING UINT64_MAX
+
+typedef union {
+  uint64_t v;
+  char pad[CK_MD_CACHELINE];
+} dedupe_counter_t;
+
+typedef struct {
+  uint64_t epoch;
+  uint32_t over_load;
+  dedupe_counter_t fill[DEDUPE_SHARDS];
+  uint64_t *slots;
+} CK_CC_CACHELINE dedupe_bucket_t;
+
+struct noit_metric_dedupe {
+  uint32_t nslots;
+  uint64_t mask;
+  uint32_t bucket_seconds;
+  uint32_t window_buckets;
+  uint32_t nbuckets;
+  double max_load;
+  dedupe_bucket_t *buckets;
+
+  stats_handle_t *lookups;
+  stats_handle_t *hits;
+  stats_handle_t *overflows;
+  stats_handle_t *skipped;
+  stats_handle_t *overloads;
+  stats_handle_t *occupancy;
+  stats_handle_t *entries;
+  stats_handle_t *fp_probability;
+};
+
+static uint32_t shard_counter;
+static __thread int my_shard = -1;
+
+static inline int
+get_shard(void) {
+  if(my_shard < 0) my_shard = ck_pr_faa_32(&shard_counter, 1) % DEDUPE_SHARDS;
+  return my_shard;
+}
+
+static inline uint64_t
+current_epoch(noit_metric_dedupe_t *d) {
+  return (mtev_now_ms() / 1000) / d->bucket_seconds;
+}
+
+static inline dedupe_bucket_t *
+bucket_for(noit_metric_dedupe_t *d, uint64_t epoch) {
+  return &d->buckets[epoch % d->nbuckets];
+}
+
+static mtev_boolean
+bucket_claim(noit_metric_dedupe_t *d, dedupe_bucket_t *b, uint64_t epoch) {
+  uint64_t cur = ck_pr_load_64(&b->epoch);
+  while(cur != epoch) {
+    /* someone else is clearing it, or our clock is behind theirs */
+    if(cur == DEDUPE_EPOCH_RESETTING || cur > epoch) return mtev_false;
+    if(ck_pr_cas_64(&b->epoch, cur, DEDUPE_EPOCH_RESETTING)) {
+      if(!b->slots) {
+        b->slots = calloc(2 * (size_t)d->nslots, sizeof(uint64_t));
+        if(!b->slots) {
+          /* leave it unclaimed; a later claim will try again */
+          ck_pr_store_64(&b->epoch, cur);
+          return mtev_false;
+        }
+      }
+      else memset(b->slots, 0, sizeof(uint64_t) * 2 * d->nslots);
+      for(int i=0; i<DEDUPE_SHARDS; i++) b->fill[i].v = 0;
+      b->over_load = 0;
+      ck_pr_fence_store();
+      ck_pr_store_64(&b->epoch, epoch);
+      return mtev_true;
+    }
+    cur = ck_pr_load_64(&b->epoch);
+  }
+  return mtev_true;
+}
+
+static inline uint64_t
+wait_for_hi(uint64_t *slot) {
+  uint64_t hi;
+  int spins = 0;
+  while((hi = ck_pr_load_64(slot)) == 0 && spins++ < DEDUPE_SPIN_LIMIT) ck_pr_stall();
+  return hi;
+}
+
+static mtev_boolean
+bucket_find(noit_metric_dedupe_t *d, dedupe_bucket_t *b, const noit_fingerprint128_t *fp) {
+  uint64_t idx = fp->lo & d->mask;
+  for(int probe = 0; probe < DEDUPE_MAX_PROBE; probe++) {
+    uint64_t *slot = &b->slots[idx * 2];
+    uint64_t lo = ck_pr_load_64(&slot[0]);
+    if(lo == 0) return mtev_false;
+    if(lo == fp->lo && wait_for_hi(&slot[1]) == fp->hi) return mtev_true;
+    idx = (idx + 1) & d->mask;
+  }
+  return mtev_false;
+}
+
+typedef enum { DEDUPE_INSERTED, DEDUPE_FOUND, DEDUPE_FULL } dedupe_insert_t;
+
+static dedupe_insert_t
+bucket_insert(noit_metric_dedupe_t *d, dedupe_bucket_t *b, const noit_fingerprint128_t *fp) {
+  uint64_t idx = fp->lo & d->mask;
+  mtev_boolean may_insert = !ck_pr_load_32(&b->over_load);
+  for(int probe = 0; probe < DEDUPE_MAX_PROBE; probe++) {
+    uint64_t *slot = &b->slots[idx * 2];
+    uint64_t lo = ck_pr_load_64(&slot[0]);
+    if(lo == 0) {
+      if(!may_insert) return DEDUPE_FULL;
+      if(ck_pr_cas_64_value(&slot[0], 0, fp->lo, &lo)) {
+        ck_pr_fence_store();
+        ck_pr_store_64(&slot[1], fp->hi);
+        ck_pr_inc_64(&b->fill[get_shard()].v);
+        return DEDUPE_INSERTED;
+      }
+      /* lost the race, lo now holds the winner's key */
+    }
+    if(lo == fp->lo && wait_for_hi(&slot[1]) == fp->hi) return DEDUPE_FOUND;
+    idx = (idx + 1) & d->mask;
+  }
+  return DEDUPE_FULL;
+}
+
+noit_metric_dedupe_t *
+noit_metric_dedupe_alloc(uint32_t slots_per_bucket, uint32_t window_seconds,
+                         uint32_t bucket_seconds, double max_load, stats_ns_t *ns) {
+  noit_metric_dedupe_t *d = calloc(1, sizeof(*d));
+  uint32_t nslots = 1024;
+  while(nslots < slots_per_bucket && nslots < (1U << 31)) nslots <<= 1;
+  if(bucket_seconds == 0) bucket_seconds = 1;
+  if(window_seconds < bucket_seconds) window_seconds = bucket_seconds;
+  if(max_load <= 0 || max_load > 0.95) max_load = 0.95;
+  d->nslots = nslots;
+  d->mask = nslots - 1;
+  d->bucket_seconds = bucket_seconds;
+  d->window_buckets = (window_seconds + bucket_seconds - 1) / bucket_seconds;
+  d->nbuckets = d->window_buckets + 1;
+  d->max_load = max_load;
+  if(posix_memalign((void **)&d->buckets, CK_MD_CACHELINE, sizeof(*d->buckets) * d->nbuckets)) {
+    free(d);
+    return NULL;
+  }
+  memset(d->buckets, 0, sizeof(*d->buckets) * d->nbuckets);
+  mtevL(mtev_debug, "dedupe: %u buckets x %u slots covering %us\n",
+        d->nbuckets, d->nslots, d->window_buckets * d->bucket_seconds);
+
+  if(ns) {
+    d->lookups = stats_register_fanout(ns, "lookups", STATS_TYPE_COUNTER, 16);
+    stats_handle_units(d->lookups, STATS_UNITS_MESSAGES);
+    d->hits = stats_register_fanout(ns, "hits", STATS_TYPE_COUNTER, 16);
+    stats_handle_units(d->hits, STATS_UNITS_MESSAGES);
+    /* keys we could not record because a bucket was too full or too probed */
+    d->overflows = stats_register_fanout(ns, "overflows", STATS_TYPE_COUNTER, 16);
+    /* keys we could not record because their bucket was being cleared */
+    d->skipped = stats_register_fanout(ns, "skipped", STATS_TYPE_COUNTER, 16);
+    /* buckets that passed max_load and stopped taking new keys */
+    d->overloads = stats_register(ns, "overloads", STATS_TYPE_COUNTER);
+    d->occupancy = stats_register(ns, "occupancy", STATS_TYPE_DOUBLE);
+    d->entries = stats_register(ns, "entries", STATS_TYPE_UINT64);
+    /* estimated chance a unique message is wrongly dropped on lookup */
+    d->fp_probability = stats_register(ns, "fp_probability", STATS_TYPE_DOUBLE);
+  }
+  return d;
+}
+
+mtev_boolean
+noit_metric_dedupe_check(noit_metric_dedupe_t *d, const noit_fingerprint128_t *infp) {
+  noit_fingerprint128_t fp = *infp;
+  if(fp.lo == 0) fp.lo = 1;
+  if(fp.hi == 0) fp.hi = 1;
+
+  stats_add64(d->lookups, 1);
+  uint64_t epoch = current_epoch(d);
+  dedupe_bucket_t *b = bucket_for(d, epoch);
+  if(!bucket_claim(d, b, epoch)) {
+    stats_add64(d->skipped, 1);
+  }
+  else {
+    switch(bucket_insert(d, b, &fp)) {
+      case DEDUPE_FOUND:
+        stats_add64(d->hits, 1);
+        return mtev_true;
+      case DEDUPE_FULL:
+        stats_add64(d->overflows, 1);
+        break;
+      case DEDUPE_INSERTED:
+        break;
+    }
+  }
+
+  /* Look back through the older buckets in the window */
+  for(uint32_t i = 1; i < d->window_buckets && i <= epoch; i++) {
+    b = bucket_for(d, epoch - i);
+    if(ck_pr_load_64(&b->epoch) != epoch - i) continue;
+    if(bucket_find(d, b, &fp)) {
+      stats_add64(d->hits, 1);
+      return mtev_true;
+    }
+  }
+  return mtev_false;
+}
+
+void
+noit_metric_dedupe_maintain(noit_metric_dedupe_t *d) {
+  uint64_t epoch = current_epoch(d);
+  /* The spare bucket holds epoch - window_buckets, which no lookup uses. */
+  bucket_claim(d, bucket_for(d, epoch + 1), epoch + 1);
+
+  uint64_t live = 0, current_fill = 0;
+  double expected_compares = 0;
+  for(uint32_t i = 0; i < d->window_buckets && i <= epoch; i++) {
+    dedupe_bucket_t *b = bucket_for(d, epoch - i);
+    if(ck_pr_load_64(&b->epoch) != epoch - i) continue;
+    uint64_t fill = 0;
+    for(int s=0; s<DEDUPE_SHARDS; s++) fill += ck_pr_load_64(&b->fill[s].v);
+    if(i == 0) {
+      /* only the current bucket takes inserts */
+      if(fill > d->max_load * d->nslots && ck_pr_cas_32(&b->over_load, 0, 1)) {
+        mtevL(mtev_error, "dedupe: %" PRIu64 "/%u slots used, not recording new keys "
+              "until the next bucket (consider raising dedupe_slots)\n",
+              fill, d->nslots);
+        stats_add64(d->overloads, 1);
+      }
+      current_fill = fill;
+    }
+    live += fill;
+    /* expected probe length of an unsuccessful linear-probing search */
+    double load = (double)fill / (double)d->nslots;
+    double probes = (load < 0.99) ? 0.5 * (1.0 + 1.0 / ((1.0 - load) * (1.0 - load))) : DEDUPE_MAX_PROBE;
+    expected_compares += (probes > DEDUPE_MAX_PROBE) ? DEDUPE_MAX_PROBE : probes;
+  }
+  double occupancy = (double)current_fill / (double)d->nslots;
+  /* a false match requires all 128 bits of a compared key to collide */
+  double fp_probability = live ? expected_compares * ldexp(1.0, -128) : 0;
+  if(d->occupancy) stats_set(d->occupancy, STATS_TYPE_DOUBLE, &occupancy);
+  if(d->entries) stats_set(d->entries, STATS_TYPE_UINT64, &live);
+  if(d->fp_probability) stats_set(d->fp_probability, STATS_TYPE_DOUBLE, &fp_probability);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2026, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NOIT_METRIC_DEDUPE_H
+#define NOIT_METRIC_DEDUPE_H
+
+#include <mtev_defines.h>
+#include <mtev_stats.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A 128-bit non-cryptographic fingerprint (MurmurHash3 x64/128).
+ * Updates chain: each update uses the current value as its seed, so
+ * feeding fields one at a time is equivalent to hashing a tuple.
+ */
+typedef struct {
+  uint64_t lo;
+  uint64_t hi;
+} noit_fingerprint128_t;
+
+API_EXPORT(void)
+  noit_fingerprint128_init(noit_fingerprint128_t *fp);
+
+API_EXPORT(void)
+  noit_fingerprint128_update(noit_fingerprint128_t *fp, const void *data, size_t len);
+
+/* The dedupe engine is a ring of open-addressing tables, one per
+ * `bucket_seconds` of wall-clock time, covering the last `window_seconds`.
+ * Keys are stored inline; inserts and lookups are lock-free.  A fingerprint
+ * is a duplicate if it has been seen in any live bucket.  Bucket memory is
+ * only allocated as buckets come into use.
+ */
+typedef struct noit_metric_dedupe noit_metric_dedupe_t;
+
+API_EXPORT(noit_metric_dedupe_t *)
+  noit_metric_dedupe_alloc(uint32_t slots_per_bucket, uint32_t window_seconds,
+                           uint32_t bucket_seconds, double max_load, stats_ns_t *ns);
+
+/* Returns mtev_true if fp was seen within the window, records it otherwise. */
+API_EXPORT(mtev_boolean)
+  noit_metric_dedupe_check(noit_metric_dedupe_t *d, const noit_fingerprint128_t *fp);
+
+/* Clears the bucket about to come into use and refreshes occupancy stats.
+ * Call this about once a second; checks will clear buckets inline if it lags. */
+API_EXPORT(void)
+  noit_metric_dedupe_maintain(noit_metric_dedupe_t *d);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -38,7 +38,7 @@
 #include <mtev_perftimer.h>
 #include <mtev_str.h>
 #include <mtev_log.h>
-#include <ck_fifo.h>
+#include <ck_spinlock.h>
 #include <mtev_fq.h>
 #include <mtev_hooks.h>
 #include <mtev_uuid.h>
@@ -47,15 +47,15 @@
 #include <mtev_rand.h>
 #include <mtev_frrh.h>
 
-#include <openssl/md5.h>
 #include <ck_hs.h>
 
 #include <noit_metric_director.h>
+#include <noit_metric_dedupe.h>
+#include <noit_metric_lane.h>
 #include <noit_metric_tag_search.h>
 #include <noit_check_log_helpers.h>
 #include <noit_message_decoder.h>
 #include "noit_prometheus_translation_internal.h"
-#include "noit_ssl10_compat.h"
 
 /* This is a hot mess designed to optimize metric selection on a variety of vectors.
  *
@@ -151,19 +151,6 @@ typedef struct {
   uint32_t refcnt;
 } dmflush_t;
 
-static void *__c_allocator_alloc(void *d, size_t size) {
-  return malloc(size);
-}
-static void __c_allocator_free(void *d, void *p) {
-  free(p);
-}
-static ProtobufCAllocator __c_allocator = {
-  .alloc = __c_allocator_alloc,
-  .free = __c_allocator_free,
-  .allocator_data = NULL
-};
-#define protobuf_c_system_allocator __c_allocator
-
 #define DMFLUSH_FLAG(a) ((dmflush_t *)((uintptr_t)(a) | FLUSHFLAG))
 #define DMFLUSH_UNFLAG(a) ((dmflush_t *)((uintptr_t)(a) & ~(uintptr_t)FLUSHFLAG))
 
@@ -178,17 +165,19 @@ MTEV_HOOK_IMPL(metric_director_revise, (noit_metric_message_t *m, interest_cnt_t
 struct fq_conn_s;
 struct fq_msg;
 
-struct hash_and_time {
-  mtev_hash_table hash;
-  uint32_t last_touched_s;
-};
-
 static __thread struct {
   int id;
   uint32_t *backlog;
-  ck_fifo_spsc_t *fifo;
+  noit_metric_lane_t *queue;
 } my_lane;
 
+/* Producer-side staging, one chunk per lane per producing thread. */
+typedef struct {
+  uint32_t cnt;
+  void *items[];
+} lane_stage_t;
+static __thread lane_stage_t **my_stages;
+
 typedef union {
   struct { void *queue; uint32_t backlog; } thread;
   uint8_t pad[CK_MD_CACHELINE];
@@ -203,9 +192,19 @@ static inline int safe_thread_id(int thread_id) {
 }
 
 static uint32_t miss_cache_size = 10000000; /* 10mm */
+static uint32_t lane_ring_size = 65536;
+static uint32_t producer_chunk = 64;
+/* If non-zero, inbound lines are decoded into per-thread arenas of blocks this size */
+static uint32_t message_arena_block_size = 0;
+static __thread noit_metric_message_arena_t *ingest_arena;
+/* Decode BF bundles straight into messages instead of via M lines; such
+ * messages carry only the metric name as their original_message. */
+static mtev_boolean native_flatbuffer = mtev_false;
+/* Evaluate all of a name's searches, across lanes, as one shared network */
+static mtev_boolean search_network = mtev_false;
 static thread_queue_t *queues;
 static mtev_hash_table id_level;
-static mtev_hash_table dedupe_hashes;
+static noit_metric_dedupe_t *dedupe_engine;
 static interest_cnt_t *check_interests;
 static pthread_mutex_t check_interests_lock;
 static mtev_boolean dedupe = mtev_true;
@@ -227,11 +226,13 @@ typedef struct {
   int64_t account_id; /* >= 0 -> exact match, < 0 -> allow all */
   uuid_t  check_uuid; /* UUID_ZERO -> any, otherwise exact match */
   noit_metric_tag_search_ast_t *ast;
+  noit_metric_tag_search_program_t *program;
 } tag_search_registration_t;
 
 static void
 tag_search_registration_cleanup(void *v) {
   tag_search_registration_t *s = (tag_search_registration_t *)v;
+  noit_metric_tag_search_program_free(s->program);
   noit_metric_tag_search_free(s->ast);
 }
 
@@ -250,11 +251,26 @@ struct thread_asts {
   ck_hs_t hs;
 } CK_CC_CACHELINE;
 
+/* A snapshot of every lane's searches for a name, built for generation gen */
+typedef struct {
+  uint64_t gen;
+  noit_metric_tag_search_network_t *net;
+} search_network_t;
+
+static void
+search_network_cleanup(void *v) {
+  search_network_t *sn = (search_network_t *)v;
+  noit_metric_tag_search_network_free(sn->net);
+}
+
 /* This gen gets update by dynamic hook when a check changes */
 typedef struct {
   char *metric_name;
   size_t metric_name_len;
   struct thread_asts *search_asts;
+  uint64_t gen; /* bumped on every register/deregister */
+  pthread_mutex_t network_lock;
+  search_network_t *network;
 } name_search_t;
 
 static unsigned long
@@ -338,6 +354,7 @@ name_get_search(check_search_t *cs, const char *metric_name, size_t metric_name_
   newns->metric_name_len = metric_name_len;
 
   newns->search_asts = thread_asts_alloc(8);
+  pthread_mutex_init(&newns->network_lock, NULL);
   pthread_mutex_lock(&cs->name_searches_writes);
   if(ck_hs_put(&cs->name_searches, hash, newns)) {
     pthread_mutex_unlock(&cs->name_searches_writes);
@@ -345,6 +362,7 @@ name_get_search(check_search_t *cs, const char *metric_name, size_t metric_name_
   }
   pthread_mutex_unlock(&cs->name_searches_writes);
   thread_asts_free(newns->search_asts);
+  pthread_mutex_destroy(&newns->network_lock);
   free(newns->metric_name);
   free(newns);
   return name_get_search(cs, metric_name, metric_name_len, false);
@@ -448,6 +466,8 @@ static stats_handle_t *stats_msg_dropped_backlogged;
 static stats_handle_t *stats_msg_distributed;
 static stats_handle_t *stats_msg_queued;
 static stats_handle_t *stats_msg_delivered;
+static stats_handle_t *stats_msg_overflowed;
+static stats_handle_t *stats_arena_blocks;
 
 static inline interest_cnt_t adjust_interest(interest_cnt_t in, short adj) {
   int tmp = (int)in;
@@ -461,18 +481,52 @@ static inline interest_cnt_t adjust_interest(interest_cnt_t in, short adj) {
 }
 void
 noit_metric_director_message_ref(void *m) {
-  noit_metric_message_t *message = (noit_metric_message_t *)m;
-  ck_pr_inc_32(&message->refcnt);
+  noit_metric_message_ref((noit_metric_message_t *)m);
 }
 
 void
 noit_metric_director_message_deref(void *m) {
-  noit_metric_message_t *message = (noit_metric_message_t *)m;
-  bool zero;
-  ck_pr_dec_32_zero(&message->refcnt, &zero);
-  if (zero) {
-    noit_metric_message_free(message);
+  noit_metric_message_deref((noit_metric_message_t *)m);
+}
+
+static void
+lane_publish(int lane, void **items, uint32_t cnt) {
+  noit_metric_lane_t *q = (noit_metric_lane_t *)ck_pr_load_ptr(&queues[lane].thread.queue);
+  if(q == NULL || cnt == 0) return;
+  ck_pr_add_32(&queues[lane].thread.backlog, cnt);
+  uint32_t spilled = noit_metric_lane_publish(q, items, cnt);
+  if(spilled) stats_add64(stats_msg_overflowed, spilled);
+}
+
+static void
+lane_stage_flush(int lane) {
+  lane_stage_t *stage = my_stages ? my_stages[lane] : NULL;
+  if(stage == NULL || stage->cnt == 0) return;
+  lane_publish(lane, stage->items, stage->cnt);
+  stage->cnt = 0;
+}
+
+/* Must be called by a producer before it returns control to its caller so that
+ * nothing is left sitting in its staging chunks. */
+static void
+lane_stage_flush_all(void) {
+  if(my_stages == NULL) return;
+  for(int i=0; i<nthreads; i++) lane_stage_flush(i);
+}
+
+static void
+lane_enqueue(int lane, void *item) {
+  if(producer_chunk <= 1) {
+    lane_publish(lane, &item, 1);
+    return;
   }
+  if(my_stages == NULL) my_stages = calloc(nthreads, sizeof(*my_stages));
+  lane_stage_t *stage = my_stages[lane];
+  if(stage == NULL) {
+    stage = my_stages[lane] = calloc(1, sizeof(*stage) + producer_chunk * sizeof(void *));
+  }
+  stage->items[stage->cnt++] = item;
+  if(stage->cnt >= producer_chunk) lane_stage_flush(lane);
 }
 
 static int
@@ -480,12 +534,11 @@ get_my_lane() {
   director_in_use = 1;
   ck_pr_fence_store();
 
-  if(my_lane.fifo == NULL) {
+  if(my_lane.queue == NULL) {
     int new_thread;
-    my_lane.fifo = calloc(1, sizeof(ck_fifo_spsc_t));
-    ck_fifo_spsc_init(my_lane.fifo, malloc(sizeof(ck_fifo_spsc_entry_t)));
+    my_lane.queue = noit_metric_lane_alloc(lane_ring_size);
     for(new_thread=0;new_thread<nthreads;new_thread++) {
-      if(ck_pr_cas_ptr(&queues[new_thread].thread.queue, NULL, my_lane.fifo)) break;
+      if(ck_pr_cas_ptr(&queues[new_thread].thread.queue, NULL, my_lane.queue)) break;
     }
     mtevAssert(new_thread<nthreads);
     my_lane.id = new_thread;
@@ -506,6 +559,20 @@ noit_metric_director_my_lane() {
   return get_my_lane();
 }
 
+mtev_boolean
+noit_metric_director_join_lane(int lane) {
+  if(my_lane.queue != NULL || lane < 0 || lane >= nthreads) return mtev_false;
+  noit_metric_lane_t *q = (noit_metric_lane_t *)ck_pr_load_ptr(&queues[lane].thread.queue);
+  if(q == NULL) return mtev_false;
+  director_in_use = 1;
+  ck_pr_fence_store();
+  my_lane.queue = q;
+  my_lane.id = lane;
+  my_lane.backlog = &queues[lane].thread.backlog;
+  mtevL(mtev_debug, "Joining thread(%p) to %d\n", (void*)(uintptr_t)pthread_self(), lane);
+  return mtev_true;
+}
+
 interest_cnt_t
 noit_adjust_checks_interest(short cnt) {
   return noit_metric_director_adjust_checks_interest(cnt);
@@ -550,6 +617,7 @@ noit_metric_director_register_search_on_thread(int thread_id, int64_t account_id
   account_search_t *searches = account_get_search(account_id, true);
   mtev_uuid_copy(as->check_uuid, check_uuid);
   as->ast = noit_metric_tag_search_ref(ast);
+  as->program = noit_metric_tag_search_program_compile(ast);
 
   check_search_t *cs = check_get_search(searches, check_uuid, true);
   name_search_t *ns = name_get_search(cs, metric_name, strlen(metric_name), true);
@@ -558,6 +626,7 @@ noit_metric_director_register_search_on_thread(int thread_id, int64_t account_id
   ck_spinlock_lock(&ns->search_asts[thread_id].lock);
   ck_hs_put(&ns->search_asts[thread_id].hs, hash, as);
   ck_spinlock_unlock(&ns->search_asts[thread_id].lock);
+  ck_pr_inc_64(&ns->gen);
 
   mtev_memory_end();
   ck_pr_inc_64(&searches->gen);
@@ -589,6 +658,7 @@ noit_metric_director_deregister_search_on_thread(int thread_id, int64_t account_
       ck_spinlock_lock(&ns->search_asts[thread_id].lock);
       found = ck_hs_remove(&ns->search_asts[thread_id].hs, hash, &dummy);
       ck_spinlock_unlock(&ns->search_asts[thread_id].lock);
+      if(found) ck_pr_inc_64(&ns->gen);
     }
   }
   if(found) mtev_memory_safe_free(found);
@@ -681,29 +751,25 @@ noit_metric_director_adjust_metric_interest_on_thread(int thread_id, uuid_t id,
 static void
 distribute_message_with_interests(interest_cnt_t *interests, noit_metric_message_t *message) {
   int i, msg_queued = 0, msg_dropped_backlogged = 0;
-  mtev_boolean msg_distributed = mtev_false;
+  int lanes[nthreads];
   for(i = 0; i < nthreads; i++) {
     if(interests[i] > 0) {
+      if(ck_pr_load_ptr(&queues[i].thread.queue) == NULL) continue;
       if(drop_backlog_over && ck_pr_load_32(&queues[i].thread.backlog) > drop_backlog_over) {
         msg_dropped_backlogged++;
         continue;
       }
-      msg_distributed = mtev_true;
-      msg_queued++;
-      ck_fifo_spsc_t *fifo = (ck_fifo_spsc_t *) queues[i].thread.queue;
-      ck_fifo_spsc_entry_t *fifo_entry;
-      ck_pr_inc_32(&queues[i].thread.backlog);
-      ck_fifo_spsc_enqueue_lock(fifo);
-      fifo_entry = ck_fifo_spsc_recycle(fifo);
-      if(!fifo_entry) fifo_entry = malloc(sizeof(ck_fifo_spsc_entry_t));
-      noit_metric_director_message_ref(message);
-      ck_fifo_spsc_enqueue(fifo, fifo_entry, message);
-      ck_fifo_spsc_enqueue_unlock(fifo);
+      lanes[msg_queued++] = i;
     }
   }
+  if(msg_queued) {
+    /* one reference per lane, taken all at once */
+    noit_metric_message_ref_n(message, msg_queued);
+    for(i = 0; i < msg_queued; i++) lane_enqueue(lanes[i], message);
+  }
   stats_add64(stats_msg_dropped_backlogged, msg_dropped_backlogged);
   stats_add64(stats_msg_queued, msg_queued);
-  if (msg_distributed) {
+  if (msg_queued) {
     stats_add64(stats_msg_distributed, 1);
   }
 }
@@ -723,17 +789,13 @@ noit_metric_director_flush(eventer_t e) {
   dmflush_t *ptr = calloc(1, sizeof(*ptr));
   ptr->e = e;
   ptr->refcnt = 1;
+  /* anything this thread has staged must be ahead of the flush marker */
+  lane_stage_flush_all();
   for(int i=0;i<nthreads;i++) {
-    ck_fifo_spsc_t *fifo = (ck_fifo_spsc_t *) queues[i].thread.queue;
-    if(fifo != NULL) {
+    if(ck_pr_load_ptr(&queues[i].thread.queue) != NULL) {
+      void *marker = DMFLUSH_FLAG(ptr);
       ck_pr_inc_32(&ptr->refcnt);
-      ck_fifo_spsc_entry_t *fifo_entry;
-      ck_pr_inc_32(&queues[i].thread.backlog);
-      ck_fifo_spsc_enqueue_lock(fifo);
-      fifo_entry = ck_fifo_spsc_recycle(fifo);
-      if(!fifo_entry) fifo_entry = malloc(sizeof(ck_fifo_spsc_entry_t));
-      ck_fifo_spsc_enqueue(fifo, fifo_entry, DMFLUSH_FLAG(ptr));
-      ck_fifo_spsc_enqueue_unlock(fifo);
+      lane_publish(i, &marker, 1);
     }
   }
   dmflush_observe(ptr);
@@ -798,6 +860,41 @@ static void set_search_miss_cache(account_search_t *as, noit_metric_id_t *id) {
   mtev_frrh_set(search_miss_cache, key, keylen, "");
 }
 
+/* Tags of the message being distributed, indexed once for all searches */
+static __thread noit_metric_tag_search_index_t *search_index;
+
+/* Returns the name's current search network, rebuilding it if searches have
+ * changed since it was built.  Must be called within an SMR section.  Returns
+ * NULL if another thread is rebuilding; the caller should evaluate lane by lane.
+ */
+static search_network_t *
+name_search_get_network(name_search_t *ns) {
+  uint64_t gen = ck_pr_load_64(&ns->gen);
+  search_network_t *sn = ck_pr_load_ptr(&ns->network);
+  if(sn && sn->gen == gen) return sn;
+  if(pthread_mutex_trylock(&ns->network_lock) != 0) return NULL;
+  sn = ns->network;
+  gen = ck_pr_load_64(&ns->gen);
+  if(sn == NULL || sn->gen != gen) {
+    search_network_t *newsn = mtev_memory_safe_malloc_cleanup(sizeof(*newsn), search_network_cleanup);
+    newsn->gen = gen;
+    newsn->net = noit_metric_tag_search_network_alloc();
+    for(int i=0; i<nthreads; i++) {
+      tag_search_registration_t *search;
+      ck_hs_iterator_t iter;
+      ck_hs_iterator_init(&iter);
+      while(ck_hs_next_spmc(&ns->search_asts[i].hs, &iter, (void **)&search)) {
+        noit_metric_tag_search_network_add(newsn->net, search->ast, i);
+      }
+    }
+    ck_pr_store_ptr(&ns->network, newsn);
+    if(sn) mtev_memory_safe_free(sn);
+    sn = newsn;
+  }
+  pthread_mutex_unlock(&ns->network_lock);
+  return sn;
+}
+
 static void
 distribute_metric(noit_metric_message_t *message) {
   mtev_perftimer_t start;
@@ -837,6 +934,7 @@ distribute_metric(noit_metric_message_t *message) {
       css[0] = check_get_search(as, message->id.id, false);
       css[1] = check_get_search(as, uuid_zero, false);
       interest_cnt_t search_interest = 0;
+      int indexed = 0; /* 0 = not yet, 1 = ready, -1 = nothing can match */
       for(int cs_idx=0; cs_idx<2; cs_idx++) {
         if(css[cs_idx] == NULL) continue;
         name_search_t *nss[2];
@@ -845,6 +943,22 @@ distribute_metric(noit_metric_message_t *message) {
         for(int ns_idx=0; ns_idx<2; ns_idx++) {
           if(nss[ns_idx] == NULL) continue;
           name_search_t *ns = nss[ns_idx];
+          search_network_t *sn = search_network ? name_search_get_network(ns) : NULL;
+          if(sn) {
+            if(indexed == 0) {
+              if(!search_index) search_index = noit_metric_tag_search_index_alloc();
+              indexed = noit_metric_tag_search_index_build_for_metric_id(search_index, &message->id) ? 1 : -1;
+            }
+            if(indexed < 0) continue;
+            uint8_t hits[nthreads];
+            for(int i=0; i<nthreads; i++) hits[i] = (interests[i] != 0);
+            if(noit_metric_tag_search_network_evaluate(sn->net, search_index, hits, nthreads) > 0) {
+              for(int i=0; i<nthreads; i++) {
+                if(hits[i] && interests[i] == 0) has_interests = interests[i] = search_interest = 1;
+              }
+            }
+            continue;
+          }
           for(int i=0; i<nthreads; i++) {
             tag_search_registration_t *search;
             ck_hs_iterator_t iter;
@@ -853,7 +967,12 @@ distribute_metric(noit_metric_message_t *message) {
             /* First do the specific check */
             ck_hs_iterator_init(&iter);
             while(ck_hs_next_spmc(&ns->search_asts[i].hs, &iter, (void **)&search)) {
-              if(noit_metric_tag_search_evaluate_against_metric_id(search->ast, &message->id)) {
+              if(indexed == 0) {
+                if(!search_index) search_index = noit_metric_tag_search_index_alloc();
+                indexed = noit_metric_tag_search_index_build_for_metric_id(search_index, &message->id) ? 1 : -1;
+              }
+              if(indexed < 0) break;
+              if(noit_metric_tag_search_program_evaluate(search->program, search_index)) {
                 has_interests = interests[i] = search_interest = 1;
                 break; /* no need to process additional searches in this lane */
               }
@@ -906,86 +1025,13 @@ distribute_check(noit_metric_message_t *message) {
   mtev_memory_end();
 }
 
-static mtev_hash_table *
-get_dedupe_hash(uint64_t whence)
-{
-  struct hash_and_time *hash_with_time;
-  mtev_hash_table *hash;
-
-  if (mtev_hash_retrieve(&dedupe_hashes, (const char *)&whence, sizeof(whence), (void **)&hash_with_time) == 1) {
-    hash = &hash_with_time->hash;
-  } else {
-    hash_with_time = calloc(1, sizeof(struct hash_and_time));
-
-    mtev_hash_init_locks(&hash_with_time->hash, MTEV_HASH_DEFAULT_SIZE, MTEV_HASH_LOCK_MODE_MUTEX);
-    uint64_t *stored_ts = calloc(1, sizeof(uint64_t));
-    *stored_ts = whence;
-    if (mtev_hash_store(&dedupe_hashes, (const char *)stored_ts, sizeof(*stored_ts), hash_with_time) == 0) {
-      /* ugh, someone beat us */
-      free(stored_ts);
-      mtev_hash_destroy(&hash_with_time->hash, NULL, NULL);
-      free(hash_with_time);
-      if (mtev_hash_retrieve(&dedupe_hashes, (const char *)&whence, sizeof(whence), (void **)&hash_with_time) == 0) {
-        return NULL;
-      }
-    }
-    hash = &hash_with_time->hash;
-  }
-
-  hash_with_time->last_touched_s = mtev_gethrtime() / 1000000000;
-  return hash;
-}
-
 static int
 noit_metric_director_prune_dedup(eventer_t e, int mask, void *unused,
     struct timeval *now) {
   struct timeval etime;
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-  uint64_t now_hrtime = mtev_gethrtime() / 1000000000;
-  const char *k;
-  int klen;
-  void *data;
-  struct hash_and_time *hash_with_time;
-
-  struct removable_hashes {
-    uint64_t key;
-    struct hash_and_time *data;
-    struct removable_hashes *next;
-  };
-
-  struct removable_hashes *head = NULL;
-  struct removable_hashes *tail = NULL;
-
-  /* build a list of expirable items */
-  while(mtev_hash_next(&dedupe_hashes, &iter, &k, &klen, &data)) {
-    hash_with_time = data;
-    if (now_hrtime > hash_with_time->last_touched_s && now_hrtime - hash_with_time->last_touched_s > 10) {
-      struct removable_hashes *h = calloc(1, sizeof(struct removable_hashes));
-      h->key = *(uint64_t *)k;
-      h->data = hash_with_time;
-      if (tail != NULL) {
-        tail->next = h;
-      }
-      tail = h;
-
-      if (head == NULL) {
-        head = tail;
-      }
-    }
-  }
-
-  /* expire them */
-  while (head != NULL) {
-    mtev_hash_delete(&dedupe_hashes, (const char *)&head->key, sizeof(head->key), free, NULL);
-    mtev_hash_destroy(&head->data->hash, free, NULL);
-    free(head->data);
-    struct removable_hashes *prev = head;
-    head = head->next;
-    free(prev);
-  }
-
+  if(dedupe_engine) noit_metric_dedupe_maintain(dedupe_engine);
   etime = eventer_get_whence(e);
-  etime.tv_sec = now->tv_sec + 5;
+  etime.tv_sec = now->tv_sec + 1;
   eventer_add_at(noit_metric_director_prune_dedup, unused, etime);
   return 0;
 }
@@ -1001,15 +1047,12 @@ distribute_message(noit_metric_message_t *message) {
 
 noit_metric_message_t *noit_metric_director_lane_next_backlog(uint32_t *backlog) {
   noit_metric_message_t *msg = NULL;
-  if(my_lane.fifo == NULL)
+  if(my_lane.queue == NULL)
     return NULL;
  again:
-  ck_fifo_spsc_dequeue_lock(my_lane.fifo);
-  if(ck_fifo_spsc_dequeue(my_lane.fifo, &msg) == false) {
-    msg = NULL;
-  }
-  ck_fifo_spsc_dequeue_unlock(my_lane.fifo);
+  msg = noit_metric_lane_pop(my_lane.queue);
   if((uintptr_t)msg & FLUSHFLAG) {
+    ck_pr_dec_32(my_lane.backlog);
     dmflush_observe(DMFLUSH_UNFLAG((dmflush_t *)msg));
     goto again;
   }
@@ -1025,6 +1068,45 @@ noit_metric_message_t *noit_metric_director_lane_next() {
   return noit_metric_director_lane_next_backlog(NULL);
 }
 
+size_t
+noit_metric_director_lane_next_batch_backlog(noit_metric_message_t **msgs, size_t max,
+                                             uint32_t *backlog) {
+  size_t cnt = 0, popped = 0;
+  if(my_lane.queue == NULL || max == 0) {
+    if(backlog) *backlog = my_lane.backlog ? ck_pr_load_32(my_lane.backlog) : 0;
+    return 0;
+  }
+  while(cnt < max) {
+    size_t n = noit_metric_lane_pop_batch(my_lane.queue, (void **)msgs + cnt, max - cnt);
+    if(n == 0) break;
+    popped += n;
+    /* flush markers are observed and squeezed out in place */
+    size_t kept = cnt;
+    for(size_t i = cnt; i < cnt + n; i++) {
+      if((uintptr_t)msgs[i] & FLUSHFLAG) {
+        dmflush_observe(DMFLUSH_UNFLAG((dmflush_t *)msgs[i]));
+        continue;
+      }
+      msgs[kept++] = msgs[i];
+    }
+    cnt = kept;
+  }
+  if(popped) ck_pr_sub_32(my_lane.backlog, popped);
+  if(cnt) stats_add64(stats_msg_delivered, cnt);
+  if(backlog) *backlog = ck_pr_load_32(my_lane.backlog);
+  return cnt;
+}
+
+size_t
+noit_metric_director_lane_next_batch(noit_metric_message_t **msgs, size_t max) {
+  return noit_metric_director_lane_next_batch_backlog(msgs, max, NULL);
+}
+
+void
+noit_metric_director_message_deref_batch(noit_metric_message_t **msgs, size_t cnt) {
+  noit_metric_message_deref_batch(msgs, cnt);
+}
+
 static noit_noit_t *
 get_noit(const char *payload, int payload_len, noit_noit_t *data) {
   const char *cp = payload, *end = payload + payload_len;
@@ -1036,6 +1118,27 @@ get_noit(const char *payload, int payload_len, noit_noit_t *data) {
   data->name_len = cp - data->name;
   return data;
 }
+static noit_metric_message_arena_t *
+get_ingest_arena(void) {
+  if(!message_arena_block_size) return NULL;
+  if(!ingest_arena) ingest_arena = noit_metric_message_arena_alloc(message_arena_block_size);
+  return ingest_arena;
+}
+
+/* Takes ownership of the caller's reference on message. */
+static void
+handle_decoded_message(noit_metric_message_t *message, int rv) {
+  if(message->value.whence_ms) // ignore screwy messages
+    stats_set_hist_intscale(stats_msg_delay, mtev_now_ms() - message->value.whence_ms, -3, 1);
+  if(drop_before_threshold_ms && message->value.whence_ms < drop_before_threshold_ms) {
+    stats_add64(stats_msg_dropped_threshold, 1);
+  }
+  else if(rv == 1) {
+    distribute_message(message);
+  }
+  noit_metric_director_message_deref(message);
+}
+
 static void
 handle_metric_buffer(const char *payload, int payload_len,
     int has_noit, noit_noit_t *noit) {
@@ -1052,40 +1155,40 @@ handle_metric_buffer(const char *payload, int payload_len,
     case 'M':
       {
         // mtev_fq will free the fq_msg -> copy the payload
-        int nlen = payload_len;
-        if(noit) nlen += noit->name_len+2;
-        char *copy = calloc(1, nlen+1);
-        memcpy(copy, payload, payload_len);
-        if(noit) memcpy(copy + payload_len + 1, noit->name, noit->name_len);
-        noit_metric_message_t *message = calloc(1, sizeof(noit_metric_message_t));
-
-        message->type = copy[0];
-        message->original_allocated = mtev_true;
-        message->original_message = copy;
-        message->original_message_len = payload_len;
-        noit_metric_director_message_ref(message);
-
-        stats_add64(stats_msg_seen, 1);
-        int rv = noit_message_decoder_parse_line(message, has_noit);
-
-        if(message->value.whence_ms) // ignore screwy messages
-          stats_set_hist_intscale(stats_msg_delay, mtev_now_ms() - message->value.whence_ms, -3, 1);
-        if(drop_before_threshold_ms && message->value.whence_ms < drop_before_threshold_ms) {
-          stats_add64(stats_msg_dropped_threshold, 1);
-          goto bail;
-        }
-
-        if(message->noit.name == NULL && noit) {
-          message->noit.name_len = noit->name_len;
-          message->noit.name = copy + payload_len + 1;
+        noit_metric_message_t *message;
+        int rv;
+        noit_metric_message_arena_t *arena = get_ingest_arena();
+        if(arena) {
+          uint64_t blocks = noit_metric_message_arena_blocks_allocated(arena);
+          message = noit_metric_message_arena_decode(arena, payload, payload_len,
+                                                     has_noit, noit, &rv);
+          if(!message) break;
+          stats_add64(stats_arena_blocks, noit_metric_message_arena_blocks_allocated(arena) - blocks);
+          stats_add64(stats_msg_seen, 1);
         }
-
-        if(rv == 1) {
-          distribute_message(message);
+        else {
+          int nlen = payload_len;
+          if(noit) nlen += noit->name_len+2;
+          char *copy = calloc(1, nlen+1);
+          memcpy(copy, payload, payload_len);
+          if(noit) memcpy(copy + payload_len + 1, noit->name, noit->name_len);
+          message = calloc(1, sizeof(noit_metric_message_t));
+
+          message->type = copy[0];
+          message->original_allocated = mtev_true;
+          message->original_message = copy;
+          message->original_message_len = payload_len;
+          noit_metric_director_message_ref(message);
+
+          stats_add64(stats_msg_seen, 1);
+          rv = noit_message_decoder_parse_line(message, has_noit);
+          if(message->noit.name == NULL && noit) {
+            message->noit.name_len = noit->name_len;
+            message->noit.name = copy + payload_len + 1;
+          }
         }
 
-      bail:
-        noit_metric_director_message_deref(message);
+        handle_decoded_message(message, rv);
       }
       break;
     case 'B':
@@ -1094,6 +1197,19 @@ handle_metric_buffer(const char *payload, int payload_len,
         char **metrics = NULL;
         noit_noit_t src_noit_impl, *src_noit = NULL;
         src_noit = get_noit(payload, payload_len, &src_noit_impl);
+        if(native_flatbuffer && payload_len > 1 && payload[1] == 'F') {
+          noit_metric_message_t **messages = NULL;
+          noit_metric_message_arena_t *arena = get_ingest_arena();
+          uint64_t blocks = arena ? noit_metric_message_arena_blocks_allocated(arena) : 0;
+          n_metrics = noit_check_log_bf_to_messages(payload, payload_len, arena, src_noit, &messages);
+          if(arena) stats_add64(stats_arena_blocks, noit_metric_message_arena_blocks_allocated(arena) - blocks);
+          stats_add64(stats_msg_seen, n_metrics);
+          for(i = 0; i < n_metrics; i++) {
+            handle_decoded_message(messages[i], 1);
+          }
+          free(messages);
+          break;
+        }
         n_metrics = noit_check_log_b_to_sm((const char *)payload, payload_len,
             &metrics, has_noit);
         for(i = 0; i < n_metrics; i++) {
@@ -1131,90 +1247,92 @@ get_message_time_s(const char* msg, int msg_length) {
   return atol(time_str);
 }
 
-static mtev_boolean
-check_dedupe_hash(unsigned char *digest, uint64_t whence) {
-  if(whence > 0) {
-    mtev_hash_table *hash = get_dedupe_hash(whence);
-    if (hash) {
-      int x = mtev_hash_store(hash, (const char *)digest, MD5_DIGEST_LENGTH, (void *)0x1);
-      if (x == 0) {
-        /* this is a dupe */
-        free(digest);
-        return mtev_true;
-      }
-    }
-    else {
-      free(digest);
-    }
-  }
-  else {
-    free(digest);
-  }
-  return mtev_false;
-}
-
 static mtev_boolean
 check_duplicate_from_noit_metric_message(noit_metric_message_t *msg) {
-  mtev_boolean ret_val = mtev_false;
-  if (msg && dedupe && msg->value.whence_ms > 0) {
-    unsigned char *digest = malloc(MD5_DIGEST_LENGTH);
-    const EVP_MD *md = EVP_get_digestbyname("MD5");
-    mtevAssert(md);
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(ctx, md, NULL);
-    EVP_DigestUpdate(ctx, &msg->value.whence_ms, sizeof(msg->value.whence_ms));
-    EVP_DigestUpdate(ctx, &msg->id.account_id, sizeof(msg->id.account_id));
-    EVP_DigestUpdate(ctx, msg->id.name, msg->id.name_len_with_tags);
-    EVP_DigestUpdate(ctx, msg->id.id, sizeof(uuid_t));
-    EVP_DigestUpdate(ctx, &msg->value.type, sizeof(msg->value.type));
-    switch(msg->value.type) {
-      case METRIC_STRING:
-      case METRIC_HISTOGRAM:
-      case METRIC_HISTOGRAM_CUMULATIVE:
-        EVP_DigestUpdate(ctx, msg->value.value.v_string, strlen(msg->value.value.v_string));
-        break;
-      case METRIC_DOUBLE:
-        EVP_DigestUpdate(ctx, &msg->value.value.v_double, sizeof(msg->value.value.v_double));
-        break;
-      case METRIC_INT32:
-        EVP_DigestUpdate(ctx, &msg->value.value.v_int32, sizeof(msg->value.value.v_int32));
-        break;
-      case METRIC_INT64:
-        EVP_DigestUpdate(ctx, &msg->value.value.v_int64, sizeof(msg->value.value.v_int64));
-        break;
-      case METRIC_UINT32:
-        EVP_DigestUpdate(ctx, &msg->value.value.v_uint32, sizeof(msg->value.value.v_uint32));
-        break;
-      case METRIC_UINT64:
-        EVP_DigestUpdate(ctx, &msg->value.value.v_uint64, sizeof(msg->value.value.v_uint64));
-        break;
-      default:
-        //treat METRIC_GUESS and METRIC_ABSENT as zero-length
-        break;
-    }
-    EVP_DigestFinal(ctx, digest, NULL);
-    EVP_MD_CTX_free(ctx);
-    ret_val = check_dedupe_hash(digest, msg->value.whence_ms / 1000);
+  if (!msg || !dedupe || !dedupe_engine || msg->value.whence_ms == 0) return mtev_false;
+  noit_fingerprint128_t fp;
+  noit_fingerprint128_init(&fp);
+  noit_fingerprint128_update(&fp, &msg->value.whence_ms, sizeof(msg->value.whence_ms));
+  noit_fingerprint128_update(&fp, &msg->id.account_id, sizeof(msg->id.account_id));
+  noit_fingerprint128_update(&fp, msg->id.name, msg->id.name_len_with_tags);
+  noit_fingerprint128_update(&fp, msg->id.id, sizeof(uuid_t));
+  noit_fingerprint128_update(&fp, &msg->value.type, sizeof(msg->value.type));
+  switch(msg->value.type) {
+    case METRIC_STRING:
+    case METRIC_HISTOGRAM:
+    case METRIC_HISTOGRAM_CUMULATIVE:
+      if(msg->value.value.v_string)
+        noit_fingerprint128_update(&fp, msg->value.value.v_string, strlen(msg->value.value.v_string));
+      break;
+    case METRIC_DOUBLE:
+      noit_fingerprint128_update(&fp, &msg->value.value.v_double, sizeof(msg->value.value.v_double));
+      break;
+    case METRIC_INT32:
+      noit_fingerprint128_update(&fp, &msg->value.value.v_int32, sizeof(msg->value.value.v_int32));
+      break;
+    case METRIC_INT64:
+      noit_fingerprint128_update(&fp, &msg->value.value.v_int64, sizeof(msg->value.value.v_int64));
+      break;
+    case METRIC_UINT32:
+      noit_fingerprint128_update(&fp, &msg->value.value.v_uint32, sizeof(msg->value.value.v_uint32));
+      break;
+    case METRIC_UINT64:
+      noit_fingerprint128_update(&fp, &msg->value.value.v_uint64, sizeof(msg->value.value.v_uint64));
+      break;
+    default:
+      //treat METRIC_GUESS and METRIC_ABSENT as zero-length
+      break;
   }
-  return ret_val;
+  return noit_metric_dedupe_check(dedupe_engine, &fp);
 }
 
 static mtev_boolean
 check_duplicate(const char *payload, const size_t payload_len) {
-  mtev_boolean ret_val = mtev_false;
-  if (dedupe) {
-    unsigned char *digest = malloc(MD5_DIGEST_LENGTH);
-    const EVP_MD *md = EVP_get_digestbyname("MD5");
-    mtevAssert(md);
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(ctx, md, NULL);
-    EVP_DigestUpdate(ctx, payload, payload_len);
-    EVP_DigestFinal(ctx, digest, NULL);
-    EVP_MD_CTX_free(ctx);
-    uint64_t whence_s = get_message_time_s(payload, payload_len);
-    ret_val = check_dedupe_hash(digest, whence_s);
+  if (!dedupe || !dedupe_engine) return mtev_false;
+  /* messages without a timestamp are never deduplicated */
+  if (get_message_time_s(payload, payload_len) == 0) return mtev_false;
+  noit_fingerprint128_t fp;
+  noit_fingerprint128_init(&fp);
+  noit_fingerprint128_update(&fp, payload, payload_len);
+  return noit_metric_dedupe_check(dedupe_engine, &fp);
+}
+
+typedef struct {
+  int64_t account_id;
+  const uint8_t *check_uuid;
+  mtev_hash_table *hists;
+} prometheus_director_closure_t;
+
+static void
+handle_prometheus_timeseries(Prometheus__Label **labels, size_t n_labels,
+                             Prometheus__Sample **samples, size_t n_samples,
+                             void *closure) {
+  prometheus_director_closure_t *pdc = closure;
+  /* each timeseries has a list of labels (Tags) and a list of samples */
+  prometheus_coercion_t coercion = noit_prometheus_metric_name_coerce(labels, n_labels,
+                                                                      false, true, NULL);
+  prometheus_metric_name_t *metric_data = noit_prometheus_metric_name_from_labels(labels,
+      n_labels, coercion.units, coercion.is_histogram);
+  for (size_t j = 0; j < n_samples; j++) {
+    if (!coercion.is_histogram) {
+      noit_metric_message_t *message = noit_prometheus_translate_to_noit_metric_message(&coercion,
+        pdc->account_id, pdc->check_uuid, metric_data, samples[j]);
+      if (message) {
+        if (!check_duplicate_from_noit_metric_message(message)) {
+          distribute_message(message);
+        }
+        noit_metric_director_message_deref(message);
+      }
+    }
+    else {
+      Prometheus__Sample *sample = samples[j];
+      struct timeval tv;
+      tv.tv_sec = (time_t)(sample->timestamp / 1000L);
+      tv.tv_usec = (suseconds_t)((sample->timestamp % 1000L) * 1000);
+      noit_prometheus_track_histogram(&pdc->hists, metric_data, coercion.hist_boundary, sample->value, tv);
+    }
   }
-  return ret_val;
+  noit_prometheus_metric_name_free(metric_data);
 }
 
 static void
@@ -1232,44 +1350,22 @@ handle_prometheus_message(const int64_t account_id,
     return;
   }
   mtev_dyn_buffer_advance(&uncompressed, uncompressed_size);
-  Prometheus__WriteRequest *write = prometheus__write_request__unpack(&protobuf_c_system_allocator,
-                                                                      mtev_dyn_buffer_used(&uncompressed),
-                                                                      mtev_dyn_buffer_data(&uncompressed));
-  if(!write) {
-    mtev_dyn_buffer_destroy(&uncompressed);
+  prometheus_director_closure_t pdc = { .account_id = account_id, .check_uuid = check_uuid };
+  ssize_t cnt = noit_prometheus_decode_write_request(mtev_dyn_buffer_data(&uncompressed),
+                                                     mtev_dyn_buffer_used(&uncompressed),
+                                                     handle_prometheus_timeseries, &pdc);
+  mtev_dyn_buffer_destroy(&uncompressed);
+  mtev_hash_table *hists = pdc.hists;
+  if(cnt < 0) {
+    /* series already distributed stand, but histograms may be missing buckets */
     mtevL(mtev_error, "Prometheus__WriteRequest decode: protobuf invalid\n");
+    if (hists) {
+      mtev_hash_destroy(hists, NULL, noit_prometheus_hist_in_progress_free);
+      free(hists);
+    }
     return;
   }
 
-  mtev_hash_table *hists = NULL;
-  for (size_t i = 0; i < write->n_timeseries; i++) {
-    Prometheus__TimeSeries *ts = write->timeseries[i];
-    /* each timeseries has a list of labels (Tags) and a list of samples */
-    prometheus_coercion_t coercion = noit_prometheus_metric_name_coerce(ts->labels, ts->n_labels,
-                                                                        false, true, NULL);
-    prometheus_metric_name_t *metric_data = noit_prometheus_metric_name_from_labels(ts->labels,
-        ts->n_labels, coercion.units, coercion.is_histogram);
-    for (size_t j = 0; j < ts->n_samples; j++) {
-      if (!coercion.is_histogram) {
-        noit_metric_message_t *message = noit_prometheus_translate_to_noit_metric_message(&coercion,
-          account_id, check_uuid, metric_data, ts->samples[j]);
-        if (message) {
-          if (!check_duplicate_from_noit_metric_message(message)) {
-            distribute_message(message);
-          }
-          noit_metric_director_message_deref(message);
-        }
-      }
-      else {
-        Prometheus__Sample *sample = ts->samples[j];
-        struct timeval tv;
-        tv.tv_sec = (time_t)(sample->timestamp / 1000L);
-        tv.tv_usec = (suseconds_t)((sample->timestamp % 1000L) * 1000);
-        noit_prometheus_track_histogram(&hists, metric_data, coercion.hist_boundary, sample->value, tv);
-      }
-    }
-    noit_prometheus_metric_name_free(metric_data);
-  }
   if (hists) {
     mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
     while(mtev_hash_adv(hists, &iter)) {
@@ -1300,8 +1396,6 @@ handle_prometheus_message(const int64_t account_id,
     mtev_hash_destroy(hists, NULL, noit_prometheus_hist_in_progress_free);
     free(hists);
   }
-  prometheus__write_request__free_unpacked(write, &protobuf_c_system_allocator);
-  mtev_dyn_buffer_destroy(&uncompressed);
 }
 
 static mtev_hook_return_t
@@ -1311,6 +1405,7 @@ handle_fq_message(void *closure, struct fq_conn_s *client, int idx, struct fq_ms
   if(check_duplicate(payload, payload_len) == mtev_false) {
     handle_metric_buffer(payload, payload_len, 1, NULL);
   }
+  lane_stage_flush_all();
   return MTEV_HOOK_CONTINUE;
 }
 static mtev_hook_return_t
@@ -1363,6 +1458,7 @@ handle_kafka_message(void *closure, mtev_rd_kafka_message_t *msg) {
       handle_metric_buffer(msg->payload, msg->payload_len, 1, NULL);
     }
   }
+  lane_stage_flush_all();
   mtev_rd_kafka_message_deref(msg);
   return MTEV_HOOK_CONTINUE;
 }
@@ -1379,6 +1475,7 @@ handle_log_line(void *closure, mtev_log_stream_t ls, const struct timeval *whenc
       strcmp(name,"check") && strcmp(name,"status")))
     return MTEV_HOOK_CONTINUE;
   handle_metric_buffer(line, len, -1, NULL);
+  lane_stage_flush_all();
   return MTEV_HOOK_CONTINUE;
 }
 
@@ -1429,11 +1526,16 @@ void noit_metric_director_init() {
   /* count of messages delivered */
   stats_msg_delivered = stats_register_fanout(stats_ns, "delivered", STATS_TYPE_COUNTER, 16);
   stats_handle_units(stats_msg_delivered, STATS_UNITS_MESSAGES);
+  /* count of messages that did not fit in a lane's ring */
+  stats_msg_overflowed = stats_register_fanout(stats_ns, "overflowed", STATS_TYPE_COUNTER, 16);
+  stats_handle_units(stats_msg_overflowed, STATS_UNITS_MESSAGES);
   /* histogram of delay timings */
   stats_msg_delay = stats_register_fanout(stats_ns, "delay", STATS_TYPE_HISTOGRAM, 16);
   stats_handle_units(stats_msg_delay, STATS_UNITS_SECONDS);
   stats_msg_selection_latency = stats_register_fanout(stats_ns, "selection_latency", STATS_TYPE_HISTOGRAM, 16);
   stats_handle_units(stats_msg_selection_latency, STATS_UNITS_SECONDS);
+  /* count of message arena blocks allocated */
+  stats_arena_blocks = stats_register_fanout(stats_ns, "arena_blocks", STATS_TYPE_COUNTER, 16);
 
   nthreads = eventer_loop_concurrency();
   mtevAssert(nthreads > 0);
@@ -1441,6 +1543,11 @@ void noit_metric_director_init() {
   queues = calloc(sizeof(*queues),nthreads);
 
   mtev_conf_get_uint32(MTEV_CONF_ROOT, "//metric_director/@miss_cache_size", &miss_cache_size);
+  mtev_conf_get_uint32(MTEV_CONF_ROOT, "//metric_director/@message_arena_block_size", &message_arena_block_size);
+  mtev_conf_get_uint32(MTEV_CONF_ROOT, "//metric_director/@lane_ring_size", &lane_ring_size);
+  mtev_conf_get_uint32(MTEV_CONF_ROOT, "//metric_director/@producer_chunk", &producer_chunk);
+  mtev_conf_get_boolean(MTEV_CONF_ROOT, "//metric_director/@native_flatbuffer", &native_flatbuffer);
+  mtev_conf_get_boolean(MTEV_CONF_ROOT, "//metric_director/@search_network", &search_network);
   double miss_cache_replacement_probability = 0.1;
   mtev_conf_get_double(MTEV_CONF_ROOT, "//metric_director/@replacement_rate", &miss_cache_replacement_probability);
   if(miss_cache_replacement_probability < 0) miss_cache_replacement_probability = 0;
@@ -1465,8 +1572,18 @@ void noit_metric_director_init() {
 
   mtev_memory_end();
 
+  uint32_t dedupe_slots = 1 << 16, dedupe_window = 10, dedupe_bucket = 2;
+  double dedupe_max_load = 0.75;
+  mtev_conf_get_uint32(MTEV_CONF_ROOT, "//metric_director/@dedupe_slots", &dedupe_slots);
+  mtev_conf_get_uint32(MTEV_CONF_ROOT, "//metric_director/@dedupe_window", &dedupe_window);
+  mtev_conf_get_uint32(MTEV_CONF_ROOT, "//metric_director/@dedupe_bucket_seconds", &dedupe_bucket);
+  mtev_conf_get_double(MTEV_CONF_ROOT, "//metric_director/@dedupe_max_load", &dedupe_max_load);
+  stats_ns_t *dedupe_ns = mtev_stats_ns(stats_ns, "dedupe");
+  dedupe_engine = noit_metric_dedupe_alloc(dedupe_slots, dedupe_window, dedupe_bucket,
+                                           dedupe_max_load, dedupe_ns);
+
   pthread_mutex_init(&check_interests_lock, NULL);
-  eventer_add_in_s_us(noit_metric_director_prune_dedup, NULL, 2, 0);
+  eventer_add_in_s_us(noit_metric_director_prune_dedup, NULL, 1, 0);
 }
 
 static mtev_hook_return_t
@@ -1491,7 +1608,6 @@ noit_director_hooks_register(void *closure) {
 
 void noit_metric_director_init_globals(void) {
   mtev_hash_init_locks(&id_level, MTEV_HASH_DEFAULT_SIZE, MTEV_HASH_LOCK_MODE_MUTEX);
-  mtev_hash_init_locks(&dedupe_hashes, MTEV_HASH_DEFAULT_SIZE, MTEV_HASH_LOCK_MODE_MUTEX);
   eventer_name_callback("noit_metric_director_prune_dedup",
                         noit_metric_director_prune_dedup);
   dso_post_init_hook_register("noit_director_hooks_register", noit_director_hooks_register, NULL);
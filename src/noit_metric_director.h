@@ -47,10 +47,34 @@ typedef interest_cnt_t caql_cnt_t; /*legacy*/
 /**
  * Funnel metrics to certain threads for processing.
  * 
- * The director will de-duplicate the incoming messages on a 10 second window based on an md5 of the incoming
- * message contents.  If you don't want messages de-deplicated, switch it off using the noit_metric_director_dedupe(mtev_false)
+ * The director will de-duplicate the incoming messages on a 10 second window based on a 128-bit fingerprint
+ * of the incoming message contents (see noit_metric_dedupe.h and the //metric_director/@dedupe_* settings).
+ * If you don't want messages de-deplicated, switch it off using the noit_metric_director_dedupe(mtev_false)
  * call.
  * 
+ * If //metric_director/@message_arena_block_size is set, inbound lines are decoded
+ * into per-thread arenas of blocks of that size rather than one heap allocation per
+ * message (and per value and tag array).  Messages then reference their block and
+ * the block is freed once the last lane has dereferenced every message in it.
+ * Consumers holding on to messages for long periods will pin whole blocks.
+ *
+ * Each lane is a bounded ring (//metric_director/@lane_ring_size) that producers
+ * fill in chunks of //metric_director/@producer_chunk messages, spilling into an
+ * unbounded overflow queue if a lane falls behind.  A lane is consumed by the
+ * thread that owns it and by any threads that have joined it with
+ * noit_metric_director_join_lane(); each message goes to one of them.  Flush
+ * markers are observed by whichever consumer pops them.
+ *
+ * BF (flatbuffer) bundles are rendered to M lines and parsed as such.  If
+ * //metric_director/@native_flatbuffer is "true" they are instead decoded
+ * directly into messages, carrying full precision values; those messages have
+ * no M line, so their original_message is only the metric name.
+ *
+ * If //metric_director/@search_network is "true", the searches registered for
+ * a check and metric name on all lanes are merged into one network in which
+ * shared clauses are evaluated once per message, rather than searched lane by
+ * lane.  The network is rebuilt on first use after a search is added or removed.
+ * 
  */
 void noit_metric_director_init();
 
@@ -59,6 +83,15 @@ void noit_metric_director_init();
  */
 int noit_metric_director_my_lane();
 
+/**
+ * make the calling thread another consumer of lane (the value of
+ * noit_metric_director_my_lane() on the thread that owns it).  Interests and
+ * searches the thread registers then apply to that lane.  Must be called
+ * before the thread makes any other director call; returns mtev_false if it
+ * already has a lane or lane has not been allocated.
+ */
+mtev_boolean noit_metric_director_join_lane(int lane);
+
 /**
  * see init(), will dedupe by default.  Pass mtev_false to switch it off 
  */
@@ -86,6 +119,13 @@ noit_metric_message_t *noit_metric_director_lane_next();
 /* This gets the next line you've subscribed to and
  * sets backlog (if not NULL) to the current backlog after a successful fetch. */
 noit_metric_message_t *noit_metric_director_lane_next_backlog(uint32_t *backlog);
+/* This fills msgs with up to max of the next lines you've subscribed to and
+ * returns how many were fetched.  Each message carries a reference that must be
+ * released, noit_metric_director_message_deref_batch() does that cheaply. */
+size_t noit_metric_director_lane_next_batch(noit_metric_message_t **msgs, size_t max);
+size_t noit_metric_director_lane_next_batch_backlog(noit_metric_message_t **msgs, size_t max,
+                                                    uint32_t *backlog);
+void noit_metric_director_message_deref_batch(noit_metric_message_t **msgs, size_t cnt);
 
 void noit_metric_director_message_ref(void *message);
 void noit_metric_director_message_deref(void *message);
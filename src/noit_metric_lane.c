@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2026, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mtev_defines.h>
+#include <ck_fifo.h>
+#include <ck_md.h>
+#include <ck_pr.h>
+#include <ck_ring.h>
+#include <ck_spinlock.h>
+
+#include "noit_metric_lane.h"
+
+struct noit_metric_lane {
+  ck_ring_t ring CK_CC_CACHELINE;
+  ck_ring_buffer_t *ring_buffer;
+  ck_spinlock_t producer_lock CK_CC_CACHELINE;
+  uint32_t overflowed;
+  ck_fifo_spsc_t overflow;
+  ck_spinlock_t consumer_lock CK_CC_CACHELINE;
+};
+
+noit_metric_lane_t *
+noit_metric_lane_alloc(uint32_t ring_size) {
+  noit_metric_lane_t *lane;
+  /* ck_ring requires a power of two */
+  uint32_t size = 4;
+  while(size < ring_size && size < (1U << 30)) size <<= 1;
+  if(posix_memalign((void **)&lane, CK_MD_CACHELINE, sizeof(*lane))) return NULL;
+  memset(lane, 0, sizeof(*lane));
+  ck_ring_init(&lane->ring, size);
+  lane->ring_buffer = calloc(size, sizeof(*lane->ring_buffer));
+  ck_spinlock_init(&lane->producer_lock);
+  ck_spinlock_init(&lane->consumer_lock);
+  ck_fifo_spsc_init(&lane->overflow, malloc(sizeof(ck_fifo_spsc_entry_t)));
+  return lane;
+}
+
+uint32_t
+noit_metric_lane_publish(noit_metric_lane_t *lane, void **items, uint32_t cnt) {
+  uint32_t i = 0;
+  ck_spinlock_lock(&lane->producer_lock);
+  if(ck_pr_load_32(&lane->overflowed) == 0) {
+    for(; i < cnt; i++) {
+      if(!ck_ring_enqueue_spsc(&lane->ring, lane->ring_buffer, items[i])) break;
+    }
+  }
+  uint32_t spilled = cnt - i;
+  for(; i < cnt; i++) {
+    ck_fifo_spsc_entry_t *fifo_entry = ck_fifo_spsc_recycle(&lane->overflow);
+    if(!fifo_entry) fifo_entry = malloc(sizeof(ck_fifo_spsc_entry_t));
+    ck_fifo_spsc_enqueue(&lane->overflow, fifo_entry, items[i]);
+    ck_pr_inc_32(&lane->overflowed);
+  }
+  ck_spinlock_unlock(&lane->producer_lock);
+  return spilled;
+}
+
+/* consumer_lock must be held */
+static void *
+lane_pop_locked(noit_metric_lane_t *lane) {
+  void *item;
+  if(ck_ring_dequeue_spsc(&lane->ring, lane->ring_buffer, &item)) return item;
+  if(ck_pr_load_32(&lane->overflowed) == 0) return NULL;
+  /* The ring may have filled and spilled since we found it empty; anything
+   * in it now is older than the overflow, and stays so until we drain it. */
+  if(ck_ring_dequeue_spsc(&lane->ring, lane->ring_buffer, &item)) return item;
+  if(ck_fifo_spsc_dequeue(&lane->overflow, &item)) {
+    ck_pr_dec_32(&lane->overflowed);
+    return item;
+  }
+  return NULL;
+}
+
+void *
+noit_metric_lane_pop(noit_metric_lane_t *lane) {
+  ck_spinlock_lock(&lane->consumer_lock);
+  void *item = lane_pop_locked(lane);
+  ck_spinlock_unlock(&lane->consumer_lock);
+  return item;
+}
+
+size_t
+noit_metric_lane_pop_batch(noit_metric_lane_t *lane, void **items, size_t max) {
+  size_t cnt = 0;
+  ck_spinlock_lock(&lane->consumer_lock);
+  while(cnt < max) {
+    void *item = lane_pop_locked(lane);
+    if(item == NULL) break;
+    items[cnt++] = item;
+  }
+  ck_spinlock_unlock(&lane->consumer_lock);
+  return cnt;
+}
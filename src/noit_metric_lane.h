@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2026, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NOIT_METRIC_LANE_H
+#define NOIT_METRIC_LANE_H
+
+#include <mtev_defines.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A metric director lane: a bounded ring fed by producers in chunks under a
+ * producer lock and drained by any number of consumers under a consumer lock,
+ * taken once per batch.  Each item goes to exactly one consumer, and items are
+ * handed out in publish order.  If the ring fills, producers spill into an
+ * unbounded fifo until the consumers have drained it, which keeps each
+ * producer's items in order.
+ */
+typedef struct noit_metric_lane noit_metric_lane_t;
+
+/* ring_size is rounded up to a power of two. */
+API_EXPORT(noit_metric_lane_t *)
+  noit_metric_lane_alloc(uint32_t ring_size);
+
+/* Queues cnt items in order and returns how many spilled past the ring. */
+API_EXPORT(uint32_t)
+  noit_metric_lane_publish(noit_metric_lane_t *lane, void **items, uint32_t cnt);
+
+/* Consumer side: the next item, or NULL if the lane is empty.  Safe to call
+ * from several threads at once. */
+API_EXPORT(void *)
+  noit_metric_lane_pop(noit_metric_lane_t *lane);
+
+/* Consumer side: fills items with up to max of the next items and returns
+ * how many were fetched, in the order noit_metric_lane_pop would return them. */
+API_EXPORT(size_t)
+  noit_metric_lane_pop_batch(noit_metric_lane_t *lane, void **items, size_t max);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1322,65 +1322,726 @@ noit_metric_tag_search_evaluate_against_tags(const noit_metric_tag_search_ast_t
   return noit_metric_tag_search_evaluate_against_tags_multi(search, &set, 1);
 }
 
-mtev_boolean
-noit_metric_tag_search_evaluate_against_metric_id(const noit_metric_tag_search_ast_t *search,
-                                                  const noit_metric_id_t *id) {
-  mtev_memory_begin();
+/* The tagsets a metric id is searched against: its own plus __check_uuid
+ * and __name, after any fixup hooks have had their say. */
+typedef struct {
+  noit_metric_tagset_t check, stream, measurement;
+  noit_metric_tag_t check_tags[MAX_TAGS];
+  noit_metric_tag_t stream_tags[MAX_TAGS];
+  noit_metric_tag_t measurement_tags[MAX_TAGS];
+  char uuid_str[13 + UUID_STR_LEN + 1];
+  char name_str[NOIT_TAG_MAX_PAIR_LEN + 1];
+} metric_id_tagsets_t;
 
+/* Must be called within mtev_memory_begin/end as the hooks may use SMR */
+static mtev_boolean
+metric_id_tagsets_prepare(metric_id_tagsets_t *s, const noit_metric_id_t *id) {
 #define MKTAGSETCOPY(name) \
-  noit_metric_tag_t name##_tags[MAX_TAGS]; \
-  memcpy(&name##_tags, name.tags, name.tag_count * sizeof(noit_metric_tag_t)); \
-  name.tags = name##_tags
+  memcpy(s->name##_tags, s->name.tags, s->name.tag_count * sizeof(noit_metric_tag_t)); \
+  s->name.tags = s->name##_tags
 
   // setup check tags
-  noit_metric_tagset_t tagset_check = id->check;
+  s->check = id->check;
   // Add in extra tags: __uuid
-  if (tagset_check.tag_count > MAX_TAGS - 1) {
-    mtev_memory_end();
-    return 0;
-  }
-  MKTAGSETCOPY(tagset_check);
-  char uuid_str[13 + UUID_STR_LEN + 1];
-  strcpy(uuid_str, "__check_uuid:");
-  mtev_uuid_unparse_lower(id->id, uuid_str + 13);
-  noit_metric_tag_t uuid_tag = { .tag = uuid_str, .total_size = strlen(uuid_str), .category_size = 13 };
-  tagset_check.tags[tagset_check.tag_count++] = uuid_tag;
-  if(noit_metric_tagset_fixup_hook_invoke(NOIT_METRIC_TAGSET_CHECK, &tagset_check) == MTEV_HOOK_ABORT) {
-    mtev_memory_end();
+  if (s->check.tag_count > MAX_TAGS - 1) return mtev_false;
+  MKTAGSETCOPY(check);
+  strcpy(s->uuid_str, "__check_uuid:");
+  mtev_uuid_unparse_lower(id->id, s->uuid_str + 13);
+  noit_metric_tag_t uuid_tag = { .tag = s->uuid_str, .total_size = strlen(s->uuid_str), .category_size = 13 };
+  s->check.tags[s->check.tag_count++] = uuid_tag;
+  if(noit_metric_tagset_fixup_hook_invoke(NOIT_METRIC_TAGSET_CHECK, &s->check) == MTEV_HOOK_ABORT) {
     return mtev_false;
   }
 
   // setup stream tags
-  noit_metric_tagset_t tagset_stream = id->stream;
+  s->stream = id->stream;
   // Add in extra tags: __name
-  if (tagset_stream.tag_count > MAX_TAGS - 1) {
-    mtev_memory_end();
-    return 0;
-  }
-  MKTAGSETCOPY(tagset_stream);
-  char name_str[NOIT_TAG_MAX_PAIR_LEN + 1];
-  snprintf(name_str, sizeof(name_str), "__name:%.*s", id->name_len, id->name);
-  noit_metric_tag_t name_tag = { .tag = name_str, .total_size = strlen(name_str), .category_size = 7 };
-  tagset_stream.tags[tagset_stream.tag_count++] = name_tag;
-  if(noit_metric_tagset_fixup_hook_invoke(NOIT_METRIC_TAGSET_STREAM, &tagset_stream) == MTEV_HOOK_ABORT) {
-    mtev_memory_end();
+  if (s->stream.tag_count > MAX_TAGS - 1) return mtev_false;
+  MKTAGSETCOPY(stream);
+  snprintf(s->name_str, sizeof(s->name_str), "__name:%.*s", id->name_len, id->name);
+  noit_metric_tag_t name_tag = { .tag = s->name_str, .total_size = strlen(s->name_str), .category_size = 7 };
+  s->stream.tags[s->stream.tag_count++] = name_tag;
+  if(noit_metric_tagset_fixup_hook_invoke(NOIT_METRIC_TAGSET_STREAM, &s->stream) == MTEV_HOOK_ABORT) {
     return mtev_false;
   }
 
   // setup measurement tags
-  noit_metric_tagset_t tagset_measurement = id->measurement;
-  MKTAGSETCOPY(tagset_measurement);
-  if(noit_metric_tagset_fixup_hook_invoke(NOIT_METRIC_TAGSET_MEASUREMENT, &tagset_measurement) == MTEV_HOOK_ABORT) {
-    mtev_memory_end();
+  s->measurement = id->measurement;
+  if (s->measurement.tag_count > MAX_TAGS) return mtev_false;
+  MKTAGSETCOPY(measurement);
+  if(noit_metric_tagset_fixup_hook_invoke(NOIT_METRIC_TAGSET_MEASUREMENT, &s->measurement) == MTEV_HOOK_ABORT) {
     return mtev_false;
   }
+#undef MKTAGSETCOPY
+  return mtev_true;
+}
 
-  const noit_metric_tagset_t *tagsets[3] = { &tagset_check, &tagset_stream, &tagset_measurement };
-  mtev_boolean ok = noit_metric_tag_search_evaluate_against_tags_multi(search, tagsets, 3);
+mtev_boolean
+noit_metric_tag_search_evaluate_against_metric_id(const noit_metric_tag_search_ast_t *search,
+                                                  const noit_metric_id_t *id) {
+  metric_id_tagsets_t s;
+  mtev_boolean ok = mtev_false;
+  mtev_memory_begin();
+  if(metric_id_tagsets_prepare(&s, id)) {
+    const noit_metric_tagset_t *tagsets[3] = { &s.check, &s.stream, &s.measurement };
+    ok = noit_metric_tag_search_evaluate_against_tags_multi(search, tagsets, 3);
+  }
   mtev_memory_end();
   return ok;
 }
 
+/* Indexed evaluation.
+ *
+ * An index holds every tag of the tagsets being searched, with b"" encoded
+ * parts decoded once, sorted by (category, value).  A program is the AST
+ * flattened into a list of match instructions, each naming a term and the
+ * instruction to go to on success or failure.  Terms with an exact category
+ * are a binary search into the index (and a second one for an exact value),
+ * and within and()/or() cheaper terms are placed first.
+ */
+typedef struct {
+  const char *cat;
+  const char *val;
+  uint32_t cat_len;
+  uint32_t val_len;
+} tag_index_entry_t;
+
+struct noit_metric_tag_search_index {
+  int cnt;
+  int allocd;
+  tag_index_entry_t *entries;
+  char *decoded;
+  size_t decoded_allocd;
+};
+
+#define PROGRAM_ACCEPT -1
+#define PROGRAM_REJECT -2
+
+typedef enum {
+  TERM_COST_EXACT = 0,    /* exact category and exact or absent value */
+  TERM_COST_CATEGORY = 1, /* exact category, pattern value */
+  TERM_COST_SCAN = 2      /* pattern category */
+} term_cost_t;
+
+typedef struct {
+  const noit_var_match_t *cat;
+  const noit_var_match_t *name;
+  mtev_boolean cat_exact;
+  mtev_boolean name_exact;
+  mtev_boolean name_any;
+  size_t cat_len;
+  size_t name_len;
+  char cat_prefix[NOIT_TAG_MAX_CAT_LEN + 1];
+  size_t cat_prefix_len;
+  term_cost_t cost;
+} program_term_t;
+
+typedef struct {
+  int term;
+  int on_true;
+  int on_false;
+} program_insn_t;
+
+struct noit_metric_tag_search_program {
+  noit_metric_tag_search_ast_t *ast; /* referenced, the terms point into it */
+  int nterms;
+  program_term_t *terms;
+  int ninsns;
+  int allocd_insns;
+  program_insn_t *insns;
+  int entry;
+};
+
+noit_metric_tag_search_index_t *
+noit_metric_tag_search_index_alloc(void) {
+  return calloc(1, sizeof(noit_metric_tag_search_index_t));
+}
+
+void
+noit_metric_tag_search_index_free(noit_metric_tag_search_index_t *idx) {
+  if(!idx) return;
+  free(idx->entries);
+  free(idx->decoded);
+  free(idx);
+}
+
+static int
+tag_index_entry_cmp(const void *av, const void *bv) {
+  const tag_index_entry_t *a = av, *b = bv;
+  size_t len = MIN(a->cat_len, b->cat_len);
+  int rv = memcmp(a->cat, b->cat, len);
+  if(rv) return rv;
+  if(a->cat_len != b->cat_len) return a->cat_len < b->cat_len ? -1 : 1;
+  len = MIN(a->val_len, b->val_len);
+  rv = memcmp(a->val, b->val, len);
+  if(rv) return rv;
+  if(a->val_len != b->val_len) return a->val_len < b->val_len ? -1 : 1;
+  return 0;
+}
+
+static inline mtev_boolean
+is_b64_part(const char *s, size_t len) {
+  return len >= 2 && s[0] == 'b' && s[1] == '"';
+}
+
+/* Decodes a b"" part the way noit_match_str would, false if it can never match */
+static mtev_boolean
+tag_index_decode(noit_metric_tag_search_index_t *idx, size_t *used,
+                 const char **part, uint32_t *part_len) {
+  if(!is_b64_part(*part, *part_len)) return mtev_true;
+  const char *start = *part + 2;
+  const char *end = memchr(start, '"', *part_len - 2);
+  if(!end) return mtev_false;
+  char *out = idx->decoded + *used;
+  int len = mtev_b64_decode(start, end - start, (unsigned char *)out, idx->decoded_allocd - *used);
+  if(len == 0) return mtev_false;
+  *used += len;
+  *part = out;
+  *part_len = len;
+  return mtev_true;
+}
+
+void
+noit_metric_tag_search_index_build(noit_metric_tag_search_index_t *idx,
+                                   const noit_metric_tagset_t **sets, int nsets) {
+  int total = 0;
+  size_t decode_need = 0;
+  for(int s=0; s<nsets; s++) {
+    total += sets[s]->tag_count;
+    for(int i=0; i<sets[s]->tag_count; i++) {
+      if(memchr(sets[s]->tags[i].tag, '"', sets[s]->tags[i].total_size))
+        decode_need += mtev_b64_max_decode_len(sets[s]->tags[i].total_size);
+    }
+  }
+  if(total > idx->allocd) {
+    free(idx->entries);
+    idx->allocd = MAX(total, 2 * idx->allocd);
+    idx->entries = malloc(idx->allocd * sizeof(*idx->entries));
+  }
+  if(decode_need > idx->decoded_allocd) {
+    free(idx->decoded);
+    idx->decoded_allocd = MAX(decode_need, 2 * idx->decoded_allocd);
+    idx->decoded = malloc(idx->decoded_allocd);
+  }
+
+  size_t used = 0;
+  idx->cnt = 0;
+  for(int s=0; s<nsets; s++) {
+    for(int i=0; i<sets[s]->tag_count; i++) {
+      const noit_metric_tag_t *tag = &sets[s]->tags[i];
+      if(tag->category_size == 0 || tag->total_size < tag->category_size) continue;
+      tag_index_entry_t *e = &idx->entries[idx->cnt];
+      e->cat = tag->tag;
+      e->cat_len = tag->category_size - 1;
+      e->val = tag->tag + tag->category_size;
+      e->val_len = tag->total_size - tag->category_size;
+      if(!tag_index_decode(idx, &used, &e->cat, &e->cat_len) ||
+         !tag_index_decode(idx, &used, &e->val, &e->val_len)) continue;
+      idx->cnt++;
+    }
+  }
+  qsort(idx->entries, idx->cnt, sizeof(*idx->entries), tag_index_entry_cmp);
+}
+
+mtev_boolean
+noit_metric_tag_search_index_build_for_metric_id(noit_metric_tag_search_index_t *idx,
+                                                 const noit_metric_id_t *id) {
+  metric_id_tagsets_t s;
+  mtev_boolean ok;
+  mtev_memory_begin();
+  ok = metric_id_tagsets_prepare(&s, id);
+  if(ok) {
+    const noit_metric_tagset_t *tagsets[3] = { &s.check, &s.stream, &s.measurement };
+    noit_metric_tag_search_index_build(idx, tagsets, 3);
+  }
+  else {
+    idx->cnt = 0;
+  }
+  mtev_memory_end();
+  return ok;
+}
+
+/* first entry in [lo,hi) whose category is >= cat (by prefix when prefix is set) */
+static int
+tag_index_lower_bound_cat(const noit_metric_tag_search_index_t *idx, int lo, int hi,
+                          const char *cat, size_t cat_len) {
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    const tag_index_entry_t *e = &idx->entries[mid];
+    size_t len = MIN(e->cat_len, cat_len);
+    int rv = memcmp(e->cat, cat, len);
+    if(rv < 0 || (rv == 0 && e->cat_len < cat_len)) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static mtev_boolean
+tag_index_find_val(const noit_metric_tag_search_index_t *idx, int lo, int hi,
+                   const char *val, size_t val_len) {
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    const tag_index_entry_t *e = &idx->entries[mid];
+    size_t len = MIN(e->val_len, val_len);
+    int rv = memcmp(e->val, val, len);
+    if(rv == 0 && e->val_len == val_len) return mtev_true;
+    if(rv < 0 || (rv == 0 && e->val_len < val_len)) lo = mid + 1;
+    else hi = mid;
+  }
+  return mtev_false;
+}
+
+/* noit_match_str() against an already decoded subject */
+static inline mtev_boolean
+var_match_decoded(const noit_var_match_t *m, const char *subj, size_t subj_len) {
+  if(m->impl) return m->impl->match(m->impl_data, m->str, subj, subj_len);
+  if(m->str == NULL) return mtev_true;
+  return strlen(m->str) == subj_len && !memcmp(m->str, subj, subj_len);
+}
+
+static inline mtev_boolean
+program_term_name_match(const program_term_t *t, const tag_index_entry_t *e) {
+  if(t->name_any) return mtev_true;
+  if(t->name_exact) return e->val_len == t->name_len && !memcmp(e->val, t->name->str, t->name_len);
+  return var_match_decoded(t->name, e->val, e->val_len);
+}
+
+static mtev_boolean
+program_term_match(const program_term_t *t, const noit_metric_tag_search_index_t *idx) {
+  int lo = 0, hi = idx->cnt;
+  if(t->cat_exact) {
+    lo = tag_index_lower_bound_cat(idx, 0, idx->cnt, t->cat->str, t->cat_len);
+    for(hi = lo; hi < idx->cnt; hi++) {
+      const tag_index_entry_t *e = &idx->entries[hi];
+      if(e->cat_len != t->cat_len || memcmp(e->cat, t->cat->str, t->cat_len)) break;
+    }
+    if(lo == hi) return mtev_false;
+    if(t->name_any) return mtev_true;
+    if(t->name_exact) return tag_index_find_val(idx, lo, hi, t->name->str, t->name_len);
+    for(int i=lo; i<hi; i++) {
+      if(program_term_name_match(t, &idx->entries[i])) return mtev_true;
+    }
+    return mtev_false;
+  }
+  if(t->cat_prefix_len) {
+    lo = tag_index_lower_bound_cat(idx, 0, idx->cnt, t->cat_prefix, t->cat_prefix_len);
+  }
+  /* entries are grouped by category, so the category pattern runs once per category */
+  const tag_index_entry_t *last = NULL;
+  mtev_boolean last_match = mtev_false;
+  for(int i=lo; i<hi; i++) {
+    const tag_index_entry_t *e = &idx->entries[i];
+    if(t->cat_prefix_len &&
+       (e->cat_len < t->cat_prefix_len || memcmp(e->cat, t->cat_prefix, t->cat_prefix_len))) break;
+    if(!last || last->cat_len != e->cat_len || memcmp(last->cat, e->cat, e->cat_len)) {
+      last_match = var_match_decoded(t->cat, e->cat, e->cat_len);
+      last = e;
+    }
+    if(last_match && program_term_name_match(t, e)) return mtev_true;
+  }
+  return mtev_false;
+}
+
+static mtev_boolean
+var_match_same(const noit_var_match_t *a, const noit_var_match_t *b) {
+  if(a->impl != b->impl) return mtev_false;
+  if(a->str == NULL || b->str == NULL) return a->str == b->str;
+  return !strcmp(a->str, b->str);
+}
+
+static void
+program_term_init(program_term_t *t, const noit_metric_tag_match_t *spec) {
+  memset(t, 0, sizeof(*t));
+  t->cat = &spec->cat;
+  t->name = &spec->name;
+  t->cat_exact = (spec->cat.impl == &var_exact_matcher || spec->cat.impl == NULL) &&
+                 spec->cat.str != NULL;
+  t->cat_len = spec->cat.str ? strlen(spec->cat.str) : 0;
+  t->name_any = spec->name.impl == NULL && spec->name.str == NULL;
+  t->name_exact = !t->name_any && spec->name.str != NULL &&
+                  (spec->name.impl == &var_exact_matcher || spec->name.impl == NULL);
+  t->name_len = spec->name.str ? strlen(spec->name.str) : 0;
+  /* A front-anchored category regex narrows the scan to a prefix range.  The prefix
+   * is only trustworthy for compiled expressions, and alternations or counted
+   * repeats (which may be zero) defeat it. */
+  re_impl_t *cat_re = NULL;
+  if(spec->cat.impl == &var_re_matcher || spec->cat.impl == &var_re_expansion_matcher)
+    cat_re = spec->cat.impl_data;
+  if(!t->cat_exact && cat_re && cat_re->rem &&
+     !strpbrk(cat_re->rem->re_str, "|{") &&
+     re_matcher_compile(cat_re->rem) && cat_re->rem->re != NULL) {
+    mtev_boolean all;
+    t->cat_prefix[0] = '\0';
+    t->cat_prefix_len = noit_var_strlcat_fixed_prefix(&spec->cat, t->cat_prefix,
+                                                      sizeof(t->cat_prefix), &all);
+  }
+  if(!t->cat_exact) t->cost = TERM_COST_SCAN;
+  else if(t->name_any || t->name_exact) t->cost = TERM_COST_EXACT;
+  else t->cost = TERM_COST_CATEGORY;
+}
+
+static int
+program_add_term(noit_metric_tag_search_program_t *p, const noit_metric_tag_match_t *spec) {
+  for(int i=0; i<p->nterms; i++) {
+    if(var_match_same(p->terms[i].cat, &spec->cat) &&
+       var_match_same(p->terms[i].name, &spec->name)) return i;
+  }
+  program_term_init(&p->terms[p->nterms], spec);
+  return p->nterms++;
+}
+
+static int
+program_count_matches(const noit_metric_tag_search_ast_t *node) {
+  if(node->operation == OP_MATCH) return 1;
+  int cnt = 0;
+  for(int i=0; i<node->contents.args.cnt; i++) cnt += program_count_matches(node->contents.args.node[i]);
+  return cnt;
+}
+
+static term_cost_t
+program_node_cost(noit_metric_tag_search_program_t *p, const noit_metric_tag_search_ast_t *node) {
+  term_cost_t cost = TERM_COST_EXACT;
+  switch(node->operation) {
+    case OP_MATCH:
+      return p->terms[program_add_term(p, &node->contents.spec)].cost;
+    case OP_HINT_ARGS:
+      return node->contents.args.cnt ? program_node_cost(p, node->contents.args.node[0]) : cost;
+    default:
+      for(int i=0; i<node->contents.args.cnt; i++) {
+        term_cost_t c = program_node_cost(p, node->contents.args.node[i]);
+        if(c > cost) cost = c;
+      }
+  }
+  return cost;
+}
+
+/* Instructions are emitted back to front so that every jump target is known
+ * by the time the instruction jumping to it is written. */
+static int
+program_emit(noit_metric_tag_search_program_t *p, const noit_metric_tag_search_ast_t *node,
+             int on_true, int on_false) {
+  switch(node->operation) {
+    case OP_MATCH:
+    {
+      program_insn_t *insn = &p->insns[p->ninsns];
+      insn->term = program_add_term(p, &node->contents.spec);
+      insn->on_true = on_true;
+      insn->on_false = on_false;
+      return p->ninsns++;
+    }
+    case OP_NOT_ARGS:
+      mtevAssert(node->contents.args.cnt == 1);
+      return program_emit(p, node->contents.args.node[0], on_false, on_true);
+    case OP_HINT_ARGS:
+      if(node->contents.args.cnt == 0) return on_false;
+      return program_emit(p, node->contents.args.node[0], on_true, on_false);
+    case OP_AND_ARGS:
+    case OP_OR_ARGS:
+    {
+      int cnt = node->contents.args.cnt;
+      int order[cnt > 0 ? cnt : 1];
+      term_cost_t costs[cnt > 0 ? cnt : 1];
+      /* stable insertion sort, cheapest first */
+      for(int i=0; i<cnt; i++) {
+        term_cost_t c = program_node_cost(p, node->contents.args.node[i]);
+        int j = i;
+        while(j > 0 && costs[j-1] > c) {
+          costs[j] = costs[j-1];
+          order[j] = order[j-1];
+          j--;
+        }
+        costs[j] = c;
+        order[j] = i;
+      }
+      int next = (node->operation == OP_AND_ARGS) ? on_true : on_false;
+      for(int i=cnt-1; i>=0; i--) {
+        const noit_metric_tag_search_ast_t *child = node->contents.args.node[order[i]];
+        if(node->operation == OP_AND_ARGS) next = program_emit(p, child, next, on_false);
+        else next = program_emit(p, child, on_true, next);
+      }
+      return next;
+    }
+    default:
+      break;
+  }
+  return on_false;
+}
+
+noit_metric_tag_search_program_t *
+noit_metric_tag_search_program_compile(noit_metric_tag_search_ast_t *ast) {
+  if(ast == NULL) return NULL;
+  noit_metric_tag_search_program_t *p = calloc(1, sizeof(*p));
+  int nmatches = program_count_matches(ast);
+  p->ast = noit_metric_tag_search_ref(ast);
+  p->terms = calloc(nmatches ? nmatches : 1, sizeof(*p->terms));
+  p->insns = calloc(nmatches ? nmatches : 1, sizeof(*p->insns));
+  p->allocd_insns = nmatches;
+  p->entry = program_emit(p, ast, PROGRAM_ACCEPT, PROGRAM_REJECT);
+  mtevAssert(p->ninsns <= p->allocd_insns);
+  return p;
+}
+
+void
+noit_metric_tag_search_program_free(noit_metric_tag_search_program_t *p) {
+  if(!p) return;
+  noit_metric_tag_search_free(p->ast);
+  free(p->terms);
+  free(p->insns);
+  free(p);
+}
+
+mtev_boolean
+noit_metric_tag_search_program_evaluate(const noit_metric_tag_search_program_t *p,
+                                        const noit_metric_tag_search_index_t *idx) {
+  /* 0 = unknown, 1 = false, 2 = true: a term may be reached along many paths */
+  MTEV_MAYBE_DECL_VARS(uint8_t, memo, 64);
+  MTEV_MAYBE_REALLOC(memo, p->nterms ? p->nterms : 1);
+  memset(memo, 0, p->nterms);
+  int pc = p->entry;
+  while(pc >= 0) {
+    const program_insn_t *insn = &p->insns[pc];
+    if(memo[insn->term] == 0) {
+      memo[insn->term] = program_term_match(&p->terms[insn->term], idx) ? 2 : 1;
+    }
+    pc = (memo[insn->term] == 2) ? insn->on_true : insn->on_false;
+  }
+  MTEV_MAYBE_FREE(memo);
+  return pc == PROGRAM_ACCEPT;
+}
+
+/* Networks.
+ *
+ * A network merges many searches into one DAG.  Terms and nodes are
+ * hash-consed, so a clause that appears in many searches (or many times in
+ * one) is a single node, and each node is evaluated at most once per index.
+ * Every search added is a root tagged with a lane; evaluation reports the
+ * lanes that have at least one matching root.
+ */
+typedef struct {
+  noit_metric_tag_search_op_t op; /* OP_MATCH, OP_AND_ARGS, OP_OR_ARGS or OP_NOT_ARGS */
+  int term;
+  int nargs;
+  int *args; /* cheapest first */
+  term_cost_t cost;
+} network_node_t;
+
+typedef struct {
+  int node;
+  int lane;
+} network_root_t;
+
+struct noit_metric_tag_search_network {
+  int nterms, allocd_terms;
+  program_term_t *terms;
+  int nnodes, allocd_nodes;
+  network_node_t *nodes;
+  int nroots, allocd_roots;
+  network_root_t *roots;
+  int nasts, allocd_asts;
+  noit_metric_tag_search_ast_t **asts;
+  mtev_hash_table term_lookup;
+  mtev_hash_table node_lookup;
+};
+
+#define NETWORK_GROW(net, field) do { \
+  if(net->n##field == net->allocd_##field) { \
+    net->allocd_##field = net->allocd_##field ? 2 * net->allocd_##field : 16; \
+    net->field = realloc(net->field, net->allocd_##field * sizeof(*net->field)); \
+  } \
+} while(0)
+
+noit_metric_tag_search_network_t *
+noit_metric_tag_search_network_alloc(void) {
+  noit_metric_tag_search_network_t *net = calloc(1, sizeof(*net));
+  mtev_hash_init(&net->term_lookup);
+  mtev_hash_init(&net->node_lookup);
+  return net;
+}
+
+void
+noit_metric_tag_search_network_free(noit_metric_tag_search_network_t *net) {
+  if(!net) return;
+  mtev_hash_destroy(&net->term_lookup, free, NULL);
+  mtev_hash_destroy(&net->node_lookup, free, NULL);
+  for(int i=0; i<net->nnodes; i++) free(net->nodes[i].args);
+  for(int i=0; i<net->nasts; i++) noit_metric_tag_search_free(net->asts[i]);
+  free(net->terms);
+  free(net->nodes);
+  free(net->roots);
+  free(net->asts);
+  free(net);
+}
+
+static void
+network_key_add_var(mtev_dyn_buffer_t *key, const noit_var_match_t *m) {
+  mtev_dyn_buffer_add(key, (uint8_t *)&m->impl, sizeof(m->impl));
+  if(m->str) mtev_dyn_buffer_add(key, (uint8_t *)m->str, strlen(m->str));
+  mtev_dyn_buffer_add(key, (uint8_t *)(m->str ? "" : "\001"), 1);
+}
+
+/* Returns the existing index for key, or stores key for index and returns -1 */
+static int
+network_intern(mtev_hash_table *lookup, const void *key, size_t len, int index) {
+  void *vidx;
+  if(mtev_hash_retrieve(lookup, key, len, &vidx)) return (int)(intptr_t)vidx;
+  char *copy = malloc(len);
+  memcpy(copy, key, len);
+  mtev_hash_store(lookup, copy, len, (void *)(intptr_t)index);
+  return -1;
+}
+
+static int
+network_add_term(noit_metric_tag_search_network_t *net, const noit_metric_tag_match_t *spec) {
+  mtev_dyn_buffer_t key;
+  mtev_dyn_buffer_init(&key);
+  network_key_add_var(&key, &spec->cat);
+  network_key_add_var(&key, &spec->name);
+  int found = network_intern(&net->term_lookup, mtev_dyn_buffer_data(&key),
+                             mtev_dyn_buffer_used(&key), net->nterms);
+  mtev_dyn_buffer_destroy(&key);
+  if(found >= 0) return found;
+  NETWORK_GROW(net, terms);
+  program_term_init(&net->terms[net->nterms], spec);
+  return net->nterms++;
+}
+
+static int
+network_add_node(noit_metric_tag_search_network_t *net, noit_metric_tag_search_op_t op,
+                 int term, int *args, int nargs) {
+  int keybuf[3 + nargs];
+  keybuf[0] = op;
+  keybuf[1] = term;
+  keybuf[2] = nargs;
+  memcpy(keybuf + 3, args, nargs * sizeof(int));
+  int found = network_intern(&net->node_lookup, keybuf, sizeof(keybuf), net->nnodes);
+  if(found >= 0) return found;
+  NETWORK_GROW(net, nodes);
+  network_node_t *node = &net->nodes[net->nnodes];
+  node->op = op;
+  node->term = term;
+  node->nargs = nargs;
+  node->args = NULL;
+  node->cost = TERM_COST_EXACT;
+  if(op == OP_MATCH) {
+    node->cost = net->terms[term].cost;
+  }
+  else if(nargs > 0) {
+    node->args = malloc(nargs * sizeof(int));
+    memcpy(node->args, args, nargs * sizeof(int));
+    for(int i=0; i<nargs; i++) {
+      if(net->nodes[args[i]].cost > node->cost) node->cost = net->nodes[args[i]].cost;
+    }
+  }
+  return net->nnodes++;
+}
+
+static int
+network_build(noit_metric_tag_search_network_t *net, const noit_metric_tag_search_ast_t *ast) {
+  switch(ast->operation) {
+    case OP_MATCH:
+      return network_add_node(net, OP_MATCH, network_add_term(net, &ast->contents.spec), NULL, 0);
+    case OP_HINT_ARGS:
+      if(ast->contents.args.cnt == 0) return network_add_node(net, OP_OR_ARGS, -1, NULL, 0);
+      return network_build(net, ast->contents.args.node[0]);
+    case OP_NOT_ARGS:
+    {
+      mtevAssert(ast->contents.args.cnt == 1);
+      int child = network_build(net, ast->contents.args.node[0]);
+      return network_add_node(net, OP_NOT_ARGS, -1, &child, 1);
+    }
+    case OP_AND_ARGS:
+    case OP_OR_ARGS:
+    {
+      int cnt = ast->contents.args.cnt, nargs = 0;
+      int args[cnt > 0 ? cnt : 1];
+      for(int i=0; i<cnt; i++) {
+        int child = network_build(net, ast->contents.args.node[i]);
+        term_cost_t c = net->nodes[child].cost;
+        /* and(a,a) is a: drop repeats, then keep cheapest first (stable) */
+        mtev_boolean dup = mtev_false;
+        for(int j=0; j<nargs; j++) if(args[j] == child) dup = mtev_true;
+        if(dup) continue;
+        int j = nargs++;
+        while(j > 0 && net->nodes[args[j-1]].cost > c) {
+          args[j] = args[j-1];
+          j--;
+        }
+        args[j] = child;
+      }
+      return network_add_node(net, ast->operation, -1, args, nargs);
+    }
+    default:
+      break;
+  }
+  return network_add_node(net, OP_OR_ARGS, -1, NULL, 0);
+}
+
+void
+noit_metric_tag_search_network_add(noit_metric_tag_search_network_t *net,
+                                   noit_metric_tag_search_ast_t *ast, int lane) {
+  if(ast == NULL || lane < 0) return;
+  NETWORK_GROW(net, asts);
+  net->asts[net->nasts++] = noit_metric_tag_search_ref(ast);
+  int node = network_build(net, ast);
+  NETWORK_GROW(net, roots);
+  net->roots[net->nroots].node = node;
+  net->roots[net->nroots].lane = lane;
+  net->nroots++;
+}
+
+static mtev_boolean
+network_node_evaluate(const noit_metric_tag_search_network_t *net,
+                      const noit_metric_tag_search_index_t *idx, uint8_t *memo, int n) {
+  if(memo[n]) return memo[n] == 2;
+  const network_node_t *node = &net->nodes[n];
+  mtev_boolean rv = mtev_false;
+  switch(node->op) {
+    case OP_MATCH:
+      rv = program_term_match(&net->terms[node->term], idx);
+      break;
+    case OP_NOT_ARGS:
+      rv = !network_node_evaluate(net, idx, memo, node->args[0]);
+      break;
+    case OP_AND_ARGS:
+      rv = mtev_true;
+      for(int i=0; i<node->nargs && rv; i++) rv = network_node_evaluate(net, idx, memo, node->args[i]);
+      break;
+    case OP_OR_ARGS:
+      for(int i=0; i<node->nargs && !rv; i++) rv = network_node_evaluate(net, idx, memo, node->args[i]);
+      break;
+    default:
+      break;
+  }
+  memo[n] = rv ? 2 : 1;
+  return rv;
+}
+
+int
+noit_metric_tag_search_network_evaluate(const noit_metric_tag_search_network_t *net,
+                                        const noit_metric_tag_search_index_t *idx,
+                                        uint8_t *lanes, int nlanes) {
+  int found = 0;
+  MTEV_MAYBE_DECL_VARS(uint8_t, memo, 256);
+  MTEV_MAYBE_REALLOC(memo, net->nnodes ? net->nnodes : 1);
+  memset(memo, 0, net->nnodes);
+  for(int i=0; i<net->nroots; i++) {
+    const network_root_t *root = &net->roots[i];
+    if(root->lane >= nlanes || lanes[root->lane]) continue;
+    if(network_node_evaluate(net, idx, memo, root->node)) {
+      lanes[root->lane] = 1;
+      found++;
+    }
+  }
+  MTEV_MAYBE_FREE(memo);
+  return found;
+}
+
+int
+noit_metric_tag_search_network_size(const noit_metric_tag_search_network_t *net, int *nnodes) {
+  if(nnodes) *nnodes = net->nnodes;
+  return net->nroots;
+}
+
 mtev_boolean
 noit_metric_tag_search_has_hint(const noit_metric_tag_search_ast_t *search, const char *cat, const char *name) {
   if(cat == NULL || search == NULL || search->operation != OP_HINT_ARGS) return mtev_false;
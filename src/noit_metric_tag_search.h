@@ -175,6 +175,68 @@ API_EXPORT(mtev_boolean)
   noit_metric_tag_search_evaluate_against_metric_id(const noit_metric_tag_search_ast_t *search,
                                                     const noit_metric_id_t *id);
 
+/* For evaluating many searches against the same tags: build an index of the
+ * tags once (sorted, category indexed, b"" parts decoded) and run each search
+ * as a compiled program against it.  A program holds a reference to its AST.
+ * Indexes are reusable and not thread-safe; programs are immutable.
+ */
+typedef struct noit_metric_tag_search_index noit_metric_tag_search_index_t;
+typedef struct noit_metric_tag_search_program noit_metric_tag_search_program_t;
+
+API_EXPORT(noit_metric_tag_search_index_t *)
+  noit_metric_tag_search_index_alloc(void);
+
+API_EXPORT(void)
+  noit_metric_tag_search_index_free(noit_metric_tag_search_index_t *);
+
+API_EXPORT(void)
+  noit_metric_tag_search_index_build(noit_metric_tag_search_index_t *,
+                                     const noit_metric_tagset_t **tags, int ntagsets);
+
+/* Indexes the same tags noit_metric_tag_search_evaluate_against_metric_id
+ * would search, returns false if nothing should match this id. */
+API_EXPORT(mtev_boolean)
+  noit_metric_tag_search_index_build_for_metric_id(noit_metric_tag_search_index_t *,
+                                                   const noit_metric_id_t *id);
+
+API_EXPORT(noit_metric_tag_search_program_t *)
+  noit_metric_tag_search_program_compile(noit_metric_tag_search_ast_t *);
+
+API_EXPORT(void)
+  noit_metric_tag_search_program_free(noit_metric_tag_search_program_t *);
+
+API_EXPORT(mtev_boolean)
+  noit_metric_tag_search_program_evaluate(const noit_metric_tag_search_program_t *,
+                                          const noit_metric_tag_search_index_t *);
+
+/* A network merges many searches, each tagged with a lane, into one matching
+ * DAG in which shared terms and clauses are evaluated at most once per index.
+ * Evaluation sets lanes[lane] for every lane with a matching search (lanes
+ * already set are skipped) and returns how many lanes it newly set.
+ * Networks hold references to their ASTs and are immutable once built.
+ */
+typedef struct noit_metric_tag_search_network noit_metric_tag_search_network_t;
+
+API_EXPORT(noit_metric_tag_search_network_t *)
+  noit_metric_tag_search_network_alloc(void);
+
+API_EXPORT(void)
+  noit_metric_tag_search_network_free(noit_metric_tag_search_network_t *);
+
+API_EXPORT(void)
+  noit_metric_tag_search_network_add(noit_metric_tag_search_network_t *,
+                                     noit_metric_tag_search_ast_t *, int lane);
+
+API_EXPORT(int)
+  noit_metric_tag_search_network_evaluate(const noit_metric_tag_search_network_t *,
+                                          const noit_metric_tag_search_index_t *,
+                                          uint8_t *lanes, int nlanes);
+
+/* Returns the number of searches added, *nnodes is set to the number of
+ * distinct nodes they share. */
+API_EXPORT(int)
+  noit_metric_tag_search_network_size(const noit_metric_tag_search_network_t *, int *nnodes);
+
 API_EXPORT(mtev_boolean)
   noit_metric_tag_search_has_hint(const noit_metric_tag_search_ast_t *search, const char *cat, const char *name);
 
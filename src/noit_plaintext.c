@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2026, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mtev_defines.h>
+#include <errno.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "noit_plaintext.h"
+
+/* The index one past the highest set bit of a 16 or 32 bit match mask */
+#define MASK_END(mask) (32 - __builtin_clz(mask))
+
+int
+noit_plaintext_count_lines(const char *buf, size_t len, size_t *usedlen) {
+  size_t i = 0, last = 0;
+  int count = 0;
+#if defined(__AVX2__)
+  const __m256i nl = _mm256_set1_epi8('\n');
+  for(; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    if(mask) {
+      count += __builtin_popcount(mask);
+      last = i + MASK_END(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i nl = _mm_set1_epi8('\n');
+  for(; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    if(mask) {
+      count += __builtin_popcount(mask);
+      last = i + MASK_END(mask);
+    }
+  }
+#endif
+  for(; i < len; i++) {
+    if(buf[i] == '\n') {
+      count++;
+      last = i + 1;
+    }
+  }
+  *usedlen = last;
+  return count;
+}
+
+const char *
+noit_plaintext_find_space(const char *s, const char *end) {
+#if defined(__AVX2__)
+  const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+  for(; end - s >= 32; s += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)s);
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab)));
+    if(mask) return s + __builtin_ctz(mask);
+  }
+#elif defined(__SSE2__)
+  const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+  for(; end - s >= 16; s += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)));
+    if(mask) return s + __builtin_ctz(mask);
+  }
+#endif
+  for(; s < end; s++) {
+    if(*s == ' ' || *s == '\t') return s;
+  }
+  return NULL;
+}
+
+const char *
+noit_plaintext_skip_space(const char *s, const char *end) {
+  while(s < end && (*s == ' ' || *s == '\t')) s++;
+  return s;
+}
+
+/* Powers of ten that are exact doubles */
+static const double exact_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define MAX_EXACT_POW10 22
+#define MAX_EXACT_MANTISSA (1ULL << 53)
+#define MAX_MANTISSA_DIGITS 19
+
+int
+noit_plaintext_parse_double(const char *s, const char *end, double *out, const char **endp) {
+  const char *p = s;
+  mtev_boolean negative = mtev_false;
+  uint64_t mantissa = 0;
+  int ndigits = 0, nsignificant = 0, exp10 = 0;
+  mtev_boolean truncated = mtev_false;
+
+  if(p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+  for(; p < end && *p >= '0' && *p <= '9'; p++, ndigits++) {
+    if(nsignificant < MAX_MANTISSA_DIGITS) {
+      mantissa = mantissa * 10 + (*p - '0');
+      if(mantissa) nsignificant++;
+    }
+    else {
+      exp10++;
+      truncated = mtev_true;
+    }
+  }
+  if(p < end && *p == '.') {
+    for(p++; p < end && *p >= '0' && *p <= '9'; p++, ndigits++) {
+      if(nsignificant < MAX_MANTISSA_DIGITS) {
+        mantissa = mantissa * 10 + (*p - '0');
+        if(mantissa) nsignificant++;
+        exp10--;
+      }
+      else truncated = mtev_true;
+    }
+  }
+  if(ndigits == 0) return -1;
+  if(p < end && (*p == 'e' || *p == 'E')) {
+    const char *ep = p + 1;
+    mtev_boolean eneg = mtev_false;
+    int e = 0;
+    if(ep < end && (*ep == '-' || *ep == '+')) eneg = (*ep++ == '-');
+    if(ep < end && *ep >= '0' && *ep <= '9') {
+      for(; ep < end && *ep >= '0' && *ep <= '9'; ep++) {
+        if(e < 100000) e = e * 10 + (*ep - '0');
+      }
+      exp10 += eneg ? -e : e;
+      p = ep;
+    }
+  }
+
+  /* Clinger's fast path: both the mantissa and the power of ten are exact
+   * doubles, so one multiply or divide rounds correctly (given arithmetic
+   * isn't carried out in extended precision). */
+  if(FLT_EVAL_METHOD == 0 && mantissa <= MAX_EXACT_MANTISSA &&
+     exp10 >= -MAX_EXACT_POW10 && exp10 <= MAX_EXACT_POW10 &&
+     nsignificant < MAX_MANTISSA_DIGITS) {
+    double v = (double)mantissa;
+    if(exp10 < 0) v /= exact_pow10[-exp10];
+    else v *= exact_pow10[exp10];
+    *out = negative ? -v : v;
+  }
+  else if(exp10 == 0 && !truncated) {
+    /* integer conversion from 64 bits rounds correctly, but only if no
+     * digits were dropped to fit the mantissa */
+    *out = negative ? -(double)mantissa : (double)mantissa;
+  }
+  else {
+    char *sendp;
+    errno = 0;
+    *out = strtod(s, &sendp);
+    if(errno == ERANGE) return -1;
+    p = sendp;
+  }
+  if(endp) *endp = p;
+  return 0;
+}
+
+int
+noit_plaintext_parse_u64(const char *s, const char *end, uint64_t *out, const char **endp) {
+  const char *p = s;
+  uint64_t v = 0;
+  for(; p < end && *p >= '0' && *p <= '9'; p++) {
+    uint64_t d = *p - '0';
+    if(v > (UINT64_MAX - d) / 10) return -1;
+    v = v * 10 + d;
+  }
+  if(p == s) return -1;
+  *out = v;
+  if(endp) *endp = p;
+  return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2026, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NOIT_PLAINTEXT_H
+#define NOIT_PLAINTEXT_H
+
+#include <mtev_defines.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Tokenizing and number parsing shared by the line oriented listeners
+ * (graphite, opentsdb).  Scans are vectorized with AVX2 or SSE2 when the
+ * build targets them and fall back to scalar loops otherwise.
+ */
+
+/* Returns the number of '\n' terminated lines in buf and sets *usedlen to
+ * the length up to and including the last '\n'. */
+API_EXPORT(int)
+  noit_plaintext_count_lines(const char *buf, size_t len, size_t *usedlen);
+
+/* Returns the first space or tab in [s, end) or NULL. */
+API_EXPORT(const char *)
+  noit_plaintext_find_space(const char *s, const char *end);
+
+/* Returns the first character in [s, end) that is not a space or tab. */
+API_EXPORT(const char *)
+  noit_plaintext_skip_space(const char *s, const char *end);
+
+/* Parses an optionally signed decimal number with optional fraction and
+ * exponent.  Values that are exactly representable from their decimal
+ * digits take a fast path; the rest are handed to strtod, so the number must
+ * be followed by a character that cannot continue it (NUL, space, ...).
+ * Returns 0 on success, -1 if there are no digits or the value is out of
+ * range.  *endp (if not NULL) is set past the number. */
+API_EXPORT(int)
+  noit_plaintext_parse_double(const char *s, const char *end, double *out, const char **endp);
+
+/* Parses unsigned decimal digits.  Returns -1 if there are none or they
+ * overflow. */
+API_EXPORT(int)
+  noit_plaintext_parse_u64(const char *s, const char *end, uint64_t *out, const char **endp);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -37,6 +37,7 @@
 #include <errno.h>
 #include <math.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -59,20 +60,6 @@
 
 #include <snappy/snappy.h>
 
-static void *__c_allocator_alloc(void *d, size_t size) {
-  return malloc(size);
-}
-static void __c_allocator_free(void *d, void *p) {
-  free(p);
-}
-static ProtobufCAllocator __c_allocator = {
-  .alloc = __c_allocator_alloc,
-  .free = __c_allocator_free,
-  .allocator_data = NULL
-};
-#define protobuf_c_system_allocator __c_allocator
-
-
 static const char *_allowed_units[] = {"seconds",  "requests", "responses", "transactions",
                                        "packets", "bytes", "octets", NULL};
 
@@ -177,6 +164,18 @@ prometheus_metric_name_t *noit_prometheus_metric_name_from_labels(Prometheus__La
   /* we don't have to canonicalize here as reconnoiter will do that for us */
   metric_data->name = strdup(final_name);
   metric_data->tagged_len = strlen(final_name);
+  noit_fingerprint128_init(&metric_data->fingerprint);
+  if (coerce_hist) {
+    /* histograms are collected by fingerprint, so it must not depend on the
+     * order the labels arrived in */
+    ssize_t clen = noit_metric_canonicalize(final_name, metric_data->tagged_len,
+                                            buffer, sizeof(buffer), mtev_false);
+    if (clen > 0) {
+      noit_fingerprint128_update(&metric_data->fingerprint, buffer, clen);
+      return metric_data;
+    }
+  }
+  noit_fingerprint128_update(&metric_data->fingerprint, final_name, metric_data->tagged_len);
   return metric_data;
 }
 
@@ -198,6 +197,222 @@ bool noit_prometheus_snappy_uncompress(mtev_dyn_buffer_t *uncompressed_data_out,
   return true;
 }
 
+/* Just enough of the protobuf wire format to walk a WriteRequest. */
+#define PB_WIRE_VARINT 0
+#define PB_WIRE_FIXED64 1
+#define PB_WIRE_LEN 2
+#define PB_WIRE_FIXED32 5
+
+typedef struct {
+  uint32_t field;
+  int wire;
+  uint64_t scalar;
+  const uint8_t *body;
+  size_t body_len;
+} pb_field_t;
+
+static bool pb_read_varint(const uint8_t **cp, const uint8_t *end, uint64_t *out)
+{
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64 && *cp < end; shift += 7) {
+    uint8_t b = *(*cp)++;
+    v |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *out = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Reads the field at *cp, advancing past it.  Length delimited contents are
+ * left in body/body_len, everything else is read into scalar. */
+static bool pb_next_field(const uint8_t **cp, const uint8_t *end, pb_field_t *f)
+{
+  uint64_t tag, len;
+  if (!pb_read_varint(cp, end, &tag)) return false;
+  f->field = tag >> 3;
+  f->wire = tag & 0x7;
+  switch (f->wire) {
+  case PB_WIRE_VARINT:
+    return pb_read_varint(cp, end, &f->scalar);
+  case PB_WIRE_FIXED64:
+    if (end - *cp < 8) return false;
+    f->scalar = 0;
+    for (int i = 7; i >= 0; i--) f->scalar = (f->scalar << 8) | (*cp)[i];
+    *cp += 8;
+    return true;
+  case PB_WIRE_FIXED32:
+    if (end - *cp < 4) return false;
+    f->scalar = (uint32_t) (*cp)[0] | ((uint32_t) (*cp)[1] << 8) |
+                ((uint32_t) (*cp)[2] << 16) | ((uint32_t) (*cp)[3] << 24);
+    *cp += 4;
+    return true;
+  case PB_WIRE_LEN:
+    if (!pb_read_varint(cp, end, &len) || len > (uint64_t) (end - *cp)) return false;
+    f->body = *cp;
+    f->body_len = len;
+    *cp += len;
+    return true;
+  default:
+    /* groups are long deprecated and never used by remote_write */
+    return false;
+  }
+}
+
+/* Reused across the TimeSeries of one WriteRequest. */
+typedef struct {
+  Prometheus__Label *labels;
+  Prometheus__Label **label_ptrs;
+  size_t nallocd_labels;
+  Prometheus__Sample *samples;
+  Prometheus__Sample **sample_ptrs;
+  size_t nallocd_samples;
+  char *strings;
+  size_t nallocd_strings;
+} prometheus_decode_scratch_t;
+
+static void prometheus_decode_scratch_reserve(prometheus_decode_scratch_t *sc, size_t n_labels,
+                                              size_t n_samples, size_t string_len)
+{
+  if (n_labels > sc->nallocd_labels) {
+    sc->nallocd_labels = MAX(n_labels, sc->nallocd_labels * 2);
+    sc->labels = realloc(sc->labels, sc->nallocd_labels * sizeof(*sc->labels));
+    sc->label_ptrs = realloc(sc->label_ptrs, sc->nallocd_labels * sizeof(*sc->label_ptrs));
+    for (size_t i = 0; i < sc->nallocd_labels; i++) sc->label_ptrs[i] = &sc->labels[i];
+  }
+  if (n_samples > sc->nallocd_samples) {
+    sc->nallocd_samples = MAX(n_samples, sc->nallocd_samples * 2);
+    sc->samples = realloc(sc->samples, sc->nallocd_samples * sizeof(*sc->samples));
+    sc->sample_ptrs = realloc(sc->sample_ptrs, sc->nallocd_samples * sizeof(*sc->sample_ptrs));
+    for (size_t i = 0; i < sc->nallocd_samples; i++) sc->sample_ptrs[i] = &sc->samples[i];
+  }
+  if (string_len > sc->nallocd_strings) {
+    sc->nallocd_strings = MAX(string_len, sc->nallocd_strings * 2);
+    sc->strings = realloc(sc->strings, sc->nallocd_strings);
+  }
+}
+
+static bool prometheus_decode_label(const uint8_t *cp, const uint8_t *end,
+                                    Prometheus__Label *label, char **strings)
+{
+  const uint8_t *name = NULL, *value = NULL;
+  size_t name_len = 0, value_len = 0;
+  pb_field_t f;
+  while (cp < end) {
+    if (!pb_next_field(&cp, end, &f)) return false;
+    if (f.wire != PB_WIRE_LEN) continue;
+    if (f.field == 1) {
+      name = f.body;
+      name_len = f.body_len;
+    }
+    else if (f.field == 2) {
+      value = f.body;
+      value_len = f.body_len;
+    }
+  }
+  *label = (Prometheus__Label) PROMETHEUS__LABEL__INIT;
+  label->name = *strings;
+  if (name_len) memcpy(*strings, name, name_len);
+  (*strings)[name_len] = '\0';
+  *strings += name_len + 1;
+  label->value = *strings;
+  if (value_len) memcpy(*strings, value, value_len);
+  (*strings)[value_len] = '\0';
+  *strings += value_len + 1;
+  return true;
+}
+
+static bool prometheus_decode_sample(const uint8_t *cp, const uint8_t *end,
+                                     Prometheus__Sample *sample)
+{
+  pb_field_t f;
+  *sample = (Prometheus__Sample) PROMETHEUS__SAMPLE__INIT;
+  while (cp < end) {
+    if (!pb_next_field(&cp, end, &f)) return false;
+    if (f.field == 1 && f.wire == PB_WIRE_FIXED64) {
+      memcpy(&sample->value, &f.scalar, sizeof(sample->value));
+    }
+    else if (f.field == 2 && f.wire == PB_WIRE_VARINT) {
+      sample->timestamp = (int64_t) f.scalar;
+    }
+  }
+  return true;
+}
+
+static bool prometheus_decode_timeseries(const uint8_t *start, const uint8_t *end,
+                                         prometheus_decode_scratch_t *sc,
+                                         noit_prometheus_timeseries_cb_t cb, void *closure)
+{
+  size_t n_labels = 0, n_samples = 0, string_len = 0;
+  const uint8_t *cp = start;
+  pb_field_t f;
+
+  /* size everything up first so the scratch space doesn't move under us */
+  while (cp < end) {
+    if (!pb_next_field(&cp, end, &f)) return false;
+    if (f.wire != PB_WIRE_LEN) continue;
+    if (f.field == 1) {
+      n_labels++;
+      string_len += f.body_len + 2;
+    }
+    else if (f.field == 2) {
+      n_samples++;
+    }
+  }
+  prometheus_decode_scratch_reserve(sc, n_labels, n_samples, string_len);
+
+  char *strings = sc->strings;
+  size_t li = 0, si = 0;
+  for (cp = start; cp < end;) {
+    pb_next_field(&cp, end, &f);
+    if (f.wire != PB_WIRE_LEN) continue;
+    if (f.field == 1) {
+      if (!prometheus_decode_label(f.body, f.body + f.body_len, &sc->labels[li++], &strings))
+        return false;
+    }
+    else if (f.field == 2) {
+      if (!prometheus_decode_sample(f.body, f.body + f.body_len, &sc->samples[si++]))
+        return false;
+    }
+  }
+  cb(sc->label_ptrs, n_labels, sc->sample_ptrs, n_samples, closure);
+  return true;
+}
+
+ssize_t noit_prometheus_decode_write_request(const void *data, size_t data_len,
+                                             noit_prometheus_timeseries_cb_t cb,
+                                             void *closure)
+{
+  prometheus_decode_scratch_t sc = {};
+  const uint8_t *cp, *end;
+  ssize_t cnt = 0;
+  pb_field_t f;
+
+  /* an empty WriteRequest is valid and simply carries no series */
+  if (data_len == 0) return 0;
+  cp = data;
+  end = cp + data_len;
+  while (cp < end) {
+    if (!pb_next_field(&cp, end, &f)) {
+      cnt = -1;
+      break;
+    }
+    if (f.field != 1 || f.wire != PB_WIRE_LEN) continue;
+    if (!prometheus_decode_timeseries(f.body, f.body + f.body_len, &sc, cb, closure)) {
+      cnt = -1;
+      break;
+    }
+    cnt++;
+  }
+  free(sc.labels);
+  free(sc.label_ptrs);
+  free(sc.samples);
+  free(sc.sample_ptrs);
+  free(sc.strings);
+  return cnt;
+}
+
 static bool is_standard_suffix(const char *suffix)
 {
   return !strcmp(suffix, "count") || !strcmp(suffix, "sum") || !strcmp(suffix, "bucket") ||
@@ -422,6 +637,10 @@ noit_prometheus_translate_to_histogram_metric(const char *metric_name,
   return metric;
 }
 
+#define HIST_KEY_OFFSET offsetof(prometheus_hist_in_progress_t, fingerprint)
+#define HIST_KEY_LEN (offsetof(prometheus_hist_in_progress_t, whence) + sizeof(struct timeval) - \
+                      HIST_KEY_OFFSET)
+
 void noit_prometheus_track_histogram(mtev_hash_table **hist_hash,
                                      const prometheus_metric_name_t *name,
                                      double boundary,
@@ -431,60 +650,67 @@ void noit_prometheus_track_histogram(mtev_hash_table **hist_hash,
     mtevL(mtev_error, "%s: misuse - no hist_hash provided\n", __func__);
     return;
   }
-  prometheus_hist_in_progress_t dummy = { .whence = w };
-  if(name->tagged_len >= sizeof(dummy.name)) return;
+  if(name->tagged_len >= sizeof(((prometheus_hist_in_progress_t *)0)->name)) return;
   if(!(*hist_hash)) {
     mtev_hash_table *tmp = (mtev_hash_table *)calloc(1, sizeof(mtev_hash_table));
     mtev_hash_init(tmp);
     *hist_hash = tmp;
   }
-  memcpy(dummy.name, name->name, name->tagged_len+1); /* include \0 */
+  /* the key is the name's fingerprint, computed once per series, and the time */
+  prometheus_hist_in_progress_t dummy;
+  dummy.fingerprint = name->fingerprint;
+  dummy.whence = w;
   if(isinf(boundary)) boundary = 10e128;
   prometheus_hist_in_progress_t *tgt = NULL;
   void *vptr = NULL;
-  if(mtev_hash_retrieve(*hist_hash, &dummy.whence, sizeof(dummy.whence) + name->tagged_len, &vptr)) {
+  if(mtev_hash_retrieve(*hist_hash, (char *)&dummy + HIST_KEY_OFFSET, HIST_KEY_LEN, &vptr)) {
     tgt = (prometheus_hist_in_progress_t *)vptr;
   } else {
     tgt = malloc(sizeof(*tgt));
-    memcpy(tgt, &dummy, sizeof(*tgt));
+    tgt->fingerprint = name->fingerprint;
+    tgt->whence = w;
+    memcpy(tgt->name, name->name, name->tagged_len+1); /* include \0 */
     tgt->nallocdbins = 16;
     tgt->bins = calloc(tgt->nallocdbins, sizeof(*tgt->bins));
     tgt->nbins = 0;
     tgt->tagged_name_len = name->tagged_len;
     tgt->untagged_name_len = name->untagged_len;
-    mtev_hash_store(*hist_hash, &tgt->whence, sizeof(tgt->whence) + name->tagged_len, tgt);
+    mtev_hash_store(*hist_hash, (char *)tgt + HIST_KEY_OFFSET, HIST_KEY_LEN, tgt);
+  }
+
+  /* buckets nearly always arrive in order, making this an append */
+  int pos = tgt->nbins;
+  if(pos > 0 && tgt->bins[pos-1].upper >= boundary) {
+    int lo = 0, hi = pos;
+    while(lo < hi) {
+      int mid = (lo + hi) / 2;
+      if(tgt->bins[mid].upper < boundary) lo = mid + 1;
+      else hi = mid;
+    }
+    pos = lo;
+    if(tgt->bins[pos].upper == boundary) {
+      /* a repeated bucket, the last one wins */
+      tgt->bins[pos].count = val;
+      return;
+    }
   }
   if(tgt->nbins == tgt->nallocdbins) {
     tgt->nallocdbins *= 2;
     tgt->bins = realloc(tgt->bins, tgt->nallocdbins * sizeof(*tgt->bins));
   }
-  tgt->bins[tgt->nbins].lower = 0;
-  tgt->bins[tgt->nbins].upper = boundary;
-  tgt->bins[tgt->nbins].count = val;
+  if(pos < tgt->nbins) {
+    memmove(&tgt->bins[pos+1], &tgt->bins[pos], (tgt->nbins - pos) * sizeof(*tgt->bins));
+  }
+  tgt->bins[pos].lower = 0;
+  tgt->bins[pos].upper = boundary;
+  tgt->bins[pos].count = val;
   tgt->nbins++;
 }
 
-static int
-noit_prometheus_upper_sort(const void *av, const void *bv) {
-  const histogram_adhoc_bin_t *a = av, *b = bv;
-  if(a->upper < b->upper) return -1;
-  if(a->upper == b->upper) return 0;
-  return 1;
-}
-
 void
 noit_prometheus_sort_and_dedupe_histogram_in_progress(prometheus_hist_in_progress_t *hip)
 {
-  /* sort */
-  qsort(hip->bins, hip->nbins, sizeof(*hip->bins), noit_prometheus_upper_sort);
-  /* dedup -- should never actually happen */
-  for(int s=0; s<hip->nbins-1; s++) {
-    if(hip->bins[s].upper == hip->bins[s+1].upper) {
-      memmove(&hip->bins[s], &hip->bins[s+1], sizeof(*hip->bins) * (hip->nbins - s - 1));
-      s--;
-      hip->nbins--;
-    }
-  }
+  /* bins are already sorted and unique, see noit_prometheus_track_histogram */
   hip->bins[0].lower = (hip->bins[0].upper <= 0) ? -10e128 : 0;
   /* undo cummulative aspect and set lower bound */
   for(int s=1; s<hip->nbins; s++) {
@@ -493,6 +719,43 @@ noit_prometheus_sort_and_dedupe_histogram_in_progress(prometheus_hist_in_progres
   }
 }
 
+typedef struct {
+  noit_prometheus_translate_cb_t cb;
+  void *cb_closure;
+  mtev_hash_table *hists;
+} prometheus_translate_closure_t;
+
+static void
+noit_prometheus_translate_timeseries(Prometheus__Label **labels, size_t n_labels,
+                                     Prometheus__Sample **samples, size_t n_samples,
+                                     void *closure)
+{
+  prometheus_translate_closure_t *tc = closure;
+  /* each timeseries has a list of labels (Tags) and a list of samples */
+  prometheus_coercion_t coercion = noit_prometheus_metric_name_coerce(labels, n_labels,
+                                                                      false, true, NULL);
+  prometheus_metric_name_t *metric_data = noit_prometheus_metric_name_from_labels(labels,
+      n_labels, coercion.units, coercion.is_histogram);
+  for (size_t j = 0; j < n_samples; j++) {
+    if (!coercion.is_histogram) {
+      metric_t *metric = noit_prometheus_translate_to_metric(&coercion,
+        metric_data, samples[j]);
+      if (metric) {
+        tc->cb(NOIT_PROMETHEUS_SNAPPY_METRIC, (noit_prometheus_snappy_data_t){ .metric = metric },
+          tc->cb_closure);
+      }
+    }
+    else {
+      Prometheus__Sample *sample = samples[j];
+      struct timeval tv;
+      tv.tv_sec = (time_t)(sample->timestamp / 1000L);
+      tv.tv_usec = (suseconds_t)((sample->timestamp % 1000L) * 1000);
+      noit_prometheus_track_histogram(&tc->hists, metric_data, coercion.hist_boundary, sample->value, tv);
+    }
+  }
+  noit_prometheus_metric_name_free(metric_data);
+}
+
 int
 noit_prometheus_translate_snappy_data(const int64_t account_id,
                                       const uuid_t check_uuid,
@@ -517,42 +780,21 @@ noit_prometheus_translate_snappy_data(const int64_t account_id,
     return -1;
   }
   mtev_dyn_buffer_advance(&uncompressed, uncompressed_size);
-  Prometheus__WriteRequest *write = prometheus__write_request__unpack(&protobuf_c_system_allocator,
-                                                                      mtev_dyn_buffer_used(&uncompressed),
-                                                                      mtev_dyn_buffer_data(&uncompressed));
-  if(!write) {
-    mtev_dyn_buffer_destroy(&uncompressed);
+  prometheus_translate_closure_t tc = { .cb = cb, .cb_closure = cb_closure };
+  ssize_t cnt = noit_prometheus_decode_write_request(mtev_dyn_buffer_data(&uncompressed),
+                                                     mtev_dyn_buffer_used(&uncompressed),
+                                                     noit_prometheus_translate_timeseries, &tc);
+  mtev_dyn_buffer_destroy(&uncompressed);
+  if(cnt < 0) {
     const char *error = "Prometheus__WriteRequest decode: protobuf invalid";
     cb(NOIT_PROMETHEUS_SNAPPY_ERROR, (noit_prometheus_snappy_data_t){ .error = error }, cb_closure);
-    return -1;
-  }
-  mtev_hash_table *hists = NULL;
-  for (size_t i = 0; i < write->n_timeseries; i++) {
-    Prometheus__TimeSeries *ts = write->timeseries[i];
-    /* each timeseries has a list of labels (Tags) and a list of samples */
-    prometheus_coercion_t coercion = noit_prometheus_metric_name_coerce(ts->labels, ts->n_labels,
-                                                                        false, true, NULL);
-    prometheus_metric_name_t *metric_data = noit_prometheus_metric_name_from_labels(ts->labels,
-        ts->n_labels, coercion.units, coercion.is_histogram);
-    for (size_t j = 0; j < ts->n_samples; j++) {
-      if (!coercion.is_histogram) {
-        metric_t *metric = noit_prometheus_translate_to_metric(&coercion,
-          metric_data, ts->samples[j]);
-        if (metric) {
-          cb(NOIT_PROMETHEUS_SNAPPY_METRIC, (noit_prometheus_snappy_data_t){ .metric = metric },
-            cb_closure);
-        }
-      }
-      else {
-        Prometheus__Sample *sample = ts->samples[j];
-        struct timeval tv;
-        tv.tv_sec = (time_t)(sample->timestamp / 1000L);
-        tv.tv_usec = (suseconds_t)((sample->timestamp % 1000L) * 1000);
-        noit_prometheus_track_histogram(&hists, metric_data, coercion.hist_boundary, sample->value, tv);
-      }
+    if (tc.hists) {
+      mtev_hash_destroy(tc.hists, NULL, noit_prometheus_hist_in_progress_free);
+      free(tc.hists);
     }
-    noit_prometheus_metric_name_free(metric_data);
+    return -1;
   }
+  mtev_hash_table *hists = tc.hists;
   if (hists) {
     mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
     while(mtev_hash_adv(hists, &iter)) {
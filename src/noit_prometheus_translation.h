@@ -36,6 +36,7 @@
 #include <stdbool.h>
 #include <circllhist.h>
 #include "noit_metric.h"
+#include "noit_metric_dedupe.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -60,10 +61,14 @@ typedef struct {
   double hist_boundary;
 } prometheus_coercion_t;
 
+/* An in progress histogram is found by the fingerprint of its name (label
+ * set) and its timestamp, which together form its key.  Bins are kept sorted
+ * by upper bound as they arrive. */
 typedef struct {
   histogram_adhoc_bin_t *bins;
   int nbins;
   int nallocdbins;
+  noit_fingerprint128_t fingerprint;
   struct timeval whence;
   char name[MAX_METRIC_TAGGED_NAME];
   size_t untagged_name_len;
@@ -75,6 +80,7 @@ typedef struct {
   char *name;
   size_t untagged_len;
   size_t tagged_len;
+  noit_fingerprint128_t fingerprint; /* of name, canonicalized if coerce_hist */
 } prometheus_metric_name_t;
 
 void noit_prometheus_metric_name_free(void *vpmn);
@@ -23,6 +23,22 @@ prometheus_coercion_t noit_prometheus_metric_name_coerce(Prometheus__Label **lab
                                                          bool do_units,
                                                          bool do_hist,
                                                          const char **allowed_units);
+/* Called for each TimeSeries of a WriteRequest.  The labels (with NUL
+ * terminated, writable name and value strings) and samples are only valid
+ * for the duration of the call. */
+typedef void (*noit_prometheus_timeseries_cb_t)(Prometheus__Label **labels, size_t n_labels,
+                                                Prometheus__Sample **samples, size_t n_samples,
+                                                void *closure);
+
+/* Walks the TimeSeries of an uncompressed WriteRequest straight off the wire
+ * without unpacking the message tree.  Metadata, exemplars and native
+ * histograms are skipped.  Returns the number of TimeSeries seen (0 for an
+ * empty request) or -1 if the data is malformed, in which case cb may already
+ * have been called for the TimeSeries preceding the error. */
+ssize_t noit_prometheus_decode_write_request(const void *data, size_t data_len,
+                                             noit_prometheus_timeseries_cb_t cb,
+                                             void *closure);
+
 noit_metric_message_t *
 noit_prometheus_translate_to_noit_metric_message(prometheus_coercion_t *coercion,
                                                  const int64_t account_id,
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2026, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mtev_defines.h>
+#include <stdlib.h>
+
+#include "noit_protobuf_arena.h"
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_RETAINED_CHUNKS 16
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+} arena_chunk_t;
+
+typedef struct {
+  ProtobufCAllocator allocator;
+  arena_chunk_t *chunks;  /* in use, the head is being carved up */
+  arena_chunk_t *spare;   /* emptied by a reset */
+  int nspare;
+  arena_chunk_t *large;   /* oversized allocations, freed on reset */
+} protobuf_arena_t;
+
+static __thread protobuf_arena_t *thread_arena;
+
+static arena_chunk_t *
+arena_chunk_alloc(size_t size) {
+  arena_chunk_t *chunk = malloc(sizeof(*chunk) + size + ARENA_ALIGN);
+  if(!chunk) return NULL;
+  chunk->next = NULL;
+  chunk->size = size + ARENA_ALIGN;
+  chunk->used = 0;
+  return chunk;
+}
+
+static void *
+arena_chunk_carve(arena_chunk_t *chunk, size_t size) {
+  uintptr_t p = (uintptr_t)(chunk->data + chunk->used);
+  p = (p + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+  size_t used = (p - (uintptr_t)chunk->data) + size;
+  if(used > chunk->size) return NULL;
+  chunk->used = used;
+  return (void *)p;
+}
+
+static void *
+protobuf_arena_alloc(void *allocator_data, size_t size) {
+  protobuf_arena_t *arena = allocator_data;
+  arena_chunk_t *chunk;
+  void *p;
+
+  if(size > ARENA_CHUNK_SIZE / 4) {
+    if((chunk = arena_chunk_alloc(size)) == NULL) return NULL;
+    chunk->next = arena->large;
+    arena->large = chunk;
+    return arena_chunk_carve(chunk, size);
+  }
+  if(arena->chunks && (p = arena_chunk_carve(arena->chunks, size)) != NULL) return p;
+
+  if(arena->spare) {
+    chunk = arena->spare;
+    arena->spare = chunk->next;
+    arena->nspare--;
+  }
+  else if((chunk = arena_chunk_alloc(ARENA_CHUNK_SIZE)) == NULL) return NULL;
+  chunk->used = 0;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  return arena_chunk_carve(chunk, size);
+}
+
+static void
+protobuf_arena_free(void *allocator_data, void *p) {
+  (void)allocator_data;
+  (void)p;
+}
+
+ProtobufCAllocator *
+noit_protobuf_arena_allocator(void) {
+  if(!thread_arena) {
+    thread_arena = calloc(1, sizeof(*thread_arena));
+    thread_arena->allocator.alloc = protobuf_arena_alloc;
+    thread_arena->allocator.free = protobuf_arena_free;
+    thread_arena->allocator.allocator_data = thread_arena;
+  }
+  return &thread_arena->allocator;
+}
+
+void
+noit_protobuf_arena_reset(void) {
+  protobuf_arena_t *arena = thread_arena;
+  if(!arena) return;
+  while(arena->chunks) {
+    arena_chunk_t *chunk = arena->chunks;
+    arena->chunks = chunk->next;
+    if(arena->nspare < ARENA_RETAINED_CHUNKS) {
+      chunk->next = arena->spare;
+      arena->spare = chunk;
+      arena->nspare++;
+    }
+    else free(chunk);
+  }
+  while(arena->large) {
+    arena_chunk_t *chunk = arena->large;
+    arena->large = chunk->next;
+    free(chunk);
+  }
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2026, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NOIT_PROTOBUF_ARENA_H
+#define NOIT_PROTOBUF_ARENA_H
+
+#include <mtev_defines.h>
+#include <protobuf-c/protobuf-c.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A bump allocator for protobuf-c unpacking.  An unpacked message is made of
+ * many small allocations that all die together, so rather than freeing them
+ * one by one (the allocator's free is a no-op) the whole arena is reset once
+ * the message is done with.  Chunks are kept across resets so a thread
+ * decoding a stream of similar messages stops allocating altogether.
+ *
+ * Each thread has its own arena; a reset invalidates everything allocated
+ * from it on that thread, so unpacks using it must not be nested.
+ */
+
+/* This thread's arena, for passing to <message>__unpack(). */
+API_EXPORT(ProtobufCAllocator *)
+  noit_protobuf_arena_allocator(void);
+
+/* Releases everything allocated from this thread's arena. */
+API_EXPORT(void)
+  noit_protobuf_arena_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -29,6 +29,9 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #define DEFAULT_ROWS_PER_CYCLE 100
+#define DEFAULT_BATCH_SIZE 1000
+#define DEFAULT_BATCH_FLUSH_MS 1000
+#define LISTENER_BUNDLE_CONCURRENCY 4
 
 #include <mtev_defines.h>
 
@@ -55,25 +58,304 @@
 #include "noit_check.h"
 #include "noit_check_tools.h"
 #include "noit_mtev_bridge.h"
+#include "noit_plaintext.h"
 #include "noit_socket_listener.h"
 
 static mtev_log_stream_t nldeb = NULL;
 static mtev_log_stream_t nlerr = NULL;
 
+/* The connection whose payload handler is running on this thread */
+static __thread listener_instance_t *current_instance;
+
+static eventer_jobq_t *listener_bundle_jobq = NULL;
+static pthread_mutex_t listener_bundle_jobq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Batched metrics are never freed individually.  Each slot keeps its key
+ * (the metric name, a NUL and the timestamp), numeric value and string
+ * buffer across flushes, so a steady stream of names stops allocating. */
+typedef struct {
+  metric_t m;
+  char *key;
+  size_t key_alloc;
+  char *str;
+  size_t str_alloc;
+  union {
+    int32_t i;
+    uint32_t I;
+    int64_t l;
+    uint64_t L;
+    double n;
+  } value;
+} batch_metric_t;
+
+struct listener_batch {
+  mtev_hash_table metrics;
+  batch_metric_t **slots;
+  uint32_t nslots;
+  uint32_t nused;
+  struct timeval first;
+};
+
+typedef struct {
+  listener_closure_t *rxc;
+  noit_check_t *check;
+  listener_batch_t *batch;
+  mtev_boolean done;
+} listener_bundle_job_t;
+
+static void listener_closure_deref(listener_closure_t *lc);
+
 /* Count endlines to determine how many full records we
  * have */
 static inline int
 count_records(char *buffer, size_t inlen, size_t *usedlen)
 {
-  char *iter = buffer, *previter = buffer;
-  int count = 0;
-  while ((iter = memchr(iter, '\n', inlen - (iter - buffer))) != 0) {
-    count++;
-    iter++;
-    previter = iter;
-  }
-  *usedlen = previter - buffer;
-  return count;
+  return noit_plaintext_count_lines(buffer, inlen, usedlen);
+}
+
+static eventer_jobq_t *
+listener_bundle_jobq_get(void) {
+  eventer_jobq_t *jobq = ck_pr_load_ptr(&listener_bundle_jobq);
+  if(jobq) return jobq;
+  pthread_mutex_lock(&listener_bundle_jobq_lock);
+  if(!listener_bundle_jobq) {
+    jobq = eventer_jobq_retrieve("listener_bundle");
+    if(!jobq) {
+      jobq = eventer_jobq_create("listener_bundle");
+      if(jobq) eventer_jobq_set_concurrency(jobq, LISTENER_BUNDLE_CONCURRENCY);
+    }
+    ck_pr_store_ptr(&listener_bundle_jobq, jobq);
+  }
+  jobq = listener_bundle_jobq;
+  pthread_mutex_unlock(&listener_bundle_jobq_lock);
+  return jobq;
+}
+
+static listener_batch_t *
+listener_batch_alloc(void) {
+  listener_batch_t *b = calloc(1, sizeof(*b));
+  mtev_hash_init(&b->metrics);
+  return b;
+}
+
+static void
+listener_batch_free(listener_batch_t *b) {
+  if(!b) return;
+  mtev_hash_destroy(&b->metrics, NULL, NULL);
+  for(uint32_t i=0; i<b->nslots; i++) {
+    free(b->slots[i]->key);
+    free(b->slots[i]->str);
+    free(b->slots[i]);
+  }
+  free(b->slots);
+  free(b);
+}
+
+static void
+listener_batch_reset(listener_batch_t *b) {
+  mtev_hash_delete_all(&b->metrics, NULL, NULL);
+  b->nused = 0;
+  memset(&b->first, 0, sizeof(b->first));
+}
+
+/* Batches come back to their closure once bundled; a few are kept. */
+static listener_batch_t *
+listener_batch_take(listener_closure_t *rxc) {
+  for(int i=0; i<LISTENER_SPARE_BATCHES; i++) {
+    listener_batch_t *b = ck_pr_fas_ptr(&rxc->spare_batches[i], NULL);
+    if(b) return b;
+  }
+  return listener_batch_alloc();
+}
+
+static void
+listener_batch_release(listener_closure_t *rxc, listener_batch_t *b) {
+  listener_batch_reset(b);
+  for(int i=0; i<LISTENER_SPARE_BATCHES; i++) {
+    if(ck_pr_cas_ptr(&rxc->spare_batches[i], NULL, b)) return;
+  }
+  listener_batch_free(b);
+}
+
+static batch_metric_t *
+listener_batch_add(listener_batch_t *b, const char *name, metric_type_t t,
+                   const void *vp, const struct timeval *w) {
+  struct timeval whence = { 0, 0 };
+  size_t name_len = strlen(name);
+  size_t key_len = name_len + 1 + sizeof(whence);
+  batch_metric_t *bm;
+  void *vbm;
+
+  if(w) memcpy(&whence, w, sizeof(whence));
+  if(b->nused == b->nslots) {
+    uint32_t nslots = b->nslots ? b->nslots * 2 : 64;
+    b->slots = realloc(b->slots, nslots * sizeof(*b->slots));
+    for(uint32_t i=b->nslots; i<nslots; i++) b->slots[i] = calloc(1, sizeof(*b->slots[i]));
+    b->nslots = nslots;
+  }
+  /* Build the key in the next free slot; it is only claimed if the
+   * (name, timestamp) pair is new to this batch. */
+  bm = b->slots[b->nused];
+  if(bm->key_alloc < key_len) {
+    free(bm->key);
+    bm->key = malloc(key_len);
+    bm->key_alloc = key_len;
+  }
+  memcpy(bm->key, name, name_len + 1);
+  memcpy(bm->key + name_len + 1, &whence, sizeof(whence));
+  if(mtev_hash_retrieve(&b->metrics, bm->key, key_len, &vbm)) {
+    /* The same point sent twice, the last value wins */
+    bm = vbm;
+  }
+  else {
+    mtev_hash_store(&b->metrics, bm->key, key_len, bm);
+    if(b->nused++ == 0) mtev_gettimeofday(&b->first, NULL);
+  }
+
+  memset(&bm->m, 0, sizeof(bm->m));
+  bm->m.metric_name = bm->key;
+  bm->m.metric_type = t;
+  memcpy(&bm->m.whence, &whence, sizeof(whence));
+  if(vp) {
+    if(t == METRIC_STRING) {
+      size_t len = strlen((const char *)vp) + 1;
+      if(bm->str_alloc < len) {
+        free(bm->str);
+        bm->str = malloc(len);
+        bm->str_alloc = len;
+      }
+      memcpy(bm->str, vp, len);
+      bm->m.metric_value.s = bm->str;
+    }
+    else {
+      size_t vsize = 0;
+      switch(t) {
+        case METRIC_INT32:
+          vsize = sizeof(int32_t);
+          break;
+        case METRIC_UINT32:
+          vsize = sizeof(uint32_t);
+          break;
+        case METRIC_INT64:
+          vsize = sizeof(int64_t);
+          break;
+        case METRIC_UINT64:
+          vsize = sizeof(uint64_t);
+          break;
+        case METRIC_DOUBLE:
+          vsize = sizeof(double);
+          break;
+        default:
+          break;
+      }
+      if(vsize) {
+        memcpy(&bm->value, vp, vsize);
+        bm->m.metric_value.vp = &bm->value;
+      }
+    }
+  }
+  return bm;
+}
+
+static int64_t
+listener_batch_age_ms(listener_batch_t *b) {
+  struct timeval now, age;
+  if(b->nused == 0) return 0;
+  mtev_gettimeofday(&now, NULL);
+  sub_timeval(now, b->first, &age);
+  return age.tv_sec * 1000 + age.tv_usec / 1000;
+}
+
+static void
+listener_batch_log(noit_check_t *check, listener_batch_t *b) {
+  struct timeval now;
+  mtev_gettimeofday(&now, NULL);
+  noit_check_log_bundle_metrics(check, &now, &b->metrics);
+}
+
+static int
+listener_bundle_job(eventer_t e, int mask, void *closure, struct timeval *now) {
+  listener_bundle_job_t *job = (listener_bundle_job_t *)closure;
+  /* WORK and CLEANUP each come once; the final EVENTER_ASYNCH (both bits)
+   * arrives after the job is freed and must be ignored. */
+  if(mask == EVENTER_ASYNCH_WORK) {
+    listener_batch_log(job->check, job->batch);
+    job->done = mtev_true;
+  }
+  if(mask == EVENTER_ASYNCH_CLEANUP) {
+    /* Never ran; don't lose the metrics */
+    if(!job->done) listener_batch_log(job->check, job->batch);
+    listener_batch_release(job->rxc, job->batch);
+    noit_check_deref(job->check);
+    listener_closure_deref(job->rxc);
+    free(job);
+  }
+  return 0;
+}
+
+/* Hands the batch off to be bundled; the caller gives up the batch. */
+static void
+listener_batch_submit(listener_closure_t *rxc, listener_batch_t *b) {
+  eventer_jobq_t *jobq;
+  if(b->nused == 0) {
+    listener_batch_release(rxc, b);
+    return;
+  }
+  jobq = listener_bundle_jobq_get();
+  if(!jobq) {
+    listener_batch_log(rxc->check, b);
+    listener_batch_release(rxc, b);
+    return;
+  }
+  listener_bundle_job_t *job = calloc(1, sizeof(*job));
+  listener_closure_ref(rxc);
+  job->rxc = rxc;
+  job->check = noit_check_ref(rxc->check);
+  job->batch = b;
+  eventer_t e = eventer_alloc_asynch(listener_bundle_job, job);
+  eventer_add_asynch(jobq, e);
+}
+
+static int
+listener_flush_timer(eventer_t e, int mask, void *closure, struct timeval *now) {
+  listener_instance_t *inst = (listener_instance_t *)closure;
+  inst->flush_timer = NULL;
+  if(inst->batch) {
+    listener_batch_submit(inst->parent, inst->batch);
+    inst->batch = NULL;
+  }
+  return 0;
+}
+
+/* Flushes the connection's batch if it is due, otherwise makes sure it
+ * will be flushed when it is, on the thread that owns the connection. */
+static void
+listener_instance_schedule_flush(listener_instance_t *inst, eventer_t e) {
+  listener_batch_t *b = inst->batch;
+  if(!b || b->nused == 0 || inst->flush_timer) return;
+  int64_t wait_ms = inst->parent->batch_flush_ms - listener_batch_age_ms(b);
+  if(wait_ms <= 0) {
+    listener_batch_submit(inst->parent, b);
+    inst->batch = NULL;
+    return;
+  }
+  inst->flush_timer = eventer_in_s_us(listener_flush_timer, inst,
+                                      wait_ms / 1000, (wait_ms % 1000) * 1000);
+  eventer_set_owner(inst->flush_timer, eventer_get_owner(e));
+  eventer_add(inst->flush_timer);
+}
+
+static void
+listener_instance_flush(listener_instance_t *inst) {
+  if(inst->flush_timer) {
+    eventer_t olde = eventer_remove(inst->flush_timer);
+    if(olde) eventer_free(olde);
+    inst->flush_timer = NULL;
+  }
+  if(inst->batch) {
+    listener_batch_submit(inst->parent, inst->batch);
+    inst->batch = NULL;
+  }
 }
 
 static listener_instance_t *
@@ -107,6 +389,17 @@ listener_closure_alloc(const char *name, noit_module_t *mod, noit_check_t *check
   lc->nldeb = deb;
   lc->nlerr = err;
   strlcpy(lc->nlname, name, sizeof(lc->nlname));
+  lc->batch_size = DEFAULT_BATCH_SIZE;
+  lc->batch_flush_ms = DEFAULT_BATCH_FLUSH_MS;
+  if(check && check->config) {
+    const char *config_val;
+    if(mtev_hash_retr_str(check->config, "batch_size", strlen("batch_size"), &config_val) &&
+       atoi(config_val) > 0)
+      lc->batch_size = atoi(config_val);
+    if(mtev_hash_retr_str(check->config, "batch_flush_ms", strlen("batch_flush_ms"), &config_val) &&
+       atoi(config_val) >= 0)
+      lc->batch_flush_ms = atoi(config_val);
+  }
   pthread_mutex_init(&lc->flushlock, NULL);
   return lc;
 }
@@ -124,9 +417,13 @@ listener_closure_deref(listener_closure_t *lc)
   ck_pr_dec_int_zero(&lc->refcnt, &zero);
   if(!zero) return;
 
-  pthread_mutex_lock(&lc->flushlock);
-  mtev_hash_delete_all(lc->immediate_metrics, NULL, mtev_memory_safe_free);
-  pthread_mutex_unlock(&lc->flushlock);
+  /* Batches in flight hold a reference, so only unflushed metrics from
+   * callers outside a connection can remain. */
+  if(lc->shared_batch) {
+    if(lc->shared_batch->nused) listener_batch_log(lc->check, lc->shared_batch);
+    listener_batch_free(lc->shared_batch);
+  }
+  for(int i=0; i<LISTENER_SPARE_BATCHES; i++) listener_batch_free(lc->spare_batches[i]);
   pthread_mutex_destroy(&lc->flushlock);
   /* no need to free `lc` here as the noit cleanup code will
    * free the check's closure for us */
@@ -178,85 +475,50 @@ listener_submit(noit_module_t *self, noit_check_t *check, noit_check_t *cause)
     noit_check_passive_set_stats(check);
 
   memcpy(&check->last_fire_time, &now, sizeof(now));
+
+  listener_closure_t *rxc = check->closure;
+  pthread_mutex_lock(&rxc->flushlock);
+  if(rxc->shared_batch && listener_batch_age_ms(rxc->shared_batch) >= rxc->batch_flush_ms) {
+    listener_batch_submit(rxc, rxc->shared_batch);
+    rxc->shared_batch = NULL;
+  }
+  pthread_mutex_unlock(&rxc->flushlock);
   mtev_memory_end();
   return 0;
 }
 
-void
-listener_flush_immediate(listener_closure_t *rxc) {
-  struct timeval now;
-  mtev_gettimeofday(&now, NULL);
-  noit_check_log_bundle_metrics(rxc->check, &now, rxc->immediate_metrics);
-  mtev_hash_delete_all(rxc->immediate_metrics, NULL, mtev_memory_safe_free);
-}
-
 void 
 listener_metric_track_or_log(void *vrxc, const char *name, 
                              metric_type_t t, const void *vp, struct timeval *w) {
-  metric_t *m;
+  batch_metric_t *bm;
   listener_closure_t *rxc = vrxc;
+  listener_instance_t *inst = current_instance;
   if(t == METRIC_GUESS) return;
-  void *vm;
-retry:
-  pthread_mutex_lock(&rxc->flushlock);
-  if(rxc->immediate_metrics == NULL) {
-    mtev_hash_table *tbl = calloc(1, sizeof(*tbl));
-    mtev_hash_init_mtev_memory(tbl, MTEV_HASH_DEFAULT_SIZE, MTEV_HASH_LOCK_MODE_MUTEX);
-    rxc->immediate_metrics = tbl;
-  }
-  if(mtev_hash_retrieve(rxc->immediate_metrics, name, strlen(name), &vm) ||
-     mtev_hash_size(rxc->immediate_metrics) > rxc->rows_per_cycle) {
-    /* collision, just log it out */
-    listener_flush_immediate(rxc);
-  }
-  pthread_mutex_unlock(&rxc->flushlock);
-  m = noit_metric_alloc();
-  m->metric_name = strdup(name);
-  m->metric_type = t;
-  if(w) {
-    memcpy(&m->whence, w, sizeof(struct timeval));
-  }
-  if(vp) {
-    if(t == METRIC_STRING) m->metric_value.s = strdup((const char *)vp);
-    else {
-      size_t vsize = 0;
-      switch(m->metric_type) {
-        case METRIC_INT32:
-          vsize = sizeof(int32_t);
-          break;
-        case METRIC_UINT32:
-          vsize = sizeof(uint32_t);
-          break;
-        case METRIC_INT64:
-          vsize = sizeof(int64_t);
-          break;
-        case METRIC_UINT64:
-          vsize = sizeof(uint64_t);
-          break;
-        case METRIC_DOUBLE:
-          vsize = sizeof(double);
-          break;
-        default:
-          break;
-      }
-      if(vsize) {
-        m->metric_value.vp = malloc(vsize);
-        memcpy(m->metric_value.vp, vp, vsize);
-      }
+
+  if(inst && inst->parent == rxc) {
+    /* Only this connection's thread touches its batch */
+    if(!inst->batch) inst->batch = listener_batch_take(rxc);
+    bm = listener_batch_add(inst->batch, name, t, vp, w);
+    noit_stats_mark_metric_logged(noit_check_get_stats_inprogress(rxc->check), &bm->m,
+        mtev_false);
+    if(inst->batch->nused >= rxc->batch_size) {
+      listener_batch_submit(rxc, inst->batch);
+      inst->batch = NULL;
     }
+    return;
   }
 
-  noit_stats_mark_metric_logged(noit_check_get_stats_inprogress(rxc->check), m,
-      mtev_false);
   pthread_mutex_lock(&rxc->flushlock);
-  const mtev_boolean inserted = mtev_hash_store(rxc->immediate_metrics,
-      m->metric_name, strlen(m->metric_name), m);
-  pthread_mutex_unlock(&rxc->flushlock);
-
-  if (!inserted) {
-    mtev_memory_safe_free(m);
-    goto retry;
+  if(!rxc->shared_batch) rxc->shared_batch = listener_batch_take(rxc);
+  bm = listener_batch_add(rxc->shared_batch, name, t, vp, w);
+  noit_stats_mark_metric_logged(noit_check_get_stats_inprogress(rxc->check), &bm->m,
+      mtev_false);
+  if(rxc->shared_batch->nused >= rxc->batch_size ||
+     listener_batch_age_ms(rxc->shared_batch) >= rxc->batch_flush_ms) {
+    listener_batch_submit(rxc, rxc->shared_batch);
+    rxc->shared_batch = NULL;
   }
+  pthread_mutex_unlock(&rxc->flushlock);
 }
 
 int
@@ -283,9 +545,7 @@ socket_close:
     /* Exceptions cause us to simply snip the connection */
     eventer_remove_fde(e);
     eventer_close(e, &newmask);
-    pthread_mutex_lock(&self->flushlock);
-    listener_flush_immediate(self);
-    pthread_mutex_unlock(&self->flushlock);
+    listener_instance_flush(inst);
     listener_instance_free(inst);
     listener_closure_deref(self);
     return 0;
@@ -305,6 +565,7 @@ socket_close:
     }
     else if (len < 0) {
       if (errno == EAGAIN) {
+        listener_instance_schedule_flush(inst, e);
         return newmask | EVENTER_EXCEPTION;
       }
 
@@ -325,8 +586,10 @@ socket_close:
       records_this_loop += num_records;
       size_t total_size = mtev_dyn_buffer_used(&inst->buffer);
       mtevAssert(total_size >= used_size);
-      if(self->payload_handler(check, (char *)mtev_dyn_buffer_data(&inst->buffer), used_size) < 0)
-        goto socket_close;
+      current_instance = inst;
+      int rv = self->payload_handler(check, (char *)mtev_dyn_buffer_data(&inst->buffer), used_size);
+      current_instance = NULL;
+      if(rv < 0) goto socket_close;
 
       void *end_ptr = mtev_dyn_buffer_data(&inst->buffer) + used_size;
       memmove(mtev_dyn_buffer_data(&inst->buffer), end_ptr, total_size - used_size);
@@ -335,9 +598,7 @@ socket_close:
       *mtev_dyn_buffer_write_pointer(&inst->buffer) = '\0';
 
       if (records_this_loop >= rows_per_cycle) {
-        pthread_mutex_lock(&self->flushlock);
-        listener_flush_immediate(self);
-        pthread_mutex_unlock(&self->flushlock);
+        listener_instance_schedule_flush(inst, e);
         return EVENTER_READ | EVENTER_WRITE | EVENTER_EXCEPTION;
       }
     }
@@ -55,6 +55,11 @@ typedef struct _mod_config {
   mtev_hash_table *options;
 } listener_mod_config_t;
 
+#define LISTENER_SPARE_BATCHES 4
+
+/* Immediate metrics awaiting a bundle, see listener_metric_track_or_log */
+typedef struct listener_batch listener_batch_t;
+
 typedef struct listener_closure_s {
   noit_module_t *self;
   noit_check_t *check;
@@ -67,8 +72,11 @@ typedef struct listener_closure_s {
   mtev_log_stream_t nlerr;
   mtev_log_stream_t nldeb;
   char nlname[16];
+  int batch_size;
+  int batch_flush_ms;
   pthread_mutex_t flushlock;
-  mtev_hash_table *immediate_metrics;
+  listener_batch_t *shared_batch;
+  listener_batch_t *spare_batches[LISTENER_SPARE_BATCHES];
   int (*payload_handler)(noit_check_t *check, char *buffer, size_t len);
   int (*count_records)(char *buffer, size_t inlen, size_t *usedlen);
 } listener_closure_t;
@@ -77,6 +85,8 @@ typedef struct listener_instance {
   mtev_dyn_buffer_t buffer;
   int subsequent_invocation;
   listener_closure_t *parent;
+  listener_batch_t *batch;
+  eventer_t flush_timer;
 } listener_instance_t;
 
 #define READ_CHUNK 32768
@@ -103,6 +113,10 @@ listener_closure_t *listener_closure_alloc(const char *name, noit_module_t *mod,
                                            int (*)(char *buffer, size_t inlen, size_t *usedlen));
 void listener_closure_ref(listener_closure_t *lc);
 int listener_submit(noit_module_t *self, noit_check_t *check, noit_check_t *cause);
+/* Metrics are batched per connection, keyed by name and timestamp, and
+ * bundled on the "listener_bundle" jobq once the batch holds batch_size
+ * metrics or is batch_flush_ms old.  Calls made outside of a connection's
+ * payload handler share a single batch under flushlock. */
 void listener_metric_track_or_log(void *vrxc, const char *name, 
                                   metric_type_t t, const void *vp, struct timeval *w);
 int listener_handler(eventer_t e, int mask, void *closure, struct timeval *now);
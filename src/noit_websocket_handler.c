@@ -38,6 +38,7 @@
 #include <mtev_defines.h>
 #include <eventer/eventer.h>
 #include <mtev_listener.h>
+#include <mtev_hash.h>
 #include <mtev_memory.h>
 #include <mtev_sem.h>
 #include <mtev_rest.h>
@@ -65,8 +66,7 @@ static const int heartbeat_str_len = 20;
 static uint32_t ls_counter = 0;
 
 typedef struct {
-  char **filters;
-  int filter_count;
+  mtev_hash_table filters;
   mtev_boolean use_filter;
   mtev_http_rest_closure_t *restc;
   char uuid_str[37];
@@ -98,10 +98,7 @@ noit_websocket_closure_free(void *jcl) {
   mtev_log_stream_remove(mtev_log_stream_get_name(w->log_stream));
   mtev_log_stream_free(w->log_stream);
 
-  for (int i = 0; i < w->filter_count; i++) {
-    free(w->filters[i]);
-  }
-  free(w->filters);
+  if (w->use_filter) mtev_hash_destroy(&w->filters, free, NULL);
 
   free(w);
 }
@@ -115,72 +112,131 @@ mtev_http_websocket_queue_msg(wcl->restc->http_ctx,
 #endif
 }
 
-static int
-send_individual_metric(noit_websocket_closure_t *wcl, const char *metric_string, size_t len)
-{
-#ifdef HAVE_WSLAY
-  noit_metric_message_t message = { .original_message = (char *)metric_string, .original_message_len = len };
-  char *json = NULL;
-  size_t json_len = 0;
-  int sent = 0;
+/* Every subscriber has its own feed, so each log record is written once per
+ * subscriber, back to back on the same thread.  The last record seen on this
+ * thread is kept decoded (with each metric's JSON rendered on first use) so
+ * that only the first subscriber pays for the decode and serialization.
+ */
+typedef struct {
+  char *line;
+  noit_metric_message_t message;
+  mtev_boolean parsed;
+  char *json;
+  size_t json_len;
+} ws_decoded_metric_t;
 
-  if(!wcl || !wcl->restc || !wcl->restc->http_ctx) return 0;
+typedef struct {
+  char *record;
+  size_t record_len;
+  int count;
+  ws_decoded_metric_t *metrics;
+} ws_decoded_record_t;
+
+static __thread ws_decoded_record_t last_record;
+
+static void
+ws_decoded_record_clear(ws_decoded_record_t *dr) {
+  for (int i = 0; i < dr->count; i++) {
+    ws_decoded_metric_t *dm = &dr->metrics[i];
+    noit_metric_message_clear(&dm->message);
+    free(dm->line);
+    free(dm->json);
+  }
+  free(dr->metrics);
+  free(dr->record);
+  memset(dr, 0, sizeof(*dr));
+}
 
-  int rval = noit_message_decoder_parse_line(&message, mtev_false);
-  if (rval < 0) {
-    noit_metric_message_clear(&message);
-    return sent;
+static void
+ws_decoded_metric_init(ws_decoded_metric_t *dm, char *line) {
+  dm->line = line;
+  dm->message.original_message = line;
+  dm->message.original_message_len = strlen(line);
+  if (noit_message_decoder_parse_line(&dm->message, mtev_false) < 0) {
+    noit_metric_message_clear(&dm->message);
+    return;
   }
+  dm->message.type = line[0];
+  dm->parsed = mtev_true;
+}
 
-  message.type = metric_string[0];
+static ws_decoded_record_t *
+ws_decode_record(const char *buf, size_t len) {
+  ws_decoded_record_t *dr = &last_record;
+  if (dr->record && dr->record_len == len && !memcmp(dr->record, buf, len)) {
+    return dr;
+  }
+  ws_decoded_record_clear(dr);
+  dr->record = malloc(len);
+  memcpy(dr->record, buf, len);
+  dr->record_len = len;
 
-  if (wcl->use_filter == mtev_true) {
-    for (int i = 0; i < wcl->filter_count; i++) {
-      if ((message.id.name_len_with_tags > 0) &&
-          (strlen(wcl->filters[i]) == message.id.name_len_with_tags) &&
-          (0 == memcmp(wcl->filters[i], message.id.name, message.id.name_len_with_tags))) {
-        noit_metric_to_json(&message, &json, &json_len, mtev_false);
-        mtev_http_websocket_queue_msg(wcl->restc->http_ctx,
-                                      WSLAY_TEXT_FRAME,
-                                      (const unsigned char *)json, json_len);
-        sent++;
-        free(json);
-        break;
+  if (buf[0] == 'B') {
+    char **out = NULL;
+    int count = noit_check_log_b_to_sm(buf, len, &out, 0);
+    if (count > 0) {
+      dr->metrics = calloc(count, sizeof(*dr->metrics));
+      for (int i = 0; i < count; i++) {
+        ws_decoded_metric_init(&dr->metrics[i], out[i]);
       }
+      dr->count = count;
     }
+    free(out);
   } else {
-    noit_metric_to_json(&message, &json, &json_len, mtev_false);
-    mtev_http_websocket_queue_msg(wcl->restc->http_ctx,
-                                  WSLAY_TEXT_FRAME,
-                                  (const unsigned char *)json, json_len);
-    sent++;
-    free(json);
+    char *line = malloc(len + 1);
+    memcpy(line, buf, len);
+    line[len] = '\0';
+    dr->metrics = calloc(1, sizeof(*dr->metrics));
+    ws_decoded_metric_init(&dr->metrics[0], line);
+    dr->count = 1;
   }
-  noit_metric_message_clear(&message);
+  return dr;
+}
+
+static int
+send_individual_metric(noit_websocket_closure_t *wcl, ws_decoded_metric_t *dm)
+{
+#ifdef HAVE_WSLAY
+  noit_metric_message_t *message = &dm->message;
+  void *unused;
+
+  if (!dm->parsed) return 0;
+  if (wcl->use_filter == mtev_true) {
+    if (message->id.name_len_with_tags <= 0 ||
+        !mtev_hash_retrieve(&wcl->filters, message->id.name,
+                            message->id.name_len_with_tags, &unused)) {
+      return 0;
+    }
+  }
+  if (!dm->json) {
+    noit_metric_to_json(message, &dm->json, &dm->json_len, mtev_false);
+  }
+  mtev_http_websocket_queue_msg(wcl->restc->http_ctx,
+                                WSLAY_TEXT_FRAME,
+                                (const unsigned char *)dm->json, dm->json_len);
+  return 1;
+#else
+  return 0;
 #endif
-  return sent;
 }
 
 
 static int
 filter_and_send(noit_websocket_closure_t *wcl, const char *buf, size_t len)
 {
-  char **out = NULL;
-  int count = 0, sent = 0;
+  ws_decoded_record_t *dr;
+  int sent = 0;
 
   if (buf == NULL || len == 0) {
     return sent;
   }
+  if (!wcl || !wcl->restc || !wcl->restc->http_ctx) {
+    return sent;
+  }
 
-  if (buf[0] == 'B') {
-    count = noit_check_log_b_to_sm(buf, len, &out, 0);
-    for (int i = 0; i < count; i++) {
-      sent += send_individual_metric(wcl, out[i], strlen(out[i]));
-      free(out[i]);
-    }
-    free(out);
-  } else {
-    sent += send_individual_metric(wcl, buf, len);
+  dr = ws_decode_record(buf, len);
+  for (int i = 0; i < dr->count; i++) {
+    sent += send_individual_metric(wcl, &dr->metrics[i]);
   }
   return sent;
 }
@@ -307,13 +363,16 @@ noit_websocket_msg_handler(mtev_http_rest_closure_t *restc, int opcode,
   restc->call_closure_free = noit_websocket_closure_free;
   handler_data->period = period_ms;
   if (metrics != NULL) {
+    int filter_count = mtev_json_object_array_length(metrics);
     handler_data->use_filter = mtev_true;
-    handler_data->filter_count = mtev_json_object_array_length(metrics);
-    handler_data->filters = calloc(sizeof(char *), handler_data->filter_count);
-    for (int i = 0; i < handler_data->filter_count; i++) {
+    mtev_hash_init(&handler_data->filters);
+    for (int i = 0; i < filter_count; i++) {
       struct mtev_json_object *o = mtev_json_object_array_get_idx(metrics, i);
-      if (o != NULL) {
-        handler_data->filters[i] = strdup(mtev_json_object_get_string(o));
+      const char *name = o ? mtev_json_object_get_string(o) : NULL;
+      if (name == NULL || *name == '\0') continue;
+      char *key = strdup(name);
+      if (!mtev_hash_store(&handler_data->filters, key, strlen(key), NULL)) {
+        free(key);
       }
     }
   }
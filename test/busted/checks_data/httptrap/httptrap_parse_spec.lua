@@ -0,0 +1,121 @@
+describe("httptrap parse jobq", function()
+  local noit, api
+  setup(function()
+    Reconnoiter.clean_workspace()
+    noit = Reconnoiter.TestNoit:new("trapq", {
+      modules = { httptrap = { image = "httptrap",
+                               config = { parse_concurrency = "2",
+                                          parse_backlog = "2",
+                                          parse_per_check = "1",
+                                          parse_max_body = "4096" } } }
+    })
+  end)
+  teardown(function() if noit ~= nil then noit:stop() end end)
+
+  local uuid_a = mtev.uuid()
+  local uuid_b = mtev.uuid()
+
+  local function check_xml(name)
+    return [=[<?xml version="1.0" encoding="utf8"?>
+<check>
+  <attributes>
+    <target>127.0.0.1</target>
+    <period>1000</period>
+    <timeout>500</timeout>
+    <name>]=] .. name .. [=[</name>
+    <filterset>allowall</filterset>
+    <module>httptrap</module>
+  </attributes>
+  <config>
+    <secret>foofoo</secret>
+  </config>
+</check>]=]
+  end
+
+  local held_body = '{"held": 1}'
+
+  -- sends the headers and the first byte of an upload and leaves it open
+  local function hold_upload(check_uuid)
+    local conn = mtev.socket('inet', 'tcp')
+    assert.message("Error creating mtev tcp socket").is_not_nil(conn)
+    local rv, err = conn:connect('127.0.0.1', noit:api_port())
+    assert.message("Error " .. (err or "nil") .. " connecting to port").is_not_equal(-1, rv)
+    rv, err = conn:ssl_upgrade_socket(Reconnoiter.ssl_file("test-stratcon.crt"),
+                                      Reconnoiter.ssl_file("test-stratcon.key"),
+                                      Reconnoiter.ssl_file("test-ca.crt"))
+    assert.message("Error " .. (err or "nil") .. " negotiating TLS").is_not_equal(-1, rv)
+    conn:write("POST /module/httptrap/" .. check_uuid .. "/foofoo HTTP/1.1\r\n" ..
+               "Host: 127.0.0.1\r\n" ..
+               "Content-Type: application/json\r\n" ..
+               "Content-Length: " .. string.len(held_body) .. "\r\n\r\n" ..
+               string.sub(held_body, 1, 1))
+    -- give the server time to admit it
+    mtev.sleep(0.5)
+    return conn
+  end
+
+  -- sends the rest of a held upload and returns its status code
+  local function finish_upload(conn)
+    conn:write(string.sub(held_body, 2))
+    local status = conn:read("\r\n")
+    conn:close()
+    return tonumber(string.match(status or "", "^HTTP/%S+ (%d+)"))
+  end
+
+  local function post(check_uuid, body)
+    return api:json("POST", "/module/httptrap/" .. check_uuid .. "/foofoo", body)
+  end
+
+  local held_a, held_b
+
+  it("should start", function()
+    assert.is_true(noit:start():is_booted())
+    api = noit:API()
+  end)
+
+  it("put", function()
+    local code = api:raw("PUT", "/checks/set/" .. uuid_a, check_xml("httptrap_a"))
+    assert.is.equal(200, code)
+    code = api:raw("PUT", "/checks/set/" .. uuid_b, check_xml("httptrap_b"))
+    assert.is.equal(200, code)
+  end)
+
+  it("parses uploads on the jobq", function()
+    local code, doc = post(uuid_a, '{"a": 1, "b": {"c": [2, 3]}}')
+    assert.is.equal(200, code)
+    assert.is_equal(3, doc["stats"])
+  end)
+
+  it("refuses a body over parse_max_body with 413", function()
+    local code, doc = post(uuid_a, '{"big": "' .. string.rep("x", 8000) .. '"}')
+    assert.is.equal(413, code)
+    assert.is_equal("payload too large", doc["error"])
+  end)
+
+  it("refuses a second upload to a busy check with 429", function()
+    held_a = hold_upload(uuid_a)
+    local code, doc = post(uuid_a, '{"a": 1}')
+    assert.is.equal(429, code)
+    assert.is_equal("too many uploads pending for check", doc["error"])
+    -- other checks are still admitted
+    code, doc = post(uuid_b, '{"a": 1}')
+    assert.is.equal(200, code)
+  end)
+
+  it("refuses any upload with 503 once the backlog is full", function()
+    held_b = hold_upload(uuid_b)
+    local code, doc = post(uuid_a, '{"a": 1}')
+    assert.is.equal(503, code)
+    assert.is_equal("too many uploads pending", doc["error"])
+    code, doc = post(uuid_b, '{"a": 1}')
+    assert.is.equal(503, code)
+  end)
+
+  it("admits uploads again once the held ones finish", function()
+    assert.is.equal(200, finish_upload(held_a))
+    assert.is.equal(200, finish_upload(held_b))
+    local code, doc = post(uuid_a, '{"a": 1}')
+    assert.is.equal(200, code)
+    assert.is_equal(1, doc["stats"])
+  end)
+end)
@@ -16,6 +16,7 @@ describe("noit", function()
 
   local uuid = mtev.uuid()
   local accum_uuid = mtev.uuid()
+  local paths_uuid = mtev.uuid()
 
   local check_xml =
 [=[<?xml version="1.0" encoding="utf8"?>
@@ -51,6 +52,23 @@ local accum_check_xml =
   </config>
 </check>]=]
 
+local paths_check_xml =
+[=[<?xml version="1.0" encoding="utf8"?>
+<check>
+  <attributes>
+    <target>127.0.0.1</target>
+    <period>900000</period>
+    <timeout>5000</timeout>
+    <name>httptrap_paths</name>
+    <filterset>allowall</filterset>
+    <module>httptrap</module>
+  </attributes>
+  <config>
+    <secret>paths</secret>
+    <asynch_metrics>false</asynch_metrics>
+  </config>
+</check>]=]
+
   local b64hist = "AAQKAAABFAAAAR4AAAEoAAB4"
   local b64hist_double = "AAQKAAACFAAAAh4AAAIoAADw"
   local payload = [=[{
@@ -253,5 +271,64 @@ local accum_check_xml =
       expected["c"]["_value"] = "54321"
       assert.same(expected, xmetrics)
     end)
+
+    local function show_metrics(check_uuid)
+      local code, xml = api:xml("GET", "/checks/show/" .. check_uuid)
+      assert.is_equal(200, code)
+      local xmetrics = {}
+      for node in xml:xpath("//metrics/metric") do
+        if xmetrics[node:attr("name")] == nil then
+          local val = node:contents()
+          if val ~= nil and val ~= '' then
+            xmetrics[node:attr("name")] = { _type = node:attr("type"), _value = val }
+          end
+        end
+      end
+      return xmetrics
+    end
+
+    it("names nested, array and _value leaves", function()
+      local code, doc = api:raw("PUT", "/checks/set/" .. paths_uuid, paths_check_xml)
+      assert.is.equal(200, code)
+      -- siblings after deeper or longer keys must not keep any of their path
+      code, doc = api:json("POST", "/module/httptrap/" .. paths_uuid .. "/paths", [=[{
+        "n": { "a": [ { "b": 1 }, [ 2, { "_type": "s", "_value": "x" } ] ] },
+        "a_much_longer_sibling_key": { "q": 3 },
+        "v": { "_type": "L", "_value": 5 },
+        "deep": { "x": { "y": { "z": { "_type": "i", "_value": 4 } } } },
+        "after": 6
+      }]=])
+      assert.is.equal(200, code)
+      assert.is_equal(7, doc["stats"])
+      assert.is_nil(doc["error"])
+      local expected = {}
+      expected["n`a`0`b"] = { _type = "L", _value = "1" }
+      expected["n`a`1`0"] = { _type = "L", _value = "2" }
+      expected["n`a`1`1"] = { _type = "s", _value = "x" }
+      expected["a_much_longer_sibling_key`q"] = { _type = "L", _value = "3" }
+      expected["v"] = { _type = "L", _value = "5" }
+      expected["deep`x`y`z"] = { _type = "i", _value = "4" }
+      expected["after"] = { _type = "L", _value = "6" }
+      assert.same(expected, show_metrics(paths_uuid))
+    end)
+
+    it("reports names truncated to the maximum length", function()
+      local truncated = "at least one metric exceeded max name length"
+      -- a single key that is too long
+      local code, doc = api:json("POST", "/module/httptrap/" .. paths_uuid .. "/paths",
+                                 '{"' .. string.rep("k", 5000) .. '": 1}')
+      assert.is.equal(200, code)
+      assert.is_equal(truncated, doc["error"])
+      -- a path that only becomes too long once its components are joined
+      code, doc = api:json("POST", "/module/httptrap/" .. paths_uuid .. "/paths",
+                           '{"' .. string.rep("p", 4000) .. '": {"' .. string.rep("c", 200) .. '": 1}}')
+      assert.is.equal(200, code)
+      assert.is_equal(truncated, doc["error"])
+      -- and the next request starts clean
+      code, doc = api:json("POST", "/module/httptrap/" .. paths_uuid .. "/paths", '{"short": 1}')
+      assert.is.equal(200, code)
+      assert.is_equal(1, doc["stats"])
+      assert.is_nil(doc["error"])
+    end)
   end)
 end)
@@ -0,0 +1,94 @@
+-- Sends the same statsd traffic with per-check aggregation on and off and
+-- reports the ingest rate logged to debug/statsd/performance for each.
+describe("statsd ingest rate #benchmark", function()
+  local port = 44324
+  local packets = 20000
+  local lines_per_packet = 32
+  local keys = 512
+
+  local check_xml =
+[=[<?xml version="1.0" encoding="utf8"?>
+<check>
+  <attributes>
+    <target>127.0.0.1</target>
+    <period>1000</period>
+    <timeout>500</timeout>
+    <name>statsd</name>
+    <filterset>allowall</filterset>
+    <module>statsd</module>
+  </attributes>
+  <config/>
+</check>]=]
+
+  -- counters, timings and gauges spread over a fixed set of keys
+  local payloads = {}
+  for p = 1,64 do
+    local lines = {}
+    for l = 1,lines_per_packet do
+      local n = (p * lines_per_packet + l) % keys
+      local kind = n % 3
+      if kind == 0 then
+        table.insert(lines, "bench.count" .. n .. ";env=prod:1|c")
+      elseif kind == 1 then
+        table.insert(lines, "bench.timing" .. n .. ":" .. (l % 50) .. "|ms")
+      else
+        table.insert(lines, "bench.gauge" .. n .. ":" .. p .. "|g")
+      end
+    end
+    payloads[p] = table.concat(lines, "\n") .. "\n"
+  end
+
+  for _, aggregate in ipairs({ "true", "false" }) do
+    describe("aggregate=" .. aggregate, function()
+      local noit, api
+      local uuid = mtev.uuid()
+      setup(function()
+        Reconnoiter.clean_workspace()
+        noit = Reconnoiter.TestNoit:new("noit", {
+          modules = { statsd = { image = "statsd",
+                                 config = { port = port, aggregate = aggregate } } },
+          logs_debug = { [''] = "false", statsd = "true",
+                         ["statsd/performance"] = "false" }
+        })
+      end)
+      teardown(function() if noit ~= nil then noit:stop() end end)
+
+      it("should start", function()
+        assert.is_true(noit:start():is_booted())
+        api = noit:API()
+      end)
+
+      it("put", function()
+        local code = api:raw("PUT", "/checks/set/" .. uuid, check_xml)
+        assert.is.equal(200, code)
+      end)
+
+      it("ingests", function()
+        local perf = noit:watchfor(mtev.pcre('STATSD: C=\\d+, M=\\d+, G=\\d+, \\(\\d+/s\\)'), true)
+        local s = mtev.socket("127.0.0.1", "udp")
+        s:connect("127.0.0.1", port)
+        local start = mtev.timeval.now()
+        for i = 1,packets do
+          s:send(payloads[i % #payloads + 1])
+        end
+        local sent = mtev.timeval.seconds(mtev.timeval.now() - start)
+
+        -- read the per-second reports until ingest goes quiet
+        local total, peak, idle = 0, 0, 0
+        while idle < 2 do
+          local line = noit:waitfor(perf, 5)
+          assert.is_not_nil(line)
+          local c, m, g, rate = string.match(line, "C=(%d+), M=(%d+), G=(%d+), %((%d+)/s%)")
+          rate = tonumber(rate)
+          total = tonumber(c) + tonumber(m) + tonumber(g)
+          if rate > peak then peak = rate end
+          if rate == 0 and total > 0 then idle = idle + 1 else idle = 0 end
+        end
+        print(string.format("statsd aggregate=%s: %d of %d samples counted, " ..
+                            "sent in %.2fs, peak %d samples/s",
+                            aggregate, total, packets * lines_per_packet, sent, peak))
+        assert.is_true(total > 0)
+      end)
+    end)
+  end
+end)
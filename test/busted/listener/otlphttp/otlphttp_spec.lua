@@ -0,0 +1,118 @@
+describe("otlphttp #otlphttp #listener", function()
+  local noit, api
+  setup(function()
+    Reconnoiter.clean_workspace()
+    noit = Reconnoiter.TestNoit:new("otlphttp", {
+      modules = { otlphttp = { image = "otlphttp", config = {} } },
+      logs_debug = { otlphttp_verbose = "false" }
+    })
+  end)
+  teardown(function()
+    if noit ~= nil then noit:stop() end
+  end)
+
+  local uuid = mtev.uuid()
+  local secret = "s3cr3tk3y"
+  local check_xml =
+[=[<?xml version="1.0" encoding="utf8"?>
+<check>
+  <attributes>
+    <target>127.0.0.1</target>
+    <period>60000</period>
+    <timeout>30000</timeout>
+    <name>otlphttp</name>
+    <filterset>allowall</filterset>
+    <module>otlphttp</module>
+  </attributes>
+  <config>
+    <secret>]=] .. secret .. [=[</secret>
+  </config>
+</check>]=]
+
+  -- just enough protobuf to build an ExportMetricsServiceRequest of gauges
+  local function varint(n)
+    local out = {}
+    repeat
+      local b = n % 128
+      n = math.floor(n / 128)
+      if n > 0 then b = b + 128 end
+      table.insert(out, string.char(b))
+    until n == 0
+    return table.concat(out)
+  end
+  local function len_field(field, body)
+    return varint(field * 8 + 2) .. varint(string.len(body)) .. body
+  end
+  local function fixed64(n)
+    -- n must be an integer exactly representable as a double
+    local lo, hi = n % 4294967296, math.floor(n / 4294967296)
+    local out = {}
+    for _, w in ipairs({ lo, hi }) do
+      for i = 0, 3 do
+        table.insert(out, string.char(math.floor(w / 256 ^ i) % 256))
+      end
+    end
+    return table.concat(out)
+  end
+  local function gauge(name, when)
+    -- NumberDataPoint.time_unix_nano = 3 (fixed64), as_double = 4 (42.0)
+    local dp = varint(3 * 8 + 1) .. fixed64(when * 1000000000) ..
+               varint(4 * 8 + 1) .. "\0\0\0\0\0\0\69\64"
+    return len_field(2, len_field(1, name) .. len_field(5, len_field(1, dp)))
+  end
+  local function request(names)
+    local metrics = {}
+    local when = os.time()
+    for _, name in ipairs(names) do table.insert(metrics, gauge(name, when)) end
+    return len_field(1, len_field(2, table.concat(metrics)))
+  end
+
+  -- posts body in chunk sized writes, pausing so each arrives in its own read
+  local function post_in_pieces(body, chunk)
+    local conn = mtev.socket('inet', 'tcp')
+    assert.message("Error creating mtev tcp socket").is_not_nil(conn)
+    local rv, err = conn:connect('127.0.0.1', noit:api_port())
+    assert.message("Error " .. (err or "nil") .. " connecting to port").is_not_equal(-1, rv)
+    rv, err = conn:ssl_upgrade_socket(Reconnoiter.ssl_file("test-stratcon.crt"),
+                                      Reconnoiter.ssl_file("test-stratcon.key"),
+                                      Reconnoiter.ssl_file("test-ca.crt"))
+    assert.message("Error " .. (err or "nil") .. " negotiating TLS").is_not_equal(-1, rv)
+    conn:write("POST /module/otlphttp/v1/" .. uuid .. "/" .. secret .. " HTTP/1.1\r\n" ..
+               "Host: 127.0.0.1\r\n" ..
+               "Content-Type: application/x-protobuf\r\n" ..
+               "Content-Length: " .. string.len(body) .. "\r\n\r\n")
+    for i = 1, string.len(body), chunk do
+      conn:write(string.sub(body, i, i + chunk - 1))
+      mtev.sleep(0.05)
+    end
+    local status = conn:read("\r\n")
+    conn:close()
+    return tonumber(string.match(status or "", "^HTTP/%S+ (%d+)"))
+  end
+
+  it("should start", function()
+    assert.is_true(noit:start():is_booted())
+    api = noit:API()
+  end)
+
+  describe("otlphttp", function()
+    it("create otlphttp check", function()
+      local code, doc = api:raw("PUT", "/checks/set/" .. uuid, check_xml)
+      assert.is.equal(200, code)
+    end)
+    it("decodes a body split across several reads", function()
+      local key = noit:watchfor(mtev.pcre('\\[otlp\\] metric: type \\d+, name: split_gauge_'), true)
+      local names = { "split_gauge_1", "split_gauge_2", "split_gauge_3" }
+      -- 7 byte writes split every varint, tag and metric across reads
+      assert.is.equal(200, post_in_pieces(request(names), 7))
+      for i = 1, #names do
+        assert.is_not_nil(noit:waitfor(key, 5))
+      end
+      noit:watchfor_stop(key)
+    end)
+    it("rejects a body truncated mid metric", function()
+      local body = request({ "split_gauge_truncated" })
+      assert.is.equal(500, post_in_pieces(string.sub(body, 1, string.len(body) - 5), 3))
+    end)
+  end)
+end)
@@ -175,5 +175,60 @@ describe("noit", function()
 
     end)
 
+    it("re-evaluates checks when rules change and checks are deleted", function()
+      local filter_uuid, check_uuid = mtev.uuid(), mtev.uuid()
+      local scheduled_xml = function(name)
+        return [=[<?xml version="1.0" encoding="utf8"?>
+        <check>
+          <attributes>
+            <target>localhost</target>
+            <period>100</period>
+            <timeout>50</timeout>
+            <name>]=] .. name .. [=[</name>
+            <filterset>]=] .. filter_uuid .. [=[</filterset>
+            <module>tags</module>
+          </attributes>
+          <config></config>
+        </check>]=]
+      end
+      -- polls until the check's current metrics show exactly the allowed names
+      local wait_allowed = function(what, allowed)
+        local seen
+        for i=1,50 do
+          local code, doc = api:json("GET", "/checks/show/" .. check_uuid .. ".json")
+          assert.message("show check").is.equal(200, code)
+          if doc.metrics ~= nil and doc.metrics.current ~= nil then
+            seen = {}
+            for k,v in pairs(doc.metrics.current) do
+              if v._filtered ~= true then table.insert(seen, k) end
+            end
+            table.sort(seen)
+            if table.concat(seen, ",") == table.concat(allowed, ",") then return end
+          end
+          mtev.sleep(0.1)
+        end
+        assert.message(what .. ": allowed " .. table.concat(seen or {}, ","))
+          .is.equal(table.concat(allowed, ","), table.concat(seen or {}, ","))
+      end
+
+      local code, doc, raw = api:raw("PUT", "/filters/set/" .. filter_uuid, filter_xml("^metric1"))
+      assert.message(raw).is.equal(200, code)
+      code, doc, raw = api:raw("PUT", "/checks/set/" .. check_uuid, scheduled_xml("cache.1"))
+      assert.message(raw).is.equal(200, code)
+      wait_allowed("initial rules", { "metric1|ST[env:prod,type:foo]" })
+
+      code, doc, raw = api:raw("PUT", "/filters/set/" .. filter_uuid, filter_xml("^metric[35]"))
+      assert.message(raw).is.equal(200, code)
+      wait_allowed("changed rules", { "metric3|ST[env:prod,type:debug]", "metric5" })
+
+      code, doc, raw = api:raw("DELETE", "/checks/delete/" .. check_uuid)
+      assert.message(raw).is.equal(200, code)
+      code, doc, raw = api:raw("PUT", "/filters/set/" .. filter_uuid, filter_xml("^metric2"))
+      assert.message(raw).is.equal(200, code)
+      code, doc, raw = api:raw("PUT", "/checks/set/" .. check_uuid, scheduled_xml("cache.2"))
+      assert.message(raw).is.equal(200, code)
+      wait_allowed("re-added check", { "metric2|ST[env:dev,type:foo]" })
+    end)
+
   end)
 end)
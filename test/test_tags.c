@@ -3,14 +3,27 @@
 #include "noit_metric.h"
 #include "noit_metric_tag_search.h"
 #include "noit_message_decoder.h"
+#include "noit_check_log_helpers.h"
+#include "noit_fb.h"
+#include "bundle.pb-c.h"
+#include "noit_plaintext.h"
+#include "noit_prometheus_translation_internal.h"
+#include "noit_check_tools_shared.h"
+#include "noit_metric_dedupe.h"
+#include "noit_metric_lane.h"
+#include "noit_protobuf_arena.h"
 #include "libnoit.h"
 #include <mtev_hash.h>
 #include <mtev_b64.h>
 #include <mtev_perftimer.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <math.h>
+#include <ck_pr.h>
 
 bool benchmark = false;
+const char *graphite_capture = NULL;
 const int BENCH_ITERS = 1000000;
 
 const char *tcpairs[][2] = {
@@ -115,6 +128,7 @@ struct Matches {
     const char *query;
     mtev_boolean match;
     uint64_t bench_ns;
+    uint64_t bench_program_ns;
   } queries[14];
 };
 
@@ -452,8 +466,9 @@ void test_tag_match()
   noit_metric_tagset_t tagset = {};
   noit_metric_tagset_builder_t builder;
   noit_metric_tag_search_ast_t *ast;
-  mtev_boolean match;
+  mtev_boolean match, program_match;
   char *canonical;
+  noit_metric_tag_search_index_t *idx = noit_metric_tag_search_index_alloc();
 
   for(int i = 0; i < sizeof(testmatches) / sizeof(*testmatches); i++) {
     noit_metric_tagset_builder_start(&builder);
@@ -465,6 +480,9 @@ void test_tag_match()
       continue;
     }
     test_assert_namef(tagset_add && tagset_end, "'%s' is valid tagset", testmatches[i].tagstring);
+    const noit_metric_tagset_t *sets[1] = { &tagset };
+    noit_metric_tag_search_index_build(idx, sets, 1);
+    noit_metric_tag_search_network_t *net = noit_metric_tag_search_network_alloc();
 
     for(int j = 0; testmatches[i].queries[j].query != NULL; j++) {
       ast = noit_metric_tag_search_parse_lazy(testmatches[i].queries[j].query, &erroroffset);
@@ -480,6 +498,20 @@ void test_tag_match()
           match = noit_metric_tag_search_evaluate_against_tags(ast, &tagset);
         }
         test_assert_namef(match == testmatches[i].queries[j].match, "'%s' %s", testmatches[i].queries[j].query, match ? "matches" : "doesn't match");
+        noit_metric_tag_search_program_t *program = noit_metric_tag_search_program_compile(ast);
+        program_match = noit_metric_tag_search_program_evaluate(program, idx);
+        if(benchmark) {
+          mtev_perftimer_t btimer;
+          mtev_perftimer_start(&btimer);
+          for(int b=0; b<BENCH_ITERS; b++) {
+            program_match = noit_metric_tag_search_program_evaluate(program, idx);
+          }
+          testmatches[i].queries[j].bench_program_ns = mtev_perftimer_elapsed(&btimer);
+        }
+        test_assert_namef(program_match == testmatches[i].queries[j].match, "'%s' program %s",
+                          testmatches[i].queries[j].query, program_match ? "matches" : "doesn't match");
+        noit_metric_tag_search_program_free(program);
+        noit_metric_tag_search_network_add(net, ast, j);
         /* clone if only to test cloning */
         noit_metric_tag_search_free(noit_metric_tag_search_clone(ast));
         noit_metric_tag_search_free(ast);
@@ -487,9 +519,17 @@ void test_tag_match()
         test_assert_namef(ast != NULL, "parsing error at %d in '%s'", erroroffset, testmatches[i].queries[j].query);
       }
     }
+    uint8_t lanes[14] = { 0 };
+    noit_metric_tag_search_network_evaluate(net, idx, lanes, 14);
+    for(int j = 0; testmatches[i].queries[j].query != NULL; j++) {
+      test_assert_namef(lanes[j] == testmatches[i].queries[j].match, "'%s' network %s",
+                        testmatches[i].queries[j].query, lanes[j] ? "matches" : "doesn't match");
+    }
+    noit_metric_tag_search_network_free(net);
     free(tagset.tags);
     free(canonical);
   }
+  noit_metric_tag_search_index_free(idx);
 }
 
 void test_canon(const char *in, const char *expect) {
@@ -636,6 +676,943 @@ void test_line(const char *name, const char *in, const char *expect, int rval_ex
   noit_metric_message_clear(&message);
 }
 
+void test_line_arena(noit_metric_message_arena_t *arena, const char *name, const char *in,
+                     const char *expect, int rval_expect) {
+  int rval = 0;
+  noit_metric_message_t *message =
+    noit_metric_message_arena_decode(arena, in, strlen(in), -1, NULL, &rval);
+  test_assert_namef(message != NULL, "test_line_arena(%s) decoded", name);
+  if(!message) return;
+  test_assert_namef(message->id.alloc_name == NULL, "test_line_arena(%s) not allocd", name);
+  test_assert_namef(rval == rval_expect, "test_line_arena(%s) rval [%d should be %d]", name, rval, rval_expect);
+  if(expect != NULL) {
+    test_assert_namef(strlen(expect) == message->id.name_len_with_tags &&
+                      !memcmp(message->id.name, expect, message->id.name_len_with_tags),
+                      "test_line_arena(%s) metric match", name);
+  }
+  noit_metric_message_deref(message);
+}
+
+#define BF_TEST_METRICS 64
+static char *
+make_bf_line(void) {
+  uuid_t check_uuid;
+  mtev_uuid_parse("43e5c324-e4b1-4c7b-9b1d-8a7b5ec3b6f1", check_uuid);
+  void *builder = noit_fb_start_metricbatch(1500000000123ULL, check_uuid,
+                                            "push`httptrap`c_933_247631::httptrap", 933);
+  for(int i=0; i<BF_TEST_METRICS; i++) {
+    char name[128];
+    double dv = 1.0 / 3.0 + i;
+    int64_t lv = -((int64_t)1 << 40) - i;
+    metric_t m = { .metric_name = name };
+    if(i % 3 == 0) {
+      snprintf(name, sizeof(name), "double_%d|ST[env:prod,node:n%d]", i, i);
+      m.metric_type = METRIC_DOUBLE;
+      m.metric_value.n = &dv;
+    }
+    else if(i % 3 == 1) {
+      snprintf(name, sizeof(name), "long_%d", i);
+      m.metric_type = METRIC_INT64;
+      m.metric_value.l = &lv;
+    }
+    else {
+      snprintf(name, sizeof(name), "text_%d|ST[env:prod]", i);
+      m.metric_type = METRIC_STRING;
+      m.metric_value.s = (char *)"hello world";
+    }
+    noit_fb_add_metric_to_metricbatch(builder, &m, 0);
+  }
+  size_t fb_size = 0;
+  void *fb = noit_fb_finalize_metricbatch(builder, &fb_size);
+  char *b64 = NULL;
+  unsigned int b64_len = 0;
+  test_assert_namef(noit_check_log_bundle_compress_b64(NOIT_COMPRESS_LZ4, fb, fb_size,
+                                                       &b64, &b64_len) == 0, "bf compress [%d]", (int)fb_size);
+  free(fb);
+  size_t line_len = b64_len + 64;
+  char *line = malloc(line_len);
+  snprintf(line, line_len, "BF\t1500000000.123\t%d\t%.*s", (int)fb_size, (int)b64_len, b64);
+  free(b64);
+  return line;
+}
+
+static int
+bf_via_text(const char *line, int len) {
+  char **lines = NULL;
+  int cnt = noit_check_log_b_to_sm(line, len, &lines, 0), ok = 0;
+  for(int i=0; i<cnt; i++) {
+    if(!lines[i]) continue;
+    noit_metric_message_t message;
+    memset(&message, 0, sizeof(message));
+    message.original_message = lines[i];
+    message.original_message_len = strlen(lines[i]);
+    if(noit_message_decoder_parse_line(&message, 0) == 1) ok++;
+    noit_metric_message_clear(&message);
+    free(lines[i]);
+  }
+  free(lines);
+  return ok;
+}
+
+static int
+bf_native(const char *line, int len, noit_metric_message_arena_t *arena) {
+  noit_metric_message_t **messages = NULL;
+  int cnt = noit_check_log_bf_to_messages(line, len, arena, NULL, &messages);
+  noit_metric_message_deref_batch(messages, cnt);
+  free(messages);
+  return cnt;
+}
+
+void test_bf_native(void) {
+  char *line = make_bf_line();
+  int len = strlen(line);
+  noit_metric_message_arena_t *arena = noit_metric_message_arena_alloc(65536);
+
+  for(int pass=0; pass<2; pass++) {
+    noit_metric_message_t **messages = NULL;
+    int cnt = noit_check_log_bf_to_messages(line, len, pass ? arena : NULL, NULL, &messages);
+    test_assert_namef(cnt == BF_TEST_METRICS, "bf native count [%d]", cnt);
+    for(int i=0; i<cnt; i++) {
+      noit_metric_message_t *m = messages[i];
+      test_assert_namef(m->id.account_id == 933, "bf native account [%d]", i);
+      test_assert_namef(m->value.whence_ms == 1500000000123ULL, "bf native whence [%d]", i);
+      if(i % 3 == 0) {
+        test_assert_namef(m->value.type == METRIC_DOUBLE &&
+                          m->value.value.v_double == 1.0 / 3.0 + i, "bf native full precision double [%d]", i);
+        test_assert_namef(m->id.stream.tag_count == 2, "bf native stream tags [%d]", i);
+      }
+      else if(i % 3 == 1) {
+        test_assert_namef(m->value.type == METRIC_INT64 &&
+                          m->value.value.v_int64 == -((int64_t)1 << 40) - i, "bf native int64 [%d]", i);
+      }
+      else {
+        test_assert_namef(m->value.type == METRIC_STRING &&
+                          !strcmp(m->value.value.v_string, "hello world"), "bf native string [%d]", i);
+      }
+    }
+    noit_metric_message_deref_batch(messages, cnt);
+    free(messages);
+  }
+  test_assert_namef(bf_via_text(line, len) == BF_TEST_METRICS, "bf text count [%d]", len);
+
+  if(benchmark) {
+    const int iters = BENCH_ITERS / BF_TEST_METRICS;
+    mtev_perftimer_t btimer;
+    mtev_perftimer_start(&btimer);
+    for(int b=0; b<iters; b++) bf_via_text(line, len);
+    uint64_t text_ns = mtev_perftimer_elapsed(&btimer);
+    mtev_perftimer_start(&btimer);
+    for(int b=0; b<iters; b++) bf_native(line, len, NULL);
+    uint64_t native_ns = mtev_perftimer_elapsed(&btimer);
+    mtev_perftimer_start(&btimer);
+    for(int b=0; b<iters; b++) bf_native(line, len, arena);
+    uint64_t arena_ns = mtev_perftimer_elapsed(&btimer);
+    double msgs = (double)iters * BF_TEST_METRICS;
+    printf("BF via M lines: %0.0f msgs/s\n", msgs / ((double)text_ns / 1e9));
+    printf("BF native:      %0.0f msgs/s\n", msgs / ((double)native_ns / 1e9));
+    printf("BF native+arena: %0.0f msgs/s\n", msgs / ((double)arena_ns / 1e9));
+  }
+  noit_metric_message_arena_free(arena);
+  free(line);
+}
+
+#define B_TEST_METRICS 32
+static char *
+make_b_line(char format, noit_compression_type_t ctype, size_t *b64_len) {
+  Bundle bundle = BUNDLE__INIT;
+  Status status = STATUS__INIT;
+  Metric metrics[B_TEST_METRICS], *mp[B_TEST_METRICS];
+  char names[B_TEST_METRICS][64];
+  status.available = 'A';
+  status.state = 'G';
+  status.duration = 12;
+  status.status = (char *)"all good";
+  bundle.status = &status;
+  for(int i=0; i<B_TEST_METRICS; i++) {
+    metric__init(&metrics[i]);
+    snprintf(names[i], sizeof(names[i]), "metric_%d|ST[env:prod]", i);
+    metrics[i].name = names[i];
+    if(i % 2) {
+      metrics[i].metrictype = METRIC_INT64;
+      metrics[i].has_valuei64 = 1;
+      metrics[i].valuei64 = -((int64_t)1 << 40) - i;
+    }
+    else {
+      metrics[i].metrictype = METRIC_STRING;
+      metrics[i].valuestr = (char *)"hello world";
+    }
+    mp[i] = &metrics[i];
+  }
+  bundle.metrics = mp;
+  bundle.n_metrics = B_TEST_METRICS;
+  size_t size = bundle__get_packed_size(&bundle);
+  uint8_t *buf = malloc(size);
+  bundle__pack(&bundle, buf);
+  char *b64 = NULL;
+  unsigned int len = 0;
+  test_assert_namef(noit_check_log_bundle_compress_b64(ctype, (char *)buf, size, &b64, &len) == 0,
+                    "B%c compress [%zu]", format, size);
+  free(buf);
+  size_t line_len = len + 128;
+  char *line = malloc(line_len);
+  int prefix = snprintf(line, line_len, "B%c\t1500000000.123\t43e5c324-e4b1-4c7b-9b1d-8a7b5ec3b6f1"
+                        "\tlocalhost\ttest\tbundle\t%zu\t", format, size);
+  memcpy(line + prefix, b64, len);
+  line[prefix + len] = '\0';
+  free(b64);
+  *b64_len = len;
+  return line;
+}
+
+static void
+b_lines_free(char **lines, int cnt) {
+  for(int i=0; i<cnt; i++) free(lines[i]);
+  free(lines);
+}
+
+void test_bundle_b3(void) {
+  size_t b2_b64, b3_b64, b1_b64;
+  char *b2 = make_b_line('2', NOIT_COMPRESS_NONE, &b2_b64);
+  char *b3 = make_b_line('3', NOIT_COMPRESS_LZ4, &b3_b64);
+  char *b1 = make_b_line('1', NOIT_COMPRESS_ZLIB, &b1_b64);
+  char **l2 = NULL, **l3 = NULL, **l1 = NULL;
+  int c2 = noit_check_log_b_to_sm(b2, strlen(b2), &l2, -1);
+  int c3 = noit_check_log_b_to_sm(b3, strlen(b3), &l3, -1);
+  int c1 = noit_check_log_b_to_sm(b1, strlen(b1), &l1, -1);
+  test_assert_namef(c2 == B_TEST_METRICS + 1, "B2 lines [%d]", c2);
+  test_assert_namef(c3 == c2 && c1 == c2, "B3 lines [%d], B1 lines [%d]", c3, c1);
+  test_assert_namef(b3_b64 < b2_b64, "B3 payload %zu < B2 payload %zu", b3_b64, b2_b64);
+  for(int i=0; i<c2; i++) {
+    test_assert_namef(!strcmp(l2[i], l3[i]) && !strcmp(l2[i], l1[i]), "B3 line %d: %s", i, l3[i]);
+  }
+  test_assert(!strcmp(l2[0], "S\t1500000000.123\t43e5c324-e4b1-4c7b-9b1d-8a7b5ec3b6f1\tG\tA\t12\tall good"));
+
+  /* every truncation of the payload: anything that cuts into the compressed
+   * data must be rejected, and nothing may read past what is there */
+  size_t b3_len = strlen(b3), prefix = b3_len - b3_b64;
+  for(size_t cut = prefix; cut < b3_len; cut++) {
+    char *t = malloc(cut);
+    memcpy(t, b3, cut);
+    char **lt = NULL;
+    int ct = noit_check_log_b_to_sm(t, cut, &lt, -1);
+    if(cut + 16 < b3_len) {
+      test_assert_namef(ct == 0 && lt == NULL, "B3 truncated to %zu of %zu rejected [%d]", cut, b3_len, ct);
+    }
+    else if(ct) {
+      /* only the frame's end mark was lost */
+      test_assert_namef(ct == c2 && !strcmp(lt[ct-1], l2[ct-1]), "B3 truncated to %zu of %zu", cut, b3_len);
+    }
+    b_lines_free(lt, ct);
+    free(t);
+  }
+
+  /* corrupt compressed bytes: decoding may succeed or fail, but must stay in bounds */
+  for(size_t pos = prefix; pos < b3_len; pos += 3) {
+    char saved = b3[pos];
+    b3[pos] = (saved == 'A') ? '/' : 'A';
+    char **lt = NULL;
+    int ct = noit_check_log_b_to_sm(b3, b3_len, &lt, -1);
+    b_lines_free(lt, ct);
+    b3[pos] = saved;
+  }
+
+  /* a declared length the payload doesn't decompress to */
+  char *len_at = strstr(b3, "\tbundle\t") + 8;
+  size_t declared = strtoul(len_at, NULL, 10);
+  for(int delta = -1; delta <= 1; delta += 2) {
+    char *bad = malloc(b3_len + 16);
+    int n = snprintf(bad, b3_len + 16, "%.*s%zu%s", (int)(len_at - b3), b3, declared + delta,
+                     strchr(len_at, '\t'));
+    char **lt = NULL;
+    int ct = noit_check_log_b_to_sm(bad, n, &lt, -1);
+    test_assert_namef(ct == 0 && lt == NULL, "B3 declared %zu for %zu rejected [%d]",
+                      declared + delta, declared, ct);
+    free(bad);
+  }
+
+  b_lines_free(l1, c1);
+  b_lines_free(l2, c2);
+  b_lines_free(l3, c3);
+  free(b1);
+  free(b2);
+  free(b3);
+}
+
+/* A graphite payload: the capture given with -g, or synthetic lines */
+static char *
+graphite_payload(size_t *len) {
+  if(graphite_capture) {
+    FILE *fp = fopen(graphite_capture, "r");
+    if(fp) {
+      fseek(fp, 0, SEEK_END);
+      long size = ftell(fp);
+      fseek(fp, 0, SEEK_SET);
+      char *buf = malloc(size + 1);
+      *len = fread(buf, 1, size, fp);
+      buf[*len] = '\0';
+      fclose(fp);
+      return buf;
+    }
+    fprintf(stderr, "cannot read %s, using synthetic lines\n", graphite_capture);
+  }
+  size_t alloc = 1 << 20, used = 0;
+  char *buf = malloc(alloc);
+  for(int i=0; used + 256 < alloc; i++) {
+    used += snprintf(buf + used, alloc - used,
+                     "servers.web%03d.cpu.cpu%d.%s;dc=us-east-1;role=web %d.%0*d %u\n",
+                     i % 500, i % 16, (i % 3) ? "user" : "system",
+                     i % 1000, i % 4, i % 7919, 1700000000 + i / 100);
+  }
+  buf[used] = '\0';
+  *len = used;
+  return buf;
+}
+
+/* graphite's tokenizing as it was: memchr per field, strtoull and strtod */
+static double
+graphite_scan_libc(const char *buf, size_t len, int *nlines) {
+  double sum = 0;
+  const char *s = buf, *end = buf + len;
+  *nlines = 0;
+  for(const char *p = buf; (p = memchr(p, '\n', end - p)) != NULL; p++) (*nlines)++;
+  while(s < end) {
+    const char *e = memchr(s, '\n', end - s);
+    if(!e) break;
+    const char *sp1 = memchr(s, ' ', e - s);
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', e - sp1 - 1) : NULL;
+    if(sp2) {
+      sum += strtod(sp1 + 1, NULL);
+      sum += (double)strtoull(sp2 + 1, NULL, 10);
+    }
+    s = e + 1;
+  }
+  return sum;
+}
+
+static double
+graphite_scan_plaintext(const char *buf, size_t len, int *nlines) {
+  double sum = 0, v;
+  uint64_t ts;
+  size_t used;
+  const char *s = buf, *end;
+  *nlines = noit_plaintext_count_lines(buf, len, &used);
+  end = buf + used;
+  while(s < end) {
+    const char *e = memchr(s, '\n', end - s);
+    const char *sp1 = noit_plaintext_find_space(s, e);
+    const char *sp2 = sp1 ? noit_plaintext_find_space(sp1 + 1, e) : NULL;
+    if(sp2) {
+      if(noit_plaintext_parse_double(sp1 + 1, sp2, &v, NULL) == 0) sum += v;
+      if(noit_plaintext_parse_u64(sp2 + 1, e, &ts, NULL) == 0) sum += (double)ts;
+    }
+    s = e + 1;
+  }
+  return sum;
+}
+
+void test_plaintext(void) {
+  const char *numbers[] = {
+    "0", "-1", "42.5", "0.1", "4.35", "1e5", "-2.5E+10", "1.5e-3", "3.14159265358979323846",
+    "9007199254740993", "12345678901234567890", "0.000000000000000000000001", "1e308", "17.",
+    /* 19 significant digits on a rounding tie, decided by dropped digits */
+    "1152921504606847104.5", "11529215046068471045e-1"
+  };
+  for(int i=0; i<sizeof(numbers)/sizeof(*numbers); i++) {
+    double v = 0, expect = strtod(numbers[i], NULL);
+    const char *endp = NULL;
+    int rv = noit_plaintext_parse_double(numbers[i], numbers[i] + strlen(numbers[i]), &v, &endp);
+    test_assert_namef(rv == 0 && v == expect && *endp == '\0',
+                      "parse_double(%s) = %.17g", numbers[i], v);
+  }
+  double v;
+  const char *bad[] = { "-", ".", "x1", "1e400" };
+  for(int i=0; i<sizeof(bad)/sizeof(*bad); i++) {
+    test_assert_namef(noit_plaintext_parse_double(bad[i], bad[i] + strlen(bad[i]), &v, NULL) < 0,
+                      "parse_double(%s) fails", bad[i]);
+  }
+
+  char lines[200];
+  for(int i=0; i<sizeof(lines); i++) lines[i] = (i % 23 == 22) ? '\n' : 'x';
+  lines[150] = '\t';
+  size_t used;
+  test_assert(noit_plaintext_count_lines(lines, sizeof(lines), &used) == 8 && used == 184);
+  test_assert(noit_plaintext_find_space(lines, lines + sizeof(lines)) == lines + 150);
+  test_assert(noit_plaintext_find_space(lines, lines + 150) == NULL);
+
+  size_t len;
+  char *payload = graphite_payload(&len);
+  int libc_lines, plaintext_lines;
+  double libc_sum = graphite_scan_libc(payload, len, &libc_lines);
+  double plaintext_sum = graphite_scan_plaintext(payload, len, &plaintext_lines);
+  test_assert_namef(libc_lines == plaintext_lines && libc_sum == plaintext_sum,
+                    "graphite scan agrees over %d lines", plaintext_lines);
+  if(benchmark) {
+    const int iters = 50;
+    mtev_perftimer_t btimer;
+    mtev_perftimer_start(&btimer);
+    for(int b=0; b<iters; b++) graphite_scan_libc(payload, len, &libc_lines);
+    uint64_t libc_ns = mtev_perftimer_elapsed(&btimer);
+    mtev_perftimer_start(&btimer);
+    for(int b=0; b<iters; b++) graphite_scan_plaintext(payload, len, &plaintext_lines);
+    uint64_t plaintext_ns = mtev_perftimer_elapsed(&btimer);
+    double mb = (double)len * iters / (1024.0 * 1024.0);
+    printf("graphite scan libc:      %0.1f MB/s, %0.1f ns/line\n",
+           mb / ((double)libc_ns / 1e9), (double)libc_ns / ((double)libc_lines * iters));
+    printf("graphite scan plaintext: %0.1f MB/s, %0.1f ns/line\n",
+           mb / ((double)plaintext_ns / 1e9), (double)plaintext_ns / ((double)plaintext_lines * iters));
+  }
+  free(payload);
+}
+
+/* A minimal protobuf writer for building remote_write payloads by hand. */
+static size_t pbw_varint(uint8_t *o, uint64_t v) {
+  size_t n = 0;
+  do {
+    o[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+    v >>= 7;
+  } while(v);
+  return n;
+}
+static size_t pbw_len(uint8_t *o, uint32_t field, const void *body, size_t len) {
+  size_t n = pbw_varint(o, (field << 3) | 2);
+  n += pbw_varint(o + n, len);
+  memcpy(o + n, body, len);
+  return n + len;
+}
+static size_t pbw_label(uint8_t *o, const char *name, const char *value) {
+  uint8_t body[128];
+  size_t n = pbw_len(body, 1, name, strlen(name));
+  n += pbw_len(body + n, 2, value, strlen(value));
+  return pbw_len(o, 1, body, n);
+}
+static size_t pbw_sample(uint8_t *o, double value, int64_t ts) {
+  uint8_t body[32];
+  size_t n = 0;
+  body[n++] = (1 << 3) | 1;
+  memcpy(body + n, &value, sizeof(value)); /* little endian hosts only */
+  n += sizeof(value);
+  body[n++] = (2 << 3) | 0;
+  n += pbw_varint(body + n, (uint64_t)ts);
+  return pbw_len(o, 2, body, n);
+}
+
+typedef struct {
+  int series;
+  size_t labels;
+  size_t samples;
+  double value_sum;
+  int64_t ts_sum;
+  char first_name[32];
+} prom_decode_seen_t;
+
+static void prom_decode_cb(Prometheus__Label **labels, size_t n_labels,
+                           Prometheus__Sample **samples, size_t n_samples,
+                           void *closure) {
+  prom_decode_seen_t *seen = closure;
+  if(seen->series++ == 0 && n_labels > 0)
+    snprintf(seen->first_name, sizeof(seen->first_name), "%s=%s",
+             labels[0]->name, labels[0]->value);
+  seen->labels += n_labels;
+  seen->samples += n_samples;
+  for(size_t i=0; i<n_samples; i++) {
+    seen->value_sum += samples[i]->value;
+    seen->ts_sum += samples[i]->timestamp;
+  }
+}
+
+/* Decode from an exactly sized heap copy so any read past the end is caught
+ * by the allocator checks the tests are run under. */
+static ssize_t prom_decode_exact(const uint8_t *buf, size_t len, prom_decode_seen_t *seen) {
+  uint8_t *copy = malloc(len ? len : 1);
+  memcpy(copy, buf, len);
+  memset(seen, 0, sizeof(*seen));
+  ssize_t rv = noit_prometheus_decode_write_request(copy, len, prom_decode_cb, seen);
+  free(copy);
+  return rv;
+}
+
+void test_prometheus_decode(void) {
+  uint8_t series[256], req[512];
+  size_t slen, rlen = 0, ends[2];
+  prom_decode_seen_t seen;
+
+  slen = pbw_label(series, "__name__", "up");
+  slen += pbw_label(series + slen, "job", "node");
+  slen += pbw_sample(series + slen, 1.5, 1000);
+  slen += pbw_sample(series + slen, 2.5, 2000);
+  rlen += pbw_len(req + rlen, 1, series, slen);
+  ends[0] = rlen;
+  slen = pbw_label(series, "__name__", "requests");
+  slen += pbw_sample(series + slen, 3.0, 3000);
+  rlen += pbw_len(req + rlen, 1, series, slen);
+  ends[1] = rlen;
+  /* metadata (field 3) is skipped */
+  rlen += pbw_len(req + rlen, 3, "\x08\x01", 2);
+
+  test_assert(prom_decode_exact(req, rlen, &seen) == 2);
+  test_assert(seen.series == 2 && seen.labels == 3 && seen.samples == 3);
+  test_assert(seen.value_sum == 7.0 && seen.ts_sum == 6000);
+  test_assert(!strcmp(seen.first_name, "__name__=up"));
+
+  /* an empty request is valid and has no series */
+  test_assert(prom_decode_exact(req, 0, &seen) == 0 && seen.series == 0);
+
+  /* a prefix is only valid if it ends on a TimeSeries boundary */
+  for(size_t i=1; i<rlen; i++) {
+    ssize_t expect = (i == ends[0]) ? 1 : (i == ends[1]) ? 2 : -1;
+    test_assert_namef(prom_decode_exact(req, i, &seen) == expect,
+                      "truncated at %zu/%zu", i, rlen);
+  }
+
+  struct {
+    const char *name;
+    const uint8_t buf[16];
+    size_t len;
+  } bad[] = {
+    { "truncated tag varint", { 0x80 }, 1 },
+    { "truncated length varint", { 0x0a, 0x80 }, 2 },
+    { "11 byte varint", { 0x08, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 }, 12 },
+    { "length overruns buffer", { 0x0a, 0x05, 'a', 'b' }, 4 },
+    { "label length overruns series", { 0x0a, 0x03, 0x0a, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, 10 },
+    { "truncated fixed64 sample", { 0x0a, 0x05, 0x12, 0x03, 0x09, 0x00, 0x00 }, 7 },
+    { "wire type 3", { 0x0b, 0x00 }, 2 },
+    { "wire type 4", { 0x0c, 0x00 }, 2 },
+    { "wire type 6", { 0x0e, 0x00 }, 2 },
+    { "wire type 7", { 0x0f, 0x00 }, 2 },
+    { "wire type 3 in series", { 0x0a, 0x02, 0x1b, 0x00 }, 4 },
+    { "wire type 7 in label", { 0x0a, 0x04, 0x0a, 0x02, 0x0f, 0x00 }, 6 },
+  };
+  for(int i=0; i<sizeof(bad)/sizeof(*bad); i++) {
+    ssize_t rv = prom_decode_exact(bad[i].buf, bad[i].len, &seen);
+    test_assert_namef(rv == -1 && seen.series == 0, "decode(%s) fails", bad[i].name);
+  }
+}
+
+typedef struct {
+  int written[64];
+  int nwritten;
+} seq_log_t;
+
+static void seq_log_write(void *item, void *closure) {
+  seq_log_t *log = closure;
+  log->written[log->nwritten++] = (int)(intptr_t)item;
+}
+
+void test_bundle_sequencer(void) {
+  noit_bundle_sequencer_t seq;
+  seq_log_t log = { .nwritten = 0 };
+  mtev_boolean idle;
+  uint32_t first[3], second;
+
+  noit_bundle_sequencer_init(&seq, seq_log_write, &log);
+
+  /* one check serialized twice: the first call's bundles are still on the
+   * jobq when the second call's single bundle is ready inline */
+  for(int i=0; i<3; i++) {
+    first[i] = noit_bundle_sequencer_reserve(&seq, &idle);
+    test_assert(idle == (i == 0));
+  }
+  second = noit_bundle_sequencer_reserve(&seq, &idle);
+  test_assert(!idle);
+  noit_bundle_sequencer_complete(&seq, second, (void *)(intptr_t)4);
+  test_assert(log.nwritten == 0);
+  noit_bundle_sequencer_complete(&seq, first[2], (void *)(intptr_t)3);
+  noit_bundle_sequencer_complete(&seq, first[1], (void *)(intptr_t)2);
+  test_assert(log.nwritten == 0);
+  noit_bundle_sequencer_complete(&seq, first[0], (void *)(intptr_t)1);
+  test_assert(log.nwritten == 4);
+  for(int i=0; i<4; i++) test_assert_namef(log.written[i] == i + 1, "bundle %d in order", i + 1);
+
+  /* idle again, and the ring grows with entries wrapped around it */
+  test_assert(noit_bundle_sequencer_reserve(&seq, &idle) == 4 && idle);
+  noit_bundle_sequencer_complete(&seq, 4, (void *)(intptr_t)5);
+  uint32_t many[20];
+  for(int i=0; i<20; i++) many[i] = noit_bundle_sequencer_reserve(&seq, NULL);
+  for(int i=19; i>=0; i--) noit_bundle_sequencer_complete(&seq, many[i], (void *)(intptr_t)(6 + i));
+  test_assert(log.nwritten == 25);
+  for(int i=0; i<25; i++) test_assert_namef(log.written[i] == i + 1, "bundle %d in order", i + 1);
+  noit_bundle_sequencer_destroy(&seq);
+}
+
+void test_check_wheel(void) {
+  static noit_check_wheel_t w;
+  noit_check_wheel_entry_t a, b, c, d;
+  const uint64_t t0 = 1700000040000ULL; /* on a minute boundary */
+  const uint64_t gran = NOIT_CHECK_SCHEDULE_GRANULARITY;
+
+  noit_check_wheel_init(&w, t0);
+  test_assert(noit_check_wheel_next_ms(&w) == 0);
+
+  /* only the outer levels are occupied, so wake at the minute boundary */
+  c.due_ms = t0 + 90000;
+  noit_check_wheel_add(&w, &c, t0);
+  test_assert(noit_check_wheel_next_ms(&w) == t0 + 60000);
+
+  /* the earliest entry of the first occupied slot, past a bitmap word */
+  a.due_ms = t0 + 128 * gran + 15;
+  b.due_ms = t0 + 128 * gran + 3;
+  d.due_ms = t0 + 60000 - gran / 2;
+  noit_check_wheel_add(&w, &a, t0);
+  noit_check_wheel_add(&w, &d, t0);
+  noit_check_wheel_add(&w, &b, t0);
+  test_assert(noit_check_wheel_next_ms(&w) == b.due_ms);
+  test_assert(noit_check_wheel_take_due(&w, b.due_ms) == &b && b.next == NULL);
+  test_assert(noit_check_wheel_next_ms(&w) == a.due_ms);
+  test_assert(noit_check_wheel_take_due(&w, a.due_ms) == &a && a.next == NULL);
+  test_assert(noit_check_wheel_next_ms(&w) == d.due_ms);
+  test_assert(noit_check_wheel_take_due(&w, d.due_ms) == &d);
+  test_assert(noit_check_wheel_next_ms(&w) == t0 + 60000);
+  test_assert(noit_check_wheel_take_due(&w, t0 + 60000) == NULL);
+  /* crossing the boundary cascaded c into the inner level */
+  test_assert(noit_check_wheel_next_ms(&w) == c.due_ms);
+  test_assert(noit_check_wheel_take_due(&w, c.due_ms) == &c);
+  test_assert(w.cnt == 0 && noit_check_wheel_next_ms(&w) == 0);
+
+  /* an idle wheel restarts its clock at the first add instead of
+   * filing the entry against where it last ran */
+  uint64_t later = t0 + 3 * 3600 * 1000 + 7;
+  a.due_ms = later + 500;
+  noit_check_wheel_add(&w, &a, later);
+  test_assert(w.now_ms == later - later % gran);
+  test_assert(noit_check_wheel_next_ms(&w) == a.due_ms);
+  test_assert(noit_check_wheel_take_due(&w, a.due_ms - 1) == NULL);
+  test_assert(noit_check_wheel_take_due(&w, a.due_ms) == &a && w.cnt == 0);
+}
+
+static noit_fingerprint128_t dedupe_fp(const char *prefix, int i) {
+  noit_fingerprint128_t fp;
+  noit_fingerprint128_init(&fp);
+  noit_fingerprint128_update(&fp, prefix, strlen(prefix));
+  noit_fingerprint128_update(&fp, &i, sizeof(i));
+  return fp;
+}
+
+void test_metric_dedupe(void) {
+  /* hour long buckets so the test can't straddle a rotation in practice */
+  noit_metric_dedupe_t *d =
+    noit_metric_dedupe_alloc(1024, 7200, 3600, 0.5, mtev_stats_ns(NULL, "test_dedupe"));
+  noit_fingerprint128_t fp;
+  test_assert(d != NULL);
+
+  fp = dedupe_fp("dup", 0);
+  test_assert(!noit_metric_dedupe_check(d, &fp));
+  test_assert(noit_metric_dedupe_check(d, &fp));
+  fp = dedupe_fp("dup", 1);
+  test_assert(!noit_metric_dedupe_check(d, &fp));
+  fp.hi ^= 1; /* the same low half alone is not a match */
+  test_assert(!noit_metric_dedupe_check(d, &fp));
+
+  /* fill past max_load; maintain notices and the bucket stops recording */
+  int recorded = 0;
+  for(int i=0; i<600; i++) {
+    fp = dedupe_fp("load", i);
+    noit_metric_dedupe_check(d, &fp);
+  }
+  for(int i=0; i<600; i++) {
+    fp = dedupe_fp("load", i);
+    if(noit_metric_dedupe_check(d, &fp)) recorded++;
+  }
+  test_assert_namef(recorded > 512, "%d of 600 recorded below the probe limit", recorded);
+  noit_metric_dedupe_maintain(d);
+  fp = dedupe_fp("late", 0);
+  test_assert(!noit_metric_dedupe_check(d, &fp));
+  test_assert(!noit_metric_dedupe_check(d, &fp));
+  fp = dedupe_fp("dup", 0);
+  test_assert(noit_metric_dedupe_check(d, &fp));
+}
+
+#define LANE_CNT 3
+#define LANE_CHUNK 5
+#define LANE_ITEMS 600
+typedef struct {
+  noit_metric_lane_t *lane[LANE_CNT];
+  uintptr_t next[LANE_CNT];
+  uint32_t spilled;
+} lane_test_t;
+
+/* Drains up to max items from each lane, checking that every lane yields
+ * exactly the items published to it, in order. */
+static void
+lane_test_drain(lane_test_t *t, bool batched, size_t max) {
+  void *items[8];
+  for(int l=0; l<LANE_CNT; l++) {
+    size_t got = 0;
+    while(got < max) {
+      size_t n;
+      if(batched) {
+        n = noit_metric_lane_pop_batch(t->lane[l], items, max - got < 8 ? max - got : 8);
+      } else {
+        n = (items[0] = noit_metric_lane_pop(t->lane[l])) ? 1 : 0;
+      }
+      if(n == 0) break;
+      for(size_t i=0; i<n; i++) {
+        test_assert_namef((uintptr_t)items[i] == t->next[l], "lane %d: %zu, expected %zu",
+                          l, (size_t)(uintptr_t)items[i], (size_t)t->next[l]);
+        t->next[l] += LANE_CNT;
+      }
+      got += n;
+    }
+  }
+}
+
+void test_metric_lane(void) {
+  /* The same interleaved stream goes to two sets of lanes: one a message at a
+   * time, drained with single pops, the other in producer chunks, drained in
+   * batches.  The rings are small enough that both spill into overflow. */
+  lane_test_t single = { .spilled = 0 }, batched = { .spilled = 0 };
+  void *stage[LANE_CNT][LANE_CHUNK];
+  uint32_t staged[LANE_CNT] = { 0 };
+  for(int l=0; l<LANE_CNT; l++) {
+    single.lane[l] = noit_metric_lane_alloc(6); /* rounds up to 8 */
+    batched.lane[l] = noit_metric_lane_alloc(6);
+    test_assert(single.lane[l] && batched.lane[l]);
+    test_assert(noit_metric_lane_pop(single.lane[l]) == NULL);
+    test_assert(noit_metric_lane_pop_batch(batched.lane[l], stage[l], LANE_CHUNK) == 0);
+    single.next[l] = batched.next[l] = l ? l : LANE_CNT;
+  }
+  for(uintptr_t v=1; v<=LANE_ITEMS; v++) {
+    int l = v % LANE_CNT;
+    void *item = (void *)v;
+    single.spilled += noit_metric_lane_publish(single.lane[l], &item, 1);
+    stage[l][staged[l]++] = item;
+    if(staged[l] == LANE_CHUNK) {
+      batched.spilled += noit_metric_lane_publish(batched.lane[l], stage[l], staged[l]);
+      staged[l] = 0;
+    }
+    if(v % 30 == 0) {
+      for(l=0; l<LANE_CNT; l++) {
+        batched.spilled += noit_metric_lane_publish(batched.lane[l], stage[l], staged[l]);
+        staged[l] = 0;
+      }
+      /* take less than was added so the overflow drains while it grows */
+      lane_test_drain(&single, false, 7);
+      lane_test_drain(&batched, true, 7);
+    }
+  }
+  test_assert(single.spilled > 0 && batched.spilled > 0);
+  lane_test_drain(&single, false, SIZE_MAX);
+  lane_test_drain(&batched, true, SIZE_MAX);
+  for(int l=0; l<LANE_CNT; l++) {
+    test_assert(single.next[l] > LANE_ITEMS && single.next[l] == batched.next[l]);
+    test_assert(noit_metric_lane_pop(single.lane[l]) == NULL);
+    test_assert(noit_metric_lane_pop(batched.lane[l]) == NULL);
+  }
+}
+
+#define SHARED_LANE_CONSUMERS 4
+#define SHARED_LANE_ITEMS 20000
+typedef struct {
+  noit_metric_lane_t *lane;
+  uint32_t done;
+  uint8_t seen[SHARED_LANE_CONSUMERS][SHARED_LANE_ITEMS + 1];
+  bool ordered[SHARED_LANE_CONSUMERS];
+} shared_lane_test_t;
+typedef struct {
+  shared_lane_test_t *t;
+  int id;
+} shared_lane_consumer_t;
+
+static void *
+shared_lane_consume(void *closure) {
+  shared_lane_consumer_t *c = closure;
+  shared_lane_test_t *t = c->t;
+  void *items[8];
+  uintptr_t last = 0;
+  t->ordered[c->id] = true;
+  for(int i=0; ; i++) {
+    bool done = ck_pr_load_32(&t->done);
+    size_t n = (i % 2) ? noit_metric_lane_pop_batch(t->lane, items, 8)
+                       : ((items[0] = noit_metric_lane_pop(t->lane)) ? 1 : 0);
+    if(n == 0 && done) break;
+    for(size_t j=0; j<n; j++) {
+      uintptr_t v = (uintptr_t)items[j];
+      if(v <= last) t->ordered[c->id] = false;
+      last = v;
+      t->seen[c->id][v]++;
+    }
+  }
+  return NULL;
+}
+
+void test_metric_lane_shared(void) {
+  /* Several consumers drain one lane while it is fed in chunks; every item
+   * must reach exactly one of them and each sees its share in publish order. */
+  static shared_lane_test_t t;
+  shared_lane_consumer_t c[SHARED_LANE_CONSUMERS];
+  pthread_t tid[SHARED_LANE_CONSUMERS];
+  void *stage[LANE_CHUNK];
+  uint32_t staged = 0;
+  memset(&t, 0, sizeof(t));
+  t.lane = noit_metric_lane_alloc(16);
+  test_assert(t.lane != NULL);
+  for(int i=0; i<SHARED_LANE_CONSUMERS; i++) {
+    c[i].t = &t;
+    c[i].id = i;
+    test_assert(pthread_create(&tid[i], NULL, shared_lane_consume, &c[i]) == 0);
+  }
+  for(uintptr_t v=1; v<=SHARED_LANE_ITEMS; v++) {
+    stage[staged++] = (void *)v;
+    if(staged == LANE_CHUNK) {
+      noit_metric_lane_publish(t.lane, stage, staged);
+      staged = 0;
+    }
+  }
+  noit_metric_lane_publish(t.lane, stage, staged);
+  ck_pr_store_32(&t.done, 1);
+  for(int i=0; i<SHARED_LANE_CONSUMERS; i++) pthread_join(tid[i], NULL);
+  int missing = 0;
+  for(int v=1; v<=SHARED_LANE_ITEMS; v++) {
+    int cnt = 0;
+    for(int i=0; i<SHARED_LANE_CONSUMERS; i++) cnt += t.seen[i][v];
+    if(cnt != 1) missing++;
+  }
+  test_assert_namef(missing == 0, "%d of %d items not delivered exactly once",
+                    missing, SHARED_LANE_ITEMS);
+  for(int i=0; i<SHARED_LANE_CONSUMERS; i++) {
+    test_assert_namef(t.ordered[i], "consumer %d saw its items in order", i);
+  }
+  test_assert(noit_metric_lane_pop(t.lane) == NULL);
+}
+
+#define ARENA_TEST_ALLOCS 400
+static void
+arena_test_fill(ProtobufCAllocator *a, char **p, size_t *sz, int n) {
+  for(int i=0; i<n; i++) {
+    /* mostly small, every 50th past the 16k large allocation cutoff */
+    sz[i] = (i % 50 == 49) ? 16385 + i : 1 + (i * 37) % 1500;
+    p[i] = a->alloc(a->allocator_data, sz[i]);
+    test_assert_namef(p[i] != NULL && ((uintptr_t)p[i] & 15) == 0,
+                      "allocation %d of %zu bytes is aligned", i, sz[i]);
+    memset(p[i], i & 0xff, sz[i]);
+  }
+  /* nothing was handed out twice, even across chunk boundaries */
+  for(int i=0; i<n; i++) {
+    test_assert_namef((unsigned char)p[i][0] == (i & 0xff) &&
+                      (unsigned char)p[i][sz[i]-1] == (i & 0xff),
+                      "allocation %d intact", i);
+  }
+}
+
+void test_protobuf_arena(void) {
+  ProtobufCAllocator *a = noit_protobuf_arena_allocator();
+  char *p[ARENA_TEST_ALLOCS];
+  size_t sz[ARENA_TEST_ALLOCS];
+  test_assert(a == noit_protobuf_arena_allocator());
+  noit_protobuf_arena_reset(); /* start from whatever earlier tests left */
+
+  /* ~300k of small allocations spans several 64k chunks */
+  arena_test_fill(a, p, sz, ARENA_TEST_ALLOCS);
+  char *first = p[0];
+  a->free(a->allocator_data, p[1]); /* a no-op */
+
+  /* a reset keeps the chunks: the same allocations land in the same memory */
+  noit_protobuf_arena_reset();
+  arena_test_fill(a, p, sz, ARENA_TEST_ALLOCS);
+  test_assert(p[0] == first);
+  noit_protobuf_arena_reset();
+  noit_protobuf_arena_reset();
+
+  /* one chunk can only be filled so far before the next is started */
+  char *q = a->alloc(a->allocator_data, 16384);
+  char *r = a->alloc(a->allocator_data, 16384);
+  char *t = a->alloc(a->allocator_data, 16384);
+  char *u = a->alloc(a->allocator_data, 16384);
+  char *v = a->alloc(a->allocator_data, 1);
+  test_assert(q && r && t && u && v);
+  test_assert(r == q + 16384 && t == r + 16384 && u == t + 16384);
+  test_assert(v < q || v >= u + 16384);
+  memset(q, 1, 4 * 16384);
+  *v = 2;
+  noit_protobuf_arena_reset();
+}
+
+static prometheus_metric_name_t *
+prom_hist_name(const char **kv, size_t n) {
+  Prometheus__Label l[8], *lp[8];
+  for(size_t i=0; i<n; i++) {
+    l[i] = (Prometheus__Label) PROMETHEUS__LABEL__INIT;
+    l[i].name = (char *)kv[i*2];
+    l[i].value = (char *)kv[i*2+1];
+    lp[i] = &l[i];
+  }
+  return noit_prometheus_metric_name_from_labels(lp, n, NULL, true);
+}
+
+void test_prometheus_histogram(void) {
+  const char *ordered[] = { "__name__", "lat", "a", "1", "b", "2", "le", "0.5" };
+  const char *shuffled[] = { "b", "2", "le", "1", "__name__", "lat", "a", "1" };
+  const char *other[] = { "__name__", "lat", "a", "2", "b", "2", "le", "0.5" };
+  const char *dup[] = { "__name__", "lat", "a", "1", "a", "2", "le", "1" };
+  const char *dup_shuffled[] = { "a", "2", "__name__", "lat", "a", "1" };
+  const char *dup_one[] = { "__name__", "lat", "a", "1" };
+  prometheus_metric_name_t *n1 = prom_hist_name(ordered, 4),
+                           *n2 = prom_hist_name(shuffled, 4),
+                           *n3 = prom_hist_name(other, 4),
+                           *d1 = prom_hist_name(dup, 4),
+                           *d2 = prom_hist_name(dup_shuffled, 3),
+                           *d3 = prom_hist_name(dup_one, 2);
+  /* le is not part of the name and label order does not matter */
+  test_assert_namef(!memcmp(&n1->fingerprint, &n2->fingerprint, sizeof(n1->fingerprint)),
+                    "%s and %s share a fingerprint", n1->name, n2->name);
+  test_assert(memcmp(&n1->fingerprint, &n3->fingerprint, sizeof(n1->fingerprint)));
+  /* repeated label names are kept, in any order */
+  test_assert_namef(!memcmp(&d1->fingerprint, &d2->fingerprint, sizeof(d1->fingerprint)),
+                    "%s and %s share a fingerprint", d1->name, d2->name);
+  test_assert(memcmp(&d1->fingerprint, &d3->fingerprint, sizeof(d1->fingerprint)));
+
+  /* buckets of one histogram arriving out of order, under either label
+   * order, with a repeated le */
+  mtev_hash_table *hists = NULL;
+  struct timeval w = { .tv_sec = 1700000000, .tv_usec = 0 }, w2 = { .tv_sec = 1700000001 };
+  noit_prometheus_track_histogram(&hists, n1, 0.5, 1, w);
+  noit_prometheus_track_histogram(&hists, n2, 1, 3, w);
+  noit_prometheus_track_histogram(&hists, n1, INFINITY, 4, w);
+  noit_prometheus_track_histogram(&hists, n2, 0.1, 0, w);
+  noit_prometheus_track_histogram(&hists, n1, 0.5, 2, w);
+  noit_prometheus_track_histogram(&hists, n2, 0.25, 1, w);
+  test_assert(hists && mtev_hash_size(hists) == 1);
+  /* a different time or label set is a different histogram */
+  noit_prometheus_track_histogram(&hists, n1, 0.5, 1, w2);
+  noit_prometheus_track_histogram(&hists, n3, 0.5, 1, w);
+  test_assert(mtev_hash_size(hists) == 3);
+
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  int found = 0;
+  while(mtev_hash_adv(hists, &iter)) {
+    prometheus_hist_in_progress_t *hip = iter.value.ptr;
+    if(memcmp(&hip->fingerprint, &n1->fingerprint, sizeof(hip->fingerprint)) ||
+       hip->whence.tv_sec != w.tv_sec) {
+      test_assert(hip->nbins == 1);
+      continue;
+    }
+    found++;
+    const double upper[] = { 0.1, 0.25, 0.5, 1, 10e128 };
+    const double count[] = { 0, 1, 2, 3, 4 };
+    test_assert_namef(hip->nbins == 5, "%d bins", hip->nbins);
+    for(int i=0; i<hip->nbins; i++) {
+      test_assert_namef(hip->bins[i].upper == upper[i] && hip->bins[i].count == count[i],
+                        "bin %d: le %g count %g", i, hip->bins[i].upper, (double)hip->bins[i].count);
+    }
+    noit_prometheus_sort_and_dedupe_histogram_in_progress(hip);
+    const double lower[] = { 0, 0.1, 0.25, 0.5, 1 };
+    const double decumulated[] = { 0, 1, 1, 1, 1 };
+    for(int i=0; i<hip->nbins; i++) {
+      test_assert_namef(hip->bins[i].lower == lower[i] && hip->bins[i].count == decumulated[i],
+                        "bin %d: [%g, %g) count %g", i, hip->bins[i].lower, hip->bins[i].upper,
+                        (double)hip->bins[i].count);
+    }
+  }
+  test_assert(found == 1);
+  mtev_hash_destroy(hists, NULL, noit_prometheus_hist_in_progress_free);
+  free(hists);
+  noit_prometheus_metric_name_free(n1);
+  noit_prometheus_metric_name_free(n2);
+  noit_prometheus_metric_name_free(n3);
+  noit_prometheus_metric_name_free(d1);
+  noit_prometheus_metric_name_free(d2);
+  noit_prometheus_metric_name_free(d3);
+}
+
 void metric_parsing(void) {
   int len;
   char buff[NOIT_TAG_MAX_PAIR_LEN], dbuff[NOIT_TAG_MAX_PAIR_LEN], ebuff[NOIT_TAG_MAX_PAIR_LEN];
@@ -660,6 +1637,28 @@ void metric_parsing(void) {
     test_line(testlines[i].name, testlines[i].input, testlines[i].output, testlines[i].rval, testlines[i].allocd);
   }
 
+  /* a tiny block size forces the arena through block rotation and oversized blocks */
+  noit_metric_message_arena_t *arena = noit_metric_message_arena_alloc(512);
+  for(int pass=0; pass<3; pass++) {
+    for(i=0; i<sizeof(testlines)/sizeof(*testlines); i++) {
+      test_line_arena(arena, testlines[i].name, testlines[i].input, testlines[i].output, testlines[i].rval);
+    }
+  }
+  /* a name made of many one-tag sections has far more tags than commas and,
+   * being over the block size, gets a block sized exactly to its estimate */
+  char line[2048], expect[1024];
+  int llen = snprintf(line, sizeof(line), "M\t127.0.0.1\t1526493506.214\t"
+                      "unknown`fault`c_1_77`4766c496-2173-4f60-9607-6449d29cac56\tsections");
+  int elen = snprintf(expect, sizeof(expect), "sections|ST[");
+  for(i=0; i<60; i++) {
+    llen += snprintf(line + llen, sizeof(line) - llen, "|ST[k%02d:v]", i);
+    elen += snprintf(expect + elen, sizeof(expect) - elen, "%sk%02d:v", i ? "," : "", i);
+  }
+  snprintf(line + llen, sizeof(line) - llen, "\ti\t100\n");
+  snprintf(expect + elen, sizeof(expect) - elen, "]");
+  test_line_arena(arena, "repeated sections", line, expect, 1);
+  noit_metric_message_arena_free(arena);
+
   for(int i=0; i<sizeof(tcpairs)/sizeof(*tcpairs); i++) {
     test_canon(tcpairs[i][0], tcpairs[i][1]);
   }
@@ -775,7 +1774,7 @@ void test_tag_at_limit(void) {
 int main(int argc, char * const *argv)
 {
   int opt;
-  if (argc > 1) {
+  if (argc > 1 && argv[1][0] != '-') {
     for(int i=1; i< argc; i++) {
       int erroroffset;
       noit_metric_tag_search_ast_t *ast = noit_metric_tag_search_parse(argv[i], &erroroffset);
@@ -790,9 +1789,10 @@ int main(int argc, char * const *argv)
     exit(0);
   }
 
-  while(-1 != (opt = getopt(argc, argv, "b"))) {
+  while(-1 != (opt = getopt(argc, argv, "bg:"))) {
     switch(opt) {
     case 'b': benchmark = true; break;
+    case 'g': graphite_capture = optarg; break;
     default:
       fprintf(stderr, "unknown option: %c\n", opt);
       exit(-2);
@@ -804,6 +1804,17 @@ int main(int argc, char * const *argv)
   test_tag_match();
   test_tag_at_limit();
   metric_parsing();
+  test_bf_native();
+  test_bundle_b3();
+  test_plaintext();
+  test_prometheus_decode();
+  test_prometheus_histogram();
+  test_bundle_sequencer();
+  test_check_wheel();
+  test_metric_dedupe();
+  test_metric_lane();
+  test_metric_lane_shared();
+  test_protobuf_arena();
   query_parsing();
   query_argument_swapping();
   printf("\nPerformance:\n====================\n");
@@ -814,8 +1825,9 @@ int main(int argc, char * const *argv)
   if(benchmark) {
     for(int i=0; i < sizeof(testmatches) / sizeof(*testmatches); i++) {
       for(int j = 0; testmatches[i].queries[j].query != NULL; j++) {
-        printf("%s on %s -> %f ns/op\n", testmatches[i].queries[j].query, testmatches[i].tagstring,
-               (double)testmatches[i].queries[j].bench_ns / (double)BENCH_ITERS);
+        printf("%s on %s -> %f ns/op (compiled %f ns/op)\n", testmatches[i].queries[j].query, testmatches[i].tagstring,
+               (double)testmatches[i].queries[j].bench_ns / (double)BENCH_ITERS,
+               (double)testmatches[i].queries[j].bench_program_ns / (double)BENCH_ITERS);
       }
     }
   }